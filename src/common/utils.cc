@@ -180,6 +180,30 @@ int64_t SamplingFromData(const char* data_buffer, int64_t data_buffer_len, int64
     return train_buffer_len;
 }
 
+int64_t ExcludeSample(const char* data_buffer, int64_t data_buffer_len, int64_t record_num,
+                      const char* sample_buffer, int64_t sample_buffer_len, char** rest_buffer,
+                      int64_t& rest_num) {
+    int64_t buffer_ptr = 0, sample_ptr = 0, rest_buffer_len = 0;
+    *rest_buffer = new char[data_buffer_len];
+    rest_num = 0;
+    for (int64_t i = 0; i < record_num; i++) {
+        int32_t record_len = 0;
+        pbc_memcpy(&record_len, data_buffer + buffer_ptr, sizeof(int32_t));
+        int64_t size = sizeof(int32_t) + record_len;
+        // the sample keeps input order, so a record is sampled if it is the next sampled one
+        if (sample_ptr + size <= sample_buffer_len &&
+            memcmp(data_buffer + buffer_ptr, sample_buffer + sample_ptr, size) == 0) {
+            sample_ptr += size;
+        } else {
+            pbc_memcpy((*rest_buffer) + rest_buffer_len, data_buffer + buffer_ptr, size);
+            rest_buffer_len += size;
+            rest_num++;
+        }
+        buffer_ptr += size;
+    }
+    return rest_buffer_len;
+}
+
 void WriteFile(const char* file_path, const char* buffer, int64_t buffer_len) {
     std::ofstream output_file;
     output_file.open(file_path, std::ios::out);
@@ -59,6 +59,12 @@ int64_t ReadDataFromBuffer(int32_t input_type, const char* data_buffer, int64_t
 int64_t SamplingFromData(const char* data_buffer, int64_t data_buffer_len, int64_t record_num,
                          char** train_buffer, int64_t train_num);
 
+// Copy the records of parsed data which are not in sample_buffer, a sample of it in input order,
+// into a new rest_buffer of the same format. Return its length and set rest_num.
+int64_t ExcludeSample(const char* data_buffer, int64_t data_buffer_len, int64_t record_num,
+                      const char* sample_buffer, int64_t sample_buffer_len, char** rest_buffer,
+                      int64_t& rest_num);
+
 // Write data to file
 void WriteFile(const char* file_path, const char* buffer, int64_t buffer_len);
 
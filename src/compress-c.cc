@@ -16,9 +16,14 @@
 
 #include "compress-c.h"  // NOLINT
 
+#include "base/memcpy.h"
 #include "compress/compress_factory.h"
+#include "train/adaptive_compress.h"
 #include "train/pbc_train.h"
 
+using PBC::AdaptiveCompress;
+using PBC::AdaptiveDictionary;
+using PBC::AdaptiveTrainer;
 using PBC::PBC_Compress;
 using PBC::PBC_Train;
 
@@ -57,11 +62,135 @@ void PBC_loadPbcTrainData(void* pbc_ctx, char* file_buffer_train, size_t file_bu
     pbc->LoadData(file_buffer_train, file_buffer_len, data_type);
 }
 
+void PBC_setTrainMethod(void* pbc_ctx, int train_method, int refine) {
+    PBC_Train* pbc = reinterpret_cast<PBC_Train*>(pbc_ctx);
+    pbc->SetTrainMethod(PBC_Train::TrainMethod(train_method), refine != 0);
+}
+
+void PBC_setTrainCostModel(void* pbc_ctx, int cost_model) {
+    PBC_Train* pbc = reinterpret_cast<PBC_Train*>(pbc_ctx);
+    pbc->SetCostModel(PBC_Train::CostModel(cost_model));
+}
+
+void PBC_setTrainSegmentPenalty(void* pbc_ctx, double segment_penalty) {
+    PBC_Train* pbc = reinterpret_cast<PBC_Train*>(pbc_ctx);
+    pbc->SetSegmentPenalty(segment_penalty);
+}
+
+void PBC_setTrainShardNum(void* pbc_ctx, int shard_num) {
+    PBC_Train* pbc = reinterpret_cast<PBC_Train*>(pbc_ctx);
+    pbc->SetShardNum(shard_num);
+}
+
+void PBC_setTrainMaxMemory(void* pbc_ctx, size_t max_memory) {
+    PBC_Train* pbc = reinterpret_cast<PBC_Train*>(pbc_ctx);
+    pbc->SetMaxMemory(max_memory);
+}
+
+size_t PBC_getTrainEstimatedPeakMemory(const void* pbc_ctx) {
+    const PBC_Train* pbc = reinterpret_cast<const PBC_Train*>(pbc_ctx);
+    return pbc->GetEstimatedPeakMemory();
+}
+
+void PBC_setTrainTimeBudget(void* pbc_ctx, double time_budget,
+                            void (*callback)(void* user_data, int cluster_num, int k),
+                            void* user_data) {
+    PBC_Train* pbc = reinterpret_cast<PBC_Train*>(pbc_ctx);
+    pbc->SetTimeBudget(time_budget);
+    if (callback == nullptr) {
+        pbc->SetProgressCallback(nullptr);
+        return;
+    }
+    pbc->SetProgressCallback(
+        [callback, user_data](int cluster_num, int k) { callback(user_data, cluster_num, k); });
+}
+
+void PBC_setTrainPatternSizes(void* pbc_ctx, const int* pattern_sizes, int num,
+                              const char* holdout_buffer, size_t holdout_len, int data_type) {
+    PBC_Train* pbc = reinterpret_cast<PBC_Train*>(pbc_ctx);
+    pbc->SetAutoPatternSizes(std::vector<int>(pattern_sizes, pattern_sizes + num));
+    pbc->LoadHoldoutData(holdout_buffer, holdout_len, data_type);
+}
+
+int PBC_getTrainSelectedPatternSize(const void* pbc_ctx) {
+    const PBC_Train* pbc = reinterpret_cast<const PBC_Train*>(pbc_ctx);
+    return pbc->GetSelectedPatternSize();
+}
+
+void PBC_setTrainCheckpoint(void* pbc_ctx, const char* checkpoint_path,
+                            double checkpoint_interval) {
+    PBC_Train* pbc = reinterpret_cast<PBC_Train*>(pbc_ctx);
+    pbc->SetCheckpoint(checkpoint_path == nullptr ? "" : checkpoint_path, checkpoint_interval);
+}
+
+int PBC_loadTrainCheckpoint(void* pbc_ctx, const char* checkpoint_buffer, size_t len) {
+    PBC_Train* pbc = reinterpret_cast<PBC_Train*>(pbc_ctx);
+    return pbc->LoadCheckpoint(checkpoint_buffer, len);
+}
+
+int PBC_loadTrainSeeds(void* pbc_ctx, const char* seed_buffer, size_t len) {
+    PBC_Train* pbc = reinterpret_cast<PBC_Train*>(pbc_ctx);
+    return pbc->LoadSeeds(seed_buffer, len);
+}
+
+size_t PBC_serializeTrainSeeds(const void* pbc_ctx, char** seed_buffer) {
+    const PBC_Train* pbc = reinterpret_cast<const PBC_Train*>(pbc_ctx);
+    return pbc->SerializeSeeds(seed_buffer);
+}
+
+int PBC_loadTrainBasePatterns(void* pbc_ctx, const char* pattern_buffer, size_t len) {
+    PBC_Train* pbc = reinterpret_cast<PBC_Train*>(pbc_ctx);
+    return pbc->LoadBasePatterns(pattern_buffer, len);
+}
+
 size_t PBC_trainPattern(void* pbc_ctx, int pattern_size, char** pattern_buffer) {
     PBC_Train* pbc = reinterpret_cast<PBC_Train*>(pbc_ctx);
     return pbc->TrainPattern(pattern_size, pattern_buffer);
 }
 
+void* PBC_createAdaptiveTrainer(CompressMethod compress_method, int k, char* pattern_buffer,
+                                size_t pattern_buffer_len) {
+    AdaptiveTrainer* trainer = new AdaptiveTrainer(PBC::CompressMethod(compress_method), k);
+    trainer->SetDictionary(pattern_buffer, pattern_buffer_len);
+    return trainer;
+}
+
+void PBC_startAdaptiveTrainer(void* trainer_ctx) {
+    reinterpret_cast<AdaptiveTrainer*>(trainer_ctx)->Start();
+}
+
+size_t PBC_getAdaptiveDictionary(const void* trainer_ctx, char** pattern_buffer,
+                                 unsigned int* version) {
+    const AdaptiveTrainer* trainer = reinterpret_cast<const AdaptiveTrainer*>(trainer_ctx);
+    std::shared_ptr<const AdaptiveDictionary> dictionary = trainer->GetDictionary();
+    *pattern_buffer = new char[dictionary->pattern_buffer.size()];
+    pbc_memcpy(*pattern_buffer, dictionary->pattern_buffer.data(),
+               dictionary->pattern_buffer.size());
+    *version = dictionary->version;
+    return dictionary->pattern_buffer.size();
+}
+
+void PBC_freeAdaptiveTrainer(void* trainer_ctx) {
+    delete reinterpret_cast<AdaptiveTrainer*>(trainer_ctx);
+}
+
+void* PBC_createAdaptiveCtx(void* trainer_ctx) {
+    return new AdaptiveCompress(reinterpret_cast<AdaptiveTrainer*>(trainer_ctx));
+}
+
+size_t PBC_adaptiveCompress(void* pbc_ctx, char* data, size_t data_len, char* compress_buffer) {
+    AdaptiveCompress* pbc = reinterpret_cast<AdaptiveCompress*>(pbc_ctx);
+    return pbc->CompressUsingPattern(data, data_len, compress_buffer);
+}
+
+size_t PBC_adaptiveDecompress(void* pbc_ctx, char* compress_data, size_t compress_data_len,
+                              char* data_buffer) {
+    AdaptiveCompress* pbc = reinterpret_cast<AdaptiveCompress*>(pbc_ctx);
+    return pbc->DecompressUsingPattern(compress_data, compress_data_len, data_buffer);
+}
+
+void PBC_freeAdaptiveCtx(void* pbc_ctx) { delete reinterpret_cast<AdaptiveCompress*>(pbc_ctx); }
+
 unsigned int PBC_isError(size_t code) { return PBC::PBC_isError(code); }
 
 void PBC_freeTrainCtx(void* pbc_ctx) {
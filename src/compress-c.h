@@ -26,6 +26,12 @@ extern "C" {
 #define TYPE_VARCHAR 0
 #define TYPE_RECORD 1
 
+#define PBC_TRAIN_MERGE 0
+#define PBC_TRAIN_PARSE_TREE 1
+
+#define PBC_COST_UNIT 0
+#define PBC_COST_ENTROPY 1
+
 typedef enum { PBC_ONLY, PBC_FSE, PBC_FSST, PBC_ZSTD } CompressMethod;
 
 // Create pbc compress object
@@ -50,9 +56,92 @@ void* PBC_createTrainCtx(int compress_method, int thread_num);
 // Load pbc train data
 void PBC_loadPbcTrainData(void* pbc_ctx, char* data_buffer, size_t len, int data_type);
 
+// Set train method, PBC_TRAIN_MERGE or PBC_TRAIN_PARSE_TREE. refine merges more than k parse tree
+// templates down to k, otherwise the k largest templates are kept
+void PBC_setTrainMethod(void* pbc_ctx, int train_method, int refine);
+
+// Set what the merge cost counts, PBC_COST_UNIT or PBC_COST_ENTROPY
+void PBC_setTrainCostModel(void* pbc_ctx, int cost_model);
+
+// Charge every wildcard segment_penalty bytes more, trading compress rate for faster decoding
+void PBC_setTrainSegmentPenalty(void* pbc_ctx, double segment_penalty);
+
+// Set the number of shards merged on their own before the final merge
+void PBC_setTrainShardNum(void* pbc_ctx, int shard_num);
+
+// Keep training under max_memory bytes by dropping records and capping the dp tables in use at
+// once, 0 means no limit
+void PBC_setTrainMaxMemory(void* pbc_ctx, size_t max_memory);
+
+// Return the peak memory in bytes estimated by the last PBC_trainPattern
+size_t PBC_getTrainEstimatedPeakMemory(const void* pbc_ctx);
+
+// Stop merging after time_budget seconds of PBC_trainPattern and keep the clusters merged so
+// far, 0 means no budget. callback, if not NULL, is called with user_data, the current cluster
+// number and k while clusters are merged.
+void PBC_setTrainTimeBudget(void* pbc_ctx, double time_budget,
+                            void (*callback)(void* user_data, int cluster_num, int k),
+                            void* user_data);
+
+// Choose k among num pattern_sizes by compressing the holdout records, in the format of
+// PBC_loadPbcTrainData, with the patterns of each size. The k of PBC_trainPattern is then
+// ignored, the holdout buffer must stay alive until it returns.
+void PBC_setTrainPatternSizes(void* pbc_ctx, const int* pattern_sizes, int num,
+                              const char* holdout_buffer, size_t holdout_len, int data_type);
+
+// Return the k chosen by the last PBC_trainPattern, -1 without pattern sizes
+int PBC_getTrainSelectedPatternSize(const void* pbc_ctx);
+
+// Write the merge state to checkpoint_path every checkpoint_interval seconds of training
+void PBC_setTrainCheckpoint(void* pbc_ctx, const char* checkpoint_path, double checkpoint_interval);
+
+// Resume from a checkpoint file after loading the same train data, return the number of clusters
+// or -1 if the checkpoint is malformed or belongs to other data
+int PBC_loadTrainCheckpoint(void* pbc_ctx, const char* checkpoint_buffer, size_t len);
+
+// Load seed clusters written by PBC_serializeTrainSeeds, return the seed number or -1 if the
+// seeds are malformed
+int PBC_loadTrainSeeds(void* pbc_ctx, const char* seed_buffer, size_t len);
+
+// Write the clusters left by PBC_trainPattern with their record counts
+size_t PBC_serializeTrainSeeds(const void* pbc_ctx, char** seed_buffer);
+
+// Keep the patterns of an earlier pattern file ahead of the trained ones with their ids, return
+// the pattern number or -1 if the pattern file is malformed
+int PBC_loadTrainBasePatterns(void* pbc_ctx, const char* pattern_buffer, size_t len);
+
 // Train pattern
 size_t PBC_trainPattern(void* pbc_ctx, int k, char** pattern_buffer);
 
+// Create an adaptive trainer which appends k patterns trained from unmatched records to each new
+// dictionary version, pattern is the version 0 dictionary
+void* PBC_createAdaptiveTrainer(CompressMethod compress_method, int k, char* pattern_buffer,
+                                size_t pattern_buffer_len);
+
+// Start the background thread of the adaptive trainer
+void PBC_startAdaptiveTrainer(void* trainer_ctx);
+
+// Copy the current dictionary of the adaptive trainer into pattern_buffer and its version into
+// version, return the dictionary length
+size_t PBC_getAdaptiveDictionary(const void* trainer_ctx, char** pattern_buffer,
+                                 unsigned int* version);
+
+// Stop and free the adaptive trainer, after the contexts using it
+void PBC_freeAdaptiveTrainer(void* trainer_ctx);
+
+// Create an adaptive compress context, one per thread
+void* PBC_createAdaptiveCtx(void* trainer_ctx);
+
+// Adaptive compress, the output starts with the dictionary version
+size_t PBC_adaptiveCompress(void* pbc_ctx, char* data, size_t data_len, char* compress_buffer);
+
+// Adaptive decompress
+size_t PBC_adaptiveDecompress(void* pbc_ctx, char* compress_data, size_t compress_data_len,
+                              char* data_buffer);
+
+// Free adaptive compress context
+void PBC_freeAdaptiveCtx(void* pbc_ctx);
+
 // Whether is error or not
 unsigned int PBC_isError(size_t code);
 
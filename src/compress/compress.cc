@@ -41,10 +41,11 @@ int PBC_Compress::OnMatch(unsigned int id,
                           unsigned long long from,  // NOLINT
                           unsigned long long to,    // NOLINT
                           unsigned int flags, void* ctx) {
-    // Our context points to a size_t storing the match count
-    size_t* matches = reinterpret_cast<size_t*>(ctx);
-    if (pattern_len_list[id] > pattern_len_list[static_cast<int>(*matches)]) {
-        (*matches) = id;
+    // keep the match with the longest literals
+    MatchContext* match_context = reinterpret_cast<MatchContext*>(ctx);
+    const std::vector<int>& pattern_lens = *match_context->pattern_lens;
+    if (pattern_lens[id] > pattern_lens[match_context->pattern_id]) {
+        match_context->pattern_id = id;
     }
     return 0;  // continue matching
 }
@@ -208,7 +209,7 @@ int64_t PBC_Compress::ReadPattern(const char* data) {
     data_ptr += sizeof(int32_t);
 
     pattern_list_.resize(pattern_num_);
-    pattern_len_list.resize(pattern_num_ + 1);
+    pattern_len_list_.resize(pattern_num_ + 1);
     patterns_.resize(pattern_num_);
     flags_.resize(pattern_num_);
     ids_.resize(pattern_num_);
@@ -286,11 +287,27 @@ int64_t PBC_Compress::ReadPattern(const char* data) {
         patterns_[pattern_pos] = pattern_HS;
         pattern_list_[pattern_pos].num++;
         pattern_list_[pattern_pos].pos.push_back(pattern_list_pos);
-        pattern_len_list[pattern_pos] =
+        pattern_len_list_[pattern_pos] =
             pattern_list_[pattern_pos].data.length() - pattern_list_[pattern_pos].num;
     }
 
-    pattern_len_list[pattern_num_] = 0;
+    pattern_len_list_[pattern_num_] = 0;
+
+    // a pattern without literals would match the empty record and can not be compiled, it only
+    // keeps its id, e.g. the id of unmatched records of an earlier pattern file
+    size_t compiled_num = 0;
+    for (int32_t pattern_pos = 0; pattern_pos < pattern_num_; pattern_pos++) {
+        if (pattern_list_[pattern_pos].data.empty()) {
+            continue;
+        }
+        patterns_[compiled_num] = patterns_[pattern_pos];
+        flags_[compiled_num] = flags_[pattern_pos];
+        ids_[compiled_num] = ids_[pattern_pos];
+        compiled_num++;
+    }
+    patterns_.resize(compiled_num);
+    flags_.resize(compiled_num);
+    ids_.resize(compiled_num);
     return data_ptr;
 }
 
@@ -323,10 +340,11 @@ bool PBC_Compress::ReadData(const char* data, int64_t len) {
 
 size_t PBC_Compress::CompressUsingPattern(const char* input_cstring, size_t input_cstring_len,
                                           char* output_cstring) {
-    size_t match_pattern_id = pattern_num_;
+    MatchContext match_context = {&pattern_len_list_, static_cast<size_t>(pattern_num_)};
 
     hs_error_t err = hs_scan(hs_db_block_, input_cstring, input_cstring_len, 0, hs_scratch_,
-                             OnMatch, &match_pattern_id);
+                             OnMatch, &match_context);
+    size_t match_pattern_id = match_context.pattern_id;
 
     if (err != HS_SUCCESS) {
         PBC_LOG(ERROR) << "ERROR: Unable to scan packet. Error code:" << err << std::endl;
@@ -479,10 +497,11 @@ bool PBC_Compress::IsSpecialChar(char ch) {
 size_t PBC_Compress::CompressUsingPatternWithLength(const char* input_cstring,
                                                     size_t input_cstring_len,
                                                     char* output_cstring) {
-    size_t match_pattern_id = pattern_num_;
+    MatchContext match_context = {&pattern_len_list_, static_cast<size_t>(pattern_num_)};
 
     hs_error_t err = hs_scan(hs_db_block_, input_cstring, input_cstring_len, 0, hs_scratch_,
-                             OnMatch, &match_pattern_id);
+                             OnMatch, &match_context);
+    size_t match_pattern_id = match_context.pattern_id;
 
     if (err != HS_SUCCESS) {
         PBC_LOG(ERROR) << "ERROR: Unable to scan packet. Error code:" << err << std::endl;
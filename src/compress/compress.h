@@ -24,8 +24,6 @@
 
 #include "hs/hs.h"
 
-static std::vector<int> pattern_len_list;
-
 namespace PBC {
 
 enum CompressTypeFlag {
@@ -61,7 +59,7 @@ public:
     // Return pattern nums
     int GetPatternNum() const { return pattern_num_; }
 
-    // HypserScan match_event_handler
+    // HypserScan match_event_handler, ctx is a MatchContext
     static int OnMatch(unsigned int id, unsigned long long from, unsigned long long to,  // NOLINT
                        unsigned int flags, void* ctx);
 
@@ -89,6 +87,12 @@ public:
     //                            char* output_cstring);
 
 protected:
+    // The pattern lengths of the scanning object and the longest pattern matched so far
+    struct MatchContext {
+        const std::vector<int>* pattern_lens;
+        size_t pattern_id;
+    };
+
     struct patternInfo {
         int num;
         std::vector<int> pos;
@@ -142,6 +146,8 @@ protected:
     hs_scratch_t* hs_scratch_ = nullptr;    // hyperscan scratch space
 
     std::vector<patternInfo> pattern_list_;  // stores pattern infos
+    // the literal length of each pattern, and 0 for the id of unmatched records
+    std::vector<int> pattern_len_list_;
 
     std::vector<std::string> patterns_;  // stores regular expressions
     std::vector<unsigned> flags_;        // stores hyperscan flag
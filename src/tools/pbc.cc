@@ -15,16 +15,26 @@
 */
 
 #include <fcntl.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <chrono>  // NOLINT
 #include <ctime>
 #include <iostream>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
 
 #include "base/memcpy.h"
 #include "common/utils.h"
 #include "compress/compress_factory.h"
+#include "train/multi_trainer.h"
+#include "train/pattern_refiner.h"
 #include "train/pbc_train.h"
+#include "train/reservoir_sampler.h"
+#include "train/stratified_sampler.h"
 
 using PBC::ERROR;
 using PBC::INFO;
@@ -34,6 +44,8 @@ constexpr int DEFAULT_MAX_DECOMPRESS_SIZE = (1024 * 1024);
 constexpr int DEFAULT_PATTERN_SIZE = 20;
 constexpr int DEFAULT_TRAIN_DATA_SIZE = 500;
 constexpr int DEFAULT_TRAIN_THREAD_NUM = 16;
+// stratified sampling of a streamed input picks from a reservoir of this many times the records
+constexpr int STREAMING_STRATIFIED_FACTOR = 4;
 
 enum PBCOperation { NO_OPERATION, TRAIN_PATTERN, TEST_COMPRESS, COMPRESS, DECOMPRESS };
 
@@ -41,12 +53,50 @@ static struct config {
     PBCOperation operation = PBCOperation::NO_OPERATION;
     int32_t target_pattern_size = DEFAULT_PATTERN_SIZE;
     int train_data_number = DEFAULT_TRAIN_DATA_SIZE;
+    // sample records across structural strata instead of by a fixed step
+    bool train_stratified_sampling = false;
+    // read the input record by record into a reservoir instead of into memory
+    bool train_streaming = false;
     char* inputfile_path = nullptr;
     char* patternfile_path = nullptr;
     char* outputfile_path = nullptr;
     int32_t train_thread_num = DEFAULT_TRAIN_THREAD_NUM;
     int32_t input_type = TYPE_RECORD;
     PBC::CompressMethod compress_method = PBC::CompressMethod::PBC_ONLY;
+    int train_lower_bounds = PBC::PBC_Train::LOWER_BOUND_ALL;
+    int train_candidate_num = PBC::PBC_Train::DEFAULT_CANDIDATE_NUM;
+    PBC::PBC_Train::MergeMode train_merge_mode = PBC::PBC_Train::MERGE_GREEDY;
+    double train_merge_tolerance = PBC::PBC_Train::DEFAULT_MERGE_TOLERANCE;
+    PBC::PBC_Train::CostModel train_cost_model = PBC::PBC_Train::COST_UNIT;
+    // bytes per wildcard
+    double train_segment_penalty = 0.0;
+    // bytes training may take, 0 for no limit
+    int64_t max_memory = 0;
+    PBC::PBC_Train::TrainMethod train_method = PBC::PBC_Train::TRAIN_MERGE;
+    bool train_refine_templates = true;
+    bool train_canonicalize = false;
+    int train_shard_num = 1;
+    // seconds, 0 trains until the pattern size is reached
+    double train_time_budget = 0.0;
+    // comma separated candidate pattern sizes, the pattern size is chosen among them if set
+    char* train_pattern_sizes = nullptr;
+    // 0 holds out as many records as are trained
+    int train_holdout_number = 0;
+    char* train_size_report = nullptr;
+    // resumed from if it exists, then rewritten every interval
+    char* train_checkpoint = nullptr;
+    double train_checkpoint_interval = PBC::PBC_Train::DEFAULT_CHECKPOINT_INTERVAL;
+    // comma separated seed files trained together with the input records
+    char* train_seed_input = nullptr;
+    char* train_seed_output = nullptr;
+    // an earlier pattern file whose patterns keep their ids
+    char* train_base_pattern = nullptr;
+    // empty trains over bytes
+    std::string train_token_delimiters;
+    // lines of "inputFile patternFile" trained at once instead of -i and -p
+    char* train_jobs = nullptr;
+    // compress the whole input with the trained patterns and refine them
+    bool train_refine = false;
     int log_level = 1;  // 0 print all logs, 1 print info logs, 2 print error log, 3 print error
                         // logs, >=4 print no log
     int use_default_log_level = 1;
@@ -54,6 +104,54 @@ static struct config {
 
 static void usage();
 
+// Parse comma separated lower bound names, return -1 if any name is unknown
+static int ParseLowerBounds(const char* lower_bounds_str) {
+    int lower_bounds = PBC::PBC_Train::LOWER_BOUND_NONE;
+    for (const std::string& name : PBC::SplitString(lower_bounds_str, ",")) {
+        if (name == "length") {
+            lower_bounds |= PBC::PBC_Train::LOWER_BOUND_LENGTH;
+        } else if (name == "anchor") {
+            lower_bounds |= PBC::PBC_Train::LOWER_BOUND_ANCHOR;
+        } else if (name == "one_gram") {
+            lower_bounds |= PBC::PBC_Train::LOWER_BOUND_ONE_GRAM;
+        } else if (name == "bigram") {
+            lower_bounds |= PBC::PBC_Train::LOWER_BOUND_BIGRAM;
+        } else if (name == "all") {
+            lower_bounds |= PBC::PBC_Train::LOWER_BOUND_ALL;
+        } else if (name != "none") {
+            return -1;
+        }
+    }
+    return lower_bounds;
+}
+
+// Parse a byte size with an optional K, M or G suffix, return -1 if it is malformed
+static int64_t ParseMemorySize(const char* size_str) {
+    char* end = nullptr;
+    double size = strtod(size_str, &end);
+    if (end == size_str || size < 0) {
+        return -1;
+    }
+    switch (*end) {
+        case 'k':
+        case 'K':
+            size *= 1024.0;
+            end++;
+            break;
+        case 'm':
+        case 'M':
+            size *= 1024.0 * 1024.0;
+            end++;
+            break;
+        case 'g':
+        case 'G':
+            size *= 1024.0 * 1024.0 * 1024.0;
+            end++;
+            break;
+    }
+    return *end == '\0' ? static_cast<int64_t>(size) : -1;
+}
+
 // Parse command line
 static bool ParseOptions(int argc, const char** argv) {
     for (int i = 1; i < argc; i++) {
@@ -94,8 +192,111 @@ static bool ParseOptions(int argc, const char** argv) {
             }
         } else if (!strcmp(argv[i], "--train-data-number") && !lastarg) {
             config.train_data_number = atoi(argv[++i]);
+            if (config.train_data_number <= 0) {
+                std::cerr << "train data number must be positive" << std::endl;
+                return false;
+            }
+        } else if (!strcmp(argv[i], "--train-sampling") && !lastarg) {
+            i++;
+            if (!strcmp(argv[i], "step")) {
+                config.train_stratified_sampling = false;
+            } else if (!strcmp(argv[i], "stratified")) {
+                config.train_stratified_sampling = true;
+            } else {
+                std::cerr << "unknown train sampling: " << argv[i] << std::endl;
+                return false;
+            }
+        } else if (!strcmp(argv[i], "--train-streaming")) {
+            config.train_streaming = true;
+        } else if (!strcmp(argv[i], "--max-memory") && !lastarg) {
+            config.max_memory = ParseMemorySize(argv[++i]);
+            if (config.max_memory < 0) {
+                std::cerr << "invalid max memory: " << argv[i] << std::endl;
+                return false;
+            }
         } else if (!strcmp(argv[i], "--train-thread-num") && !lastarg) {
             config.train_thread_num = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--train-lower-bounds") && !lastarg) {
+            config.train_lower_bounds = ParseLowerBounds(argv[++i]);
+            if (config.train_lower_bounds < 0) {
+                std::cerr << "unknown lower bound: " << argv[i] << std::endl;
+                return false;
+            }
+        } else if (!strcmp(argv[i], "--train-candidate-num") && !lastarg) {
+            config.train_candidate_num = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--train-merge-mode") && !lastarg) {
+            ++i;
+            if (!strcmp(argv[i], "greedy")) {
+                config.train_merge_mode = PBC::PBC_Train::MERGE_GREEDY;
+            } else if (!strcmp(argv[i], "reciprocal")) {
+                config.train_merge_mode = PBC::PBC_Train::MERGE_RECIPROCAL;
+            } else {
+                std::cerr << "unknown merge mode: " << argv[i] << std::endl;
+                return false;
+            }
+        } else if (!strcmp(argv[i], "--train-merge-tolerance") && !lastarg) {
+            config.train_merge_tolerance = atof(argv[++i]);
+        } else if (!strcmp(argv[i], "--train-cost-model") && !lastarg) {
+            ++i;
+            if (!strcmp(argv[i], "unit")) {
+                config.train_cost_model = PBC::PBC_Train::COST_UNIT;
+            } else if (!strcmp(argv[i], "entropy")) {
+                config.train_cost_model = PBC::PBC_Train::COST_ENTROPY;
+            } else {
+                std::cerr << "unknown cost model: " << argv[i] << std::endl;
+                return false;
+            }
+        } else if (!strcmp(argv[i], "--train-segment-penalty") && !lastarg) {
+            config.train_segment_penalty = atof(argv[++i]);
+        } else if (!strcmp(argv[i], "--train-method") && !lastarg) {
+            ++i;
+            if (!strcmp(argv[i], "merge")) {
+                config.train_method = PBC::PBC_Train::TRAIN_MERGE;
+            } else if (!strcmp(argv[i], "parse_tree")) {
+                config.train_method = PBC::PBC_Train::TRAIN_PARSE_TREE;
+            } else {
+                std::cerr << "unknown train method: " << argv[i] << std::endl;
+                return false;
+            }
+        } else if (!strcmp(argv[i], "--train-no-refine")) {
+            config.train_refine_templates = false;
+        } else if (!strcmp(argv[i], "--train-canonicalize")) {
+            config.train_canonicalize = true;
+        } else if (!strcmp(argv[i], "--train-shard-num") && !lastarg) {
+            config.train_shard_num = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--train-time-budget") && !lastarg) {
+            config.train_time_budget = atof(argv[++i]);
+        } else if (!strcmp(argv[i], "--train-pattern-sizes") && !lastarg) {
+            config.train_pattern_sizes = const_cast<char*>(argv[++i]);
+            for (const std::string& pattern_size :
+                 PBC::SplitString(config.train_pattern_sizes, ",")) {
+                if (atoi(pattern_size.c_str()) > MAX_PATTERN_SIZE) {
+                    std::cerr << "dict size overflow" << std::endl;
+                    return false;
+                }
+            }
+        } else if (!strcmp(argv[i], "--train-holdout-number") && !lastarg) {
+            config.train_holdout_number = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--train-size-report") && !lastarg) {
+            config.train_size_report = const_cast<char*>(argv[++i]);
+        } else if (!strcmp(argv[i], "--train-checkpoint") && !lastarg) {
+            config.train_checkpoint = const_cast<char*>(argv[++i]);
+        } else if (!strcmp(argv[i], "--train-checkpoint-interval") && !lastarg) {
+            config.train_checkpoint_interval = atof(argv[++i]);
+        } else if (!strcmp(argv[i], "--train-seed-input") && !lastarg) {
+            config.train_seed_input = const_cast<char*>(argv[++i]);
+        } else if (!strcmp(argv[i], "--train-seed-output") && !lastarg) {
+            config.train_seed_output = const_cast<char*>(argv[++i]);
+        } else if (!strcmp(argv[i], "--train-base-pattern") && !lastarg) {
+            config.train_base_pattern = const_cast<char*>(argv[++i]);
+        } else if (!strcmp(argv[i], "--train-tokenize")) {
+            config.train_token_delimiters = PBC::TokenTable::DEFAULT_DELIMITERS;
+        } else if (!strcmp(argv[i], "--train-token-delimiters") && !lastarg) {
+            config.train_token_delimiters = argv[++i];
+        } else if (!strcmp(argv[i], "--train-refine")) {
+            config.train_refine = true;
+        } else if (!strcmp(argv[i], "--train-jobs") && !lastarg) {
+            config.train_jobs = const_cast<char*>(argv[++i]);
         } else if (!strcmp(argv[i], "--varchar")) {
             config.input_type = TYPE_VARCHAR;
         } else if (!strcmp(argv[i], "--log-level") && !lastarg) {
@@ -111,7 +312,7 @@ static void usage() {
         "\n"
            "Usage: pbc [OPTIONS] [arg [arg ...]]\n"
            "  --help             Output this help and exit.\n"
-           "  --train-pattern -i <inputFile> -p <patternFile> [--compress-method <pbc_only/pbc_fse/pbc_fsst/pbc_zstd>] [--pattern-size <pattern_size>] [--train-data-number <train_data_number>] [--train-thread-num <train_thread_num>] [--varchar].\n"
+           "  --train-pattern -i <inputFile> -p <patternFile> [--compress-method <pbc_only/pbc_fse/pbc_fsst/pbc_zstd>] [--pattern-size <pattern_size>] [--train-data-number <train_data_number>] [--train-sampling <step/stratified>] [--train-streaming] [--train-thread-num <train_thread_num>] [--max-memory <bytes>] [--train-lower-bounds <bounds>] [--train-candidate-num <candidate_num>] [--train-merge-mode <greedy/reciprocal>] [--train-merge-tolerance <tolerance>] [--train-cost-model <unit/entropy>] [--train-segment-penalty <bytes>] [--train-method <merge/parse_tree>] [--train-no-refine] [--train-canonicalize] [--train-shard-num <shard_num>] [--train-time-budget <seconds>] [--train-pattern-sizes <sizes>] [--train-holdout-number <holdout_number>] [--train-size-report <reportFile>] [--train-checkpoint <checkpointFile>] [--train-checkpoint-interval <seconds>] [--train-seed-input <seedFiles>] [--train-seed-output <seedFile>] [--train-base-pattern <patternFile>] [--train-tokenize] [--train-token-delimiters <delimiters>] [--train-refine] [--train-jobs <jobFile>] [--varchar].\n"
            "  --test-compress -i <inputFile> -p <patternFile> [--compress-method <pbc_only/pbc_fse/pbc_fsst/pbc_zstd>] [--varchar].\n"
            "  -c/--compress -i <inputFile> -p <patternFile> [-o <outputFile>].\n"
            "  -d/--decompress -i <inputFile> -p <patternFile> [-o <outputFile>].\n"
@@ -121,11 +322,38 @@ static void usage() {
            "  --compress-method        Compress method, one of pbc_only, pbc_fse, pbc_fsst, pbc_zstd, default is pbc_only.\n"
            "  --pattern-size           The number of expected generate, default is 20.\n"
            "  --train-data-number      The number of data used for training pattern, default is 500.\n"
+           "  --train-sampling         How the training records are sampled, step takes every n-th record, stratified groups the records by their shape and first words and samples every group, so rare templates are trained too, default is step.\n"
+           "  --train-streaming        Read the input file, every file under an input directory, or stdin if -i is not set, one chunk at a time and keep a uniform reservoir sample of the records to train on, so memory does not grow with the input.\n"
            "  --train-thread-num       The thread num used for training pattern, default is 16.\n"
+           "  --max-memory             The memory training may take, in bytes or with a K, M or G suffix. Training drops sampled records until they fit and lets fewer threads hold dp tables at once if all of them would not, the estimated peak is logged before merging. Training fails if even one record does not fit. Reading a whole input takes about three times its size, use --train-streaming for larger inputs. Default is 0, i.e. no limit.\n"
+           "  --train-lower-bounds     Comma separated lower bounds used to prune pairs when training, any of length, anchor, one_gram, bigram, all, none, default is all.\n"
+           "  --train-candidate-num    The number of best candidates kept by each cluster when training, default is 1.\n"
+           "  --train-merge-mode       How clusters are merged when training, greedy merges the closest pair one at a time, reciprocal merges disjoint mutually closest pairs in parallel rounds, default is greedy.\n"
+           "  --train-merge-tolerance  The relative cost a pair may exceed the closest pair by to join the same reciprocal round, default is 0.\n"
+           "  --train-cost-model       What the merge cost counts when training, unit counts every wildcard and residual symbol as 1, entropy counts the bits they take after the secondary encoder, default is unit.\n"
+           "  --train-segment-penalty  The bytes every wildcard costs on top of the cost model when training, a penalty trains patterns with fewer wildcards which decompress faster, default is 0.\n"
+           "  --train-method           How patterns are trained, merge clusters records with the encoding length dp, parse_tree groups them into templates in one pass and merges the templates with the dp if there are more than the pattern size, default is merge.\n"
+           "  --train-no-refine        Keep the largest parse_tree templates instead of merging them.\n"
+           "  --train-canonicalize     Train records which only differ in numbers and hex ids as one weighted record.\n"
+           "  --train-shard-num        Merge the training records in shards first, in parallel with the train threads, then merge the clusters of all shards, default is 1.\n"
+           "  --train-time-budget      Stop merging after this many seconds of training and write the clusters merged so far, default is 0, i.e. no budget.\n"
+           "  --train-pattern-sizes    Comma separated candidate pattern sizes, training keeps the patterns of each, compresses the holdout records with them and writes the size on the knee of the compress rate instead of --pattern-size.\n"
+           "  --train-holdout-number   The number of records held out for --train-pattern-sizes, sampled from the records not sampled for training, default is the train data number.\n"
+           "  --train-size-report      Write the compress rate and speed of every candidate pattern size to a csv file.\n"
+           "  --train-checkpoint       Write the merge state to a checkpoint file while training, a run with the same options and input resumes from the file if it exists.\n"
+           "  --train-checkpoint-interval The seconds between two checkpoints, default is 600.\n"
+           "  --train-seed-input       Comma separated seed files whose weighted clusters are trained together with the input records.\n"
+           "  --train-seed-output      Write the trained clusters with their record counts to a seed file, which another run can take as seed input.\n"
+           "  --train-base-pattern     Keep the patterns of an earlier pattern file first with their ids and append patterns trained from the records they do not cover, its seed file gives their record counts.\n"
+           "  --train-tokenize         Train over tokens split on the default delimiters instead of bytes, the patterns are still byte patterns.\n"
+           "  --train-token-delimiters The delimiter bytes tokens are split on, implies --train-tokenize.\n"
+           "  --train-refine           After training, read the whole input again and compress it with the trained patterns in parallel. Patterns with a large share of the residual bytes are split in two if that compresses their records better, and patterns for large groups of unmatched records are added. The trained patterns keep their ids. Not done for stdin or with --train-base-pattern.\n"
+           "  --train-jobs             Train the dictionaries of many inputs at once on the train threads instead of -i and -p, every line of the job file is an input file and its pattern file separated by spaces. The other train options apply to every job, except the checkpoint, seed and base pattern options which are ignored. The largest inputs start first and at most train-thread-num inputs are sampled and trained at once.\n"
            "  --varchar                Data type of input file, only effected when train-pattern and test-compress, default is Record(split by \'\\n\').\n"
            "\n"
            "Examples:\n"
            "  pbc --train-pattern -i inputFile -p patternFile --compress-method pbc_fse --pattern-size 50 --train-data-number 1000 --train-thread-num 64 --varchar\n"
+           "  pbc --train-pattern --train-jobs jobFile --pattern-size 50 --train-thread-num 16\n"
            "  pbc --test-compress -i inputFile -p patternFile --compress-method pbc_fse --varchar\n"
            "  pbc --compress -i inputFile -p patternFile -o outputFile\n"
            "  cat inputFile | pbc --compress -p patternFile > outputFile\n"
@@ -149,6 +377,165 @@ static std::string CompressMethodToString(PBC::CompressMethod compress_method) {
     return "UNKONW_COMPRESS_METHOD";
 }
 
+// Sample the training records of input_path, and the holdout records if pattern sizes are
+// set, into new buffers in the format of ReadDataFromBuffer. Stratified sampling runs on
+// scheduler, or on a scheduler of its own if it is nullptr. Return the length of train_buffer,
+// -1 if the input can not be read or no record is left for the holdout.
+static int64_t SampleInput(const char* input_path, PBC::TaskScheduler* scheduler,
+                           char** train_buffer, char** holdout_buffer,
+                           int64_t& holdout_buffer_len) {
+    char* original_buffer = nullptr;
+    char* records_buffer = nullptr;
+    int64_t original_len = 0;
+    int64_t records_buffer_len = 0;
+    int64_t train_buffer_len = 0;
+    int64_t record_num = 0;
+    int32_t max_record_len = 0;
+    *train_buffer = nullptr;
+    *holdout_buffer = nullptr;
+    holdout_buffer_len = 0;
+
+    int64_t holdout_number = config.train_holdout_number > 0 ? config.train_holdout_number
+                                                             : config.train_data_number;
+    if (config.train_streaming) {
+        // the reservoir holds the records both samples are taken from
+        int64_t reservoir_num = config.train_data_number;
+        if (config.train_pattern_sizes != nullptr) {
+            reservoir_num += holdout_number;
+        }
+        if (config.train_stratified_sampling) {
+            reservoir_num *= STREAMING_STRATIFIED_FACTOR;
+        }
+        PBC::ReservoirSampler reservoir(reservoir_num);
+        if (!PBC::StreamRecords(input_path, config.input_type,
+                                [&reservoir](const char* record, int32_t len) {
+                                    reservoir.Add(record, len);
+                                })) {
+            return -1;
+        }
+        records_buffer_len = reservoir.Serialize(&records_buffer, record_num, max_record_len);
+        PBC_LOG(INFO) << "streaming: read record number = " << reservoir.SeenNum()
+                      << ", reservoir record number = " << record_num
+                      << ", reservoir bytes = " << records_buffer_len << std::endl;
+        if (record_num == 0) {
+            PBC_LOG(ERROR) << "The input has no record" << std::endl;
+            delete[] records_buffer;
+            return -1;
+        }
+    } else {
+        struct stat input_stat;
+        if (config.max_memory > 0 && input_path != nullptr && stat(input_path, &input_stat) == 0 &&
+            3 * static_cast<int64_t>(input_stat.st_size) > config.max_memory) {
+            PBC_LOG(INFO) << "reading the whole input takes about " << 3 * input_stat.st_size
+                          << " bytes, more than max memory, --train-streaming reads a sample"
+                          << std::endl;
+        }
+        original_len = PBC::ReadFile(input_path, &original_buffer);
+        if (original_len < 0) {
+            return -1;
+        }
+        records_buffer_len = PBC::ReadDataFromBuffer(config.input_type, original_buffer,
+                                                     original_len, &records_buffer, record_num,
+                                                     max_record_len);
+    }
+    PBC::TaskScheduler* sampling_scheduler = nullptr;
+    PBC::StratifiedSampler* stratified_sampler = nullptr;
+    if (config.train_stratified_sampling) {
+        if (scheduler == nullptr && config.train_thread_num > 1) {
+            sampling_scheduler = new PBC::TaskScheduler(config.train_thread_num);
+        }
+        stratified_sampler =
+            new PBC::StratifiedSampler(scheduler != nullptr ? scheduler : sampling_scheduler);
+        train_buffer_len = stratified_sampler->Sample(records_buffer, records_buffer_len,
+                                                      record_num, train_buffer,
+                                                      config.train_data_number);
+    } else {
+        train_buffer_len = PBC::SamplingFromData(records_buffer, records_buffer_len, record_num,
+                                                 train_buffer, config.train_data_number);
+    }
+    if (config.train_pattern_sizes != nullptr) {
+        // the holdout is sampled the same way from the records not sampled for training
+        char* rest_buffer = nullptr;
+        int64_t rest_num = 0;
+        int64_t rest_buffer_len =
+            PBC::ExcludeSample(records_buffer, records_buffer_len, record_num, *train_buffer,
+                               train_buffer_len, &rest_buffer, rest_num);
+        if (rest_num == 0) {
+            PBC_LOG(ERROR) << "All " << record_num << " records are sampled for training, "
+                           << "no record is left to hold out for --train-pattern-sizes"
+                           << std::endl;
+            delete[] *train_buffer;
+            *train_buffer = nullptr;
+            train_buffer_len = -1;
+        } else {
+            if (rest_num < holdout_number) {
+                PBC_LOG(INFO) << "Only " << rest_num << " records are not sampled for training, "
+                              << "the holdout has fewer than " << holdout_number << std::endl;
+            }
+            if (stratified_sampler != nullptr) {
+                holdout_buffer_len = stratified_sampler->Sample(
+                    rest_buffer, rest_buffer_len, rest_num, holdout_buffer, holdout_number);
+            } else {
+                holdout_buffer_len = PBC::SamplingFromData(rest_buffer, rest_buffer_len, rest_num,
+                                                           holdout_buffer, holdout_number);
+            }
+        }
+        delete[] rest_buffer;
+    }
+    delete stratified_sampler;
+    delete sampling_scheduler;
+    // only the samples are trained on
+    delete[] records_buffer;
+    delete[] original_buffer;
+    return train_buffer_len;
+}
+
+// Set the training options of the command line on pbc_train, and its holdout records if pattern
+// sizes are set
+static void ConfigureTrain(PBC::PBC_Train* pbc_train, char* holdout_buffer,
+                           int64_t holdout_buffer_len) {
+    pbc_train->SetLowerBounds(config.train_lower_bounds);
+    pbc_train->SetCandidateNum(config.train_candidate_num);
+    pbc_train->SetMergeMode(config.train_merge_mode);
+    pbc_train->SetMergeTolerance(config.train_merge_tolerance);
+    pbc_train->SetCostModel(config.train_cost_model);
+    pbc_train->SetSegmentPenalty(config.train_segment_penalty);
+    pbc_train->SetMaxMemory(config.max_memory);
+    pbc_train->SetTokenDelimiters(config.train_token_delimiters);
+    pbc_train->SetTrainMethod(config.train_method, config.train_refine_templates);
+    pbc_train->SetCanonicalize(config.train_canonicalize);
+    pbc_train->SetShardNum(config.train_shard_num);
+    pbc_train->SetTimeBudget(config.train_time_budget);
+    if (config.train_pattern_sizes != nullptr) {
+        std::vector<int> pattern_sizes;
+        for (const std::string& pattern_size :
+             PBC::SplitString(config.train_pattern_sizes, ",")) {
+            pattern_sizes.push_back(atoi(pattern_size.c_str()));
+        }
+        pbc_train->SetAutoPatternSizes(pattern_sizes);
+        pbc_train->LoadHoldoutData(holdout_buffer, holdout_buffer_len, TYPE_VARCHAR);
+    }
+}
+
+// Refine the trained patterns of input_path with one more pass over all its records. Return the
+// length of the new refined_buffer, -1 if the input can not be read again.
+static int64_t RefinePatterns(const char* input_path, PBC::TaskScheduler* scheduler,
+                              const char* pattern_buffer, int64_t pattern_buffer_len,
+                              char** refined_buffer) {
+    PBC::PatternRefiner refiner(config.compress_method, scheduler);
+    if (!refiner.LoadPatterns(pattern_buffer, pattern_buffer_len)) {
+        PBC_LOG(ERROR) << "invalid pattern file to refine" << std::endl;
+        return -1;
+    }
+    if (!PBC::StreamRecords(input_path, config.input_type,
+                            [&refiner](const char* record, int32_t len) {
+                                refiner.Add(record, len);
+                            })) {
+        return -1;
+    }
+    return refiner.Refine(refined_buffer);
+}
+
 static int PBCTrainPattern() {
     PBC::SetPBCLogLevel(config.log_level);
     PBC_LOG(INFO) << "operation: train_pattern" << std::endl;
@@ -163,45 +550,251 @@ static int PBCTrainPattern() {
     PBC_LOG(INFO) << "train_data_number: " << config.train_data_number << std::endl;
     PBC_LOG(INFO) << "target pattern size: " << config.target_pattern_size << std::endl;
 
-    char* original_buffer = nullptr;
-    char* records_buffer = nullptr;
     char* train_buffer = nullptr;
+    char* holdout_buffer = nullptr;
     char* pattern_buffer = nullptr;
-    int64_t original_len = 0;
-    int64_t records_buffer_len = 0;
-    int64_t train_buffer_len = 0;
+    int64_t holdout_buffer_len = 0;
     int64_t pattern_buffer_len = 0;
-    int64_t record_num = 0;
-    int32_t max_record_len = 0;
-
-    original_len = PBC::ReadFile(config.inputfile_path, &original_buffer);
-    if (original_len < 0) {
+    int64_t train_buffer_len = SampleInput(config.inputfile_path, nullptr, &train_buffer,
+                                           &holdout_buffer, holdout_buffer_len);
+    if (train_buffer_len < 0) {
         return -1;
     }
-    records_buffer_len = PBC::ReadDataFromBuffer(config.input_type, original_buffer, original_len,
-                                                 &records_buffer, record_num, max_record_len);
-    train_buffer_len = PBC::SamplingFromData(records_buffer, records_buffer_len, record_num,
-                                             &train_buffer, config.train_data_number);
 
     auto start_train_time = std::chrono::steady_clock::now();
     PBC::PBC_Train* pbc_train = new PBC::PBC_Train(config.compress_method, config.train_thread_num);
+    ConfigureTrain(pbc_train, holdout_buffer, holdout_buffer_len);
+    if (config.train_seed_input != nullptr) {
+        for (const std::string& seed_path : PBC::SplitString(config.train_seed_input, ",")) {
+            char* seed_buffer = nullptr;
+            int64_t seed_buffer_len = PBC::ReadFile(seed_path.c_str(), &seed_buffer);
+            int seed_num = seed_buffer_len < 0 ? -1 : pbc_train->LoadSeeds(seed_buffer,
+                                                                          seed_buffer_len);
+            delete[] seed_buffer;
+            if (seed_num < 0) {
+                PBC_LOG(ERROR) << "invalid seed file: " << seed_path << std::endl;
+                delete pbc_train;
+                delete[] train_buffer;
+                delete[] holdout_buffer;
+                return -1;
+            }
+            PBC_LOG(INFO) << "load " << seed_num << " seeds from " << seed_path << std::endl;
+        }
+    }
+    if (config.train_base_pattern != nullptr) {
+        char* base_buffer = nullptr;
+        int64_t base_buffer_len = PBC::ReadFile(config.train_base_pattern, &base_buffer);
+        int base_num = base_buffer_len < 0 ? -1 : pbc_train->LoadBasePatterns(base_buffer,
+                                                                              base_buffer_len);
+        delete[] base_buffer;
+        if (base_num < 0) {
+            PBC_LOG(ERROR) << "invalid base pattern file: " << config.train_base_pattern
+                           << std::endl;
+            delete pbc_train;
+            delete[] train_buffer;
+            delete[] holdout_buffer;
+            return -1;
+        }
+        PBC_LOG(INFO) << "load " << base_num << " base patterns from "
+                      << config.train_base_pattern << std::endl;
+    }
     pbc_train->PBC::PBC_Train::LoadData(train_buffer, train_buffer_len, /*data_type=*/TYPE_VARCHAR);
+    if (config.train_checkpoint != nullptr) {
+        if (access(config.train_checkpoint, F_OK) == 0) {
+            char* checkpoint_buffer = nullptr;
+            int64_t checkpoint_buffer_len = PBC::ReadFile(config.train_checkpoint,
+                                                          &checkpoint_buffer);
+            int cluster_num = checkpoint_buffer_len < 0
+                                  ? -1
+                                  : pbc_train->LoadCheckpoint(checkpoint_buffer,
+                                                              checkpoint_buffer_len);
+            delete[] checkpoint_buffer;
+            if (cluster_num < 0) {
+                PBC_LOG(ERROR) << "invalid checkpoint file: " << config.train_checkpoint
+                               << std::endl;
+                delete pbc_train;
+                delete[] train_buffer;
+                delete[] holdout_buffer;
+                return -1;
+            }
+            PBC_LOG(INFO) << "resume " << cluster_num << " clusters from "
+                          << config.train_checkpoint << std::endl;
+        }
+        pbc_train->SetCheckpoint(config.train_checkpoint, config.train_checkpoint_interval);
+    }
     pattern_buffer_len =
         pbc_train->PBC::PBC_Train::TrainPattern(config.target_pattern_size, &pattern_buffer);
+    if (pattern_buffer_len < 0) {
+        PBC_LOG(ERROR) << "train pattern failed" << std::endl;
+        delete pbc_train;
+        delete[] train_buffer;
+        delete[] holdout_buffer;
+        delete[] pattern_buffer;
+        return -1;
+    }
+    if (config.train_refine) {
+        if (config.inputfile_path == nullptr || !strcmp(config.inputfile_path, "-") ||
+            config.train_base_pattern != nullptr) {
+            PBC_LOG(INFO) << "refinement is skipped for stdin and base patterns" << std::endl;
+        } else {
+            PBC::TaskScheduler* refine_scheduler = nullptr;
+            if (config.train_thread_num > 1) {
+                refine_scheduler = new PBC::TaskScheduler(config.train_thread_num);
+            }
+            char* refined_buffer = nullptr;
+            int64_t refined_buffer_len = RefinePatterns(config.inputfile_path, refine_scheduler,
+                                                        pattern_buffer, pattern_buffer_len,
+                                                        &refined_buffer);
+            delete refine_scheduler;
+            if (refined_buffer_len < 0) {
+                PBC_LOG(ERROR) << "refinement failed, the trained patterns are written"
+                               << std::endl;
+                delete[] refined_buffer;
+            } else {
+                delete[] pattern_buffer;
+                pattern_buffer = refined_buffer;
+                pattern_buffer_len = refined_buffer_len;
+            }
+        }
+    }
     auto end_train_time = std::chrono::steady_clock::now();
+    if (pbc_train->BudgetExceeded()) {
+        PBC_LOG(INFO) << "train time budget exceeded, the pattern file keeps more patterns than "
+                      << config.target_pattern_size << std::endl;
+    }
     PBC_LOG(INFO) << "train pattern cost time: "
                   << std::chrono::duration<double>(end_train_time - start_train_time).count() << "s"
                   << std::endl;
+    if (pbc_train->GetSelectedPatternSize() > 0) {
+        PBC_LOG(INFO) << "selected pattern size: " << pbc_train->GetSelectedPatternSize()
+                      << std::endl;
+    }
+    if (config.train_size_report != nullptr) {
+        std::string report =
+            "k,cluster_num,pattern_num,pattern_len,original_len,compressed_len,compress_rate,"
+            "compress_speed_mb_s,selected\n";
+        for (const auto& size_report : pbc_train->GetPatternSizeReports()) {
+            report += std::to_string(size_report.k) + "," +
+                      std::to_string(size_report.cluster_num) + "," +
+                      std::to_string(size_report.pattern_num) + "," +
+                      std::to_string(size_report.pattern_len) + "," +
+                      std::to_string(size_report.original_len) + "," +
+                      std::to_string(size_report.compressed_len) + "," +
+                      std::to_string(size_report.compress_rate) + "," +
+                      std::to_string(size_report.compress_speed) + "," +
+                      (size_report.k == pbc_train->GetSelectedPatternSize() ? "1" : "0") + "\n";
+        }
+        PBC::WriteFile(config.train_size_report, report.data(), report.size());
+    }
 
     PBC::WriteFile(config.patternfile_path, pattern_buffer, pattern_buffer_len);
+    if (config.train_seed_output != nullptr) {
+        char* seed_buffer = nullptr;
+        int64_t seed_buffer_len = pbc_train->SerializeSeeds(&seed_buffer);
+        PBC::WriteFile(config.train_seed_output, seed_buffer, seed_buffer_len);
+        delete[] seed_buffer;
+    }
     delete pbc_train;
-    delete[] records_buffer;
     delete[] train_buffer;
-    delete[] original_buffer;
+    delete[] holdout_buffer;
     delete[] pattern_buffer;
     return 0;
 }
 
+// Train a pattern file for every line "inputFile patternFile" of config.train_jobs on one shared
+// scheduler
+static int PBCTrainJobs() {
+    PBC::SetPBCLogLevel(config.log_level);
+    PBC_LOG(INFO) << "operation: train_pattern" << std::endl;
+    PBC_LOG(INFO) << "compress method: " << CompressMethodToString(config.compress_method)
+                  << std::endl;
+    PBC_LOG(INFO) << "train jobs file path:" << config.train_jobs << std::endl;
+    if (config.train_checkpoint != nullptr || config.train_seed_input != nullptr ||
+        config.train_seed_output != nullptr || config.train_base_pattern != nullptr) {
+        PBC_LOG(INFO) << "the checkpoint, seed and base pattern options are ignored by train jobs"
+                      << std::endl;
+    }
+    char* jobs_buffer = nullptr;
+    int64_t jobs_buffer_len = PBC::ReadFile(config.train_jobs, &jobs_buffer);
+    if (jobs_buffer_len < 0) {
+        return -1;
+    }
+    std::vector<std::pair<std::string, std::string>> job_paths;
+    for (const std::string& line :
+         PBC::SplitString(std::string(jobs_buffer, jobs_buffer_len), "\n")) {
+        std::vector<std::string> fields;
+        std::istringstream line_stream(line);
+        for (std::string field; line_stream >> field;) {
+            fields.push_back(field);
+        }
+        if (fields.empty()) {
+            continue;
+        }
+        if (fields.size() != 2) {
+            PBC_LOG(ERROR) << "invalid train job: " << line << std::endl;
+            delete[] jobs_buffer;
+            return -1;
+        }
+        job_paths.emplace_back(fields[0], fields[1]);
+    }
+    delete[] jobs_buffer;
+
+    auto start_train_time = std::chrono::steady_clock::now();
+    PBC::MultiTrainer driver(std::max(config.train_thread_num, 1));
+    for (const auto& job_path : job_paths) {
+        struct stat input_stat;
+        int64_t cost = stat(job_path.first.c_str(), &input_stat) == 0 ? input_stat.st_size : 0;
+        const std::string input_path = job_path.first;
+        driver.AddJob(input_path, config.compress_method, config.target_pattern_size, cost,
+                      [&driver, input_path](PBC::PBC_Train& pbc_train,
+                                            std::vector<char*>& buffers) {
+                          char* train_buffer = nullptr;
+                          char* holdout_buffer = nullptr;
+                          int64_t holdout_buffer_len = 0;
+                          int64_t train_buffer_len =
+                              SampleInput(input_path.c_str(), driver.Scheduler(), &train_buffer,
+                                          &holdout_buffer, holdout_buffer_len);
+                          buffers.push_back(train_buffer);
+                          buffers.push_back(holdout_buffer);
+                          if (train_buffer_len < 0) {
+                              return false;
+                          }
+                          ConfigureTrain(&pbc_train, holdout_buffer, holdout_buffer_len);
+                          pbc_train.LoadData(train_buffer, train_buffer_len, TYPE_VARCHAR);
+                          return true;
+                      });
+    }
+    driver.SetFinishCallback([&driver, &job_paths](int job_id, const std::string& input_path,
+                                                   const char* pattern_buffer,
+                                                   int64_t pattern_buffer_len) {
+        if (pattern_buffer_len < 0) {
+            return;
+        }
+        if (!config.train_refine) {
+            PBC::WriteFile(job_paths[job_id].second.c_str(), pattern_buffer, pattern_buffer_len);
+            return;
+        }
+        char* refined_buffer = nullptr;
+        int64_t refined_buffer_len =
+            RefinePatterns(input_path.c_str(), driver.Scheduler(), pattern_buffer,
+                           pattern_buffer_len, &refined_buffer);
+        if (refined_buffer_len >= 0) {
+            PBC::WriteFile(job_paths[job_id].second.c_str(), refined_buffer, refined_buffer_len);
+        } else {
+            PBC_LOG(ERROR) << "refinement of " << input_path
+                           << " failed, the trained patterns are written" << std::endl;
+            PBC::WriteFile(job_paths[job_id].second.c_str(), pattern_buffer, pattern_buffer_len);
+        }
+        delete[] refined_buffer;
+    });
+    int success_num = driver.Run();
+    auto end_train_time = std::chrono::steady_clock::now();
+    PBC_LOG(INFO) << "train pattern cost time: "
+                  << std::chrono::duration<double>(end_train_time - start_train_time).count() << "s"
+                  << std::endl;
+    return success_num == driver.JobNum() ? 0 : -1;
+}
+
 static int PBCTestCompress() {
     PBC::SetPBCLogLevel(config.log_level);
     PBC_LOG(INFO) << "operation: test_compress" << std::endl;
@@ -636,7 +1229,7 @@ int main(int argc, const char* argv[]) {
             std::cerr << "no operation is set" << std::endl;
             break;
         case PBCOperation::TRAIN_PATTERN:
-            return PBCTrainPattern();
+            return config.train_jobs != nullptr ? PBCTrainJobs() : PBCTrainPattern();
         case PBCOperation::TEST_COMPRESS:
             return PBCTestCompress();
         case PBCOperation::COMPRESS:
@@ -0,0 +1,242 @@
+/*
+ * Copyright 2023 The PBC Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include "train/adaptive_compress.h"
+
+#include <utility>
+
+#include "base/memcpy.h"
+#include "common/utils.h"
+#include "train/pbc_train.h"
+
+namespace PBC {
+
+const int AdaptiveTrainer::DEFAULT_PATTERN_NUM = 16;
+const int AdaptiveTrainer::DEFAULT_TRAIN_RECORD_NUM = 1000;
+const int AdaptiveTrainer::DEFAULT_MAX_PENDING_NUM = 10000;
+const int AdaptiveTrainer::DEFAULT_MAX_FEED_RATE = 1000;
+const double AdaptiveTrainer::DEFAULT_MIN_TRAIN_INTERVAL = 60.0;
+
+AdaptiveTrainer::AdaptiveTrainer(CompressMethod compress_method, int k)
+    : compress_method_(compress_method), k_(k), version_(0), dropped_num_(0) {}
+
+AdaptiveTrainer::~AdaptiveTrainer() { Stop(); }
+
+void AdaptiveTrainer::SetDictionary(const char* pattern_buffer, int64_t len) {
+    std::shared_ptr<AdaptiveDictionary> dictionary(new AdaptiveDictionary());
+    dictionary->version = 0;
+    dictionary->pattern_buffer.assign(pattern_buffer, len);
+    std::atomic_store(&dictionary_, std::shared_ptr<const AdaptiveDictionary>(dictionary));
+    version_.store(0);
+}
+
+void AdaptiveTrainer::Start() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!stop_) {
+        return;
+    }
+    stop_ = false;
+    last_train_time_ = std::chrono::steady_clock::now();
+    thread_ = std::thread(&AdaptiveTrainer::TrainLoop, this);
+}
+
+void AdaptiveTrainer::Stop() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+    }
+    condition_.notify_all();
+    if (thread_.joinable()) {
+        thread_.join();
+    }
+}
+
+bool AdaptiveTrainer::Feed(const char* record, size_t len) {
+    auto now = std::chrono::steady_clock::now();
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (now - feed_window_start_ >= std::chrono::seconds(1)) {
+        feed_window_start_ = now;
+        feed_window_num_ = 0;
+    }
+    if (feed_window_num_ >= max_feed_rate_ ||
+        static_cast<int>(pending_.size()) >= max_pending_num_) {
+        dropped_num_++;
+        return false;
+    }
+    feed_window_num_++;
+    pending_.emplace_back(record, len);
+    if (static_cast<int>(pending_.size()) == train_record_num_) {
+        condition_.notify_one();
+    }
+    return true;
+}
+
+void AdaptiveTrainer::TrainLoop() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (!stop_) {
+        if (static_cast<int>(pending_.size()) < train_record_num_) {
+            condition_.wait(lock);
+            continue;
+        }
+        auto next_train_time =
+            last_train_time_ + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                                   std::chrono::duration<double>(min_train_interval_));
+        if (std::chrono::steady_clock::now() < next_train_time) {
+            condition_.wait_until(lock, next_train_time);
+            continue;
+        }
+        lock.unlock();
+        TrainPending();
+        lock.lock();
+        last_train_time_ = std::chrono::steady_clock::now();
+    }
+}
+
+bool AdaptiveTrainer::TrainPending() {
+    std::lock_guard<std::mutex> train_lock(train_mutex_);
+    std::vector<std::string> records;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        records.swap(pending_);
+    }
+    std::shared_ptr<const AdaptiveDictionary> dictionary = GetDictionary();
+    if (records.empty() || dictionary == nullptr) {
+        return false;
+    }
+    // a version adds k patterns and the id of unmatched records, pattern ids take two symbols
+    int32_t pattern_num = 0;
+    const std::string& base_buffer = dictionary->pattern_buffer;
+    if (base_buffer.size() >= sizeof(int32_t)) {
+        pbc_memcpy(&pattern_num, base_buffer.data(), sizeof(int32_t));
+    }
+    int64_t max_pattern_num = static_cast<int64_t>(PBC_Compress::DEFAULT_SYMBOL_SIZE) *
+                              PBC_Compress::DEFAULT_SYMBOL_SIZE;
+    if (pattern_num + k_ + 1 >= max_pattern_num) {
+        PBC_LOG(INFO) << "adaptive trainer: pattern num " << pattern_num << " is full" << std::endl;
+        return false;
+    }
+
+    auto start_time = std::chrono::steady_clock::now();
+    int64_t train_buffer_len = 0;
+    for (const std::string& record : records) {
+        train_buffer_len += sizeof(int32_t) + record.size();
+    }
+    char* train_buffer = new char[train_buffer_len];
+    int64_t pos = 0;
+    for (const std::string& record : records) {
+        int32_t record_len = record.size();
+        pbc_memcpy(train_buffer + pos, &record_len, sizeof(int32_t));
+        pos += sizeof(int32_t);
+        pbc_memcpy(train_buffer + pos, record.data(), record_len);
+        pos += record_len;
+    }
+
+    PBC_Train pbc_train(compress_method_, 0);
+    char* pattern_buffer = nullptr;
+    int64_t pattern_buffer_len = -1;
+    if (pbc_train.LoadBasePatterns(base_buffer.data(), base_buffer.size()) >= 0) {
+        pbc_train.LoadData(train_buffer, train_buffer_len, TYPE_VARCHAR);
+        pattern_buffer_len = pbc_train.TrainPattern(k_, &pattern_buffer);
+    }
+    delete[] train_buffer;
+    if (pattern_buffer_len < 0) {
+        PBC_LOG(ERROR) << "adaptive trainer: train version " << dictionary->version + 1
+                       << " failed" << std::endl;
+        delete[] pattern_buffer;
+        return false;
+    }
+
+    int32_t new_pattern_num = 0;
+    pbc_memcpy(&new_pattern_num, pattern_buffer, sizeof(int32_t));
+    if (new_pattern_num == pattern_num) {
+        // no pattern stands for more than one record yet
+        delete[] pattern_buffer;
+        return false;
+    }
+    std::shared_ptr<AdaptiveDictionary> new_dictionary(new AdaptiveDictionary());
+    new_dictionary->version = dictionary->version + 1;
+    new_dictionary->pattern_buffer.assign(pattern_buffer, pattern_buffer_len);
+    delete[] pattern_buffer;
+    std::atomic_store(&dictionary_, std::shared_ptr<const AdaptiveDictionary>(new_dictionary));
+    version_.store(new_dictionary->version);
+    auto end_time = std::chrono::steady_clock::now();
+    PBC_LOG(INFO) << "adaptive trainer: version = " << new_dictionary->version
+                  << ", record num = " << records.size() << ", pattern num = " << pattern_num
+                  << " -> " << new_pattern_num << ", cost time = "
+                  << std::chrono::duration<double>(end_time - start_time).count() << "s."
+                  << std::endl;
+    return true;
+}
+
+bool AdaptiveCompress::Refresh() {
+    if (dictionary_ != nullptr && dictionary_->version == trainer_->GetVersion()) {
+        return true;
+    }
+    std::shared_ptr<const AdaptiveDictionary> dictionary = trainer_->GetDictionary();
+    if (dictionary == nullptr) {
+        return false;
+    }
+    if (dictionary_ != nullptr && dictionary->version == dictionary_->version) {
+        return true;
+    }
+    PBC_Compress* pbc_compress = CompressFactory::CreatePBCCompress(trainer_->GetCompressMethod());
+    if (pbc_compress == nullptr || !pbc_compress->ReadData(dictionary->pattern_buffer.data(),
+                                                           dictionary->pattern_buffer.size())) {
+        PBC_LOG(ERROR) << "read adaptive dictionary version " << dictionary->version << " failed"
+                       << std::endl;
+        delete pbc_compress;
+        return pbc_compress_ != nullptr;
+    }
+    delete pbc_compress_;
+    pbc_compress_ = pbc_compress;
+    dictionary_ = std::move(dictionary);
+    return true;
+}
+
+size_t AdaptiveCompress::CompressUsingPattern(const char* input_cstring, size_t input_cstring_len,
+                                              char* output_cstring) {
+    if (!Refresh()) {
+        return PBC_ERROR(PBC_error_compress_failed);
+    }
+    int version_len = 0;
+    WriteVarint(dictionary_->version, reinterpret_cast<uint8_t*>(output_cstring), version_len);
+    size_t compressed_len = pbc_compress_->CompressUsingPattern(input_cstring, input_cstring_len,
+                                                                output_cstring + version_len);
+    if (PBC_isError(compressed_len)) {
+        return compressed_len;
+    }
+    char compress_type = output_cstring[version_len];
+    if (compress_type == COMPRESS_NOT_COMPRESS || compress_type == COMPRESS_SECONDARY_ONLY) {
+        trainer_->Feed(input_cstring, input_cstring_len);
+    }
+    return version_len + compressed_len;
+}
+
+size_t AdaptiveCompress::DecompressUsingPattern(const char* input_cstring, int input_cstring_len,
+                                                char* output_cstring) {
+    if (input_cstring_len < 1 || !Refresh()) {
+        return PBC_ERROR(PBC_error_decompress_failed);
+    }
+    int version_len = 0;
+    uint32_t version = ReadVarint(reinterpret_cast<const uint8_t*>(input_cstring), version_len);
+    if (version_len >= input_cstring_len || version > dictionary_->version) {
+        return PBC_ERROR(PBC_error_decompress_failed);
+    }
+    return pbc_compress_->DecompressUsingPattern(input_cstring + version_len,
+                                                 input_cstring_len - version_len, output_cstring);
+}
+
+}  // namespace PBC
@@ -0,0 +1,152 @@
+/*
+ * Copyright 2023 The PBC Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#ifndef SRC_TRAIN_ADAPTIVE_COMPRESS_H_
+#define SRC_TRAIN_ADAPTIVE_COMPRESS_H_
+
+#include <atomic>
+#include <chrono>              // NOLINT
+#include <condition_variable>  // NOLINT
+#include <cstdint>
+#include <memory>
+#include <mutex>  // NOLINT
+#include <string>
+#include <thread>  // NOLINT
+#include <vector>
+
+#include "compress/compress_factory.h"
+
+namespace PBC {
+
+// A pattern file and its version. A version keeps the patterns of the one before with their ids
+// (see PBC_Train::LoadBasePatterns), so it decodes the records of all earlier versions.
+struct AdaptiveDictionary {
+    uint32_t version;
+    std::string pattern_buffer;
+};
+
+// The background trainer of the adaptive mode. Compression contexts feed it the records no
+// pattern matched, at most max_feed_rate records per second and max_pending_num records at a
+// time. Once train_record_num records are pending and min_train_interval seconds passed since
+// the last version, the trainer thread appends k patterns trained from them to the current
+// dictionary and publishes the result as the next version by an atomic swap.
+class AdaptiveTrainer {
+public:
+    static const int DEFAULT_PATTERN_NUM;
+    static const int DEFAULT_TRAIN_RECORD_NUM;
+    static const int DEFAULT_MAX_PENDING_NUM;
+    static const int DEFAULT_MAX_FEED_RATE;
+    static const double DEFAULT_MIN_TRAIN_INTERVAL;
+
+public:
+    explicit AdaptiveTrainer(CompressMethod compress_method, int k = DEFAULT_PATTERN_NUM);
+    ~AdaptiveTrainer();
+
+    AdaptiveTrainer(const AdaptiveTrainer&) = delete;
+    AdaptiveTrainer& operator=(const AdaptiveTrainer&) = delete;
+
+    // Set the version 0 dictionary, a pattern file trained with compress_method
+    void SetDictionary(const char* pattern_buffer, int64_t len);
+    void SetTrainRecordNum(int train_record_num) { train_record_num_ = train_record_num; }
+    void SetMaxPendingNum(int max_pending_num) { max_pending_num_ = max_pending_num; }
+    void SetMaxFeedRate(int max_feed_rate) { max_feed_rate_ = max_feed_rate; }
+    void SetMinTrainInterval(double min_train_interval) {
+        min_train_interval_ = min_train_interval;
+    }
+    // Start and stop the trainer thread, pending records are kept when it stops
+    void Start();
+    void Stop();
+
+    // Offer a record no pattern matched, return false if the rate limits drop it
+    bool Feed(const char* record, size_t len);
+    // Train the pending records now, return true if a new version is published
+    bool TrainPending();
+
+    CompressMethod GetCompressMethod() const { return compress_method_; }
+    // Return the current dictionary, nullptr before SetDictionary
+    std::shared_ptr<const AdaptiveDictionary> GetDictionary() const {
+        return std::atomic_load(&dictionary_);
+    }
+    // Return the current version, cheaper than GetDictionary
+    uint32_t GetVersion() const { return version_.load(); }
+    // Return the number of records dropped by the rate limits
+    int64_t GetDroppedNum() const { return dropped_num_.load(); }
+
+private:
+    void TrainLoop();
+
+private:
+    CompressMethod compress_method_;
+    int k_;
+    int train_record_num_ = DEFAULT_TRAIN_RECORD_NUM;
+    int max_pending_num_ = DEFAULT_MAX_PENDING_NUM;
+    int max_feed_rate_ = DEFAULT_MAX_FEED_RATE;
+    double min_train_interval_ = DEFAULT_MIN_TRAIN_INTERVAL;
+
+    // swapped by std::atomic_store, contexts keep the versions they still use alive
+    std::shared_ptr<const AdaptiveDictionary> dictionary_;
+    std::atomic<uint32_t> version_;
+    std::atomic<int64_t> dropped_num_;
+
+    // protects the pending records, the feed window and stop_
+    std::mutex mutex_;
+    std::condition_variable condition_;
+    std::vector<std::string> pending_;
+    // the records fed since feed_window_start_, reset every second
+    std::chrono::steady_clock::time_point feed_window_start_;
+    int feed_window_num_ = 0;
+    std::chrono::steady_clock::time_point last_train_time_;
+    std::thread thread_;
+    bool stop_ = true;
+    // serializes TrainPending calls
+    std::mutex train_mutex_;
+};
+
+// A compression context of the adaptive mode. A compressed record is the varint version of the
+// dictionary which compressed it followed by the output of PBC_Compress. Records no pattern
+// matched are fed to the trainer, and a newer version is picked up before the next record. Like
+// PBC_Compress a context is used by one thread at a time, the contexts share the trainer.
+class AdaptiveCompress {
+public:
+    explicit AdaptiveCompress(AdaptiveTrainer* trainer) : trainer_(trainer) {}
+    ~AdaptiveCompress() { delete pbc_compress_; }
+
+    AdaptiveCompress(const AdaptiveCompress&) = delete;
+    AdaptiveCompress& operator=(const AdaptiveCompress&) = delete;
+
+    // Same as PBC_Compress::CompressUsingPattern, the output takes up to 5 more bytes
+    size_t CompressUsingPattern(const char* input_cstring, size_t input_cstring_len,
+                                char* output_cstring);
+    // Same as PBC_Compress::DecompressUsingPattern, fails for a version the trainer does not
+    // have yet
+    size_t DecompressUsingPattern(const char* input_cstring, int input_cstring_len,
+                                  char* output_cstring);
+    // Return the version of the dictionary in use
+    uint32_t GetVersion() const { return dictionary_ == nullptr ? 0 : dictionary_->version; }
+
+private:
+    // Switch to the current dictionary of the trainer if it is newer, return false if there is
+    // no usable dictionary
+    bool Refresh();
+
+private:
+    AdaptiveTrainer* trainer_;
+    std::shared_ptr<const AdaptiveDictionary> dictionary_;
+    PBC_Compress* pbc_compress_ = nullptr;
+};
+
+}  // namespace PBC
+#endif  // SRC_TRAIN_ADAPTIVE_COMPRESS_H_
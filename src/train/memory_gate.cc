@@ -0,0 +1,53 @@
+/*
+ * Copyright 2023 The PBC Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include "train/memory_gate.h"
+
+#include <algorithm>
+
+namespace PBC {
+
+void MemoryGate::Acquire(int64_t bytes) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (used_bytes_ > 0 && used_bytes_ + bytes > limit_) {
+        wait_num_++;
+        condition_.wait(lock, [this, bytes] {
+            return used_bytes_ == 0 || used_bytes_ + bytes <= limit_;
+        });
+    }
+    used_bytes_ += bytes;
+    peak_bytes_ = std::max(peak_bytes_, used_bytes_);
+}
+
+void MemoryGate::Release(int64_t bytes) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        used_bytes_ -= bytes;
+    }
+    condition_.notify_all();
+}
+
+int64_t MemoryGate::PeakBytes() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return peak_bytes_;
+}
+
+int64_t MemoryGate::WaitNum() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return wait_num_;
+}
+
+}  // namespace PBC
@@ -0,0 +1,73 @@
+/*
+ * Copyright 2023 The PBC Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#ifndef SRC_TRAIN_MEMORY_GATE_H_
+#define SRC_TRAIN_MEMORY_GATE_H_
+
+#include <condition_variable>  // NOLINT
+#include <cstdint>
+#include <mutex>  // NOLINT
+
+namespace PBC {
+
+// Bound of the bytes of the workspaces threads hold at once. Acquire waits until a workspace fits
+// under the limit next to those in use. A workspace is let through whenever none is in use, so
+// one larger than the limit runs alone instead of never. Holders must not wait for other tasks,
+// or the threads waiting here could be the ones they wait for.
+class MemoryGate {
+public:
+    explicit MemoryGate(int64_t limit) : limit_(limit) {}
+
+    MemoryGate(const MemoryGate&) = delete;
+    MemoryGate& operator=(const MemoryGate&) = delete;
+
+    void Acquire(int64_t bytes);
+    void Release(int64_t bytes);
+
+    int64_t Limit() const { return limit_; }
+    // Return the most bytes in use at once and the number of Acquire calls which waited
+    int64_t PeakBytes() const;
+    int64_t WaitNum() const;
+
+private:
+    const int64_t limit_;
+    mutable std::mutex mutex_;
+    std::condition_variable condition_;
+    int64_t used_bytes_ = 0;
+    int64_t peak_bytes_ = 0;
+    int64_t wait_num_ = 0;
+};
+
+// Hold bytes of a gate while in scope, nothing if the gate is nullptr
+class MemoryGuard {
+public:
+    MemoryGuard(MemoryGate* gate, int64_t bytes) : gate_(gate), bytes_(bytes) {
+        if (gate_ != nullptr) gate_->Acquire(bytes_);
+    }
+    ~MemoryGuard() {
+        if (gate_ != nullptr) gate_->Release(bytes_);
+    }
+
+    MemoryGuard(const MemoryGuard&) = delete;
+    MemoryGuard& operator=(const MemoryGuard&) = delete;
+
+private:
+    MemoryGate* gate_;
+    int64_t bytes_;
+};
+
+}  // namespace PBC
+#endif  // SRC_TRAIN_MEMORY_GATE_H_
@@ -0,0 +1,109 @@
+/*
+ * Copyright 2023 The PBC Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include "train/min_value_heap.h"
+
+namespace PBC {
+
+void MinValueHeap::Reset(int capacity) {
+    entries_.clear();
+    positions_.assign(capacity, -1);
+}
+
+void MinValueHeap::Update(int id, int value) {
+    int pos = positions_[id];
+    if (pos < 0) {
+        entries_.push_back({value, id});
+        positions_[id] = static_cast<int>(entries_.size()) - 1;
+        SiftUp(positions_[id]);
+        return;
+    }
+    int old_value = entries_[pos].value;
+    if (value == old_value) {
+        return;
+    }
+    entries_[pos].value = value;
+    if (value < old_value) {
+        SiftUp(pos);
+    } else {
+        SiftDown(pos);
+    }
+}
+
+void MinValueHeap::Erase(int id) {
+    int pos = positions_[id];
+    if (pos < 0) {
+        return;
+    }
+    positions_[id] = -1;
+    Entry last = entries_.back();
+    entries_.pop_back();
+    if (pos == static_cast<int>(entries_.size())) {
+        return;
+    }
+    Place(pos, last);
+    SiftUp(pos);
+    SiftDown(positions_[last.id]);
+}
+
+bool MinValueHeap::Top(int& id, int& value) const {
+    if (entries_.empty()) {
+        return false;
+    }
+    id = entries_[0].id;
+    value = entries_[0].value;
+    return true;
+}
+
+void MinValueHeap::SiftUp(int pos) {
+    Entry entry = entries_[pos];
+    while (pos > 0) {
+        int parent = (pos - 1) / 2;
+        if (!Less(entry, entries_[parent])) {
+            break;
+        }
+        Place(pos, entries_[parent]);
+        pos = parent;
+    }
+    Place(pos, entry);
+}
+
+void MinValueHeap::SiftDown(int pos) {
+    int size = static_cast<int>(entries_.size());
+    Entry entry = entries_[pos];
+    while (true) {
+        int child = pos * 2 + 1;
+        if (child >= size) {
+            break;
+        }
+        if (child + 1 < size && Less(entries_[child + 1], entries_[child])) {
+            child++;
+        }
+        if (!Less(entries_[child], entry)) {
+            break;
+        }
+        Place(pos, entries_[child]);
+        pos = child;
+    }
+    Place(pos, entry);
+}
+
+void MinValueHeap::Place(int pos, const Entry& entry) {
+    entries_[pos] = entry;
+    positions_[entry.id] = pos;
+}
+
+}  // namespace PBC
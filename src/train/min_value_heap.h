@@ -0,0 +1,66 @@
+/*
+ * Copyright 2023 The PBC Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#ifndef SRC_TRAIN_MIN_VALUE_HEAP_H_
+#define SRC_TRAIN_MIN_VALUE_HEAP_H_
+
+#include <vector>
+
+namespace PBC {
+
+// Indexed binary min-heap of cluster ids ordered by (value, id). Every id in [0, capacity) has at
+// most one entry, so the value of an id can be changed or the id removed in O(log n), and equal
+// values always pop the smallest id first.
+class MinValueHeap {
+public:
+    MinValueHeap() = default;
+
+    // Remove all entries and allow ids in [0, capacity)
+    void Reset(int capacity);
+    // Insert id with value, or change its value if id is already in the heap
+    void Update(int id, int value);
+    // Remove id from the heap, do nothing if id is not in the heap
+    void Erase(int id);
+    // Return false if the heap is empty, otherwise the entry with minimal (value, id)
+    bool Top(int& id, int& value) const;
+
+    bool Contains(int id) const { return positions_[id] >= 0; }
+    int Size() const { return static_cast<int>(entries_.size()); }
+    int Capacity() const { return static_cast<int>(positions_.size()); }
+
+private:
+    struct Entry {
+        int value;
+        int id;
+    };
+
+    static bool Less(const Entry& entry1, const Entry& entry2) {
+        return entry1.value < entry2.value ||
+               (entry1.value == entry2.value && entry1.id < entry2.id);
+    }
+
+    void SiftUp(int pos);
+    void SiftDown(int pos);
+    void Place(int pos, const Entry& entry);
+
+private:
+    std::vector<Entry> entries_;
+    // positions_[id] is the index of id in entries_, -1 if id is not in the heap
+    std::vector<int> positions_;
+};
+
+}  // namespace PBC
+#endif  // SRC_TRAIN_MIN_VALUE_HEAP_H_
@@ -0,0 +1,100 @@
+/*
+ * Copyright 2023 The PBC Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include "train/multi_trainer.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>  // NOLINT
+#include <iostream>
+#include <numeric>
+#include <utility>
+
+#include "common/utils.h"
+
+namespace PBC {
+
+MultiTrainer::MultiTrainer(size_t num_threads) : scheduler_(num_threads) {}
+
+int MultiTrainer::AddJob(const std::string& name, CompressMethod compress_method, int k,
+                         int64_t cost, Loader loader) {
+    jobs_.push_back({name, compress_method, k, cost, std::move(loader)});
+    return static_cast<int>(jobs_.size()) - 1;
+}
+
+bool MultiTrainer::RunJob(int job_id) {
+    const Job& job = jobs_[job_id];
+    auto start_time = std::chrono::steady_clock::now();
+    std::vector<char*> buffers;
+    char* pattern_buffer = nullptr;
+    int64_t pattern_buffer_len = -1;
+    {
+        PBC_Train pbc_train(job.compress_method, 0);
+        pbc_train.SetScheduler(&scheduler_);
+        if (job.loader(pbc_train, buffers)) {
+            pattern_buffer_len = pbc_train.TrainPattern(job.k, &pattern_buffer);
+        }
+    }
+    for (char* buffer : buffers) {
+        delete[] buffer;
+    }
+    if (pattern_buffer_len < 0) {
+        delete[] pattern_buffer;
+        pattern_buffer = nullptr;
+        PBC_LOG(ERROR) << "train job " << job.name << " failed" << std::endl;
+    } else {
+        auto end_time = std::chrono::steady_clock::now();
+        PBC_LOG(INFO) << "train job " << job.name << " done: pattern len = " << pattern_buffer_len
+                      << ", cost time = "
+                      << std::chrono::duration<double>(end_time - start_time).count() << "s."
+                      << std::endl;
+    }
+    if (finish_callback_) {
+        finish_callback_(job_id, job.name, pattern_buffer, pattern_buffer_len);
+    }
+    delete[] pattern_buffer;
+    return pattern_buffer_len >= 0;
+}
+
+int MultiTrainer::Run() {
+    int job_num = static_cast<int>(jobs_.size());
+    std::vector<int> order(job_num);
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(),
+                     [this](int a, int b) { return jobs_[a].cost > jobs_[b].cost; });
+
+    // every runner takes the next job of the queue until it is empty, a runner left without a
+    // job returns its thread to the scheduler
+    int runner_num = static_cast<int>(scheduler_.ThreadNum());
+    if (max_job_num_ > 0) {
+        runner_num = std::min(runner_num, max_job_num_);
+    }
+    runner_num = std::max(std::min(runner_num, job_num), 1);
+    std::atomic<int> next_job(0), success_num(0);
+    scheduler_.ParallelFor(0, runner_num, 1, [this, job_num, &order, &next_job,
+                                              &success_num](int) {
+        for (int i = next_job++; i < job_num; i = next_job++) {
+            if (RunJob(order[i])) {
+                success_num++;
+            }
+        }
+    });
+    PBC_LOG(INFO) << "train jobs: job num = " << job_num << ", succeeded = " << success_num
+                  << ", runner num = " << runner_num << std::endl;
+    return success_num;
+}
+
+}  // namespace PBC
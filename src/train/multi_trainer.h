@@ -0,0 +1,91 @@
+/*
+ * Copyright 2023 The PBC Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#ifndef SRC_TRAIN_MULTI_TRAINER_H_
+#define SRC_TRAIN_MULTI_TRAINER_H_
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "compress/compress_factory.h"
+#include "train/pbc_train.h"
+#include "train/task_scheduler.h"
+
+namespace PBC {
+
+// Trains the dictionaries of many jobs at once on one TaskScheduler. Every thread of the
+// scheduler runs jobs from a queue ordered by decreasing cost, so the largest jobs start first
+// and every running job keeps a thread of its own, while the threads without a job left help the
+// parallel loops of the others by work stealing. At most max_job_num jobs, the thread number by
+// default, hold their records and training state at once. A job reports its pattern file to the
+// finish callback as soon as it is trained, from the thread which trained it.
+class MultiTrainer {
+public:
+    // Set the options of the trainer of a job and load its records, the buffers LoadData and
+    // LoadHoldoutData point to are added to buffers and freed by delete[] once the job is done.
+    // Return false to fail the job.
+    typedef std::function<bool(PBC_Train& train, std::vector<char*>& buffers)> Loader;
+    // Called with the pattern file of a job, pattern_buffer is nullptr and pattern_len -1 if the
+    // job failed. Callbacks of different jobs may run at once.
+    typedef std::function<void(int job_id, const std::string& name, const char* pattern_buffer,
+                               int64_t pattern_len)>
+        FinishCallback;
+
+public:
+    // num_threads counts the calling thread of Run as for TaskScheduler
+    explicit MultiTrainer(size_t num_threads = 0);
+
+    MultiTrainer(const MultiTrainer&) = delete;
+    MultiTrainer& operator=(const MultiTrainer&) = delete;
+
+    // Add a job training k patterns by compress_method, its records are loaded when it starts.
+    // cost only orders the jobs, e.g. the bytes of their records. Return the job id.
+    int AddJob(const std::string& name, CompressMethod compress_method, int k, int64_t cost,
+               Loader loader);
+    void SetMaxJobNum(int max_job_num) { max_job_num_ = max_job_num; }
+    void SetFinishCallback(FinishCallback finish_callback) {
+        finish_callback_ = std::move(finish_callback);
+    }
+    // Train all jobs added so far and return the number which succeeded
+    int Run();
+
+    int JobNum() const { return static_cast<int>(jobs_.size()); }
+    // The scheduler shared by the jobs, which loaders may run their own parallel loops on
+    TaskScheduler* Scheduler() { return &scheduler_; }
+
+private:
+    struct Job {
+        std::string name;
+        CompressMethod compress_method;
+        int k;
+        int64_t cost;
+        Loader loader;
+    };
+
+    bool RunJob(int job_id);
+
+private:
+    TaskScheduler scheduler_;
+    std::vector<Job> jobs_;
+    // 0 runs as many jobs at once as there are threads
+    int max_job_num_ = 0;
+    FinishCallback finish_callback_;
+};
+
+}  // namespace PBC
+#endif  // SRC_TRAIN_MULTI_TRAINER_H_
@@ -0,0 +1,175 @@
+/*
+ * Copyright 2023 The PBC Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include "train/one_gram_table.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define PBC_ONE_GRAM_X86
+#endif
+
+#include <algorithm>
+#include <cstring>
+
+#include "base/memcpy.h"
+
+namespace PBC {
+
+namespace {
+
+constexpr size_t kCountsAlignment = 32;
+
+typedef int (*MinSumKernel)(const uint8_t* a, const uint8_t* b, size_t len);
+
+#ifdef PBC_ONE_GRAM_X86
+int MinSumSSE2(const uint8_t* a, const uint8_t* b, size_t len) {
+    const __m128i zero = _mm_setzero_si128();
+    __m128i acc = _mm_setzero_si128();
+    for (size_t i = 0; i < len; i += 16) {
+        __m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i));
+        __m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i));
+        // sad against zero sums the 8 unsigned bytes of each half into a 64-bit lane
+        acc = _mm_add_epi64(acc, _mm_sad_epu8(_mm_min_epu8(va, vb), zero));
+    }
+    return static_cast<int>(_mm_cvtsi128_si64(acc) +
+                            _mm_cvtsi128_si64(_mm_unpackhi_epi64(acc, acc)));
+}
+
+__attribute__((target("avx2"))) int MinSumAVX2(const uint8_t* a, const uint8_t* b, size_t len) {
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i acc = _mm256_setzero_si256();
+    for (size_t i = 0; i < len; i += 32) {
+        __m256i va = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i));
+        __m256i vb = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + i));
+        acc = _mm256_add_epi64(acc, _mm256_sad_epu8(_mm256_min_epu8(va, vb), zero));
+    }
+    __m128i sum = _mm_add_epi64(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+    return static_cast<int>(_mm_cvtsi128_si64(sum) +
+                            _mm_cvtsi128_si64(_mm_unpackhi_epi64(sum, sum)));
+}
+#else
+int MinSumScalar(const uint8_t* a, const uint8_t* b, size_t len) {
+    int sum = 0;
+    for (size_t i = 0; i < len; i++) {
+        sum += std::min(a[i], b[i]);
+    }
+    return sum;
+}
+#endif
+
+MinSumKernel SelectMinSumKernel() {
+#ifdef PBC_ONE_GRAM_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return MinSumAVX2;
+    }
+    return MinSumSSE2;
+#else
+    return MinSumScalar;
+#endif
+}
+
+}  // namespace
+
+void OneGramTable::Build(const int* counts, size_t symbol_size) {
+    // symbols after the last used one are zero, CommonCount only compares the common prefix
+    size_t used_size = symbol_size;
+    while (used_size > 0 && counts[used_size - 1] == 0) {
+        used_size--;
+    }
+    size_t padded_size = (used_size + kCountsAlignment - 1) / kCountsAlignment * kCountsAlignment;
+    counts_.assign(padded_size, 0);
+    counts_.shrink_to_fit();
+    overflow_.clear();
+    for (size_t i = 0; i < used_size; i++) {
+        if (counts[i] >= OVERFLOW_COUNT) {
+            counts_[i] = OVERFLOW_COUNT;
+            overflow_.push_back({static_cast<int32_t>(i), counts[i]});
+        } else {
+            counts_[i] = static_cast<uint8_t>(counts[i]);
+        }
+    }
+    overflow_.shrink_to_fit();
+}
+
+int OneGramTable::OverflowCount(int32_t symbol) const {
+    auto it = std::lower_bound(
+        overflow_.begin(), overflow_.end(), symbol,
+        [](const Overflow& overflow, int32_t value) { return overflow.symbol < value; });
+    return it->count;
+}
+
+int OneGramTable::CommonCount(const OneGramTable& a, const OneGramTable& b) {
+    static const MinSumKernel kernel = SelectMinSumKernel();
+    size_t len = std::min(a.counts_.size(), b.counts_.size());
+    int common = kernel(a.counts_.data(), b.counts_.data(), len);
+    if (a.overflow_.empty() || b.overflow_.empty()) {
+        return common;
+    }
+    // min(OVERFLOW_COUNT, x) is exact unless both sides overflow, fix up those symbols only
+    for (const Overflow& overflow : a.overflow_) {
+        if (static_cast<size_t>(overflow.symbol) < len &&
+            b.counts_[overflow.symbol] == OVERFLOW_COUNT) {
+            common += std::min(overflow.count, b.OverflowCount(overflow.symbol)) - OVERFLOW_COUNT;
+        }
+    }
+    return common;
+}
+
+void OneGramTable::Serialize(std::string& buffer) const {
+    // [int32 counts_size, counts] [int32 overflow_num, (int32 symbol, int32 count) ...]
+    int32_t counts_size = counts_.size();
+    buffer.append(reinterpret_cast<const char*>(&counts_size), sizeof(int32_t));
+    buffer.append(reinterpret_cast<const char*>(counts_.data()), counts_size);
+    int32_t overflow_num = overflow_.size();
+    buffer.append(reinterpret_cast<const char*>(&overflow_num), sizeof(int32_t));
+    for (const Overflow& overflow : overflow_) {
+        buffer.append(reinterpret_cast<const char*>(&overflow.symbol), sizeof(int32_t));
+        buffer.append(reinterpret_cast<const char*>(&overflow.count), sizeof(int32_t));
+    }
+}
+
+bool OneGramTable::Deserialize(const char* buffer, int64_t len, int64_t& pos) {
+    int32_t counts_size = 0, overflow_num = 0;
+    if (pos + static_cast<int64_t>(sizeof(int32_t)) > len) {
+        return false;
+    }
+    pbc_memcpy(&counts_size, buffer + pos, sizeof(int32_t));
+    pos += sizeof(int32_t);
+    if (counts_size < 0 || counts_size % kCountsAlignment != 0 ||
+        pos + counts_size + static_cast<int64_t>(sizeof(int32_t)) > len) {
+        return false;
+    }
+    counts_.assign(buffer + pos, buffer + pos + counts_size);
+    pos += counts_size;
+    pbc_memcpy(&overflow_num, buffer + pos, sizeof(int32_t));
+    pos += sizeof(int32_t);
+    if (overflow_num < 0 || pos + 2 * static_cast<int64_t>(sizeof(int32_t)) * overflow_num > len) {
+        return false;
+    }
+    overflow_.resize(overflow_num);
+    for (Overflow& overflow : overflow_) {
+        pbc_memcpy(&overflow.symbol, buffer + pos, sizeof(int32_t));
+        pbc_memcpy(&overflow.count, buffer + pos + sizeof(int32_t), sizeof(int32_t));
+        pos += 2 * sizeof(int32_t);
+        if (overflow.symbol < 0 || overflow.symbol >= counts_size) {
+            return false;
+        }
+    }
+    return true;
+}
+
+}  // namespace PBC
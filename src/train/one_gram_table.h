@@ -0,0 +1,70 @@
+/*
+ * Copyright 2023 The PBC Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#ifndef SRC_TRAIN_ONE_GRAM_TABLE_H_
+#define SRC_TRAIN_ONE_GRAM_TABLE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace PBC {
+
+// Compact 1-gram histogram used by the training pruning check. Each symbol takes one byte,
+// counts that do not fit are stored as OVERFLOW_COUNT and kept exactly in a sorted side list.
+class OneGramTable {
+public:
+    static const uint8_t OVERFLOW_COUNT = 0xff;
+
+public:
+    OneGramTable() = default;
+
+    // Build the table from exact counts of symbol_size symbols
+    void Build(const int* counts, size_t symbol_size);
+
+    // Return the number of common symbols, i.e. sum(min(a[s], b[s])) over all symbols
+    static int CommonCount(const OneGramTable& a, const OneGramTable& b);
+
+    // Append the table to buffer
+    void Serialize(std::string& buffer) const;
+    // Read a table written by Serialize from buffer at pos, return false if the buffer is
+    // malformed
+    bool Deserialize(const char* buffer, int64_t len, int64_t& pos);
+
+    // Return heap bytes used by the table
+    size_t MemoryUsage() const {
+        return counts_.capacity() + overflow_.capacity() * sizeof(Overflow);
+    }
+
+private:
+    struct Overflow {
+        int32_t symbol;
+        int32_t count;
+    };
+
+    // Return the exact count of symbol which is marked as OVERFLOW_COUNT
+    int OverflowCount(int32_t symbol) const;
+
+private:
+    // one byte per symbol, padded with zeros to a multiple of 32 bytes for the simd kernels
+    std::vector<uint8_t> counts_;
+    // exact counts of symbols whose count >= OVERFLOW_COUNT, sorted by symbol
+    std::vector<Overflow> overflow_;
+};
+
+}  // namespace PBC
+#endif  // SRC_TRAIN_ONE_GRAM_TABLE_H_
@@ -0,0 +1,52 @@
+/*
+ * Copyright 2023 The PBC Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include "train/pattern_arena.h"
+
+#include <cstdint>
+
+namespace PBC {
+
+const size_t PatternArena::DEFAULT_BLOCK_SIZE = (1024 * 1024);
+
+char* PatternArena::Allocate(size_t size, size_t alignment) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    uintptr_t begin = (reinterpret_cast<uintptr_t>(free_begin_) + alignment - 1) & ~(alignment - 1);
+    if (free_begin_ == nullptr || begin + size > reinterpret_cast<uintptr_t>(free_end_)) {
+        // a large allocation gets a block of its own and keeps the free part of the last block
+        size_t new_block_size = size + alignment > block_size_ / 4 ? size + alignment : block_size_;
+        blocks_.emplace_back(new char[new_block_size]);
+        memory_usage_ += new_block_size;
+        char* block = blocks_.back().get();
+        begin = (reinterpret_cast<uintptr_t>(block) + alignment - 1) & ~(alignment - 1);
+        if (new_block_size == block_size_) {
+            free_begin_ = reinterpret_cast<char*>(begin + size);
+            free_end_ = block + new_block_size;
+        }
+        return reinterpret_cast<char*>(begin);
+    }
+    free_begin_ = reinterpret_cast<char*>(begin + size);
+    return reinterpret_cast<char*>(begin);
+}
+
+void PatternArena::Clear() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    blocks_.clear();
+    free_begin_ = free_end_ = nullptr;
+    memory_usage_ = 0;
+}
+
+}  // namespace PBC
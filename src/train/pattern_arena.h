@@ -0,0 +1,65 @@
+/*
+ * Copyright 2023 The PBC Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#ifndef SRC_TRAIN_PATTERN_ARENA_H_
+#define SRC_TRAIN_PATTERN_ARENA_H_
+
+#include <cstddef>
+#include <memory>
+#include <mutex>  // NOLINT
+#include <vector>
+
+namespace PBC {
+
+// Block arena holding the variable sized training state (pattern bytes and bigram tables).
+// Memory is only released all at once, so returned pointers stay valid until Clear(), and
+// Allocate may be called from several threads.
+class PatternArena {
+public:
+    static const size_t DEFAULT_BLOCK_SIZE;
+
+public:
+    explicit PatternArena(size_t block_size = DEFAULT_BLOCK_SIZE) : block_size_(block_size) {}
+
+    PatternArena(const PatternArena&) = delete;
+    PatternArena& operator=(const PatternArena&) = delete;
+
+    // Return size bytes aligned to alignment, which must be a power of 2
+    char* Allocate(size_t size, size_t alignment = 1);
+    template <class T>
+    T* AllocateArray(size_t num) {
+        return reinterpret_cast<T*>(Allocate(num * sizeof(T), alignof(T)));
+    }
+    // Release all blocks
+    void Clear();
+    // Set the size of the blocks allocated from now on
+    void SetBlockSize(size_t block_size) { block_size_ = block_size; }
+    size_t BlockSize() const { return block_size_; }
+    // Return the bytes of all blocks
+    size_t MemoryUsage() const { return memory_usage_; }
+
+private:
+    size_t block_size_;
+    std::vector<std::unique_ptr<char[]>> blocks_;
+    // the free part of the last block
+    char* free_begin_ = nullptr;
+    char* free_end_ = nullptr;
+    size_t memory_usage_ = 0;
+    std::mutex mutex_;
+};
+
+}  // namespace PBC
+#endif  // SRC_TRAIN_PATTERN_ARENA_H_
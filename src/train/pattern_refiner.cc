@@ -0,0 +1,375 @@
+/*
+ * Copyright 2023 The PBC Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include "train/pattern_refiner.h"
+
+#include <chrono>  // NOLINT
+#include <iostream>
+
+#include "base/memcpy.h"
+#include "common/utils.h"
+#include "train/pbc_train.h"
+
+namespace PBC {
+
+const int PatternRefiner::DEFAULT_SAMPLE_NUM = 64;
+const int PatternRefiner::DEFAULT_UNMATCHED_SAMPLE_NUM = 1000;
+const int PatternRefiner::DEFAULT_SPLIT_NUM = 2;
+const int PatternRefiner::DEFAULT_NEW_PATTERN_NUM = 16;
+const double PatternRefiner::DEFAULT_MIN_RESIDUAL_SHARE = 0.01;
+const double PatternRefiner::DEFAULT_MIN_SPLIT_GAIN = 0.05;
+const double PatternRefiner::DEFAULT_MIN_GROUP_SHARE = 0.001;
+
+namespace {
+
+// a chunk is compressed once it holds this many bytes or records
+const int64_t CHUNK_BYTES = 8 << 20;
+const int64_t CHUNK_RECORD_NUM = 1 << 16;
+// the type byte and the two bytes of the pattern id of a record compressed by pbc_only
+const int RECORD_HEADER_LEN = 3;
+
+// Parse the patterns of a pattern file, return the position of its secondary encoder data or -1
+// if it is malformed
+int64_t ParsePatternFile(const char* buffer, int64_t len, std::vector<std::string>& patterns) {
+    int32_t pattern_num = 0;
+    if (len < static_cast<int64_t>(sizeof(int32_t))) {
+        return -1;
+    }
+    pbc_memcpy(&pattern_num, buffer, sizeof(int32_t));
+    int64_t pos = sizeof(int32_t);
+    for (int32_t i = 0; i < pattern_num; i++) {
+        int32_t pattern_len = 0;
+        if (len - pos < static_cast<int64_t>(sizeof(int32_t))) {
+            return -1;
+        }
+        pbc_memcpy(&pattern_len, buffer + pos, sizeof(int32_t));
+        pos += sizeof(int32_t);
+        if (pattern_len < 0 || len - pos < pattern_len) {
+            return -1;
+        }
+        patterns.emplace_back(buffer + pos, pattern_len);
+        pos += pattern_len;
+    }
+    return pos;
+}
+
+std::string WritePatternFile(const std::vector<std::string>& patterns) {
+    std::string pattern_file;
+    int32_t pattern_num = patterns.size();
+    pattern_file.append(reinterpret_cast<const char*>(&pattern_num), sizeof(int32_t));
+    for (const std::string& pattern : patterns) {
+        int32_t pattern_len = pattern.size();
+        pattern_file.append(reinterpret_cast<const char*>(&pattern_len), sizeof(int32_t));
+        pattern_file.append(pattern);
+    }
+    return pattern_file;
+}
+
+std::string SerializeSample(const ReservoirSampler& sample, int64_t& record_num) {
+    char* buffer = nullptr;
+    int32_t max_record_len = 0;
+    int64_t len = sample.Serialize(&buffer, record_num, max_record_len);
+    std::string records(buffer, len);
+    delete[] buffer;
+    return records;
+}
+
+// Return the pattern id of a record compressed by pbc_only, or -1 if it is not matched
+int CompressedPatternId(const char* compressed_data, size_t compressed_len) {
+    if (PBC_isError(compressed_len) || compressed_data[0] != COMPRESS_PBC_ONLY) {
+        return -1;
+    }
+    return static_cast<unsigned char>(compressed_data[1]) * PBC_Compress::DEFAULT_SYMBOL_SIZE +
+           static_cast<unsigned char>(compressed_data[2]);
+}
+
+}  // namespace
+
+PatternRefiner::PatternRefiner(CompressMethod compress_method, TaskScheduler* scheduler)
+    : compress_method_(compress_method), scheduler_(scheduler) {}
+
+bool PatternRefiner::LoadPatterns(const char* pattern_buffer, int64_t len) {
+    patterns_.clear();
+    if (ParsePatternFile(pattern_buffer, len, patterns_) < 0) {
+        return false;
+    }
+    int block_num = scheduler_ != nullptr ? static_cast<int>(scheduler_->ThreadNum()) : 1;
+    compressors_.clear();
+    for (int block = 0; block < block_num; block++) {
+        compressors_.emplace_back(new PBC_ONLY_Compress());
+        if (!compressors_.back()->ReadData(pattern_buffer, len)) {
+            compressors_.clear();
+            return false;
+        }
+    }
+    pattern_stats_.assign(patterns_.size(), PatternStat());
+    pattern_samples_.clear();
+    for (size_t i = 0; i < patterns_.size(); i++) {
+        pattern_samples_.emplace_back(
+            new ReservoirSampler(DEFAULT_SAMPLE_NUM, ReservoirSampler::DEFAULT_SEED + i));
+    }
+    unmatched_sample_.reset(new ReservoirSampler(DEFAULT_UNMATCHED_SAMPLE_NUM));
+    encoder_sample_.reset(new ReservoirSampler(DEFAULT_UNMATCHED_SAMPLE_NUM));
+    return true;
+}
+
+void PatternRefiner::Add(const char* record, int32_t len) {
+    chunk_positions_.push_back(chunk_.size());
+    chunk_.append(reinterpret_cast<const char*>(&len), sizeof(int32_t));
+    chunk_.append(record, len);
+    if (static_cast<int64_t>(chunk_.size()) >= CHUNK_BYTES ||
+        static_cast<int64_t>(chunk_positions_.size()) >= CHUNK_RECORD_NUM) {
+        FlushChunk();
+    }
+}
+
+void PatternRefiner::FlushChunk() {
+    int record_num = static_cast<int>(chunk_positions_.size());
+    if (compressors_.empty()) {
+        chunk_.clear();
+        chunk_positions_.clear();
+        return;
+    }
+    if (record_num == 0) {
+        return;
+    }
+    auto record_at = [this](int i, int32_t& record_len) {
+        pbc_memcpy(&record_len, chunk_.data() + chunk_positions_[i], sizeof(int32_t));
+        return chunk_.data() + chunk_positions_[i] + sizeof(int32_t);
+    };
+    // every block of records is compressed by its own compressor
+    std::vector<int> pattern_ids(record_num);
+    std::vector<size_t> compressed_lens(record_num);
+    int block_num = std::min(static_cast<int>(compressors_.size()), record_num);
+    auto compress_block = [&](int block) {
+        int begin = static_cast<int64_t>(record_num) * block / block_num;
+        int end = static_cast<int64_t>(record_num) * (block + 1) / block_num;
+        std::vector<char> compressed_data;
+        for (int i = begin; i < end; i++) {
+            int32_t record_len = 0;
+            const char* record = record_at(i, record_len);
+            // the output of a record is less than 3 times its length
+            compressed_data.resize(std::max(compressed_data.size(),
+                                            3 * static_cast<size_t>(record_len) + 16));
+            compressed_lens[i] = compressors_[block]->CompressUsingPattern(record, record_len,
+                                                                           compressed_data.data());
+            pattern_ids[i] = CompressedPatternId(compressed_data.data(), compressed_lens[i]);
+        }
+    };
+    if (scheduler_ != nullptr && block_num > 1) {
+        scheduler_->ParallelFor(0, block_num, 1, compress_block);
+    } else {
+        for (int block = 0; block < block_num; block++) {
+            compress_block(block);
+        }
+    }
+
+    // the samples take the records in input order
+    for (int i = 0; i < record_num; i++) {
+        int32_t record_len = 0;
+        const char* record = record_at(i, record_len);
+        record_num_++;
+        encoder_sample_->Add(record, record_len);
+        if (pattern_ids[i] < 0) {
+            unmatched_num_++;
+            unmatched_sample_->Add(record, record_len);
+            continue;
+        }
+        PatternStat& stat = pattern_stats_[pattern_ids[i]];
+        stat.record_num++;
+        stat.residual_bytes += compressed_lens[i] - RECORD_HEADER_LEN;
+        pattern_samples_[pattern_ids[i]]->Add(record, record_len);
+    }
+    chunk_.clear();
+    chunk_positions_.clear();
+}
+
+void PatternRefiner::TrainSample(const std::string& records, int k,
+                                 std::vector<std::string>& patterns) {
+    std::vector<char> data_buffer(records.begin(), records.end());
+    PBC_Train pbc_train(PBC_ONLY, 0);
+    pbc_train.LoadData(data_buffer.data(), data_buffer.size(), TYPE_VARCHAR);
+    char* pattern_buffer = nullptr;
+    int64_t pattern_len = pbc_train.TrainPattern(k, &pattern_buffer);
+    if (pattern_len > 0) {
+        ParsePatternFile(pattern_buffer, pattern_len, patterns);
+    }
+    delete[] pattern_buffer;
+}
+
+int64_t PatternRefiner::CompressSample(const std::vector<std::string>& patterns,
+                                       const std::string& records,
+                                       std::vector<int64_t>& match_nums,
+                                       std::vector<int64_t>& saved_bytes) {
+    match_nums.assign(patterns.size(), 0);
+    saved_bytes.assign(patterns.size(), 0);
+    std::string pattern_file = WritePatternFile(patterns);
+    PBC_ONLY_Compress pbc_compress;
+    if (!pbc_compress.ReadData(pattern_file.data(), pattern_file.size())) {
+        return -1;
+    }
+    int64_t compressed_bytes = 0;
+    std::vector<char> compressed_data;
+    for (size_t pos = 0; pos < records.size();) {
+        int32_t record_len = 0;
+        pbc_memcpy(&record_len, records.data() + pos, sizeof(int32_t));
+        const char* record = records.data() + pos + sizeof(int32_t);
+        pos += sizeof(int32_t) + record_len;
+        compressed_data.resize(
+            std::max(compressed_data.size(), 3 * static_cast<size_t>(record_len) + 16));
+        size_t compressed_len =
+            pbc_compress.CompressUsingPattern(record, record_len, compressed_data.data());
+        int pattern_id = CompressedPatternId(compressed_data.data(), compressed_len);
+        // an unmatched record is stored behind its type byte
+        int64_t record_bytes = pattern_id < 0 ? record_len + 1 : compressed_len;
+        compressed_bytes += record_bytes;
+        if (pattern_id >= 0) {
+            match_nums[pattern_id]++;
+            saved_bytes[pattern_id] += record_len + 1 - record_bytes;
+        }
+    }
+    return compressed_bytes;
+}
+
+std::vector<std::string> PatternRefiner::SplitPattern(int pattern_id) {
+    int64_t sample_num = 0;
+    std::string records = SerializeSample(*pattern_samples_[pattern_id], sample_num);
+    // every child needs at least two records
+    if (sample_num < 2 * split_num_) {
+        return {};
+    }
+    std::vector<std::string> children;
+    TrainSample(records, split_num_, children);
+    children.erase(std::remove(children.begin(), children.end(), patterns_[pattern_id]),
+                   children.end());
+    // the pattern stays for the records its children miss, so one child splits them in two
+    if (children.empty()) {
+        return {};
+    }
+
+    std::vector<std::string> patterns = {patterns_[pattern_id]};
+    std::vector<int64_t> match_nums, saved_bytes;
+    int64_t pattern_bytes = CompressSample(patterns, records, match_nums, saved_bytes);
+    patterns.insert(patterns.end(), children.begin(), children.end());
+    int64_t split_bytes = CompressSample(patterns, records, match_nums, saved_bytes);
+    if (pattern_bytes <= 0 || split_bytes < 0 ||
+        split_bytes > (1.0 - min_split_gain_) * pattern_bytes) {
+        return {};
+    }
+    std::vector<std::string> used_children;
+    for (size_t i = 0; i < children.size(); i++) {
+        if (match_nums[i + 1] > 0) {
+            used_children.push_back(children[i]);
+        }
+    }
+    return used_children;
+}
+
+std::vector<std::string> PatternRefiner::TrainUnmatched() {
+    int64_t min_group_num = static_cast<int64_t>(min_group_share_ * record_num_);
+    if (new_pattern_num_ == 0 || unmatched_num_ < std::max<int64_t>(min_group_num, 2)) {
+        return {};
+    }
+    int64_t sample_num = 0;
+    std::string records = SerializeSample(*unmatched_sample_, sample_num);
+    std::vector<std::string> patterns;
+    TrainSample(records, new_pattern_num_, patterns);
+    std::vector<int64_t> match_nums, saved_bytes;
+    if (patterns.empty() || CompressSample(patterns, records, match_nums, saved_bytes) < 0) {
+        return {};
+    }
+    // a pattern is kept if it saves bytes and matches enough of all records going by the sample
+    std::vector<std::string> new_patterns;
+    for (size_t i = 0; i < patterns.size(); i++) {
+        double group_num = static_cast<double>(match_nums[i]) * unmatched_num_ / sample_num;
+        if (match_nums[i] >= 2 && saved_bytes[i] > 0 && group_num >= min_group_num) {
+            new_patterns.push_back(patterns[i]);
+        }
+    }
+    return new_patterns;
+}
+
+int64_t PatternRefiner::Refine(char** pattern_buffer) {
+    auto start_time = std::chrono::steady_clock::now();
+    FlushChunk();
+    int64_t residual_bytes = 0;
+    for (const PatternStat& stat : pattern_stats_) {
+        residual_bytes += stat.residual_bytes;
+    }
+    std::vector<int> split_ids;
+    for (size_t i = 0; i < pattern_stats_.size(); i++) {
+        if (pattern_stats_[i].residual_bytes > 0 &&
+            pattern_stats_[i].residual_bytes >= min_residual_share_ * residual_bytes) {
+            split_ids.push_back(i);
+        }
+    }
+
+    // the patterns to split and the unmatched records are trained at once
+    int split_num = static_cast<int>(split_ids.size());
+    std::vector<std::vector<std::string>> children(split_num);
+    std::vector<std::string> new_patterns;
+    auto refine = [this, split_num, &split_ids, &children, &new_patterns](int i) {
+        if (i < split_num) {
+            children[i] = SplitPattern(split_ids[i]);
+        } else {
+            new_patterns = TrainUnmatched();
+        }
+    };
+    if (scheduler_ != nullptr) {
+        scheduler_->ParallelFor(0, split_num + 1, 1, refine);
+    } else {
+        for (int i = 0; i <= split_num; i++) {
+            refine(i);
+        }
+    }
+
+    std::vector<std::string> refined_patterns(patterns_);
+    split_pattern_count_ = 0;
+    for (const std::vector<std::string>& pattern_children : children) {
+        if (!pattern_children.empty()) {
+            split_pattern_count_++;
+            refined_patterns.insert(refined_patterns.end(), pattern_children.begin(),
+                                    pattern_children.end());
+        }
+    }
+    new_pattern_count_ = new_patterns.size();
+    refined_patterns.insert(refined_patterns.end(), new_patterns.begin(), new_patterns.end());
+
+    // the secondary encoder is built from a sample of all records
+    int64_t sample_num = 0;
+    std::string records = SerializeSample(*encoder_sample_, sample_num);
+    std::vector<char> data_buffer(records.begin(), records.end());
+    PBC_Train pbc_train(compress_method_, 0);
+    pbc_train.SetScheduler(scheduler_);
+    if (sample_num > 0) {
+        pbc_train.LoadData(data_buffer.data(), data_buffer.size(), TYPE_VARCHAR);
+    }
+    int64_t pattern_len = pbc_train.WritePatterns(refined_patterns, pattern_buffer);
+    auto end_time = std::chrono::steady_clock::now();
+    PBC_LOG(INFO) << "refine patterns: record num = " << record_num_
+                  << ", unmatched num = " << unmatched_num_
+                  << ", residual bytes = " << residual_bytes
+                  << ", split candidates = " << split_num
+                  << ", split patterns = " << split_pattern_count_
+                  << ", new patterns = " << new_pattern_count_
+                  << ", pattern num = " << patterns_.size() << " -> " << refined_patterns.size()
+                  << ", cost time = "
+                  << std::chrono::duration<double>(end_time - start_time).count() << "s."
+                  << std::endl;
+    return pattern_len;
+}
+
+}  // namespace PBC
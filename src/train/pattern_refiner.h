@@ -0,0 +1,129 @@
+/*
+ * Copyright 2023 The PBC Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#ifndef SRC_TRAIN_PATTERN_REFINER_H_
+#define SRC_TRAIN_PATTERN_REFINER_H_
+
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "compress/compress_factory.h"
+#include "compress/pbc_only_compress.h"
+#include "train/reservoir_sampler.h"
+#include "train/task_scheduler.h"
+
+namespace PBC {
+
+// Refines a trained pattern file on the full input. The records are added one by one and
+// compressed by chunks with the patterns, in parallel on the scheduler, which counts the records
+// and residual bytes of every pattern and of the unmatched records and keeps a reservoir sample
+// of each. Refine then splits a pattern whose residuals are at least min_residual_share of all
+// residual bytes if they are structured, i.e. split_num patterns trained from its sample compress
+// the sample at least min_split_gain better than it. The children are appended and the pattern is
+// kept for the records they miss. The sample of the unmatched records is trained into
+// new_pattern_num patterns, and those expected to match at least min_group_share of all records
+// are appended. The patterns of the trained file keep their ids.
+class PatternRefiner {
+public:
+    static const int DEFAULT_SAMPLE_NUM;
+    static const int DEFAULT_UNMATCHED_SAMPLE_NUM;
+    static const int DEFAULT_SPLIT_NUM;
+    static const int DEFAULT_NEW_PATTERN_NUM;
+    static const double DEFAULT_MIN_RESIDUAL_SHARE;
+    static const double DEFAULT_MIN_SPLIT_GAIN;
+    static const double DEFAULT_MIN_GROUP_SHARE;
+
+public:
+    // Chunks are compressed and patterns trained in parallel on scheduler unless it is nullptr.
+    // The refined file is written for compress_method.
+    explicit PatternRefiner(CompressMethod compress_method, TaskScheduler* scheduler = nullptr);
+
+    PatternRefiner(const PatternRefiner&) = delete;
+    PatternRefiner& operator=(const PatternRefiner&) = delete;
+
+    // Load the trained pattern file, return false if it is malformed
+    bool LoadPatterns(const char* pattern_buffer, int64_t len);
+    void Add(const char* record, int32_t len);
+    // Write the refined pattern file into a new pattern_buffer and return its length, -1 if it
+    // could not be written
+    int64_t Refine(char** pattern_buffer);
+
+    void SetSplitNum(int split_num) { split_num_ = std::max(split_num, 2); }
+    void SetNewPatternNum(int new_pattern_num) { new_pattern_num_ = std::max(new_pattern_num, 0); }
+    void SetMinSplitGain(double min_split_gain) { min_split_gain_ = min_split_gain; }
+    void SetMinGroupShare(double min_group_share) { min_group_share_ = min_group_share; }
+
+    int64_t RecordNum() const { return record_num_; }
+    int64_t UnmatchedNum() const { return unmatched_num_; }
+    // Return the number of patterns split and of new patterns for unmatched records by Refine
+    int SplitPatternCount() const { return split_pattern_count_; }
+    int NewPatternCount() const { return new_pattern_count_; }
+
+private:
+    struct PatternStat {
+        int64_t record_num = 0;
+        // the varints and residuals of the records, i.e. their compressed bytes after the type
+        // byte and the pattern id
+        int64_t residual_bytes = 0;
+    };
+
+    // Compress the records of the chunk and add them to the statistics
+    void FlushChunk();
+    // Train k patterns from records in the format of ReadDataFromBuffer in the calling thread
+    static void TrainSample(const std::string& records, int k, std::vector<std::string>& patterns);
+    // Compress records in the format of ReadDataFromBuffer with patterns, count the records each
+    // pattern matches and the bytes it saves over storing them, and return the compressed bytes
+    // or -1 if the patterns do not compile
+    static int64_t CompressSample(const std::vector<std::string>& patterns,
+                                  const std::string& records, std::vector<int64_t>& match_nums,
+                                  std::vector<int64_t>& saved_bytes);
+    // Try to split pattern_id, return the patterns its records are split into or nothing
+    std::vector<std::string> SplitPattern(int pattern_id);
+    // Return the patterns trained from the unmatched records which match enough records
+    std::vector<std::string> TrainUnmatched();
+
+private:
+    CompressMethod compress_method_;
+    TaskScheduler* scheduler_;
+    int split_num_ = DEFAULT_SPLIT_NUM;
+    int new_pattern_num_ = DEFAULT_NEW_PATTERN_NUM;
+    double min_residual_share_ = DEFAULT_MIN_RESIDUAL_SHARE;
+    double min_split_gain_ = DEFAULT_MIN_SPLIT_GAIN;
+    double min_group_share_ = DEFAULT_MIN_GROUP_SHARE;
+
+    std::vector<std::string> patterns_;
+    // one compressor for every block of a chunk
+    std::vector<std::unique_ptr<PBC_ONLY_Compress>> compressors_;
+    // the records not compressed yet, in the format of ReadDataFromBuffer
+    std::string chunk_;
+    std::vector<int64_t> chunk_positions_;
+
+    std::vector<PatternStat> pattern_stats_;
+    std::vector<std::unique_ptr<ReservoirSampler>> pattern_samples_;
+    std::unique_ptr<ReservoirSampler> unmatched_sample_;
+    // the records the secondary encoder of the refined file is built from
+    std::unique_ptr<ReservoirSampler> encoder_sample_;
+    int64_t record_num_ = 0;
+    int64_t unmatched_num_ = 0;
+    int split_pattern_count_ = 0;
+    int new_pattern_count_ = 0;
+};
+
+}  // namespace PBC
+#endif  // SRC_TRAIN_PATTERN_REFINER_H_
@@ -17,6 +17,8 @@
 #include "train/pbc_train.h"
 
 #include <algorithm>
+#include <cmath>
+#include <numeric>
 #include <utility>
 
 #include "base/memcpy.h"
@@ -25,6 +27,7 @@
 #include "compress/pbc_fsst_compress.h"
 #include "compress/pbc_only_compress.h"
 #include "compress/pbc_zstd_compress.h"
+#include "train/template_miner.h"
 
 namespace PBC {
 
@@ -32,28 +35,95 @@ const CompressMethod PBC_Train::DEFAULT_COMPRESS_METHOD = CompressMethod::PBC_FS
 const size_t PBC_Train::DEFAULT_THREAD_NUM = 16;
 const size_t PBC_Train::DEFAULT_SYMBOL_SIZE = 256;
 const size_t PBC_Train::DEFAULT_BUFFER_SIZE = (1024 * 1024);
+const int PBC_Train::DEFAULT_CANDIDATE_NUM = 1;
+const double PBC_Train::DEFAULT_MERGE_TOLERANCE = 0.0;
+const double PBC_Train::DEFAULT_CHECKPOINT_INTERVAL = 600.0;
+const int PBC_Train::LOOKUP_ID;
+const int PBC_Train::WILDCARD_SYMBOL;
+
+namespace {
+
+// the pairs a thread takes at once from the parallel scan of one cluster, most of them end at a
+// lower bound and cost far less than scheduling them one by one
+const int PAIR_GRAIN_SIZE = 16;
+// the clusters a thread takes at once when updating the min value table after a merge
+const int UPDATE_GRAIN_SIZE = 16;
+// under a memory budget an arena block is this share of the arena state, but at least
+// MIN_ARENA_BLOCK_SIZE bytes
+const int ARENA_BLOCK_SHARE = 16;
+const size_t MIN_ARENA_BLOCK_SIZE = 4096;
+
+// Hash the symbols of a pattern with FNV-1a
+size_t HashSymbols(const uint16_t* symbols, int len) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (int i = 0; i < len; i++) {
+        hash = (hash ^ symbols[i]) * 1099511628211ULL;
+    }
+    return static_cast<size_t>(hash);
+}
+
+// Append the bytes of value to buffer
+template <class T>
+void AppendValue(std::string& buffer, const T& value) {
+    buffer.append(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+// Read a value at pos, return false if the buffer is too short
+template <class T>
+bool ReadValue(const char* buffer, int64_t len, int64_t& pos, T& value) {
+    if (pos + static_cast<int64_t>(sizeof(T)) > len) {
+        return false;
+    }
+    pbc_memcpy(&value, buffer + pos, sizeof(T));
+    pos += sizeof(T);
+    return true;
+}
+
+const char CHECKPOINT_MAGIC[] = "PBCK";
+const int32_t CHECKPOINT_VERSION = 3;
+// the merge costs other than the unit ones are in 1/COST_SCALE bits
+const int COST_SCALE = 4;
+
+}  // namespace
 
 PBC_Train::PBC_Train(CompressMethod compress_method, size_t num_threads, size_t symbol_size,
                      size_t buffer_size)
     : compress_method_(compress_method),
       thread_num_(num_threads),
       symbol_size_(symbol_size),
-      buffer_size_(buffer_size) {
+      buffer_size_(buffer_size),
+      pattern_set_(0, PatternIdHash{this}, PatternIdEqual{this}) {
+    for (auto& lower_bound_hit : lower_bound_hits_) {
+        lower_bound_hit = 0;
+    }
+    dp_num_ = 0;
+    rescan_num_ = 0;
     if (thread_num_ > 0) {
-        thread_pool_ = new ThreadPool(64);
-        thread_pool2_ = new ThreadPool(thread_num_);
+        scheduler_ = new TaskScheduler(thread_num_);
+        owns_scheduler_ = true;
     }
 }
 
 PBC_Train::~PBC_Train() {
-    if (thread_num_ > 0) {
-        delete thread_pool_;
-        delete thread_pool2_;
+    if (owns_scheduler_) {
+        delete scheduler_;
     }
+    delete token_table_;
+}
 
-    for (auto& pattern_info : pattern_infos_) {
-        delete[] pattern_info.pattern_buffer;
+void PBC_Train::SetScheduler(TaskScheduler* scheduler) {
+    if (owns_scheduler_) {
+        delete scheduler_;
     }
+    scheduler_ = scheduler;
+    owns_scheduler_ = false;
+    thread_num_ = scheduler_ != nullptr ? static_cast<int>(scheduler_->ThreadNum()) : 0;
+}
+
+void PBC_Train::SetTokenDelimiters(const std::string& delimiters) {
+    token_delimiters_ = delimiters;
+    delete token_table_;
+    token_table_ = delimiters.empty() ? nullptr : new TokenTable(delimiters);
 }
 
 int64_t PBC_Train::ReadPatternFromDataBuffer(int64_t& data_pos, int64_t max_len,
@@ -77,268 +147,618 @@ int64_t PBC_Train::ReadPatternFromDataBuffer(int64_t& data_pos, int64_t max_len,
     return pattern_len;
 }
 
+size_t PBC_Train::PatternIdHash::operator()(int id) const {
+    return id == LOOKUP_ID ? train->lookup_hash_ : train->pattern_hashes_[id];
+}
+
+bool PBC_Train::PatternIdEqual::operator()(int id1, int id2) const {
+    const Symbol* symbols1 =
+        id1 == LOOKUP_ID ? train->lookup_symbols_.data() : train->patterns_[id1];
+    const Symbol* symbols2 =
+        id2 == LOOKUP_ID ? train->lookup_symbols_.data() : train->patterns_[id2];
+    int pattern_len1 = id1 == LOOKUP_ID ? train->lookup_symbols_.size() : train->pattern_lens_[id1];
+    int pattern_len2 = id2 == LOOKUP_ID ? train->lookup_symbols_.size() : train->pattern_lens_[id2];
+    return pattern_len1 == pattern_len2 &&
+           memcmp(symbols1, symbols2, pattern_len1 * sizeof(Symbol)) == 0;
+}
+
 void PBC_Train::LoadData(char* data_buffer, int64_t len, int data_type) {
     data_buffer_ = data_buffer;
     len_ = len;
     data_type_ = data_type;
-    int64_t pattern_len_with_escapestr = 0;
-    int cluster_i = 0;
     int64_t data_pos = 0;
     int64_t each_input_pattern_len = 0;
 
     char* each_input_pattern = new char[len_];
-
     do {
-        PatternInfo pattern_info;
         each_input_pattern_len =
             ReadPatternFromDataBuffer(data_pos, len_, data_buffer_, each_input_pattern, data_type_);
         if (each_input_pattern_len == 0) {
             continue;
         }
-        pattern_len_with_escapestr = each_input_pattern_len;
-        pattern_info.pattern_buffer = AddEscapeChar(each_input_pattern, pattern_len_with_escapestr);
-        pattern_info.pattern_len = pattern_len_with_escapestr;
-        // cluster id initialization
-        pattern_info.cluster_id = cluster_i++;
-        // initially each cluster only contains 1 string
-        pattern_info.record_num = 1;
-        pattern_info.thresholds = INT_MAX;
-
-        // counting the symbol frequency for 1-gram pruning
-        std::vector<int> one_gram(symbol_size_, 0);
-        pattern_info.char_freq = each_input_pattern_len;
-        for (int i = 0; i < each_input_pattern_len; i++) {
-            one_gram[static_cast<int32_t>(static_cast<unsigned char>(each_input_pattern[i]))]++;
-        }
-        pattern_info.one_gram_table = one_gram;
-        pattern_infos_.push_back(pattern_info);
+        record_num_++;
+        // only the first copy of a record is stored, the others count its records
+        if (token_table_ != nullptr) {
+            lookup_symbols_.clear();
+            token_table_->Tokenize(each_input_pattern, each_input_pattern_len, lookup_symbols_);
+        } else {
+            lookup_symbols_.assign(
+                reinterpret_cast<unsigned char*>(each_input_pattern),
+                reinterpret_cast<unsigned char*>(each_input_pattern) + each_input_pattern_len);
+        }
+        symbol_num_ += lookup_symbols_.size();
+        AddLookupPattern(1);
     } while (data_pos < len_);
-
-    all_pattern_num_ = static_cast<int>(pattern_infos_.size());
     delete[] each_input_pattern;
+    if (token_table_ != nullptr) {
+        PBC_LOG(INFO) << "tokenized records: token num = " << token_table_->Size() << std::endl;
+    }
 }
 
-int PBC_Train::UpdateState(int cur_state, enum Type suf_type, bool isWildcard, int num_a,
-                           int num_b) {
-    if (suf_type == pat)
-        // if current suffix is in pattern, we should count the wildcard for both two clusters
-        cur_state = cur_state + num_a + num_b;
-    if (!isWildcard)
-        // if current suffix is not wildcard, we should count the symbol
-        cur_state = cur_state + num_a;
-    else
-        // if current suffix is wildcard, we should minus the repeated wildcard
-        cur_state = cur_state - num_a;
-    return cur_state;
+void PBC_Train::AddSeedPattern(const char* pattern, int pattern_len, int record_num) {
+    ParseLookupPattern(std::string(pattern, pattern_len));
+    record_num_ += record_num;
+    AddLookupPattern(record_num);
 }
 
-int PBC_Train::ConstructTables(std::vector<std::vector<Type>>& type_table,
-                               std::vector<std::vector<int>>& state_table,
-                               std::vector<std::vector<SourcePos>>& trans_sources,
-                               const char* str_a, const char* str_b, int len_a, int len_b,
-                               int num_a, int num_b, int threshold) {
-    type_table[0][0] = pat;
-    state_table[0][0] = 0;
-    for (int i = 1; i < len_a + 1; i++) {
-        // the type of this position should be filling subsequence
-        type_table[i][0] = fs;
-        // processing the escape string
-        if (str_a[i - 1] == '\\') {
-            i++;
-            state_table[i][0] = UpdateState(state_table[i - 2][0], type_table[i - 2][0],
-                                            /*isWildcard=*/false, num_a, num_b);
-        } else {
-            if (str_a[i - 1] == '*')
-                state_table[i][0] = UpdateState(state_table[i - 1][0], type_table[i - 1][0],
-                                                /*isWildcard=*/true, num_a, num_b);
-            else
-                state_table[i][0] = UpdateState(state_table[i - 1][0], type_table[i - 1][0],
-                                                /*isWildcard=*/false, num_a, num_b);
+int PBC_Train::LoadSeeds(const char* seed_buffer, int64_t len) {
+    int32_t seed_num;
+    int64_t pos = sizeof(int32_t);
+    if (len < pos) {
+        return -1;
+    }
+    pbc_memcpy(&seed_num, seed_buffer, sizeof(int32_t));
+    for (int32_t i = 0; i < seed_num; i++) {
+        int32_t record_num, pattern_len;
+        if (pos + 2 * static_cast<int64_t>(sizeof(int32_t)) > len) {
+            return -1;
+        }
+        pbc_memcpy(&record_num, seed_buffer + pos, sizeof(int32_t));
+        pbc_memcpy(&pattern_len, seed_buffer + pos + sizeof(int32_t), sizeof(int32_t));
+        pos += 2 * sizeof(int32_t);
+        if (record_num <= 0 || pattern_len < 0 || pos + pattern_len > len) {
+            return -1;
         }
+        AddSeedPattern(seed_buffer + pos, pattern_len, record_num);
+        pos += pattern_len;
     }
-    for (int j = 1; j < len_b + 1; j++) {
-        type_table[0][j] = fs;
-        // processing the escape string
-        if (str_b[j - 1] == '\\') {
-            j++;
-            state_table[0][j] = UpdateState(state_table[0][j - 2], type_table[0][j - 2],
-                                            /*isWildcard=*/false, num_b, num_a);
+    return seed_num;
+}
+
+void PBC_Train::CollectClusters(std::vector<std::pair<std::string, int>>& clusters) const {
+    clusters.clear();
+    // base patterns no record is known to use only live in the pattern file
+    for (size_t i = 0; i < base_patterns_.size(); i++) {
+        if (base_record_nums_[i] > 0) {
+            clusters.emplace_back(base_patterns_[i], base_record_nums_[i]);
+        }
+    }
+    for (int i = 0; i < all_pattern_num_; i++) {
+        if (cluster_ids_[i] != i) continue;
+        clusters.emplace_back(std::string(), record_nums_[i]);
+        SerializePattern(patterns_[i], pattern_lens_[i], clusters.back().first);
+    }
+}
+
+int64_t PBC_Train::SerializeSeeds(char** seed_buffer) const {
+    std::vector<std::pair<std::string, int>> clusters;
+    CollectClusters(clusters);
+    int64_t buffer_len = sizeof(int32_t);
+    for (const auto& cluster : clusters) {
+        buffer_len += 2 * sizeof(int32_t) + cluster.first.size();
+    }
+    *seed_buffer = new char[buffer_len];
+
+    int64_t pos = 0;
+    int32_t seed_num = clusters.size();
+    pbc_memcpy(*seed_buffer, &seed_num, sizeof(int32_t));
+    pos += sizeof(int32_t);
+    for (const auto& cluster : clusters) {
+        int32_t record_num = cluster.second;
+        int32_t pattern_len = cluster.first.size();
+        pbc_memcpy(*seed_buffer + pos, &record_num, sizeof(int32_t));
+        pbc_memcpy(*seed_buffer + pos + sizeof(int32_t), &pattern_len, sizeof(int32_t));
+        pos += 2 * sizeof(int32_t);
+        pbc_memcpy(*seed_buffer + pos, cluster.first.data(), pattern_len);
+        pos += pattern_len;
+    }
+    return buffer_len;
+}
+
+int PBC_Train::LoadBasePatterns(const char* pattern_buffer, int64_t len) {
+    int32_t pattern_num;
+    int64_t pos = sizeof(int32_t);
+    if (len < pos) {
+        return -1;
+    }
+    pbc_memcpy(&pattern_num, pattern_buffer, sizeof(int32_t));
+    if (pattern_num < 0) {
+        return -1;
+    }
+    std::vector<std::string> patterns;
+    for (int32_t i = 0; i < pattern_num; i++) {
+        int32_t pattern_len;
+        if (pos + static_cast<int64_t>(sizeof(int32_t)) > len) {
+            return -1;
+        }
+        pbc_memcpy(&pattern_len, pattern_buffer + pos, sizeof(int32_t));
+        pos += sizeof(int32_t);
+        if (pattern_len < 0 || pos + pattern_len > len) {
+            return -1;
+        }
+        patterns.emplace_back(pattern_buffer + pos, pattern_len);
+        pos += pattern_len;
+    }
+
+    has_base_ = true;
+    base_patterns_.swap(patterns);
+    base_symbols_.assign(pattern_num, std::vector<Symbol>());
+    base_record_nums_.assign(pattern_num, 0);
+    base_ids_.clear();
+    for (int32_t i = 0; i < pattern_num; i++) {
+        ParsePattern(base_patterns_[i].data(), base_patterns_[i].size(), base_symbols_[i]);
+        base_ids_.emplace(base_patterns_[i], i);
+    }
+    base_encoder_data_.assign(pattern_buffer + pos, len - pos);
+    return pattern_num;
+}
+
+void PBC_Train::TrainShards(int k) {
+    // a shard holding at most k patterns would not merge anything
+    int shard_num = std::min(shard_num_, all_pattern_num_ / std::max(k, 1));
+    if (shard_num < 2) {
+        return;
+    }
+    auto start_time = std::chrono::steady_clock::now();
+    std::vector<std::string> patterns(all_pattern_num_);
+    for (int i = 0; i < all_pattern_num_; i++) {
+        SerializePattern(patterns_[i], pattern_lens_[i], patterns[i]);
+    }
+
+    // the patterns are dealt to the shards round robin, every shard is merged down to k
+    // clusters by its own single threaded trainer
+    std::vector<std::vector<std::pair<std::string, int>>> shard_clusters(shard_num);
+    auto train_shard = [this, k, shard_num, &patterns, &shard_clusters](int shard) {
+        PBC_Train shard_train(compress_method_, 0, symbol_size_, buffer_size_);
+        shard_train.SetLowerBounds(lower_bounds_);
+        shard_train.SetCandidateNum(candidate_num_);
+        shard_train.SetMergeMode(merge_mode_);
+        shard_train.SetMergeTolerance(merge_tolerance_);
+        shard_train.SetTokenDelimiters(token_delimiters_);
+        // the shards have no records to estimate costs from, they use those of this run
+        shard_train.wildcard_cost_ = wildcard_cost_;
+        shard_train.symbol_cost_ = symbol_cost_;
+        // the shards share the deadline and the dp workspace bound of this run
+        shard_train.time_budget_ = time_budget_;
+        shard_train.deadline_ = deadline_;
+        shard_train.dp_gate_ = dp_gate_;
+        for (int i = shard; i < all_pattern_num_; i += shard_num) {
+            shard_train.AddSeedPattern(patterns[i].data(), patterns[i].size(), record_nums_[i]);
+        }
+        shard_train.MergeClusters(k);
+        shard_train.CollectClusters(shard_clusters[shard]);
+    };
+    if (thread_num_ > 0) {
+        scheduler_->ParallelFor(0, shard_num, 1, train_shard);
+    } else {
+        for (int shard = 0; shard < shard_num; shard++) {
+            train_shard(shard);
+        }
+    }
+
+    if (DeadlineReached()) {
+        budget_exceeded_ = true;
+    }
+
+    // the clusters of all shards are merged as weighted seeds
+    int pattern_num = all_pattern_num_;
+    ClearPatterns();
+    for (const auto& clusters : shard_clusters) {
+        for (const auto& cluster : clusters) {
+            ParseLookupPattern(cluster.first);
+            AddLookupPattern(cluster.second);
+        }
+    }
+    auto end_time = std::chrono::steady_clock::now();
+    PBC_LOG(INFO) << "train shards: shard num = " << shard_num << ", pattern num = " << pattern_num
+                  << " -> " << all_pattern_num_ << ", cost time = "
+                  << std::chrono::duration<double>(end_time - start_time).count() << "s."
+                  << std::endl;
+}
+
+void PBC_Train::AddLookupPattern(int record_num) {
+    // only the first copy of a pattern is stored, the others count its records
+    lookup_hash_ = HashSymbols(lookup_symbols_.data(), lookup_symbols_.size());
+    auto it = pattern_set_.find(LOOKUP_ID);
+    if (it != pattern_set_.end()) {
+        record_nums_[*it] += record_num;
+        return;
+    }
+    int id = static_cast<int>(patterns_.size());
+    patterns_.push_back(nullptr);
+    pattern_lens_.push_back(0);
+    pattern_capacities_.push_back(0);
+    StorePattern(id, lookup_symbols_.data(), lookup_symbols_.size());
+    record_nums_.push_back(record_num);
+    pattern_hashes_.push_back(lookup_hash_);
+    pattern_set_.insert(id);
+    all_pattern_num_ = static_cast<int>(patterns_.size());
+}
+
+void PBC_Train::ClearPatterns() {
+    patterns_.clear();
+    pattern_lens_.clear();
+    pattern_capacities_.clear();
+    record_nums_.clear();
+    pattern_hashes_.clear();
+    pattern_set_.clear();
+    pattern_arena_.Clear();
+    all_pattern_num_ = 0;
+}
+
+bool PBC_Train::MatchPattern(const Symbol* pattern, int pattern_len, const Symbol* record,
+                             int record_len) {
+    // the last wildcard takes one more symbol whenever the rest fails
+    int pattern_pos = 0, record_pos = 0;
+    int wildcard_pos = -1, wildcard_record_pos = 0;
+    while (record_pos < record_len) {
+        if (pattern_pos < pattern_len && pattern[pattern_pos] == WILDCARD_SYMBOL) {
+            wildcard_pos = pattern_pos++;
+            wildcard_record_pos = record_pos;
+        } else if (pattern_pos < pattern_len && pattern[pattern_pos] == record[record_pos]) {
+            pattern_pos++;
+            record_pos++;
+        } else if (wildcard_pos >= 0) {
+            pattern_pos = wildcard_pos + 1;
+            record_pos = ++wildcard_record_pos;
         } else {
-            if (str_b[j - 1] == '*')
-                state_table[0][j] = UpdateState(state_table[0][j - 1], type_table[0][j - 1],
-                                                /*isWildcard=*/true, num_b, num_a);
-            else
-                state_table[0][j] = UpdateState(state_table[0][j - 1], type_table[0][j - 1],
-                                                /*isWildcard=*/false, num_b, num_a);
+            return false;
         }
     }
+    while (pattern_pos < pattern_len && pattern[pattern_pos] == WILDCARD_SYMBOL) {
+        pattern_pos++;
+    }
+    return pattern_pos == pattern_len;
+}
 
-    int min_encoding_length = INT_MAX;
-    for (int i = 1; i < len_a + 1; i++) {
-        int escape_char_num_a = 0;
-        if (str_a[i - 1] == '\\') {
-            escape_char_num_a++;
-            i++;
+void PBC_Train::AbsorbByBasePatterns() {
+    auto start_time = std::chrono::steady_clock::now();
+    // a seed equal to a base pattern brings its record count, a record is covered by the first
+    // base pattern matching it
+    std::vector<std::pair<std::string, int>> patterns;
+    std::string pattern;
+    std::vector<Symbol> symbols;
+    int64_t absorbed_num = 0;
+    for (int i = 0; i < all_pattern_num_; i++) {
+        SerializePattern(patterns_[i], pattern_lens_[i], pattern);
+        auto it = base_ids_.find(pattern);
+        int base_id = it == base_ids_.end() ? -1 : it->second;
+        const Symbol* pattern_end = patterns_[i] + pattern_lens_[i];
+        bool literal = std::find(static_cast<const Symbol*>(patterns_[i]), pattern_end,
+                                 static_cast<Symbol>(WILDCARD_SYMBOL)) == pattern_end;
+        if (base_id < 0 && literal) {
+            ParsePattern(pattern.data(), pattern.size(), symbols);
+            for (size_t j = 0; j < base_symbols_.size(); j++) {
+                // the id kept for unmatched records covers nothing
+                if (base_patterns_[j] == "*") {
+                    continue;
+                }
+                if (MatchPattern(base_symbols_[j].data(), base_symbols_[j].size(), symbols.data(),
+                                 symbols.size())) {
+                    base_id = static_cast<int>(j);
+                    break;
+                }
+            }
         }
-        int last_pos_a = i - 1 - escape_char_num_a;
-        for (int j = 1; j < len_b + 1; j++) {
-            int escape_char_num_b = 0;
-            if (str_b[j - 1] == '\\') {
-                escape_char_num_b++;
-                j++;
+        if (base_id >= 0) {
+            base_record_nums_[base_id] += record_nums_[i];
+            absorbed_num += record_nums_[i];
+            continue;
+        }
+        patterns.emplace_back(pattern, record_nums_[i]);
+    }
+
+    int pattern_num = all_pattern_num_;
+    ClearPatterns();
+    for (const auto& uncovered_pattern : patterns) {
+        ParseLookupPattern(uncovered_pattern.first);
+        AddLookupPattern(uncovered_pattern.second);
+    }
+    auto end_time = std::chrono::steady_clock::now();
+    PBC_LOG(INFO) << "absorb by base patterns: base pattern num = " << base_patterns_.size()
+                  << ", absorbed record num = " << absorbed_num << ", pattern num = "
+                  << pattern_num << " -> " << all_pattern_num_ << ", cost time = "
+                  << std::chrono::duration<double>(end_time - start_time).count() << "s."
+                  << std::endl;
+}
+
+namespace {
+
+bool IsAlnum(char c) {
+    return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+}
+
+bool IsHexDigit(char c) {
+    return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F');
+}
+
+// Build the canonical key of a record by masking variable looking parts of its alphanumeric
+// words: a word of hex digits with at least one digit (hex ids, the parts of UUIDs) becomes
+// '\x01', and every other run of digits (numbers, timestamps, IPs) becomes '\x02'. runs are the
+// masked [begin, end) ranges of the record.
+void CanonicalKey(const std::string& record, std::string& key,
+                  std::vector<std::pair<size_t, size_t>>& runs) {
+    key.clear();
+    runs.clear();
+    size_t len = record.size();
+    for (size_t i = 0; i < len;) {
+        if (!IsAlnum(record[i])) {
+            key.push_back(record[i++]);
+            continue;
+        }
+        size_t word_end = i;
+        bool hex = true, has_digit = false;
+        while (word_end < len && IsAlnum(record[word_end])) {
+            hex = hex && IsHexDigit(record[word_end]);
+            has_digit = has_digit || (record[word_end] >= '0' && record[word_end] <= '9');
+            word_end++;
+        }
+        // a 0x prefix keeps the word hex
+        if (!hex && word_end - i > 2 && record[i] == '0' && (record[i + 1] | 0x20) == 'x') {
+            hex = std::all_of(record.begin() + i + 2, record.begin() + word_end, IsHexDigit);
+        }
+        if (hex && has_digit) {
+            key.push_back('\x01');
+            runs.emplace_back(i, word_end);
+            i = word_end;
+            continue;
+        }
+        while (i < word_end) {
+            if (record[i] < '0' || record[i] > '9') {
+                key.push_back(record[i++]);
+                continue;
             }
-            int last_pos_b = j - 1 - escape_char_num_b;
-            if (str_a[i - 1] == str_b[j - 1] && (str_a[i - 1] != '*' || escape_char_num_a != 0)) {
-                // compute the value transfered from state[i][j-1] and state[i-1][j]
-                // respectively
-                int up_value = UpdateState(state_table[last_pos_a][j], type_table[last_pos_a][j],
-                                           /*isWildcard=*/false, num_a, num_b);
-                int left_value = UpdateState(state_table[i][last_pos_b], type_table[i][last_pos_b],
-                                             /*isWildcard=*/false, num_b, num_a);
+            size_t run_begin = i;
+            while (i < word_end && record[i] >= '0' && record[i] <= '9') {
+                i++;
+            }
+            key.push_back('\x02');
+            runs.emplace_back(run_begin, i);
+        }
+    }
+}
 
-                int last_pos_value = state_table[last_pos_a][last_pos_b];
+}  // namespace
+
+void PBC_Train::CanonicalizePatterns() {
+    auto start_time = std::chrono::steady_clock::now();
+    // Group the distinct patterns by canonical key in load order. The members of a group have
+    // the same masked runs in the same order, a run is a wildcard of the group pattern if the
+    // members differ in it. The members share every other byte, so the rest of the group pattern
+    // is taken from its first member.
+    struct Group {
+        int record_num;
+        std::string record;
+        std::vector<std::pair<size_t, size_t>> runs;
+        // the runs of the first member and whether the members differ in each of them
+        std::vector<std::string> run_values;
+        std::vector<bool> run_varying;
+    };
+    std::unordered_map<std::string, int> group_ids;
+    std::vector<Group> groups;
+    std::string record, key;
+    std::vector<std::pair<size_t, size_t>> runs;
+    for (int i = 0; i < all_pattern_num_; i++) {
+        SerializePattern(patterns_[i], pattern_lens_[i], record);
+        CanonicalKey(record, key, runs);
+        auto it = group_ids.emplace(key, static_cast<int>(groups.size())).first;
+        if (it->second == static_cast<int>(groups.size())) {
+            groups.emplace_back();
+            Group& group = groups.back();
+            group.record_num = 0;
+            group.record = record;
+            group.runs = runs;
+            for (const std::pair<size_t, size_t>& run : runs) {
+                group.run_values.push_back(record.substr(run.first, run.second - run.first));
+            }
+            group.run_varying.assign(runs.size(), false);
+        }
+        Group& group = groups[it->second];
+        for (size_t j = 0; j < runs.size(); j++) {
+            if (record.compare(runs[j].first, runs[j].second - runs[j].first,
+                               group.run_values[j]) != 0) {
+                group.run_varying[j] = true;
+            }
+        }
+        group.record_num += record_nums_[i];
+    }
 
-                //  the minimal EL is transfered from state[i][j-1], state[i-1][j] and
-                //  state[i-1][j-1]
-                if (up_value < last_pos_value || left_value < last_pos_value) {
-                    type_table[i][j] = fs;
+    int pattern_num = all_pattern_num_;
+    ClearPatterns();
+    std::string pattern;
+    for (const Group& group : groups) {
+        pattern.clear();
+        size_t pos = 0;
+        for (size_t j = 0; j < group.runs.size(); j++) {
+            if (group.run_varying[j]) {
+                pattern.append(group.record, pos, group.runs[j].first - pos);
+                pattern.push_back('*');
+                pos = group.runs[j].second;
+            }
+        }
+        pattern.append(group.record, pos, std::string::npos);
+        ParseLookupPattern(pattern);
+        AddLookupPattern(group.record_num);
+    }
+    auto end_time = std::chrono::steady_clock::now();
+    PBC_LOG(INFO) << "canonicalize patterns: pattern num = " << pattern_num << " -> "
+                  << all_pattern_num_ << ", cost time = "
+                  << std::chrono::duration<double>(end_time - start_time).count() << "s."
+                  << std::endl;
+}
 
-                    if (up_value >= left_value) {
-                        state_table[i][j] = left_value;
-                        trans_sources[i][j] = uppos;
-                    } else {
-                        state_table[i][j] = up_value;
-                        trans_sources[i][j] = leftpos;
-                    }
-                } else if (up_value == last_pos_value || left_value == last_pos_value) {
-                    state_table[i][j] = last_pos_value;
-                    type_table[i][j] = fs;
-                    if (up_value >= left_value) {
-                        state_table[i][j] = left_value;
-                        trans_sources[i][j] = uppos;
-                    } else {
-                        state_table[i][j] = up_value;
-                        trans_sources[i][j] = leftpos;
-                    }
-                } else {
-                    state_table[i][j] = last_pos_value;
-                    type_table[i][j] = pat;
-                    trans_sources[i][j] = upperleft;
+void PBC_Train::ParseLookupPattern(const std::string& pattern) {
+    std::vector<Symbol> symbols;
+    ParsePattern(pattern.data(), pattern.size(), symbols);
+    if (token_table_ == nullptr) {
+        lookup_symbols_.swap(symbols);
+        return;
+    }
+    // tokenize the literal runs between wildcards
+    lookup_symbols_.clear();
+    std::string literals;
+    for (size_t i = 0; i <= symbols.size(); i++) {
+        if (i < symbols.size() && symbols[i] != WILDCARD_SYMBOL) {
+            literals.push_back(static_cast<char>(symbols[i]));
+            continue;
+        }
+        token_table_->Tokenize(literals.data(), literals.size(), lookup_symbols_);
+        literals.clear();
+        if (i < symbols.size()) {
+            lookup_symbols_.push_back(WILDCARD_SYMBOL);
+        }
+    }
+}
+
+void PBC_Train::MineTemplates(int k) {
+    auto start_time = std::chrono::steady_clock::now();
+    // the byte mode mines over the tokens of the default delimiters
+    TokenTable byte_token_table;
+    TokenTable* token_table = token_table_ != nullptr ? token_table_ : &byte_token_table;
+    TemplateMiner miner(token_table);
+    std::vector<uint16_t> tokens;
+    std::string literals;
+    for (int i = 0; i < all_pattern_num_; i++) {
+        if (token_table_ != nullptr) {
+            miner.Add(patterns_[i], pattern_lens_[i], record_nums_[i]);
+            continue;
+        }
+        // tokenize the literal runs between the wildcards of seeds
+        tokens.clear();
+        for (int j = 0; j <= pattern_lens_[i]; j++) {
+            if (j < pattern_lens_[i] && patterns_[i][j] != WILDCARD_SYMBOL) {
+                literals.push_back(static_cast<char>(patterns_[i][j]));
+                continue;
+            }
+            byte_token_table.Tokenize(literals.data(), literals.size(), tokens);
+            literals.clear();
+            if (j < pattern_lens_[i]) {
+                tokens.push_back(TemplateMiner::WILDCARD_TOKEN);
+            }
+        }
+        miner.Add(tokens.data(), tokens.size(), record_nums_[i]);
+    }
+
+    // without refinement only the k largest templates are kept, stable in template order
+    std::vector<int> template_ids(miner.TemplateNum());
+    std::iota(template_ids.begin(), template_ids.end(), 0);
+    if (!refine_templates_ && miner.TemplateNum() > k) {
+        std::stable_sort(template_ids.begin(), template_ids.end(), [&miner](int a, int b) {
+            return miner.Weight(a) > miner.Weight(b);
+        });
+        template_ids.resize(std::max(k, 0));
+    }
+
+    // the templates replace the loaded patterns as weighted seed clusters
+    ClearPatterns();
+    for (int template_id : template_ids) {
+        lookup_symbols_.clear();
+        for (uint16_t token : miner.Template(template_id)) {
+            if (token == TemplateMiner::WILDCARD_TOKEN) {
+                // a wildcard matches any run of tokens
+                if (lookup_symbols_.empty() || lookup_symbols_.back() != WILDCARD_SYMBOL) {
+                    lookup_symbols_.push_back(WILDCARD_SYMBOL);
                 }
+            } else if (token_table_ != nullptr) {
+                lookup_symbols_.push_back(token);
             } else {
-                // update the value transfered from state[i][j-1] and state[i-1][j] respectively
-                int up_value, left_value;
-                if (str_a[i - 1] == '*' && escape_char_num_a == 0)
-                    up_value = UpdateState(state_table[last_pos_a][j], type_table[last_pos_a][j],
-                                           /*isWildcard=*/true, num_a, num_b);
-                else
-                    up_value = UpdateState(state_table[last_pos_a][j], type_table[last_pos_a][j],
-                                           /*isWildcard=*/false, num_a, num_b);
-                if (str_b[j - 1] == '*' && escape_char_num_b == 0)
-                    left_value = UpdateState(state_table[i][last_pos_b], type_table[i][last_pos_b],
-                                             /*isWildcard=*/true, num_b, num_a);
-                else
-                    left_value = UpdateState(state_table[i][last_pos_b], type_table[i][last_pos_b],
-                                             /*isWildcard=*/false, num_b, num_a);
-                type_table[i][j] = fs;
-
-                // the minimal EL is transfered from state[i][j-1] and state[i-1][j]
-                if (up_value >= left_value) {
-                    state_table[i][j] = left_value;
-                    trans_sources[i][j] = uppos;
-                } else {
-                    state_table[i][j] = up_value;
-                    trans_sources[i][j] = leftpos;
+                for (char c : token_table->Token(token)) {
+                    lookup_symbols_.push_back(static_cast<unsigned char>(c));
                 }
             }
-            if (state_table[i][j] < min_encoding_length) min_encoding_length = state_table[i][j];
         }
-        if (min_encoding_length >= threshold) return INT_MAX;
+        AddLookupPattern(static_cast<int>(miner.Weight(template_id)));
     }
-    return state_table[len_a][len_b];
+    auto end_time = std::chrono::steady_clock::now();
+    PBC_LOG(INFO) << "mine templates: template num = " << miner.TemplateNum()
+                  << ", seed num = " << all_pattern_num_ << ", cost time = "
+                  << std::chrono::duration<double>(end_time - start_time).count() << "s."
+                  << std::endl;
 }
 
-int PBC_Train::ConstructTablesMultiThreads(std::vector<std::vector<Type>>& type_table,
-                                           std::vector<std::vector<int>>& state_table,
-                                           std::vector<std::vector<SourcePos>>& trans_sources,
-                                           const char* str_a, const char* str_b, int len_a,
-                                           int len_b, int num_a, int num_b,
-                                           int threshold_id) const {
+int PBC_Train::UpdateState(int cur_state, enum Type suf_type, bool isWildcard, int wildcard_a,
+                           int wildcard_b, int symbol_a) {
+    if (suf_type == pat)
+        // if current suffix is in pattern, we should count the wildcard for both two clusters
+        cur_state = cur_state + wildcard_a + wildcard_b;
+    if (!isWildcard)
+        // if current suffix is not wildcard, we should count the symbol
+        cur_state = cur_state + symbol_a;
+    else
+        // if current suffix is wildcard, we should minus the repeated wildcard
+        cur_state = cur_state - wildcard_a;
+    return cur_state;
+}
+
+template <class Threshold>
+int PBC_Train::FillTables(std::vector<std::vector<Type>>& type_table,
+                          std::vector<std::vector<int>>& state_table,
+                          std::vector<std::vector<SourcePos>>& trans_sources,
+                          const Symbol* symbols_a, const Symbol* symbols_b, int len_a, int len_b,
+                          const MergeWeights& weights, const Threshold& threshold) {
     type_table[0][0] = pat;
     state_table[0][0] = 0;
+    // the first column and row are filling subsequences, except that an escaped symbol keeps the
+    // type pat there as it always did in the escaped form
     for (int i = 1; i < len_a + 1; i++) {
-        // the type of this position should be filling subsequence
-        type_table[i][0] = fs;
-        // processing the escape string
-        if (str_a[i - 1] == '\\') {
-            i++;
-            state_table[i][0] = UpdateState(state_table[i - 2][0], type_table[i - 2][0],
-                                            /*isWildcard=*/false, num_a, num_b);
-        } else {
-            if (str_a[i - 1] == '*')
-                state_table[i][0] = UpdateState(state_table[i - 1][0], type_table[i - 1][0],
-                                                /*isWildcard=*/true, num_a, num_b);
-            else
-                state_table[i][0] = UpdateState(state_table[i - 1][0], type_table[i - 1][0],
-                                                /*isWildcard=*/false, num_a, num_b);
-        }
+        type_table[i][0] = IsEscapedSymbol(symbols_a[i - 1]) ? pat : fs;
+        state_table[i][0] = UpdateState(state_table[i - 1][0], type_table[i - 1][0],
+                                        symbols_a[i - 1] == WILDCARD_SYMBOL, weights.wildcard_a,
+                                        weights.wildcard_b, weights.symbol_a);
     }
     for (int j = 1; j < len_b + 1; j++) {
-        type_table[0][j] = fs;
-        // processing the escape string
-        if (str_b[j - 1] == '\\') {
-            j++;
-            state_table[0][j] = UpdateState(state_table[0][j - 2], type_table[0][j - 2],
-                                            /*isWildcard=*/false, num_b, num_a);
-        } else {
-            if (str_b[j - 1] == '*')
-                state_table[0][j] = UpdateState(state_table[0][j - 1], type_table[0][j - 1],
-                                                /*isWildcard=*/true, num_b, num_a);
-            else
-                state_table[0][j] = UpdateState(state_table[0][j - 1], type_table[0][j - 1],
-                                                /*isWildcard=*/false, num_b, num_a);
-        }
+        type_table[0][j] = IsEscapedSymbol(symbols_b[j - 1]) ? pat : fs;
+        state_table[0][j] = UpdateState(state_table[0][j - 1], type_table[0][j - 1],
+                                        symbols_b[j - 1] == WILDCARD_SYMBOL, weights.wildcard_b,
+                                        weights.wildcard_a, weights.symbol_b);
     }
 
-    int min_encoding_length = INT_MAX;
+    // Only a wildcard lowers the state again, so a path through row i ends at least at its state
+    // there minus the weights of the wildcards it has not consumed yet. The dp stops once no
+    // path through a row can end below the threshold.
+    std::vector<int64_t> wildcard_rests_b(len_b + 1, 0);
+    for (int j = len_b - 1; j >= 0; j--) {
+        wildcard_rests_b[j] =
+            wildcard_rests_b[j + 1] + (symbols_b[j] == WILDCARD_SYMBOL ? weights.wildcard_b : 0);
+    }
+    int64_t wildcard_rest_a = 0;
+    for (int i = 0; i < len_a; i++) {
+        wildcard_rest_a += symbols_a[i] == WILDCARD_SYMBOL ? weights.wildcard_a : 0;
+    }
     for (int i = 1; i < len_a + 1; i++) {
-        int escape_char_num_a = 0;
-        if (str_a[i - 1] == '\\') {
-            escape_char_num_a++;
-            i++;
-        }
-        int last_pos_a = i - 1 - escape_char_num_a;
+        int symbol_a = symbols_a[i - 1];
+        bool wildcard_a = symbol_a == WILDCARD_SYMBOL;
+        wildcard_rest_a -= wildcard_a ? weights.wildcard_a : 0;
+        int64_t row_min = state_table[i][0] - wildcard_rests_b[0];
         for (int j = 1; j < len_b + 1; j++) {
-            int escape_char_num_b = 0;
-            if (str_b[j - 1] == '\\') {
-                escape_char_num_b++;
-                j++;
-            }
-            int last_pos_b = j - 1 - escape_char_num_b;
-            if (str_a[i - 1] == str_b[j - 1] && (str_a[i - 1] != '*' || escape_char_num_a != 0)) {
+            int symbol_b = symbols_b[j - 1];
+            bool wildcard_b = symbol_b == WILDCARD_SYMBOL;
+            // a literal '*' of a is also aligned with a wildcard of b
+            if ((symbol_a == symbol_b && !wildcard_a) || (symbol_a == '*' && wildcard_b)) {
                 // compute the value transfered from state[i][j-1] and state[i-1][j]
                 // respectively
-                int up_value = UpdateState(state_table[last_pos_a][j], type_table[last_pos_a][j],
-                                           /*isWildcard=*/false, num_a, num_b);
-                int left_value = UpdateState(state_table[i][last_pos_b], type_table[i][last_pos_b],
-                                             /*isWildcard=*/false, num_b, num_a);
+                int up_value =
+                    UpdateState(state_table[i - 1][j], type_table[i - 1][j], /*isWildcard=*/false,
+                                weights.wildcard_a, weights.wildcard_b, weights.symbol_a);
+                int left_value =
+                    UpdateState(state_table[i][j - 1], type_table[i][j - 1], /*isWildcard=*/false,
+                                weights.wildcard_b, weights.wildcard_a, weights.symbol_b);
 
-                int last_pos_value = state_table[last_pos_a][last_pos_b];
+                int last_pos_value = state_table[i - 1][j - 1];
 
                 //  the minimal EL is transfered from state[i][j-1], state[i-1][j] and
                 //  state[i-1][j-1]
-                if (up_value < last_pos_value || left_value < last_pos_value) {
-                    type_table[i][j] = fs;
-
-                    if (up_value >= left_value) {
-                        state_table[i][j] = left_value;
-                        trans_sources[i][j] = uppos;
-                    } else {
-                        state_table[i][j] = up_value;
-                        trans_sources[i][j] = leftpos;
-                    }
-                } else if (up_value == last_pos_value || left_value == last_pos_value) {
-                    state_table[i][j] = last_pos_value;
+                if (up_value <= last_pos_value || left_value <= last_pos_value) {
                     type_table[i][j] = fs;
                     if (up_value >= left_value) {
                         state_table[i][j] = left_value;
@@ -354,19 +774,12 @@ int PBC_Train::ConstructTablesMultiThreads(std::vector<std::vector<Type>>& type_
                 }
             } else {
                 // update the value transfered from state[i][j-1] and state[i-1][j] respectively
-                int up_value, left_value;
-                if (str_a[i - 1] == '*' && escape_char_num_a == 0)
-                    up_value = UpdateState(state_table[last_pos_a][j], type_table[last_pos_a][j],
-                                           /*isWildcard=*/true, num_a, num_b);
-                else
-                    up_value = UpdateState(state_table[last_pos_a][j], type_table[last_pos_a][j],
-                                           /*isWildcard=*/false, num_a, num_b);
-                if (str_b[j - 1] == '*' && escape_char_num_b == 0)
-                    left_value = UpdateState(state_table[i][last_pos_b], type_table[i][last_pos_b],
-                                             /*isWildcard=*/true, num_b, num_a);
-                else
-                    left_value = UpdateState(state_table[i][last_pos_b], type_table[i][last_pos_b],
-                                             /*isWildcard=*/false, num_b, num_a);
+                int up_value =
+                    UpdateState(state_table[i - 1][j], type_table[i - 1][j], wildcard_a,
+                                weights.wildcard_a, weights.wildcard_b, weights.symbol_a);
+                int left_value =
+                    UpdateState(state_table[i][j - 1], type_table[i][j - 1], wildcard_b,
+                                weights.wildcard_b, weights.wildcard_a, weights.symbol_b);
                 type_table[i][j] = fs;
 
                 // the minimal EL is transfered from state[i][j-1] and state[i-1][j]
@@ -378,15 +791,38 @@ int PBC_Train::ConstructTablesMultiThreads(std::vector<std::vector<Type>>& type_
                     trans_sources[i][j] = leftpos;
                 }
             }
-            if (state_table[i][j] < min_encoding_length) min_encoding_length = state_table[i][j];
+            row_min = std::min(row_min, state_table[i][j] - wildcard_rests_b[j]);
         }
-        if (min_encoding_length >= pattern_infos_[threshold_id].thresholds) return INT_MAX;
+        if (row_min - wildcard_rest_a >= threshold()) return INT_MAX;
     }
     return state_table[len_a][len_b];
 }
 
-int PBC_Train::MinEncodingLength(const char* str_a, const char* str_b, int len_a, int len_b,
-                                 int num_a, int num_b, int threshold) {
+int PBC_Train::ConstructTables(std::vector<std::vector<Type>>& type_table,
+                               std::vector<std::vector<int>>& state_table,
+                               std::vector<std::vector<SourcePos>>& trans_sources,
+                               const Symbol* symbols_a, const Symbol* symbols_b, int len_a,
+                               int len_b, const MergeWeights& weights, int threshold) {
+    return FillTables(type_table, state_table, trans_sources, symbols_a, symbols_b, len_a, len_b,
+                      weights, [threshold] { return threshold; });
+}
+
+int PBC_Train::ConstructTablesMultiThreads(std::vector<std::vector<Type>>& type_table,
+                                           std::vector<std::vector<int>>& state_table,
+                                           std::vector<std::vector<SourcePos>>& trans_sources,
+                                           const Symbol* symbols_a, const Symbol* symbols_b,
+                                           int len_a, int len_b, const MergeWeights& weights,
+                                           int threshold_id, int key) const {
+    // other threads lower the threshold while the tables are filled
+    auto threshold = [this, threshold_id, key] {
+        return LoadCandidateThreshold(threshold_id, key);
+    };
+    return FillTables(type_table, state_table, trans_sources, symbols_a, symbols_b, len_a, len_b,
+                      weights, threshold);
+}
+
+int PBC_Train::MinEncodingLength(const Symbol* symbols_a, const Symbol* symbols_b, int len_a,
+                                 int len_b, const MergeWeights& weights, int threshold) {
     // store the suffix is in pattern or in filling subsequence
     std::vector<std::vector<Type>> type_table(len_a + 1, std::vector<Type>(len_b + 1));
     // recording the encoding length increment
@@ -394,13 +830,13 @@ int PBC_Train::MinEncodingLength(const char* str_a, const char* str_b, int len_a
     // store the source of state transition (left, up or upper left)
     std::vector<std::vector<SourcePos>> trans_sources(len_a + 1,
                                                       std::vector<SourcePos>(len_b + 1, esc));
-    return ConstructTables(type_table, state_table, trans_sources, str_a, str_b, len_a, len_b,
-                           num_a, num_b, threshold);
+    return ConstructTables(type_table, state_table, trans_sources, symbols_a, symbols_b, len_a,
+                           len_b, weights, threshold);
 }
 
-int PBC_Train::MinEncodingLengthMultiThreads(const char* str_a, const char* str_b, int len_a,
-                                             int len_b, int num_a, int num_b,
-                                             int threshold_id) const {
+int PBC_Train::MinEncodingLengthMultiThreads(const Symbol* symbols_a, const Symbol* symbols_b,
+                                             int len_a, int len_b, const MergeWeights& weights,
+                                             int threshold_id, int key) const {
     // store the suffix is in pattern or in filling subsequence
     std::vector<std::vector<Type>> type_table(len_a + 1, std::vector<Type>(len_b + 1));
     // recording the encoding length increment
@@ -408,20 +844,28 @@ int PBC_Train::MinEncodingLengthMultiThreads(const char* str_a, const char* str_
     // store the source of state transition (left, up or upper left)
     std::vector<std::vector<SourcePos>> trans_sources(len_a + 1,
                                                       std::vector<SourcePos>(len_b + 1, esc));
-    return ConstructTablesMultiThreads(type_table, state_table, trans_sources, str_a, str_b, len_a,
-                                       len_b, num_a, num_b, threshold_id);
-}
-
-int PBC_Train::MergePattern(const char* str_a, const char* str_b, int len_a, int len_b, int num_a,
-                            int num_b, std::string& str) {
-    // check if str_a and str_b are exactly the same
-    // if (len_a == len_b) {
-    //     for (uint32_t i = 0; i < len_a; i++) {
-    //         if (str_a[i] != str_b[i]) break;
-    //         str += str_a[i];
-    //         if (i == len_a - 1) return -1;
-    //     }
-    // }
+    return ConstructTablesMultiThreads(type_table, state_table, trans_sources, symbols_a,
+                                       symbols_b, len_a, len_b, weights, threshold_id, key);
+}
+
+namespace {
+
+// Map each position of the escaped form of symbols to its symbol (1-based), or -1 for the '\\'
+// of an escaped symbol
+void EscapedPositions(const uint16_t* symbols, int len, std::vector<int>& positions) {
+    positions.assign(1, 0);
+    for (int i = 0; i < len; i++) {
+        if (symbols[i] == '*' || symbols[i] == '\\') {
+            positions.push_back(-1);
+        }
+        positions.push_back(i + 1);
+    }
+}
+
+}  // namespace
+
+int PBC_Train::MergePattern(const Symbol* symbols_a, const Symbol* symbols_b, int len_a,
+                            int len_b, const MergeWeights& weights, std::vector<Symbol>& merged) {
     // store the suffix is in pattern or in filling subsequence
     std::vector<std::vector<Type>> type_table(len_a + 1, std::vector<Type>(len_b + 1));
     // recording the encoding length increment
@@ -429,168 +873,401 @@ int PBC_Train::MergePattern(const char* str_a, const char* str_b, int len_a, int
     // store the source of state transition (left, up or upper left)
     std::vector<std::vector<SourcePos>> trans_sources(len_a + 1,
                                                       std::vector<SourcePos>(len_b + 1, esc));
-    ConstructTables(type_table, state_table, trans_sources, str_a, str_b, len_a, len_b, num_a,
-                    num_b, INT_MAX);
-
-    // last_type is suffix type of the current pos
-    int pos_a = len_a, pos_b = len_b;
+    ConstructTables(type_table, state_table, trans_sources, symbols_a, symbols_b, len_a, len_b,
+                    weights, INT_MAX);
+
+    // The traceback walks the positions of the escaped forms, the '\\' of an escaped symbol has
+    // no state and is skipped as esc. Walking symbols instead would change how a literal '*' of
+    // a aligned with a wildcard of b is traced, and so the trained patterns.
+    std::vector<int> positions_a, positions_b;
+    EscapedPositions(symbols_a, len_a, positions_a);
+    EscapedPositions(symbols_b, len_b, positions_b);
+    auto trans_source = [&](int pos_a, int pos_b) {
+        return positions_a[pos_a] < 0 || positions_b[pos_b] < 0
+                   ? esc
+                   : trans_sources[positions_a[pos_a]][positions_b[pos_b]];
+    };
+
+    // last_type is suffix type of the current pos, merged is built backwards
+    int pos_a = positions_a.size() - 1, pos_b = positions_b.size() - 1;
     Type last_type = type_table[len_a][len_b];
+    merged.clear();
 
     if (type_table[len_a][len_b] != pat) {
-        str = "*";
+        merged.push_back(WILDCARD_SYMBOL);
     }
 
     while (pos_a > 0 && pos_b > 0) {
         // only when the state is transfered from upperleft, we add the current suffix to the
         // pattern
-        if (trans_sources[pos_a][pos_b] == upperleft) {
-            str = str_a[pos_a - 1] + str;
+        if (trans_source(pos_a, pos_b) == upperleft) {
+            merged.push_back(symbols_a[positions_a[pos_a] - 1]);
             last_type = pat;
             pos_a--;
             pos_b--;
             // skip the escape string
-            while (pos_a > 0 && pos_b > 0 && trans_sources[pos_a][pos_b] == esc) {
-                if (last_type == pat) str = "\\" + str;
+            while (pos_a > 0 && pos_b > 0 && trans_source(pos_a, pos_b) == esc) {
+                if (last_type == pat) merged.push_back('\\');
                 pos_a--;
                 pos_b--;
             }
 
-        } else if (trans_sources[pos_a][pos_b] == uppos) {
+        } else if (trans_source(pos_a, pos_b) == uppos) {
             if (last_type == pat) {
-                str = "*" + str;
+                merged.push_back(WILDCARD_SYMBOL);
                 last_type = fs;
             }
             pos_b--;
-            while (pos_a > 0 && pos_b > 0 && trans_sources[pos_a][pos_b] == esc) {
-                if (last_type == pat) str = "\\" + str;
+            while (pos_a > 0 && pos_b > 0 && trans_source(pos_a, pos_b) == esc) {
+                if (last_type == pat) merged.push_back('\\');
                 pos_b--;
             }
 
-        } else if (trans_sources[pos_a][pos_b] == leftpos) {
+        } else if (trans_source(pos_a, pos_b) == leftpos) {
             if (last_type == pat) {
-                str = "*" + str;
+                merged.push_back(WILDCARD_SYMBOL);
                 last_type = fs;
             }
             pos_a--;
-            while (pos_a > 0 && pos_b > 0 && trans_sources[pos_a][pos_b] == esc) {
-                if (last_type == pat) str = "\\" + str;
+            while (pos_a > 0 && pos_b > 0 && trans_source(pos_a, pos_b) == esc) {
+                if (last_type == pat) merged.push_back('\\');
                 pos_a--;
             }
         }
     }
 
-    if (pos_a != pos_b && str[0] != '*') {
-        str = "*" + str;
+    // a literal '*' at the front reads as a wildcard in the escaped form
+    if (pos_a != pos_b && (merged.empty() || (merged.back() != WILDCARD_SYMBOL &&
+                                              merged.back() != '*'))) {
+        merged.push_back(WILDCARD_SYMBOL);
     }
+    std::reverse(merged.begin(), merged.end());
     return state_table[len_a][len_b];
 }
 
-char* PBC_Train::AddEscapeChar(char* cstring, int64_t& len) {
-    char* result_cstring = new char[3 * len];
-    uint32_t cur_pos = 0;
+void PBC_Train::SerializePattern(const Symbol* symbols, int len, std::string& str) const {
+    str.clear();
     for (int i = 0; i < len; i++) {
-        // add the escape string for wildcard symbol '*'
-        if (cstring[i] == '*' || cstring[i] == '\\') {
-            result_cstring[cur_pos++] = '\\';
+        if (symbols[i] == WILDCARD_SYMBOL) {
+            str.push_back('*');
+            continue;
+        }
+        if (token_table_ == nullptr) {
+            // add the escape string for literal '*' and '\\'
+            if (IsEscapedSymbol(symbols[i])) {
+                str.push_back('\\');
+            }
+            str.push_back(static_cast<char>(symbols[i]));
+            continue;
+        }
+        for (char c : token_table_->Token(symbols[i])) {
+            if (IsEscapedSymbol(static_cast<unsigned char>(c))) {
+                str.push_back('\\');
+            }
+            str.push_back(c);
         }
-        result_cstring[cur_pos++] = cstring[i];
     }
-    result_cstring[cur_pos] = 0;
-    len = cur_pos;
-    return result_cstring;
 }
 
-int PBC_Train::GetMinEncodingLength(int cluster_id1, int cluster_id2, int threshold) const {
-    // caculate the the number of common chars
-    int value_common = 0;
-    for (int k = 0; k < symbol_size_; k++) {
-        value_common = value_common + std::min(pattern_infos_[cluster_id1].one_gram_table[k],
-                                               pattern_infos_[cluster_id2].one_gram_table[k]);
+void PBC_Train::ParsePattern(const char* str, int len, std::vector<Symbol>& symbols) {
+    symbols.clear();
+    for (int i = 0; i < len; i++) {
+        // '\\' escapes the next char, '*' is wildcard
+        if (str[i] == '\\' && i + 1 < len) {
+            i++;
+            symbols.push_back(static_cast<unsigned char>(str[i]));
+        } else if (str[i] == '*') {
+            symbols.push_back(WILDCARD_SYMBOL);
+        } else {
+            symbols.push_back(static_cast<unsigned char>(str[i]));
+        }
     }
+}
 
-    if (((pattern_infos_[cluster_id1].char_freq - value_common) *
-             pattern_infos_[cluster_id1].record_num +
-         (pattern_infos_[cluster_id2].char_freq - value_common) *
-             pattern_infos_[cluster_id2].record_num) >= threshold) {
-        return INT_MAX;
+void PBC_Train::StorePattern(int cluster_id, const Symbol* symbols, int pattern_len) {
+    if (pattern_len > pattern_capacities_[cluster_id]) {
+        patterns_[cluster_id] = pattern_arena_.AllocateArray<Symbol>(pattern_len);
+        pattern_capacities_[cluster_id] = pattern_len;
     }
-    return MinEncodingLength(
-        pattern_infos_[cluster_id1].pattern_buffer, pattern_infos_[cluster_id2].pattern_buffer,
-        pattern_infos_[cluster_id1].pattern_len, pattern_infos_[cluster_id2].pattern_len,
-        pattern_infos_[cluster_id1].record_num, pattern_infos_[cluster_id2].record_num, threshold);
+    std::copy(symbols, symbols + pattern_len, patterns_[cluster_id]);
+    pattern_lens_[cluster_id] = pattern_len;
+}
+
+void PBC_Train::ComputePatternBounds(int cluster_id) {
+    const Symbol* symbols = patterns_[cluster_id];
+    int pattern_len = pattern_lens_[cluster_id];
+    PatternBounds& bounds = pattern_bounds_[cluster_id];
+    bounds.literal_num = 0;
+    bounds.wildcard_num = 0;
+    bounds.first_symbol = pattern_len > 0 ? symbols[0] : WILDCARD_SYMBOL;
+    bounds.last_symbol = pattern_len > 0 ? symbols[pattern_len - 1] : WILDCARD_SYMBOL;
+    bounds.has_literal_star = false;
+    std::vector<uint16_t> bigram_table;
+
+    for (int i = 0; i < pattern_len; i++) {
+        if (symbols[i] == WILDCARD_SYMBOL) {
+            bounds.wildcard_num++;
+            continue;
+        }
+        bounds.literal_num++;
+        if (symbols[i] == '*') bounds.has_literal_star = true;
+        if (i > 0 && symbols[i - 1] != WILDCARD_SYMBOL) {
+            bigram_table.push_back(static_cast<uint16_t>((SymbolBucket(symbols[i - 1]) << 8) |
+                                                         SymbolBucket(symbols[i])));
+        }
+    }
+    std::sort(bigram_table.begin(), bigram_table.end());
+
+    int bigram_num = static_cast<int>(bigram_table.size());
+    if (bigram_num > bigram_capacities_[cluster_id]) {
+        bigram_tables_[cluster_id] = pattern_arena_.AllocateArray<uint16_t>(bigram_num);
+        bigram_capacities_[cluster_id] = bigram_num;
+    }
+    std::copy(bigram_table.begin(), bigram_table.end(), bigram_tables_[cluster_id]);
+    bigram_nums_[cluster_id] = bigram_num;
+}
+
+int PBC_Train::CommonBigramCount(const uint16_t* bigram_table1, int bigram_num1,
+                                 const uint16_t* bigram_table2, int bigram_num2) {
+    int common = 0;
+    int i = 0, j = 0;
+    while (i < bigram_num1 && j < bigram_num2) {
+        if (bigram_table1[i] < bigram_table2[j]) {
+            i++;
+        } else if (bigram_table1[i] > bigram_table2[j]) {
+            j++;
+        } else {
+            common++;
+            i++;
+            j++;
+        }
+    }
+    return common;
+}
+
+bool PBC_Train::PruneByLowerBounds(int cluster_id1, int cluster_id2, int threshold,
+                                   PruneCounts& prune_counts) const {
+    const PatternBounds& pattern_a = pattern_bounds_[cluster_id1];
+    const PatternBounds& pattern_b = pattern_bounds_[cluster_id2];
+    MergeWeights weights = GetMergeWeights(cluster_id1, cluster_id2);
+    int64_t run_cost = static_cast<int64_t>(weights.wildcard_a) + weights.wildcard_b;
+    int64_t aligned_cost = static_cast<int64_t>(weights.symbol_a) + weights.symbol_b;
+
+    // Every path of the dp pays (wildcard_a + wildcard_b) for each filling run, symbol for each
+    // literal symbol left in a filling run and -wildcard for each wildcard, so its cost equals
+    //   base + run_cost * runs - aligned_cost * aligned
+    // where aligned is the number of symbols merged into the pattern. The bounds below bound
+    // runs from below and aligned from above. The dp may align an escaped '*' of a with a
+    // wildcard of b, which breaks this equation, so such pairs are never pruned.
+    bool aligned_bounds = !(pattern_a.has_literal_star && pattern_b.wildcard_num > 0);
+    int64_t base = static_cast<int64_t>(weights.symbol_a) * pattern_a.literal_num -
+                   static_cast<int64_t>(weights.wildcard_a) * pattern_a.wildcard_num +
+                   static_cast<int64_t>(weights.symbol_b) * pattern_b.literal_num -
+                   static_cast<int64_t>(weights.wildcard_b) * pattern_b.wildcard_num;
+    int64_t max_aligned = std::min(pattern_a.literal_num, pattern_b.literal_num);
+    // a filling run exists unless the two patterns are aligned completely
+    int64_t min_runs = (pattern_a.literal_num != pattern_b.literal_num ||
+                        pattern_a.wildcard_num > 0 || pattern_b.wildcard_num > 0)
+                           ? 1
+                           : 0;
+    // nothing aligned means the whole pair is a single filling run
+    int64_t min_cost =
+        max_aligned == 0 ? run_cost : run_cost * min_runs - aligned_cost * max_aligned;
+
+    if (aligned_bounds && (lower_bounds_ & LOWER_BOUND_LENGTH) && base + min_cost >= threshold) {
+        prune_counts.lower_bound_hits[0]++;
+        return true;
+    }
+
+    // a pair whose first (last) symbols can not be aligned must start (end) with a filling run
+    int64_t anchor_runs = 0;
+    if (aligned_bounds && max_aligned > 0 &&
+        (lower_bounds_ & (LOWER_BOUND_ANCHOR | LOWER_BOUND_BIGRAM))) {
+        anchor_runs =
+            (pattern_a.first_symbol == WILDCARD_SYMBOL ||
+             pattern_a.first_symbol != pattern_b.first_symbol) +
+            (pattern_a.last_symbol == WILDCARD_SYMBOL ||
+             pattern_a.last_symbol != pattern_b.last_symbol);
+        min_runs = std::max(min_runs, anchor_runs);
+        min_cost = run_cost * min_runs - aligned_cost * max_aligned;
+        if ((lower_bounds_ & LOWER_BOUND_ANCHOR) && base + min_cost >= threshold) {
+            prune_counts.lower_bound_hits[1]++;
+            return true;
+        }
+    }
+
+    // an aligned symbol is a literal of both patterns, so at most as many symbols are aligned as
+    // the 1-gram tables share
+    if (aligned_bounds && max_aligned > 0 && (lower_bounds_ & LOWER_BOUND_ONE_GRAM)) {
+        max_aligned = std::min<int64_t>(max_aligned,
+                                        OneGramTable::CommonCount(one_gram_tables_[cluster_id1],
+                                                                  one_gram_tables_[cluster_id2]));
+        min_cost =
+            max_aligned == 0 ? run_cost : run_cost * min_runs - aligned_cost * max_aligned;
+        if (base + min_cost >= threshold) {
+            prune_counts.lower_bound_hits[2]++;
+            return true;
+        }
+    }
+
+    // each aligned segment of length l uses l - 1 bigrams present in both patterns and there are
+    // at most (runs + 1 - anchor_runs) segments, so
+    // aligned <= common_bigram + runs + 1 - anchor_runs
+    if (aligned_bounds && max_aligned > 0 && (lower_bounds_ & LOWER_BOUND_BIGRAM)) {
+        int64_t common_bigram =
+            CommonBigramCount(bigram_tables_[cluster_id1], bigram_nums_[cluster_id1],
+                              bigram_tables_[cluster_id2], bigram_nums_[cluster_id2]);
+        // a run costing less than an aligned symbol pays for itself until aligned reaches
+        // max_aligned, otherwise the fewest runs are the cheapest
+        int64_t runs = min_runs;
+        if (run_cost < aligned_cost) {
+            runs = std::max(runs, max_aligned + anchor_runs - 1 - common_bigram);
+        }
+        min_cost = run_cost * runs -
+                   aligned_cost * std::min(max_aligned, common_bigram + runs + 1 - anchor_runs);
+        if (base + min_cost >= threshold) {
+            prune_counts.lower_bound_hits[3]++;
+            return true;
+        }
+    }
+    prune_counts.dp_num++;
+    return false;
 }
 
-int PBC_Train::GetMinEncodingLengthMultiThreads(int cluster_id1, int cluster_id2) {
-    // caculate the the number of common chars
-    int value_common = 0;
-    for (int k = 0; k < symbol_size_; k++) {
-        value_common = value_common + std::min(pattern_infos_[cluster_id1].one_gram_table[k],
-                                               pattern_infos_[cluster_id2].one_gram_table[k]);
+void PBC_Train::AddCounts(PruneCounts& result, const PruneCounts& partial) {
+    for (int i = 0; i < 4; i++) {
+        result.lower_bound_hits[i] += partial.lower_bound_hits[i];
     }
+    result.dp_num += partial.dp_num;
+}
 
-    if (((pattern_infos_[cluster_id1].char_freq - value_common) *
-             pattern_infos_[cluster_id1].record_num +
-         (pattern_infos_[cluster_id2].char_freq - value_common) *
-             pattern_infos_[cluster_id2].record_num) >= pattern_infos_[cluster_id1].thresholds) {
+void PBC_Train::AddPruneCounts(const PruneCounts& prune_counts) {
+    for (int i = 0; i < 4; i++) {
+        lower_bound_hits_[i] += prune_counts.lower_bound_hits[i];
+    }
+    dp_num_ += prune_counts.dp_num;
+}
+
+int PBC_Train::GetMinEncodingLength(int cluster_id1, int cluster_id2, int threshold,
+                                    PruneCounts& prune_counts) const {
+    if (PruneByLowerBounds(cluster_id1, cluster_id2, threshold, prune_counts)) {
+        return INT_MAX;
+    }
+    MemoryGuard dp_guard(dp_gate_.get(), DpWorkspaceBytes(pattern_lens_[cluster_id1],
+                                                          pattern_lens_[cluster_id2]));
+    return MinEncodingLength(
+        patterns_[cluster_id1], patterns_[cluster_id2],
+        pattern_lens_[cluster_id1], pattern_lens_[cluster_id2],
+        GetMergeWeights(cluster_id1, cluster_id2), threshold);
+}
+
+int PBC_Train::GetMinEncodingLengthMultiThreads(int cluster_id1, int cluster_id2,
+                                                PruneCounts& prune_counts) {
+    if (PruneByLowerBounds(cluster_id1, cluster_id2,
+                           LoadCandidateThreshold(cluster_id1, cluster_id2), prune_counts)) {
         return INT_MAX;
     }
-    int min_encoding_length = MinEncodingLengthMultiThreads(
-        pattern_infos_[cluster_id1].pattern_buffer, pattern_infos_[cluster_id2].pattern_buffer,
-        pattern_infos_[cluster_id1].pattern_len, pattern_infos_[cluster_id2].pattern_len,
-        pattern_infos_[cluster_id1].record_num, pattern_infos_[cluster_id2].record_num,
-        cluster_id1);
-    if (min_encoding_length < pattern_infos_[cluster_id1].thresholds) {
-        pattern_infos_[cluster_id1].thresholds = min_encoding_length;
+    int min_encoding_length;
+    {
+        MemoryGuard dp_guard(dp_gate_.get(), DpWorkspaceBytes(pattern_lens_[cluster_id1],
+                                                              pattern_lens_[cluster_id2]));
+        min_encoding_length = MinEncodingLengthMultiThreads(
+            patterns_[cluster_id1], patterns_[cluster_id2],
+            pattern_lens_[cluster_id1], pattern_lens_[cluster_id2],
+            GetMergeWeights(cluster_id1, cluster_id2), cluster_id1, cluster_id2);
+    }
+    if (min_encoding_length < LoadCandidateThreshold(cluster_id1, cluster_id2)) {
+        std::lock_guard<std::mutex> lock(candidate_mutexes_[cluster_id1]);
+        InsertCandidate(cluster_id1, min_encoding_length, cluster_id2);
+        thresholds_[cluster_id1] =
+            PackCandidateBound(candidate_bounds_[cluster_id1]);
     }
     return min_encoding_length;
 }
 
+bool PBC_Train::IsCandidateValid(const Candidate& candidate) const {
+    return cluster_ids_[candidate.key] == candidate.key &&
+           epochs_[candidate.key] == candidate.epoch;
+}
+
+void PBC_Train::InsertCandidate(int cluster_id, int value, int key) {
+    MinValueKey& bound = candidate_bounds_[cluster_id];
+    if (value == INT_MAX || CandidateLess(bound.value, bound.key, value, key)) {
+        return;
+    }
+    Candidate* candidates = CandidateList(cluster_id);
+    int& candidate_count = candidate_counts_[cluster_id];
+    // move the candidates not less than the new one back, the last one of a full list drops out
+    int pos = std::min(candidate_count, candidate_num_ - 1);
+    while (pos > 0 &&
+           !CandidateLess(candidates[pos - 1].value, candidates[pos - 1].key, value, key)) {
+        candidates[pos] = candidates[pos - 1];
+        pos--;
+    }
+    candidates[pos] = {value, key, epochs_[key]};
+    if (candidate_count < candidate_num_) {
+        candidate_count++;
+    }
+    // candidates rejected from a full list are greater than its last candidate
+    if (candidate_count == candidate_num_) {
+        bound = {candidates[candidate_count - 1].value, candidates[candidate_count - 1].key};
+    }
+}
+
+int PBC_Train::CandidateThreshold(const MinValueKey& bound, int key) {
+    if (bound.value == INT_MAX) {
+        return INT_MAX;
+    }
+    // a candidate equal to the bound value still enters the list if its key is not greater
+    return key <= bound.key ? bound.value + 1 : bound.value;
+}
+
+int PBC_Train::LoadCandidateThreshold(int cluster_id, int key) const {
+    int64_t bound = thresholds_[cluster_id].load();
+    return CandidateThreshold(
+        {static_cast<int>(bound >> 32), static_cast<int>(bound & 0xffffffff)}, key);
+}
+
 PBC_Train::MinValueKey PBC_Train::GetMinValue(int cluster_id, bool skip_non_original_cluster) {
     MinValueKey result = {INT_MAX, -1};
-    int min_value = INT_MAX;
+    candidate_counts_[cluster_id] = 0;
+    candidate_bounds_[cluster_id] = {INT_MAX, INT_MAX};
     if (thread_num_ > 0) {
-        pattern_infos_[cluster_id].thresholds = INT_MAX;
-        std::vector<std::future<int>> min_encoding_length(all_pattern_num_);
-        for (int j = cluster_id + 1; j < all_pattern_num_; j++) {
-            if (skip_non_original_cluster && pattern_infos_[j].cluster_id != j) {
-                continue;
-            }
-            min_encoding_length[j] = thread_pool2_->SubmitTask(
-                &PBC_Train::GetMinEncodingLengthMultiThreads, this, cluster_id, j);
-        }
-
-        // wait min_encoding_length task finished and get the min value
-        for (int j = cluster_id + 1; j < all_pattern_num_; j++) {
-            if (skip_non_original_cluster && pattern_infos_[j].cluster_id != j) {
-                continue;
-            }
-
-            int value = min_encoding_length[j].get();
-            if (value < min_value) {
-                result.value = value;
-                result.key = j;
-                min_value = value;
-            }
-        }
+        thresholds_[cluster_id] = PackCandidateBound({INT_MAX, INT_MAX});
+        PruneCounts prune_counts = scheduler_->ParallelReduce(
+            cluster_id + 1, all_pattern_num_, PAIR_GRAIN_SIZE, PruneCounts(),
+            [this, cluster_id, skip_non_original_cluster](int chunk_begin, int chunk_end,
+                                                          PruneCounts& partial) {
+                for (int j = chunk_begin; j < chunk_end; j++) {
+                    if (skip_non_original_cluster && cluster_ids_[j] != j) {
+                        continue;
+                    }
+                    GetMinEncodingLengthMultiThreads(cluster_id, j, partial);
+                }
+            },
+            AddCounts);
+        AddPruneCounts(prune_counts);
     } else {
+        PruneCounts prune_counts;
         for (int j = cluster_id + 1; j < all_pattern_num_; j++) {
-            if (skip_non_original_cluster && pattern_infos_[j].cluster_id != j) {
+            if (skip_non_original_cluster && cluster_ids_[j] != j) {
                 continue;
             }
 
-            int value = GetMinEncodingLength(cluster_id, j, min_value);
-
-            if (value < min_value) {
-                result.value = value;
-                result.key = j;
-                min_value = value;
-            }
+            int value = GetMinEncodingLength(
+                cluster_id, j, CandidateThreshold(candidate_bounds_[cluster_id], j), prune_counts);
+            InsertCandidate(cluster_id, value, j);
         }
+        AddPruneCounts(prune_counts);
+    }
+    if (candidate_counts_[cluster_id] > 0) {
+        result.value = CandidateList(cluster_id)[0].value;
+        result.key = CandidateList(cluster_id)[0].key;
     }
     return result;
 }
 
-void PBC_Train::ComputeTotalMinValueTable() {
+bool PBC_Train::ComputeTotalMinValueTable() {
     PBC_LOG(INFO) << "------------ compute minimal encoding length ------------" << std::endl;
     PBC_LOG(INFO) << "init pattern count:" << all_pattern_num_ << std::endl;
     PBC_LOG(INFO) << "---------------------------------------------------------" << std::endl
@@ -598,61 +1275,144 @@ void PBC_Train::ComputeTotalMinValueTable() {
 
     int per_num = all_pattern_num_ >= 100 ? all_pattern_num_ / 100 : 1;
     if (thread_num_ > 0) {
-        std::vector<std::future<MinValueKey>> min_value_futures;
-        for (int i = 0; i < all_pattern_num_ - 1; i++) {
-            min_value_futures.push_back(
-                thread_pool_->SubmitTask(&PBC_Train::GetMinValue, this, i, false));
-        }
-        // wait all tasks finished
-        for (int i = 0; i < all_pattern_num_ - 1; i++) {
-            if (i % per_num == 0) {
-                PBC_LOG(DETAIL) << "current compute MEL progress: " << i << "/" << all_pattern_num_
-                                << std::endl;
+        std::vector<std::mutex>(all_pattern_num_).swap(candidate_mutexes_);
+        std::atomic<int> finished_num(0);
+        scheduler_->ParallelFor(0, all_pattern_num_ - 1, 1, [this, per_num, &finished_num](int i) {
+            if (DeadlineReached()) {
+                return;
             }
-            pattern_infos_[i].min_value_key = min_value_futures[i].get();
-        }
+            min_value_keys_[i] = GetMinValue(i, false);
+            int finished = finished_num++;
+            if (finished % per_num == 0) {
+                PBC_LOG(DETAIL) << "current compute MEL progress: " << finished << "/"
+                                << all_pattern_num_ << std::endl;
+            }
+        });
     } else {
         for (int i = 0; i < all_pattern_num_ - 1; i++) {
             if (i % per_num == 0) {
                 PBC_LOG(DETAIL) << "current compute MEL progress: " << i << "/" << all_pattern_num_
                                 << std::endl;
             }
-            pattern_infos_[i].min_value_key = GetMinValue(i, false);
+            if (DeadlineReached()) {
+                return false;
+            }
+            min_value_keys_[i] = GetMinValue(i, false);
         }
     }
+    // a skipped task leaves the deadline passed
+    if (DeadlineReached()) {
+        return false;
+    }
+
+    min_value_heap_.Reset(all_pattern_num_);
+    round_touched_.assign(all_pattern_num_, false);
+    for (int i = 0; i < all_pattern_num_ - 1; i++) {
+        min_value_heap_.Update(i, min_value_keys_[i].value);
+    }
+    return true;
 }
 
 void PBC_Train::GetClosestCluster(int& cluster_id1, int& cluster_id2) const {
     cluster_id1 = cluster_id2 = -1;
-    int cur_min_value = INT_MAX;
-    for (int i = 0; i < all_pattern_num_ - 1; i++) {
-        if (pattern_infos_[i].cluster_id != i) continue;
-        if (pattern_infos_[i].min_value_key.value < cur_min_value) {
-            cluster_id1 = i;
-            cluster_id2 = pattern_infos_[i].min_value_key.key;
-            cur_min_value = pattern_infos_[i].min_value_key.value;
+    int cluster_id, min_value;
+    // clusters without any cluster behind them keep INT_MAX and are never chosen
+    if (min_value_heap_.Top(cluster_id, min_value) && min_value < INT_MAX) {
+        cluster_id1 = cluster_id;
+        cluster_id2 = min_value_keys_[cluster_id].key;
+    }
+}
+
+void PBC_Train::GetReciprocalClusters(int max_pair_num,
+                                      std::vector<std::pair<int, int>>& merge_pairs) {
+    std::vector<int> popped_cluster_ids;
+    int cluster_id, value;
+    // the first pair is the greedy choice, later pairs may cost at most (1 + merge_tolerance_)
+    // times as much
+    double max_value = 0;
+    PruneCounts prune_counts;
+    while (static_cast<int>(merge_pairs.size()) < max_pair_num &&
+           min_value_heap_.Top(cluster_id, value) && value < INT_MAX) {
+        if (popped_cluster_ids.empty()) {
+            max_value = value + std::abs(static_cast<double>(value)) * merge_tolerance_;
+        } else if (value > max_value) {
+            break;
         }
+        min_value_heap_.Erase(cluster_id);
+        int partner_id = min_value_keys_[cluster_id].key;
+        // The pair is the nearest one of cluster_id among the clusters behind it. A cluster in
+        // front of cluster_id or partner_id that is at most value away from it has a min value of
+        // at most value as well, so it was popped before and is checked here.
+        bool reciprocal = !round_touched_[cluster_id] && !round_touched_[partner_id];
+        for (size_t i = 0; reciprocal && i < popped_cluster_ids.size(); i++) {
+            int popped_id = popped_cluster_ids[i];
+            for (int pair_id : {cluster_id, partner_id}) {
+                if (GetMinEncodingLength(std::min(popped_id, pair_id), std::max(popped_id, pair_id),
+                                         value + 1, prune_counts) <= value) {
+                    reciprocal = false;
+                    break;
+                }
+            }
+        }
+        if (reciprocal) {
+            merge_pairs.push_back(std::make_pair(cluster_id, partner_id));
+        }
+        popped_cluster_ids.push_back(cluster_id);
+        round_touched_[cluster_id] = round_touched_[partner_id] = true;
+    }
+    AddPruneCounts(prune_counts);
+    for (int popped_cluster_id : popped_cluster_ids) {
+        round_touched_[popped_cluster_id] = false;
+        round_touched_[min_value_keys_[popped_cluster_id].key] = false;
+        min_value_heap_.Update(popped_cluster_id,
+                               min_value_keys_[popped_cluster_id].value);
     }
 }
 
-void PBC_Train::UpdateMinValueTable(int cluster_id, int changed_cluster_id1,
-                                    int changed_cluster_id2) {
+bool PBC_Train::UpdateMinValueTable(int cluster_id, const std::vector<int>& changed_cluster_ids,
+                                    PruneCounts& prune_counts) {
+    Candidate* candidates = CandidateList(cluster_id);
+    MinValueKey& min_value_key = min_value_keys_[cluster_id];
+    Candidate* candidates_end = std::remove_if(
+        candidates, candidates + candidate_counts_[cluster_id],
+        [this](const Candidate& candidate) { return !IsCandidateValid(candidate); });
+    candidate_counts_[cluster_id] = static_cast<int>(candidates_end - candidates);
+
+    int best_key = min_value_key.key;
+    bool best_changed =
+        best_key >= 0 &&
+        (cluster_ids_[best_key] != best_key ||
+         std::binary_search(changed_cluster_ids.begin(), changed_cluster_ids.end(), best_key));
+    bool updated = false;
+    auto it = std::upper_bound(changed_cluster_ids.begin(), changed_cluster_ids.end(), cluster_id);
+    for (; it != changed_cluster_ids.end(); it++) {
+        // the merged cluster is evaluated against the candidate bound rather than the min value,
+        // so that it can take the place of a stale candidate
+        int value = GetMinEncodingLength(
+            cluster_id, *it, CandidateThreshold(candidate_bounds_[cluster_id], *it), prune_counts);
+        InsertCandidate(cluster_id, value, *it);
+        if (!best_changed && value < min_value_key.value) {
+            min_value_key.value = value;
+            min_value_key.key = *it;
+            updated = true;
+        }
+    }
     // only update when the cluster cluster_id and its corresponding cluster with minimal EL is a
     // merged cluster
-    if (pattern_infos_[cluster_id].min_value_key.key == changed_cluster_id1 ||
-        pattern_infos_[cluster_id].min_value_key.key == changed_cluster_id2) {
-        pattern_infos_[cluster_id].min_value_key =
-            GetMinValue(cluster_id, /*skip_non_original_cluster=*/true);
+    if (!best_changed) {
+        return updated;
+    }
+    if (candidate_counts_[cluster_id] > 0) {
+        min_value_key.value = candidates[0].value;
+        min_value_key.key = candidates[0].key;
+    } else if (candidate_bounds_[cluster_id].value == INT_MAX) {
+        // the candidate list held every cluster behind cluster_id and all of them are merged
+        min_value_key = {INT_MAX, -1};
     } else {
-        if (cluster_id < changed_cluster_id1) {
-            int value = GetMinEncodingLength(cluster_id, changed_cluster_id1,
-                                             pattern_infos_[cluster_id].min_value_key.value);
-            if (value < pattern_infos_[cluster_id].min_value_key.value) {
-                pattern_infos_[cluster_id].min_value_key.value = value;
-                pattern_infos_[cluster_id].min_value_key.key = changed_cluster_id1;
-            }
-        }
+        rescan_num_++;
+        min_value_key = GetMinValue(cluster_id, /*skip_non_original_cluster=*/true);
     }
+    return true;
 }
 
 bool PBC_Train::CreateSecondaryEncoderData(char* pattern_buffer, int64_t& pattern_len) {
@@ -672,48 +1432,111 @@ bool PBC_Train::CreateSecondaryEncoderData(char* pattern_buffer, int64_t& patter
     return false;
 }
 
-bool PBC_Train::CreateFseTableUsingCompressedData(char* pattern_buffer, int64_t& pattern_len) {
-    std::vector<string> compressed_vec;
-    std::vector<int> compressed_len_vec;
-    PBC::PBC_Compress* pbc_compress = new PBC_ONLY_Compress(symbol_size_, buffer_size_);
-    pbc_compress->ReadData(pattern_buffer, pattern_len);
-
+int32_t PBC_Train::LocateRecords(const char* buffer, int64_t len, int data_type,
+                                 std::vector<int64_t>& record_positions,
+                                 std::vector<int32_t>& record_lens) {
+    // like ReadPatternFromDataBuffer, skipping empty records
+    int32_t max_record_len = 0;
     int64_t data_pos = 0;
-    int64_t each_input_data_len = 0;
-
-    char* each_input_data = new char[len_];
-    char* compressed_data = new char[len_];
-    char* train_data = new char[len_ + 30000];
-    uint train_data_offset = 0;
+    while (data_pos < len) {
+        int64_t record_pos = data_pos;
+        int32_t record_len = 0;
+        if (data_type == TYPE_VARCHAR) {
+            pbc_memcpy(&record_len, buffer + data_pos, sizeof(int32_t));
+            record_pos += sizeof(int32_t);
+            data_pos = record_pos + record_len;
+        } else {
+            while (record_pos + record_len < len && buffer[record_pos + record_len] != '\n') {
+                record_len++;
+            }
+            data_pos = record_pos + record_len + 1;
+        }
+        if (record_len > 0) {
+            record_positions.push_back(record_pos);
+            record_lens.push_back(record_len);
+            max_record_len = std::max(max_record_len, record_len);
+        }
+    }
+    return max_record_len;
+}
 
-    do {
-        each_input_data_len =
-            ReadPatternFromDataBuffer(data_pos, len_, data_buffer_, each_input_data, data_type_);
-        if (each_input_data_len == 0) {
-            continue;
+bool PBC_Train::CompressSamples(const char* pattern_buffer, int64_t pattern_len,
+                                std::vector<char>& samples, std::vector<size_t>& sample_offsets) {
+    std::vector<int64_t> record_positions;
+    std::vector<int32_t> record_lens;
+    int32_t max_record_len =
+        LocateRecords(data_buffer_, len_, data_type_, record_positions, record_lens);
+
+    // Every block of records is compressed once by its own pbc_only object into its own buffer.
+    // The output lengths give sample_offsets, then each block is copied to its offset in samples.
+    int record_num = static_cast<int>(record_lens.size());
+    int block_num = thread_num_ > 0 ? static_cast<int>(scheduler_->ThreadNum()) : 1;
+    block_num = std::max(std::min(block_num, record_num), 1);
+    std::vector<std::vector<char>> block_samples(block_num);
+    sample_offsets.assign(record_num + 1, 0);
+    std::atomic<bool> failed(false);
+    auto compress_block = [&](int block) {
+        int begin = static_cast<int64_t>(record_num) * block / block_num;
+        int end = static_cast<int64_t>(record_num) * (block + 1) / block_num;
+        PBC_ONLY_Compress pbc_compress(symbol_size_, buffer_size_);
+        if (!pbc_compress.ReadData(pattern_buffer, pattern_len)) {
+            failed = true;
+            return;
         }
-        size_t compress_result = pbc_compress->CompressUsingPattern(
-            each_input_data, each_input_data_len, compressed_data);
-        if (!PBC::PBC_isError(compress_result)) {
-            pbc_memcpy(train_data + train_data_offset, compressed_data, compress_result);
-            train_data_offset += compress_result;
-        } else {
-            PBC_LOG(ERROR) << "Compress failed when CreateFseTableUsingCompressedData."
-                           << std::endl;
-            return false;
+        // the output of a record is less than 3 times its length
+        std::vector<char> compressed_data(3 * static_cast<size_t>(max_record_len) + 16);
+        for (int i = begin; i < end && !failed; i++) {
+            size_t compress_result = pbc_compress.CompressUsingPattern(
+                data_buffer_ + record_positions[i], record_lens[i], compressed_data.data());
+            if (PBC::PBC_isError(compress_result)) {
+                failed = true;
+                return;
+            }
+            block_samples[block].insert(block_samples[block].end(), compressed_data.data(),
+                                        compressed_data.data() + compress_result);
+            sample_offsets[i + 1] = compress_result;
         }
-    } while (data_pos < len_);
+    };
+    if (thread_num_ > 0) {
+        scheduler_->ParallelFor(0, block_num, 1, compress_block);
+    } else {
+        compress_block(0);
+    }
+    if (failed) {
+        return false;
+    }
+
+    std::partial_sum(sample_offsets.begin(), sample_offsets.end(), sample_offsets.begin());
+    samples.resize(sample_offsets[record_num]);
+    for (int block = 0; block < block_num; block++) {
+        int begin = static_cast<int64_t>(record_num) * block / block_num;
+        if (!block_samples[block].empty()) {
+            pbc_memcpy(samples.data() + sample_offsets[begin], block_samples[block].data(),
+                       block_samples[block].size());
+        }
+    }
+    return true;
+}
+
+bool PBC_Train::CreateFseTableUsingCompressedData(char* pattern_buffer, int64_t& pattern_len) {
+    std::vector<char> train_data;
+    std::vector<size_t> sample_offsets;
+    if (!CompressSamples(pattern_buffer, pattern_len, train_data, sample_offsets)) {
+        PBC_LOG(ERROR) << "Compress failed when CreateFseTableUsingCompressedData." << std::endl;
+        return false;
+    }
 
     for (int i = 0; i < symbol_size_; i++) {
-        train_data[train_data_offset++] = (unsigned char)i;
+        train_data.push_back(static_cast<char>(i));
     }
+    uint train_data_offset = train_data.size();
 
     uint32_t fse_max = symbol_size_;
     uint32_t fse_tableLog = 12;
     int16_t fse_normTable[symbol_size_];
 
     unsigned int* fse_countTable = new unsigned int[fse_max + 1];
-    PBC_HIST_count(fse_countTable, &fse_max, train_data, train_data_offset);
+    PBC_HIST_count(fse_countTable, &fse_max, train_data.data(), train_data_offset);
     fse_tableLog = PBC_FSE_optimalTableLog(fse_tableLog, train_data_offset, fse_max);
     PBC_FSE_normalizeCount(fse_normTable, fse_tableLog, fse_countTable, train_data_offset, fse_max);
 
@@ -724,61 +1547,29 @@ bool PBC_Train::CreateFseTableUsingCompressedData(char* pattern_buffer, int64_t&
 
     pattern_buffer[pattern_len] = 0;
 
-    delete pbc_compress;
-    delete[] train_data;
-    delete[] each_input_data;
-    delete[] compressed_data;
     delete[] fse_countTable;
     return true;
 }
 
 bool PBC_Train::CreateFsstTableUsingCompressedData(char* pattern_buffer, int64_t& pattern_len) {
+    std::vector<char> samples;
+    std::vector<size_t> sample_offsets;
+    if (!CompressSamples(pattern_buffer, pattern_len, samples, sample_offsets)) {
+        PBC_LOG(ERROR) << "Compress failed when CreateFsstTableUsingCompressedData." << std::endl;
+        return false;
+    }
     PBC_FSST_Compress* pbc_fsst_compress = new PBC_FSST_Compress(symbol_size_, buffer_size_);
     pbc_fsst_compress->ReadData(pattern_buffer, pattern_len);
 
-    std::vector<string> compressed_vec;
-    std::vector<int> compressed_len_vec;
-    PBC::PBC_Compress* pbc_compress = new PBC_ONLY_Compress(symbol_size_, buffer_size_);
-    pbc_compress->ReadData(pattern_buffer, pattern_len);
-
-    int64_t data_pos = 0;
-    int64_t each_input_data_len = 0;
-
-    char* each_input_data = new char[len_];
-    char* compressed_data = new char[len_];
-
-    do {
-        each_input_data_len =
-            ReadPatternFromDataBuffer(data_pos, len_, data_buffer_, each_input_data, data_type_);
-        if (each_input_data_len == 0) {
-            continue;
-        }
-        size_t compress_result = pbc_compress->CompressUsingPattern(
-            each_input_data, each_input_data_len, compressed_data);
-        if (!PBC::PBC_isError(compress_result)) {
-            std::string compress_str(compressed_data, compress_result);
-            compressed_vec.push_back(compress_str);
-            compressed_len_vec.push_back(compress_result);
-        } else {
-            PBC_LOG(ERROR) << "Compress failed when CreateFsstTableUsingCompressedData."
-                           << std::endl;
-            return false;
-        }
-
-    } while (data_pos < len_);
-
-    std::vector<uint64_t> rowLens, compressedRowLens;
-    std::vector<unsigned char*> rowPtrs, compressedRowPtrs;
-    rowLens.reserve(compressed_vec.size());
-    compressedRowLens.resize(compressed_vec.size());
-    rowPtrs.reserve(compressed_vec.size());
-    compressedRowPtrs.resize(compressed_vec.size() + 1);
-    for (auto& d : compressed_vec) {
-        rowLens.push_back(d.size());
-        rowPtrs.push_back(reinterpret_cast<unsigned char*>(const_cast<char*>(d.data())));
+    size_t samples_num = sample_offsets.size() - 1;
+    std::vector<uint64_t> rowLens(samples_num);
+    std::vector<unsigned char*> rowPtrs(samples_num);
+    for (size_t i = 0; i < samples_num; i++) {
+        rowLens[i] = sample_offsets[i + 1] - sample_offsets[i];
+        rowPtrs[i] = reinterpret_cast<unsigned char*>(samples.data() + sample_offsets[i]);
     }
 
-    auto enc = (pbc_fsst_create(compressed_vec.size(), rowLens.data(), rowPtrs.data(), false));
+    auto enc = (pbc_fsst_create(samples_num, rowLens.data(), rowPtrs.data(), false));
     char* fsst_encoder_buffer = nullptr;
     auto cBSize = pbc_fsst_compress->serializeEncoder(enc, &fsst_encoder_buffer);
     pbc_memcpy(pattern_buffer + pattern_len, fsst_encoder_buffer, cBSize);
@@ -786,180 +1577,894 @@ bool PBC_Train::CreateFsstTableUsingCompressedData(char* pattern_buffer, int64_t
     pattern_buffer[pattern_len] = 0;
 
     delete pbc_fsst_compress;
-    delete pbc_compress;
-    delete[] each_input_data;
-    delete[] compressed_data;
     delete[] fsst_encoder_buffer;
     return true;
 }
 
 bool PBC_Train::CreateZstdDictUsingCompressedData(char* pattern_buffer, int64_t& pattern_len) {
-    std::vector<string> compressed_vec;
-    std::vector<size_t> compressed_len_vec;
-    PBC::PBC_Compress* pbc_compress = new PBC_ONLY_Compress(symbol_size_, buffer_size_);
-    pbc_compress->ReadData(pattern_buffer, pattern_len);
+    std::vector<char> samples;
+    std::vector<size_t> sample_offsets;
+    if (!CompressSamples(pattern_buffer, pattern_len, samples, sample_offsets)) {
+        PBC_LOG(ERROR) << "Compress failed when CreateZstdDictUsingCompressedData." << std::endl;
+        return false;
+    }
+    size_t samples_num = sample_offsets.size() - 1;
+    std::vector<size_t> samples_len(samples_num);
+    for (size_t i = 0; i < samples_num; i++) {
+        samples_len[i] = sample_offsets[i + 1] - sample_offsets[i];
+    }
 
-    int64_t data_pos = 0;
-    int64_t each_input_data_len = 0, samples_size = 0;
+    char* dict_buffer = new char[DEFAULT_ZSTD_DICT_SIZE * 100];
+    size_t cBSize = ZDICT_trainFromBuffer(dict_buffer, DEFAULT_ZSTD_DICT_SIZE, samples.data(),
+                                          samples_len.data(), samples_num);
 
-    char* each_input_data = new char[len_];
-    char* compressed_data = new char[len_];
+    memcpy(pattern_buffer + pattern_len, dict_buffer, cBSize * sizeof(char));
+    pattern_len += cBSize;
+    pattern_buffer[pattern_len] = 0;
 
-    do {
-        each_input_data_len =
-            ReadPatternFromDataBuffer(data_pos, len_, data_buffer_, each_input_data, data_type_);
-        if (each_input_data_len == 0) {
+    delete[] dict_buffer;
+    return true;
+}
+
+void PBC_Train::MergeCluster(int cluster_id1, int cluster_id2) {
+    std::vector<Symbol> merged;
+    {
+        MemoryGuard dp_guard(dp_gate_.get(), DpWorkspaceBytes(pattern_lens_[cluster_id1],
+                                                              pattern_lens_[cluster_id2]));
+        MergePattern(patterns_[cluster_id1], patterns_[cluster_id2], pattern_lens_[cluster_id1],
+                     pattern_lens_[cluster_id2], GetMergeWeights(cluster_id1, cluster_id2),
+                     merged);
+    }
+
+    if (token_table_ != nullptr) {
+        StorePattern(cluster_id1, merged.data(), merged.size());
+    } else {
+        // merged holds the '\\' of escaped symbols, parse its escaped form back into symbols
+        std::string new_pattern;
+        for (Symbol symbol : merged) {
+            new_pattern.push_back(symbol == WILDCARD_SYMBOL ? '*' : static_cast<char>(symbol));
+        }
+        std::vector<Symbol> new_symbols;
+        ParsePattern(new_pattern.data(), new_pattern.length(), new_symbols);
+        StorePattern(cluster_id1, new_symbols.data(), new_symbols.size());
+    }
+
+    // update one_gram_table_ with the literal symbols of the merged pattern
+    std::vector<int> one_gram(symbol_size_, 0);
+    char_freqs_[cluster_id1] = 0;
+    for (int i = 0; i < pattern_lens_[cluster_id1]; i++) {
+        if (patterns_[cluster_id1][i] != WILDCARD_SYMBOL) {
+            one_gram[SymbolBucket(patterns_[cluster_id1][i])]++;
+            char_freqs_[cluster_id1]++;
+        }
+    }
+    one_gram_tables_[cluster_id1].Build(one_gram.data(), symbol_size_);
+    ComputePatternBounds(cluster_id1);
+    epochs_[cluster_id1]++;
+
+    record_nums_[cluster_id1] = record_nums_[cluster_id1] + record_nums_[cluster_id2];
+}
+
+int64_t PBC_Train::TrainPattern(int k, char** pattern_buffer) {
+    deadline_ = std::chrono::steady_clock::now() +
+                std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                    std::chrono::duration<double>(time_budget_));
+    budget_exceeded_ = false;
+    pattern_size_reports_.clear();
+    selected_pattern_size_ = -1;
+    // the steps before merging keep room for the largest auto size
+    int merge_k = k;
+    if (!auto_pattern_sizes_.empty()) {
+        k = auto_pattern_sizes_.front();
+        merge_k = auto_pattern_sizes_.back();
+    }
+    ComputeMergeCosts();
+    // a resumed state has been through the steps before merging
+    if (!resumed_) {
+        size_candidates_.clear();
+        if (has_base_) {
+            AbsorbByBasePatterns();
+        }
+        if (canonicalize_) {
+            CanonicalizePatterns();
+        }
+        if (train_method_ == TRAIN_PARSE_TREE) {
+            MineTemplates(k);
+        }
+    }
+    if (!FitMemoryBudget()) {
+        return -1;
+    }
+    if (!resumed_ && shard_num_ > 1) {
+        TrainShards(k);
+    }
+    MergeClusters(merge_k);
+    if (dp_gate_ != nullptr) {
+        PBC_LOG(INFO) << "dp workspace peak = " << dp_gate_->PeakBytes()
+                      << " bytes, waits = " << dp_gate_->WaitNum() << std::endl;
+    }
+
+    if (!size_candidates_.empty()) {
+        return SelectPatternSize(pattern_buffer);
+    }
+    std::vector<std::string> trained_patterns;
+    CollectTrainedPatterns(trained_patterns);
+    return WritePatternFile(trained_patterns, pattern_buffer);
+}
+
+void PBC_Train::ComputeMergeCosts() {
+    wildcard_cost_ = 1;
+    symbol_cost_ = 1;
+    if (cost_model_ == COST_UNIT && segment_penalty_ == 0.0) {
+        return;
+    }
+    // the unit costs are a byte each
+    double wildcard_bits = 8.0, symbol_bits = 8.0;
+    if (cost_model_ == COST_ENTROPY) {
+        EstimateEntropyCosts(wildcard_bits, symbol_bits);
+    }
+    wildcard_bits += 8.0 * segment_penalty_;
+    // costs are in 1/COST_SCALE bits, coarser if the cost of all loaded records would not fit an
+    // int
+    int scale = COST_SCALE;
+    for (; scale > 1; scale /= 2) {
+        double max_cost = (symbol_num_ + record_num_) * std::max(wildcard_bits, symbol_bits);
+        if (max_cost * scale < INT_MAX / 4) break;
+    }
+    wildcard_cost_ = std::max(static_cast<int>(std::lround(wildcard_bits * scale)), 1);
+    symbol_cost_ = std::max(static_cast<int>(std::lround(symbol_bits * scale)), 1);
+    PBC_LOG(INFO) << "merge costs: wildcard bits = " << wildcard_bits
+                  << ", symbol bits = " << symbol_bits << ", wildcard cost = " << wildcard_cost_
+                  << ", symbol cost = " << symbol_cost_ << std::endl;
+}
+
+void PBC_Train::EstimateEntropyCosts(double& wildcard_bits, double& symbol_bits) const {
+    // The residuals are mostly the runs CanonicalKey masks, so the varint bytes and residual bytes
+    // of the loaded records are estimated by writing every such run as a residual
+    std::vector<int64_t> record_positions;
+    std::vector<int32_t> record_lens;
+    if (data_buffer_ != nullptr) {
+        LocateRecords(data_buffer_, len_, data_type_, record_positions, record_lens);
+    }
+    std::vector<int64_t> varint_counts(256, 0), residual_counts(256, 0);
+    int64_t byte_num = 0, run_num = 0;
+    std::string record, key;
+    std::vector<std::pair<size_t, size_t>> runs;
+    uint8_t varint[8];
+    for (size_t i = 0; i < record_positions.size(); i++) {
+        record.assign(data_buffer_ + record_positions[i], record_lens[i]);
+        byte_num += record_lens[i];
+        CanonicalKey(record, key, runs);
+        for (const std::pair<size_t, size_t>& run : runs) {
+            int varint_len = 0;
+            WriteVarint(static_cast<uint32_t>(run.second - run.first), varint, varint_len);
+            for (int j = 0; j < varint_len; j++) {
+                varint_counts[varint[j]]++;
+            }
+            for (size_t j = run.first; j < run.second; j++) {
+                residual_counts[static_cast<unsigned char>(record[j])]++;
+            }
+        }
+        run_num += runs.size();
+    }
+    int64_t varint_num = std::accumulate(varint_counts.begin(), varint_counts.end(), int64_t(0));
+    int64_t residual_num =
+        std::accumulate(residual_counts.begin(), residual_counts.end(), int64_t(0));
+
+    // fse and the huffman literals of zstd code both kinds of bytes by one table of their
+    // frequencies, pbc_only stores them as they are and fsst only replaces substrings the
+    // patterns already took out
+    double varint_bits = 8.0, residual_bits = 8.0;
+    if ((compress_method_ == PBC_FSE || compress_method_ == PBC_ZSTD) && residual_num > 0) {
+        varint_bits = 0.0;
+        residual_bits = 0.0;
+        double total = static_cast<double>(varint_num + residual_num);
+        for (int b = 0; b < 256; b++) {
+            if (varint_counts[b] + residual_counts[b] == 0) continue;
+            double bits = -std::log2((varint_counts[b] + residual_counts[b]) / total);
+            varint_bits += bits * varint_counts[b] / varint_num;
+            residual_bits += bits * residual_counts[b] / residual_num;
+        }
+    }
+    // a wildcard takes the varint bytes of a run on average, a token symbol stands for its bytes
+    double varint_len = run_num > 0 ? static_cast<double>(varint_num) / run_num : 1.0;
+    double bytes_per_symbol = symbol_num_ > 0 ? static_cast<double>(byte_num) / symbol_num_ : 1.0;
+    wildcard_bits = varint_bits * varint_len;
+    symbol_bits = residual_bits * bytes_per_symbol;
+}
+
+void PBC_Train::CollectTrainedPatterns(std::vector<std::string>& trained_patterns) const {
+    for (int i = 0; i < all_pattern_num_; i++) {
+        if (cluster_ids_[i] != i) continue;
+        std::string escaped_pattern;
+        SerializePattern(patterns_[i], pattern_lens_[i], escaped_pattern);
+        if (escaped_pattern.size() > 1 && (record_nums_[i] > 1)) {
+            trained_patterns.push_back(std::move(escaped_pattern));
+        }
+    }
+}
+
+int64_t PBC_Train::WritePatternFile(const std::vector<std::string>& trained_patterns,
+                                    char** pattern_buffer) {
+    int64_t buffer_len = 0;
+    int32_t max_pattern_len = 0;
+    // the pattern file keeps the escaped form, base patterns keep their ids
+    std::vector<std::string> escaped_patterns(base_patterns_);
+    escaped_patterns.insert(escaped_patterns.end(), trained_patterns.begin(),
+                            trained_patterns.end());
+    for (const std::string& escaped_pattern : escaped_patterns) {
+        max_pattern_len = max(max_pattern_len, static_cast<int32_t>(escaped_pattern.size()));
+    }
+    if (has_base_ && escaped_patterns.size() > base_patterns_.size()) {
+        // the base pattern number is the id of records the base patterns did not match, a
+        // pattern without literals keeps that id for them
+        escaped_patterns.insert(escaped_patterns.begin() + base_patterns_.size(), "*");
+    }
+    int32_t pattern_num = escaped_patterns.size();
+
+    *pattern_buffer = new char[((max_pattern_len + 1) * pattern_num) + 4096 * 1024 +
+                               base_encoder_data_.size()];
+
+    PBC_LOG(INFO) << "actual pattern num : " << pattern_num << std::endl;
+
+    pbc_memcpy((*pattern_buffer) + buffer_len, &pattern_num, sizeof(int32_t));
+    buffer_len += sizeof(int32_t);
+    for (const std::string& escaped_pattern : escaped_patterns) {
+        int32_t escaped_pattern_len = escaped_pattern.size();
+        pbc_memcpy((*pattern_buffer) + buffer_len, &escaped_pattern_len, sizeof(int32_t));
+        buffer_len += sizeof(int32_t);
+
+        pbc_memcpy((*pattern_buffer) + buffer_len, escaped_pattern.data(), escaped_pattern_len);
+        buffer_len += escaped_pattern_len;
+    }
+
+    if (has_base_) {
+        // data compressed with the base patterns needs their secondary encoder data
+        pbc_memcpy((*pattern_buffer) + buffer_len, base_encoder_data_.data(),
+                   base_encoder_data_.size());
+        buffer_len += base_encoder_data_.size();
+        return buffer_len;
+    }
+    auto CreateSecondaryEncoderData_start_time = std::chrono::steady_clock::now();
+    if (!CreateSecondaryEncoderData((*pattern_buffer), buffer_len)) {
+        return -1;
+    }
+    auto CreateSecondaryEncoderData_end_time = std::chrono::steady_clock::now();
+    double CreateSecondaryEncoderData_time =
+        std::chrono::duration<double>(CreateSecondaryEncoderData_end_time -
+                                      CreateSecondaryEncoderData_start_time)
+            .count();
+    PBC_LOG(INFO) << "CreateSecondaryEncoderData_time=" << CreateSecondaryEncoderData_time << "s."
+                  << std::endl;
+    return buffer_len;
+}
+
+uint64_t PBC_Train::DataFingerprint() const {
+    // FNV-1a over the loaded records and their number
+    const uint64_t prime = 1099511628211ULL;
+    uint64_t fingerprint = 14695981039346656037ULL;
+    for (uint64_t i = 0; i < len_; i++) {
+        fingerprint = (fingerprint ^ static_cast<unsigned char>(data_buffer_[i])) * prime;
+    }
+    return (fingerprint ^ static_cast<uint64_t>(record_num_)) * prime;
+}
+
+int64_t PBC_Train::SerializeCheckpoint(char** checkpoint_buffer) const {
+    // the state exists once the min value table of MergeClusters is complete
+    if (static_cast<int>(cluster_ids_.size()) != all_pattern_num_ ||
+        min_value_heap_.Capacity() != all_pattern_num_) {
+        return -1;
+    }
+    std::string buffer(CHECKPOINT_MAGIC, sizeof(int32_t));
+    AppendValue(buffer, CHECKPOINT_VERSION);
+    AppendValue(buffer, DataFingerprint());
+    AppendValue(buffer, static_cast<int32_t>(symbol_size_));
+    AppendValue(buffer, static_cast<int32_t>(candidate_num_));
+    AppendValue(buffer, static_cast<int32_t>(wildcard_cost_));
+    AppendValue(buffer, static_cast<int32_t>(symbol_cost_));
+    AppendValue(buffer, static_cast<int32_t>(merge_mode_));
+    AppendValue(buffer, merge_tolerance_);
+    AppendValue(buffer, static_cast<int32_t>(lower_bounds_));
+    AppendValue(buffer, static_cast<int32_t>(token_delimiters_.size()));
+    buffer += token_delimiters_;
+
+    // merged clusters only keep what the alive ones refer to
+    AppendValue(buffer, all_pattern_num_);
+    for (int i = 0; i < all_pattern_num_; i++) {
+        AppendValue(buffer, static_cast<int32_t>(cluster_ids_[i]));
+        AppendValue(buffer, static_cast<int32_t>(record_nums_[i]));
+        AppendValue(buffer, static_cast<int32_t>(epochs_[i]));
+        AppendValue(buffer, static_cast<int32_t>(min_value_keys_[i].value));
+        AppendValue(buffer, static_cast<int32_t>(min_value_keys_[i].key));
+        AppendValue(buffer, static_cast<int8_t>(min_value_heap_.Contains(i)));
+        if (cluster_ids_[i] != i) {
             continue;
         }
-        size_t compress_result = pbc_compress->CompressUsingPattern(
-            each_input_data, each_input_data_len, compressed_data);
-        if (!PBC::PBC_isError(compress_result)) {
-            std::string compress_str(compressed_data, compress_result);
-            compressed_vec.push_back(compress_str);
-            compressed_len_vec.push_back(compress_result);
-            samples_size += compress_result;
-        } else {
-            PBC_LOG(ERROR) << "Compress failed when CreateZstdDictUsingCompressedData."
-                           << std::endl;
-            return false;
+        AppendValue(buffer, static_cast<int32_t>(char_freqs_[i]));
+        AppendValue(buffer, static_cast<int32_t>(pattern_lens_[i]));
+        buffer.append(reinterpret_cast<const char*>(patterns_[i]),
+                      pattern_lens_[i] * sizeof(Symbol));
+        one_gram_tables_[i].Serialize(buffer);
+        AppendValue(buffer, static_cast<int32_t>(candidate_bounds_[i].value));
+        AppendValue(buffer, static_cast<int32_t>(candidate_bounds_[i].key));
+        AppendValue(buffer, static_cast<int64_t>(thresholds_[i].load()));
+        AppendValue(buffer, static_cast<int32_t>(candidate_counts_[i]));
+        const Candidate* candidates = &candidates_[static_cast<size_t>(i) * candidate_num_];
+        for (int j = 0; j < candidate_counts_[i]; j++) {
+            AppendValue(buffer, static_cast<int32_t>(candidates[j].value));
+            AppendValue(buffer, static_cast<int32_t>(candidates[j].key));
+            AppendValue(buffer, static_cast<int32_t>(candidates[j].epoch));
         }
+    }
 
-    } while (data_pos < len_);
+    AppendValue(buffer, static_cast<int32_t>(base_record_nums_.size()));
+    for (int record_num : base_record_nums_) {
+        AppendValue(buffer, static_cast<int32_t>(record_num));
+    }
+    AppendValue(buffer, static_cast<int32_t>(size_candidates_.size()));
+    for (const SizeCandidate& candidate : size_candidates_) {
+        AppendValue(buffer, static_cast<int32_t>(candidate.k));
+        AppendValue(buffer, static_cast<int32_t>(candidate.cluster_num));
+        AppendValue(buffer, static_cast<int32_t>(candidate.trained_patterns.size()));
+        for (const std::string& pattern : candidate.trained_patterns) {
+            AppendValue(buffer, static_cast<int32_t>(pattern.size()));
+            buffer += pattern;
+        }
+    }
 
-    char* samples_buffer = new char[samples_size];
-    size_t sb_writer = 0;
-    size_t samples_num = compressed_vec.size();
-    size_t* samples_len = new size_t[samples_num];
-    int actual_num = 0;
+    *checkpoint_buffer = new char[buffer.size()];
+    pbc_memcpy(*checkpoint_buffer, buffer.data(), buffer.size());
+    return buffer.size();
+}
 
-    for (uint i = 0; i < samples_num; i++) {
-        if (compressed_len_vec[i] == 0) continue;
-        memcpy(samples_buffer + sb_writer, &(compressed_vec[i][0]),
-               compressed_len_vec[i] * sizeof(char));
-        sb_writer += compressed_len_vec[i] * sizeof(char);
-        samples_len[actual_num] = compressed_len_vec[i];
-        actual_num++;
+int PBC_Train::LoadCheckpoint(const char* checkpoint_buffer, int64_t len) {
+    int64_t pos = sizeof(int32_t);
+    int32_t version, symbol_size, candidate_num, wildcard_cost, symbol_cost, merge_mode,
+        lower_bounds, delimiters_len, pattern_num;
+    double merge_tolerance;
+    uint64_t fingerprint;
+    if (len < pos || memcmp(checkpoint_buffer, CHECKPOINT_MAGIC, sizeof(int32_t)) != 0 ||
+        !ReadValue(checkpoint_buffer, len, pos, version) || version != CHECKPOINT_VERSION ||
+        !ReadValue(checkpoint_buffer, len, pos, fingerprint) ||
+        !ReadValue(checkpoint_buffer, len, pos, symbol_size) ||
+        !ReadValue(checkpoint_buffer, len, pos, candidate_num) ||
+        !ReadValue(checkpoint_buffer, len, pos, wildcard_cost) ||
+        !ReadValue(checkpoint_buffer, len, pos, symbol_cost) ||
+        !ReadValue(checkpoint_buffer, len, pos, merge_mode) ||
+        !ReadValue(checkpoint_buffer, len, pos, merge_tolerance) ||
+        !ReadValue(checkpoint_buffer, len, pos, lower_bounds) ||
+        !ReadValue(checkpoint_buffer, len, pos, delimiters_len) || delimiters_len < 0 ||
+        pos + delimiters_len > len) {
+        return -1;
+    }
+    std::string delimiters(checkpoint_buffer + pos, delimiters_len);
+    pos += delimiters_len;
+    // the values in the checkpoint were computed with the costs of the cost model
+    ComputeMergeCosts();
+    if (fingerprint != DataFingerprint() || symbol_size != static_cast<int32_t>(symbol_size_) ||
+        candidate_num != candidate_num_ || wildcard_cost != wildcard_cost_ ||
+        symbol_cost != symbol_cost_ || merge_mode != merge_mode_ ||
+        merge_tolerance != merge_tolerance_ || lower_bounds != lower_bounds_ ||
+        delimiters != token_delimiters_) {
+        PBC_LOG(ERROR) << "the checkpoint was written for other records or options" << std::endl;
+        return -1;
+    }
+    if (!ReadValue(checkpoint_buffer, len, pos, pattern_num) || pattern_num < 0) {
+        return -1;
     }
 
-    char* dict_buffer = new char[DEFAULT_ZSTD_DICT_SIZE * 100];
-    size_t cBSize = ZDICT_trainFromBuffer(dict_buffer, DEFAULT_ZSTD_DICT_SIZE, samples_buffer,
-                                          samples_len, actual_num);
+    // read everything before touching the current state
+    std::vector<int> cluster_ids(pattern_num), record_nums(pattern_num), epochs(pattern_num);
+    std::vector<int> char_freqs(pattern_num, 0), candidate_counts(pattern_num, 0);
+    std::vector<MinValueKey> min_value_keys(pattern_num);
+    std::vector<MinValueKey> candidate_bounds(pattern_num, {INT_MAX, INT_MAX});
+    std::vector<int64_t> thresholds(pattern_num, PackCandidateBound({INT_MAX, INT_MAX}));
+    std::vector<int8_t> heap_flags(pattern_num);
+    std::vector<std::vector<Symbol>> symbols(pattern_num);
+    std::vector<OneGramTable> one_gram_tables(pattern_num);
+    std::vector<Candidate> candidates(static_cast<size_t>(pattern_num) * candidate_num_);
+    int alive_num = 0;
+    for (int i = 0; i < pattern_num; i++) {
+        int32_t pattern_len;
+        if (!ReadValue(checkpoint_buffer, len, pos, cluster_ids[i]) ||
+            !ReadValue(checkpoint_buffer, len, pos, record_nums[i]) ||
+            !ReadValue(checkpoint_buffer, len, pos, epochs[i]) ||
+            !ReadValue(checkpoint_buffer, len, pos, min_value_keys[i].value) ||
+            !ReadValue(checkpoint_buffer, len, pos, min_value_keys[i].key) ||
+            !ReadValue(checkpoint_buffer, len, pos, heap_flags[i]) || cluster_ids[i] < 0 ||
+            cluster_ids[i] >= pattern_num || min_value_keys[i].key < -1 ||
+            min_value_keys[i].key >= pattern_num) {
+            return -1;
+        }
+        if (cluster_ids[i] != i) {
+            continue;
+        }
+        alive_num++;
+        if (!ReadValue(checkpoint_buffer, len, pos, char_freqs[i]) ||
+            !ReadValue(checkpoint_buffer, len, pos, pattern_len) || pattern_len < 0 ||
+            pos + static_cast<int64_t>(pattern_len * sizeof(Symbol)) > len) {
+            return -1;
+        }
+        symbols[i].resize(pattern_len);
+        pbc_memcpy(symbols[i].data(), checkpoint_buffer + pos, pattern_len * sizeof(Symbol));
+        pos += pattern_len * sizeof(Symbol);
+        if (!one_gram_tables[i].Deserialize(checkpoint_buffer, len, pos) ||
+            !ReadValue(checkpoint_buffer, len, pos, candidate_bounds[i].value) ||
+            !ReadValue(checkpoint_buffer, len, pos, candidate_bounds[i].key) ||
+            !ReadValue(checkpoint_buffer, len, pos, thresholds[i]) ||
+            !ReadValue(checkpoint_buffer, len, pos, candidate_counts[i]) ||
+            candidate_counts[i] < 0 || candidate_counts[i] > candidate_num_) {
+            return -1;
+        }
+        Candidate* list = &candidates[static_cast<size_t>(i) * candidate_num_];
+        for (int j = 0; j < candidate_counts[i]; j++) {
+            if (!ReadValue(checkpoint_buffer, len, pos, list[j].value) ||
+                !ReadValue(checkpoint_buffer, len, pos, list[j].key) ||
+                !ReadValue(checkpoint_buffer, len, pos, list[j].epoch) || list[j].key < 0 ||
+                list[j].key >= pattern_num) {
+                return -1;
+            }
+        }
+    }
+    int32_t base_num, size_candidate_num;
+    if (!ReadValue(checkpoint_buffer, len, pos, base_num) ||
+        base_num != static_cast<int32_t>(base_patterns_.size())) {
+        return -1;
+    }
+    std::vector<int> base_record_nums(base_num);
+    for (int& record_num : base_record_nums) {
+        if (!ReadValue(checkpoint_buffer, len, pos, record_num)) {
+            return -1;
+        }
+    }
+    if (!ReadValue(checkpoint_buffer, len, pos, size_candidate_num) || size_candidate_num < 0) {
+        return -1;
+    }
+    std::vector<SizeCandidate> size_candidates(size_candidate_num);
+    for (SizeCandidate& candidate : size_candidates) {
+        int32_t trained_num;
+        if (!ReadValue(checkpoint_buffer, len, pos, candidate.k) ||
+            !ReadValue(checkpoint_buffer, len, pos, candidate.cluster_num) ||
+            !ReadValue(checkpoint_buffer, len, pos, trained_num) || trained_num < 0) {
+            return -1;
+        }
+        candidate.trained_patterns.resize(trained_num);
+        for (std::string& pattern : candidate.trained_patterns) {
+            int32_t pattern_len;
+            if (!ReadValue(checkpoint_buffer, len, pos, pattern_len) || pattern_len < 0 ||
+                pos + pattern_len > len) {
+                return -1;
+            }
+            pattern.assign(checkpoint_buffer + pos, pattern_len);
+            pos += pattern_len;
+        }
+    }
+    if (pos != len) {
+        return -1;
+    }
 
-    memcpy(pattern_buffer + pattern_len, dict_buffer, cBSize * sizeof(char));
-    pattern_len += cBSize;
-    pattern_buffer[pattern_len] = 0;
+    // the state replaces the distinct patterns of LoadData, like PreTrain and
+    // ComputeTotalMinValueTable would have set it up
+    ClearPatterns();
+    all_pattern_num_ = pattern_num;
+    patterns_.assign(pattern_num, nullptr);
+    pattern_lens_.assign(pattern_num, 0);
+    pattern_capacities_.assign(pattern_num, 0);
+    record_nums_.swap(record_nums);
+    cluster_ids_.swap(cluster_ids);
+    char_freqs_.swap(char_freqs);
+    min_value_keys_.swap(min_value_keys);
+    one_gram_tables_.swap(one_gram_tables);
+    pattern_bounds_.assign(pattern_num, PatternBounds());
+    bigram_tables_.assign(pattern_num, nullptr);
+    bigram_nums_.assign(pattern_num, 0);
+    bigram_capacities_.assign(pattern_num, 0);
+    epochs_.swap(epochs);
+    candidates_.swap(candidates);
+    candidate_counts_.swap(candidate_counts);
+    candidate_bounds_.swap(candidate_bounds);
+    std::vector<std::atomic<int64_t>>(pattern_num).swap(thresholds_);
+    if (thread_num_ > 0) {
+        std::vector<std::mutex>(pattern_num).swap(candidate_mutexes_);
+    }
+    min_value_heap_.Reset(pattern_num);
+    round_touched_.assign(pattern_num, false);
+    for (int i = 0; i < pattern_num; i++) {
+        thresholds_[i] = thresholds[i];
+        if (cluster_ids_[i] == i) {
+            StorePattern(i, symbols[i].data(), symbols[i].size());
+            ComputePatternBounds(i);
+        }
+        if (heap_flags[i]) {
+            min_value_heap_.Update(i, min_value_keys_[i].value);
+        }
+    }
+    base_record_nums_.swap(base_record_nums);
+    size_candidates_.swap(size_candidates);
+    resumed_ = true;
+    return alive_num;
+}
 
-    delete pbc_compress;
-    delete[] samples_len;
-    delete[] each_input_data;
-    delete[] compressed_data;
-    delete[] samples_buffer;
-    delete[] dict_buffer;
+bool PBC_Train::WriteCheckpoint() const {
+    auto start_time = std::chrono::steady_clock::now();
+    char* checkpoint_buffer = nullptr;
+    int64_t checkpoint_len = SerializeCheckpoint(&checkpoint_buffer);
+    if (checkpoint_len < 0) {
+        return false;
+    }
+    // a killed write leaves the temporary file, never a truncated checkpoint
+    std::string temp_path = checkpoint_path_ + ".tmp";
+    std::ofstream checkpoint_file(temp_path, std::ios::out | std::ios::binary);
+    checkpoint_file.write(checkpoint_buffer, checkpoint_len);
+    checkpoint_file.close();
+    delete[] checkpoint_buffer;
+    if (!checkpoint_file || std::rename(temp_path.c_str(), checkpoint_path_.c_str()) != 0) {
+        PBC_LOG(ERROR) << "write checkpoint " << checkpoint_path_ << " failed" << std::endl;
+        return false;
+    }
+    auto end_time = std::chrono::steady_clock::now();
+    PBC_LOG(INFO) << "write checkpoint: " << checkpoint_path_ << ", len = " << checkpoint_len
+                  << ", cost time = "
+                  << std::chrono::duration<double>(end_time - start_time).count() << "s."
+                  << std::endl;
     return true;
 }
 
-int64_t PBC_Train::TrainPattern(int k, char** pattern_buffer) {
-    PreTrain();
+void PBC_Train::LoadHoldoutData(const char* holdout_buffer, int64_t len, int data_type) {
+    holdout_buffer_ = holdout_buffer;
+    holdout_len_ = len;
+    holdout_data_type_ = data_type;
+}
 
+void PBC_Train::SetAutoPatternSizes(const std::vector<int>& pattern_sizes) {
+    auto_pattern_sizes_.clear();
+    for (int pattern_size : pattern_sizes) {
+        if (pattern_size > 0) {
+            auto_pattern_sizes_.push_back(pattern_size);
+        }
+    }
+    std::sort(auto_pattern_sizes_.begin(), auto_pattern_sizes_.end(), std::greater<int>());
+    auto_pattern_sizes_.erase(std::unique(auto_pattern_sizes_.begin(), auto_pattern_sizes_.end()),
+                              auto_pattern_sizes_.end());
+}
+
+int64_t PBC_Train::SelectPatternSize(char** pattern_buffer) {
+    auto start_time = std::chrono::steady_clock::now();
+    // the candidates are kept by decreasing k, the reports go by increasing k
+    std::vector<char*> pattern_buffers;
+    std::vector<int64_t> pattern_lens;
+    for (auto it = size_candidates_.rbegin(); it != size_candidates_.rend(); ++it) {
+        PatternSizeReport report;
+        report.k = it->k;
+        report.cluster_num = it->cluster_num;
+        char* buffer = nullptr;
+        report.pattern_len = WritePatternFile(it->trained_patterns, &buffer);
+        pattern_buffers.push_back(buffer);
+        pattern_lens.push_back(report.pattern_len);
+        if (report.pattern_len < 0 || !EvaluateHoldout(buffer, report.pattern_len, report)) {
+            for (char* pattern_buffer : pattern_buffers) {
+                delete[] pattern_buffer;
+            }
+            pattern_size_reports_.clear();
+            return -1;
+        }
+        pattern_size_reports_.push_back(report);
+    }
+
+    // the knee is the point farthest below the chord of the compress rate over log k, both
+    // scaled to [0, 1]. Without one the smallest k of the lowest rate is taken.
+    int report_num = static_cast<int>(pattern_size_reports_.size());
+    const std::vector<PatternSizeReport>& reports = pattern_size_reports_;
+    int selected = 0;
+    for (int i = 1; i < report_num; i++) {
+        if (reports[i].compress_rate < reports[selected].compress_rate) {
+            selected = i;
+        }
+    }
+    if (report_num >= 3) {
+        double min_x = std::log(static_cast<double>(reports.front().k));
+        double max_x = std::log(static_cast<double>(reports.back().k));
+        double min_y = reports[0].compress_rate;
+        double max_y = min_y;
+        for (const PatternSizeReport& report : reports) {
+            min_y = std::min(min_y, report.compress_rate);
+            max_y = std::max(max_y, report.compress_rate);
+        }
+        if (max_y > min_y) {
+            double first_y = (reports.front().compress_rate - min_y) / (max_y - min_y);
+            double last_y = (reports.back().compress_rate - min_y) / (max_y - min_y);
+            double max_distance = 0.0;
+            for (int i = 1; i < report_num - 1; i++) {
+                double x = (std::log(static_cast<double>(reports[i].k)) - min_x) / (max_x - min_x);
+                double y = (reports[i].compress_rate - min_y) / (max_y - min_y);
+                double distance = first_y + (last_y - first_y) * x - y;
+                if (distance > max_distance) {
+                    max_distance = distance;
+                    selected = i;
+                }
+            }
+        }
+    }
+    selected_pattern_size_ = pattern_size_reports_[selected].k;
+    *pattern_buffer = pattern_buffers[selected];
+    for (int i = 0; i < report_num; i++) {
+        if (i != selected) {
+            delete[] pattern_buffers[i];
+        }
+    }
+
+    PBC_LOG(INFO) << "------------ pattern size report ------------" << std::endl;
+    for (const PatternSizeReport& report : pattern_size_reports_) {
+        PBC_LOG(INFO) << "k=" << report.k << ",cluster_num=" << report.cluster_num
+                      << ",pattern_num=" << report.pattern_num
+                      << ",pattern_len=" << report.pattern_len
+                      << ",compress_rate=" << report.compress_rate
+                      << ",compress_speed=" << report.compress_speed << "MB/s"
+                      << (report.k == selected_pattern_size_ ? " (selected)" : "") << std::endl;
+    }
+    PBC_LOG(INFO) << "---------------------------------------------" << std::endl;
+    auto end_time = std::chrono::steady_clock::now();
+    PBC_LOG(INFO) << "select pattern size: k = " << selected_pattern_size_ << ", cost time = "
+                  << std::chrono::duration<double>(end_time - start_time).count() << "s."
+                  << std::endl;
+    return pattern_lens[selected];
+}
+
+bool PBC_Train::EvaluateHoldout(const char* pattern_buffer, int64_t pattern_len,
+                                PatternSizeReport& report) {
+    pbc_memcpy(&report.pattern_num, pattern_buffer, sizeof(int32_t));
+    // the loaded records stand in for a missing holdout
+    const char* buffer = holdout_buffer_;
+    int64_t len = holdout_len_;
+    int data_type = holdout_data_type_;
+    if (buffer == nullptr) {
+        buffer = data_buffer_;
+        len = len_;
+        data_type = data_type_;
+    }
+    std::vector<int64_t> record_positions;
+    std::vector<int32_t> record_lens;
+    int32_t max_record_len = LocateRecords(buffer, len, data_type, record_positions, record_lens);
+
+    // like CompressSamples every block of records has its own compressor, the speed is the one
+    // of a single thread
+    int record_num = static_cast<int>(record_lens.size());
+    int block_num = thread_num_ > 0 ? static_cast<int>(scheduler_->ThreadNum()) : 1;
+    block_num = std::max(std::min(block_num, record_num), 1);
+    std::vector<int64_t> block_original_lens(block_num, 0);
+    std::vector<int64_t> block_compressed_lens(block_num, 0);
+    std::vector<double> block_times(block_num, 0.0);
+    std::atomic<bool> failed(false);
+    auto compress_block = [&](int block) {
+        int begin = static_cast<int64_t>(record_num) * block / block_num;
+        int end = static_cast<int64_t>(record_num) * (block + 1) / block_num;
+        PBC_Compress* pbc_compress = CompressFactory::CreatePBCCompress(compress_method_);
+        if (pbc_compress == nullptr || !pbc_compress->ReadData(pattern_buffer, pattern_len)) {
+            delete pbc_compress;
+            failed = true;
+            return;
+        }
+        std::vector<char> compressed_data(3 * static_cast<size_t>(max_record_len) + 16);
+        auto start_time = std::chrono::steady_clock::now();
+        for (int i = begin; i < end && !failed; i++) {
+            size_t compress_result = pbc_compress->CompressUsingPattern(
+                buffer + record_positions[i], record_lens[i], compressed_data.data());
+            if (PBC::PBC_isError(compress_result)) {
+                failed = true;
+                break;
+            }
+            block_original_lens[block] += record_lens[i];
+            // like --test-compress an uncompressed record counts its own length
+            block_compressed_lens[block] +=
+                compressed_data[0] == COMPRESS_NOT_COMPRESS ? record_lens[i] : compress_result;
+        }
+        auto end_time = std::chrono::steady_clock::now();
+        block_times[block] = std::chrono::duration<double>(end_time - start_time).count();
+        delete pbc_compress;
+    };
+    if (thread_num_ > 0) {
+        scheduler_->ParallelFor(0, block_num, 1, compress_block);
+    } else {
+        compress_block(0);
+    }
+    if (failed) {
+        PBC_LOG(ERROR) << "evaluate pattern size " << report.k << " failed" << std::endl;
+        return false;
+    }
+
+    report.original_len = 0;
+    report.compressed_len = 0;
+    double compress_time = 0.0;
+    for (int block = 0; block < block_num; block++) {
+        report.original_len += block_original_lens[block];
+        report.compressed_len += block_compressed_lens[block];
+        compress_time += block_times[block];
+    }
+    report.compress_rate = report.original_len == 0 ? 1.0
+                                                    : static_cast<double>(report.compressed_len) /
+                                                          report.original_len;
+    report.compress_speed =
+        compress_time > 0.0 ? report.original_len / compress_time / 1024 / 1024 : 0.0;
+    return true;
+}
+
+void PBC_Train::MergeClusters(int k) {
     double ComputeTotalMinValueTable_time = 0.0, MergePattern_time = 0.0,
            UpdateMinValueTable_time = 0.0, GetMinValue_time = 0.0;
-    auto ComputeTotalMinValueTable_start_time = std::chrono::steady_clock::now();
-    ComputeTotalMinValueTable();
-    auto ComputeTotalMinValueTable_end_time = std::chrono::steady_clock::now();
-    ComputeTotalMinValueTable_time +=
-        std::chrono::duration<double>(ComputeTotalMinValueTable_end_time -
-                                      ComputeTotalMinValueTable_start_time)
-            .count();
-    PBC_LOG(INFO) << "ComputeTotalMinValueTable_time=" << ComputeTotalMinValueTable_time
-                  << std::endl;
-    int end_num = all_pattern_num_;
+    bool table_complete = true;
+    if (resumed_) {
+        // LoadCheckpoint restored the state PreTrain and the min value table left
+        resumed_ = false;
+    } else {
+        PreTrain();
+        auto ComputeTotalMinValueTable_start_time = std::chrono::steady_clock::now();
+        table_complete = ComputeTotalMinValueTable();
+        auto ComputeTotalMinValueTable_end_time = std::chrono::steady_clock::now();
+        ComputeTotalMinValueTable_time +=
+            std::chrono::duration<double>(ComputeTotalMinValueTable_end_time -
+                                          ComputeTotalMinValueTable_start_time)
+                .count();
+        PBC_LOG(INFO) << "ComputeTotalMinValueTable_time=" << ComputeTotalMinValueTable_time
+                      << std::endl;
+    }
+    int end_num = 0;
+    for (int i = 0; i < all_pattern_num_; i++) {
+        if (cluster_ids_[i] == i) end_num++;
+    }
 
     int train_perc_count = 0;
     int64_t report_num = (end_num - k) / 100;
     int64_t itr_count = 0;
+    int64_t round_num = 0;
 
     PBC_LOG(INFO) << "------------ merge pattern ---------------" << std::endl;
     PBC_LOG(INFO) << "init pattern count:" << end_num << std::endl;
     PBC_LOG(INFO) << "target pattern num:" << k << std::endl;
     PBC_LOG(INFO) << "------------------------------------------" << std::endl;
 
+    std::vector<std::pair<int, int>> merge_pairs;
+    std::vector<int> changed_cluster_ids;
+    std::vector<int> update_cluster_ids;
+    std::vector<char> updated_flags;
+    // keep the trained patterns of every auto pattern size the clusters reach
+    auto keep_size_candidates = [this](int cluster_num) {
+        while (size_candidates_.size() < auto_pattern_sizes_.size() &&
+               cluster_num <= auto_pattern_sizes_[size_candidates_.size()]) {
+            SizeCandidate candidate;
+            candidate.k = auto_pattern_sizes_[size_candidates_.size()];
+            candidate.cluster_num = cluster_num;
+            CollectTrainedPatterns(candidate.trained_patterns);
+            size_candidates_.push_back(std::move(candidate));
+        }
+    };
+    keep_size_candidates(end_num);
+    auto checkpoint_time = std::chrono::steady_clock::now();
     while (end_num > k) {
+        if (!table_complete || DeadlineReached()) {
+            // the clusters merged so far stand for the k clusters, the next run may resume them
+            budget_exceeded_ = true;
+            PBC_LOG(INFO) << "time budget of " << time_budget_
+                          << "s exceeded, stop merging at pattern num: " << end_num << std::endl;
+            if (table_complete && !checkpoint_path_.empty()) {
+                WriteCheckpoint();
+            }
+            break;
+        }
+        if (!checkpoint_path_.empty() &&
+            std::chrono::steady_clock::now() - checkpoint_time >=
+                std::chrono::duration<double>(checkpoint_interval_)) {
+            WriteCheckpoint();
+            checkpoint_time = std::chrono::steady_clock::now();
+        }
         if (itr_count > report_num * train_perc_count) {
             PBC_LOG(DETAIL) << "Pattern training " << train_perc_count
                             << "%. current pattern num: " << end_num << std::endl;
             PBC_LOG(DETAIL) << "UpdateMinValueTable_time=" << UpdateMinValueTable_time
                             << "s,MergePattern_time=" << MergePattern_time
                             << "s,GetMinValue_time=" << GetMinValue_time << "s." << std::endl;
+            if (progress_callback_) {
+                progress_callback_(end_num, k);
+            }
             train_perc_count++;
         }
-        itr_count++;
-        int cluster_id1, cluster_id2;
-        GetClosestCluster(cluster_id1, cluster_id2);
-        pattern_infos_[cluster_id2].cluster_id = cluster_id1;
-
-        std::string new_pattern;
+        merge_pairs.clear();
+        if (merge_mode_ == MERGE_RECIPROCAL) {
+            GetReciprocalClusters(end_num - k, merge_pairs);
+        } else {
+            int cluster_id1, cluster_id2;
+            GetClosestCluster(cluster_id1, cluster_id2);
+            merge_pairs.push_back(std::make_pair(cluster_id1, cluster_id2));
+        }
+        itr_count += merge_pairs.size();
+        round_num++;
+
+        int max_cluster_id2 = 0;
+        changed_cluster_ids.clear();
+        for (const auto& merge_pair : merge_pairs) {
+            cluster_ids_[merge_pair.second] = merge_pair.first;
+            min_value_heap_.Erase(merge_pair.second);
+            changed_cluster_ids.push_back(merge_pair.first);
+            max_cluster_id2 = max(max_cluster_id2, merge_pair.second);
+        }
+        std::sort(changed_cluster_ids.begin(), changed_cluster_ids.end());
 
         auto MergePattern_start_time = std::chrono::steady_clock::now();
-        MergePattern(
-            pattern_infos_[cluster_id1].pattern_buffer, pattern_infos_[cluster_id2].pattern_buffer,
-            pattern_infos_[cluster_id1].pattern_len, pattern_infos_[cluster_id2].pattern_len,
-            pattern_infos_[cluster_id1].record_num, pattern_infos_[cluster_id2].record_num,
-            new_pattern);
-        auto MergePattern_end_time = std::chrono::steady_clock::now();
-
-        int new_pattern_len = new_pattern.length();
-        // update one_gram_table_
-        std::vector<int> one_gram(symbol_size_, 0);
-        pattern_infos_[cluster_id1].char_freq = new_pattern_len;
-        for (int i = 0; i < new_pattern_len; i++) {
-            one_gram[static_cast<int32_t>(static_cast<unsigned char>(new_pattern[i]))]++;
-
-            if (new_pattern[i] == '\\' && i > 0 && new_pattern[i - 1] != '\\') {
-                one_gram[static_cast<int32_t>(static_cast<unsigned char>(new_pattern[i]))]--;
-                pattern_infos_[cluster_id1].char_freq--;
-            }
-            if (new_pattern[i] == '*' && i > 0 && new_pattern[i - 1] != '\\') {
-                one_gram[static_cast<int32_t>(static_cast<unsigned char>(new_pattern[i]))]--;
-                pattern_infos_[cluster_id1].char_freq--;
+        if (thread_num_ > 0 && merge_pairs.size() > 1) {
+            scheduler_->ParallelFor(0, merge_pairs.size(), 1, [this, &merge_pairs](int i) {
+                MergeCluster(merge_pairs[i].first, merge_pairs[i].second);
+            });
+        } else {
+            for (const auto& merge_pair : merge_pairs) {
+                MergeCluster(merge_pair.first, merge_pair.second);
             }
-            pattern_infos_[cluster_id1].pattern_buffer[i] = new_pattern[i];
         }
-        pattern_infos_[cluster_id1].pattern_buffer[new_pattern_len] = '\0';
-
-        pattern_infos_[cluster_id1].one_gram_table = one_gram;
-        pattern_infos_[cluster_id1].pattern_len = new_pattern_len;
-
-        pattern_infos_[cluster_id1].record_num =
-            pattern_infos_[cluster_id1].record_num + pattern_infos_[cluster_id2].record_num;
+        auto MergePattern_end_time = std::chrono::steady_clock::now();
 
         // UpdateMinValueTable
         auto UpdateMinValueTable_start_time = std::chrono::steady_clock::now();
         if (thread_num_ > 0) {
-            std::vector<std::future<void>> update_min_value_future;
-            for (int i = 0; i < cluster_id2; i++) {
-                if (pattern_infos_[i].cluster_id != i) continue;
-                if (i == cluster_id1) continue;
-                update_min_value_future.push_back(thread_pool_->SubmitTask(
-                    &PBC_Train::UpdateMinValueTable, this, i, cluster_id1, cluster_id2));
+            update_cluster_ids.clear();
+            for (int i = 0; i < max_cluster_id2; i++) {
+                if (cluster_ids_[i] != i) continue;
+                if (std::binary_search(changed_cluster_ids.begin(), changed_cluster_ids.end(), i))
+                    continue;
+                update_cluster_ids.push_back(i);
             }
-            for (int i = 0; i < update_min_value_future.size(); i++) {
-                update_min_value_future[i].get();
+            updated_flags.assign(update_cluster_ids.size(), 0);
+            PruneCounts prune_counts = scheduler_->ParallelReduce(
+                0, update_cluster_ids.size(), UPDATE_GRAIN_SIZE, PruneCounts(),
+                [this, &update_cluster_ids, &updated_flags, &changed_cluster_ids](
+                    int chunk_begin, int chunk_end, PruneCounts& partial) {
+                    for (int i = chunk_begin; i < chunk_end; i++) {
+                        updated_flags[i] = UpdateMinValueTable(update_cluster_ids[i],
+                                                               changed_cluster_ids, partial);
+                    }
+                },
+                AddCounts);
+            AddPruneCounts(prune_counts);
+            // the heap is not thread safe, update it after all tasks finished
+            for (size_t i = 0; i < update_cluster_ids.size(); i++) {
+                if (updated_flags[i]) {
+                    int cluster_id = update_cluster_ids[i];
+                    min_value_heap_.Update(cluster_id,
+                                           min_value_keys_[cluster_id].value);
+                }
             }
         } else {
-            for (int i = 0; i < cluster_id2; i++) {
-                if (pattern_infos_[i].cluster_id != i) continue;
-                if (i == cluster_id1) continue;
-                UpdateMinValueTable(i, cluster_id1, cluster_id2);
+            PruneCounts prune_counts;
+            for (int i = 0; i < max_cluster_id2; i++) {
+                if (cluster_ids_[i] != i) continue;
+                if (std::binary_search(changed_cluster_ids.begin(), changed_cluster_ids.end(), i))
+                    continue;
+                if (UpdateMinValueTable(i, changed_cluster_ids, prune_counts)) {
+                    min_value_heap_.Update(i, min_value_keys_[i].value);
+                }
             }
+            AddPruneCounts(prune_counts);
         }
         auto UpdateMinValueTable_end_time = std::chrono::steady_clock::now();
 
-        // update the minmal EL of cluster_id1 and corresponding pattern ID
+        // update the minmal EL of merged clusters and corresponding pattern ID
         auto GetMinValue_start_time = std::chrono::steady_clock::now();
-        pattern_infos_[cluster_id1].min_value_key =
-            GetMinValue(cluster_id1, /*skip_non_original_cluster=*/true);
+        if (thread_num_ > 0 && changed_cluster_ids.size() > 1) {
+            scheduler_->ParallelFor(0, changed_cluster_ids.size(), 1,
+                                    [this, &changed_cluster_ids](int i) {
+                                        int cluster_id = changed_cluster_ids[i];
+                                        min_value_keys_[cluster_id] = GetMinValue(
+                                            cluster_id, /*skip_non_original_cluster=*/true);
+                                    });
+        } else {
+            for (int cluster_id : changed_cluster_ids) {
+                min_value_keys_[cluster_id] =
+                    GetMinValue(cluster_id, /*skip_non_original_cluster=*/true);
+            }
+        }
+        for (int cluster_id : changed_cluster_ids) {
+            min_value_heap_.Update(cluster_id, min_value_keys_[cluster_id].value);
+        }
         auto GetMinValue_end_time = std::chrono::steady_clock::now();
-        end_num--;
+        end_num -= merge_pairs.size();
+        keep_size_candidates(end_num);
 
         UpdateMinValueTable_time += std::chrono::duration<double>(UpdateMinValueTable_end_time -
                                                                   UpdateMinValueTable_start_time)
@@ -969,86 +2474,212 @@ int64_t PBC_Train::TrainPattern(int k, char** pattern_buffer) {
         GetMinValue_time +=
             std::chrono::duration<double>(GetMinValue_end_time - GetMinValue_start_time).count();
     }
+    if (progress_callback_) {
+        progress_callback_(end_num, k);
+    }
+    PBC_LOG(INFO) << "merge rounds: " << round_num << std::endl;
+    PBC_LOG(INFO) << "ComputeTotalMinValueTable_time=" << ComputeTotalMinValueTable_time
+                  << "s,UpdateMinValueTable_time=" << UpdateMinValueTable_time
+                  << "s,MergePattern_time=" << MergePattern_time
+                  << "s,GetMinValue_time=" << GetMinValue_time << "s." << std::endl;
+    PBC_LOG(INFO) << "lower bound hits: length=" << lower_bound_hits_[0]
+                  << ",anchor=" << lower_bound_hits_[1] << ",one_gram=" << lower_bound_hits_[2]
+                  << ",bigram=" << lower_bound_hits_[3] << ",dp=" << dp_num_
+                  << ",rescan=" << rescan_num_ << std::endl;
+}
 
-    int64_t buffer_len = 0;
-    int32_t pattern_num = 0;
-    int32_t max_pattern_len = 0;
+int64_t PBC_Train::DpWorkspaceBytes(int len_a, int len_b) {
+    // the type, state and source tables, each a vector per row with its allocation
+    const int64_t row_bytes = sizeof(std::vector<int>) + 16;
+    return (len_a + 1) * ((len_b + 1) * static_cast<int64_t>(sizeof(Type) + sizeof(int) +
+                                                               sizeof(SourcePos)) +
+                          3 * row_bytes);
+}
+
+PBC_Train::MemoryEstimate PBC_Train::EstimateMemory() const {
+    MemoryEstimate estimate;
+    estimate.data_bytes = len_ + holdout_len_;
+    int64_t symbol_num = 0;
+    int longest_len = 0, second_len = 0;
     for (int i = 0; i < all_pattern_num_; i++) {
-        if (pattern_infos_[i].cluster_id != i) continue;
-        if (pattern_infos_[i].pattern_len > 1 && (pattern_infos_[i].record_num > 1)) {
-            pattern_num++;
-            max_pattern_len = max(max_pattern_len, pattern_infos_[i].pattern_len);
+        symbol_num += pattern_lens_[i];
+        if (pattern_lens_[i] > longest_len) {
+            second_len = longest_len;
+            longest_len = pattern_lens_[i];
+        } else if (pattern_lens_[i] > second_len) {
+            second_len = pattern_lens_[i];
         }
     }
+    // the arrays PreTrain sizes per cluster, a 1-gram table of a byte per symbol, the candidate
+    // list, a heap entry and the mutex of the parallel dp
+    int64_t cluster_bytes = sizeof(Symbol*) + 9 * sizeof(int) + 2 * sizeof(MinValueKey) +
+                            sizeof(OneGramTable) + (symbol_size_ + 31) / 32 * 32 +
+                            sizeof(PatternBounds) + sizeof(uint16_t*) +
+                            candidate_num_ * sizeof(Candidate) + sizeof(std::atomic<int64_t>) +
+                            2 * sizeof(int) + sizeof(std::mutex);
+    estimate.state_bytes = ArenaStateBytes(symbol_num) + all_pattern_num_ * cluster_bytes;
+    if (!resumed_ && shard_num_ > 1) {
+        // the shard trainers hold a copy of every pattern
+        estimate.state_bytes *= 2;
+    }
+    // the last arena block is hardly used
+    estimate.state_bytes += pattern_arena_.BlockSize();
+    estimate.dp_bytes = DpWorkspaceBytes(longest_len, second_len);
+    estimate.dp_num = thread_num_ > 0 ? static_cast<int>(scheduler_->ThreadNum()) : 1;
+    return estimate;
+}
 
-    *pattern_buffer = new char[((max_pattern_len + 1) * pattern_num) + 4096 * 1024];
-
-    PBC_LOG(INFO) << "actual pattern num : " << pattern_num << std::endl;
+int64_t PBC_Train::ArenaStateBytes(int64_t symbol_num) {
+    // the patterns and their bigram tables, twice for the patterns merging moves out of place
+    return 2 * 2 * symbol_num * static_cast<int64_t>(sizeof(Symbol));
+}
 
-    pbc_memcpy((*pattern_buffer) + buffer_len, &pattern_num, sizeof(int32_t));
-    buffer_len += sizeof(int32_t);
-    for (int i = 0; i < all_pattern_num_; i++) {
-        if (pattern_infos_[i].cluster_id != i) continue;
-        if (pattern_infos_[i].pattern_len > 1 && (pattern_infos_[i].record_num > 1)) {
-            pbc_memcpy((*pattern_buffer) + buffer_len, &(pattern_infos_[i].pattern_len),
-                       sizeof(int32_t));
-            buffer_len += sizeof(int32_t);
-            // PBC_LOG(INFO) << "pattern len : " << all_pattern_len_[i] << std::endl;
+int64_t PBC_Train::SamplePatterns(int keep_num) {
+    // a kept pattern keeps its own records, the dropped records are not counted for any of them
+    std::vector<std::pair<std::string, int>> kept_patterns(keep_num);
+    int64_t symbol_num = 0;
+    int64_t dropped_record_num =
+        std::accumulate(record_nums_.begin(), record_nums_.begin() + all_pattern_num_, int64_t(0));
+    for (int i = 0; i < keep_num; i++) {
+        int id = static_cast<int>(static_cast<int64_t>(i) * all_pattern_num_ / keep_num);
+        SerializePattern(patterns_[id], pattern_lens_[id], kept_patterns[i].first);
+        kept_patterns[i].second = record_nums_[id];
+        dropped_record_num -= record_nums_[id];
+        symbol_num += pattern_lens_[id];
+    }
+    ClearPatterns();
+    // the blocks shrink with the state, so that the hardly used last one stays a small part of it
+    pattern_arena_.SetBlockSize(std::min(
+        std::max(static_cast<size_t>(ArenaStateBytes(symbol_num) / ARENA_BLOCK_SHARE),
+                 MIN_ARENA_BLOCK_SIZE),
+        PatternArena::DEFAULT_BLOCK_SIZE));
+    for (const auto& kept_pattern : kept_patterns) {
+        ParseLookupPattern(kept_pattern.first);
+        AddLookupPattern(kept_pattern.second);
+    }
+    return dropped_record_num;
+}
 
-            pbc_memcpy((*pattern_buffer) + buffer_len, pattern_infos_[i].pattern_buffer,
-                       pattern_infos_[i].pattern_len);
-            buffer_len += pattern_infos_[i].pattern_len;
+bool PBC_Train::FitMemoryBudget() {
+    dp_gate_.reset();
+    int pattern_num = all_pattern_num_;
+    int64_t dropped_record_num = 0;
+    // a resumed state must keep the clusters of its checkpoint
+    if (max_memory_ > 0 && !resumed_) {
+        // store the patterns again in arena blocks scaled to them
+        SamplePatterns(all_pattern_num_);
+    }
+    MemoryEstimate estimate = EstimateMemory();
+    if (max_memory_ > 0 && !resumed_) {
+        // the state shrinks about in proportion to the distinct records kept, the data and one dp
+        // workspace do not
+        while (all_pattern_num_ > 1 &&
+               estimate.data_bytes + estimate.state_bytes + estimate.dp_bytes > max_memory_) {
+            int64_t room = max_memory_ - estimate.data_bytes - estimate.dp_bytes;
+            if (room <= 0) {
+                break;
+            }
+            int keep_num = static_cast<int>(static_cast<double>(all_pattern_num_) * room /
+                                            estimate.state_bytes);
+            dropped_record_num +=
+                SamplePatterns(std::max(std::min(keep_num, all_pattern_num_ - 1), 1));
+            estimate = EstimateMemory();
         }
     }
-
-    auto CreateSecondaryEncoderData_start_time = std::chrono::steady_clock::now();
-    if (!CreateSecondaryEncoderData((*pattern_buffer), buffer_len)) {
-        return -1;
+    if (max_memory_ > 0 &&
+        estimate.data_bytes + estimate.state_bytes + estimate.dp_bytes > max_memory_) {
+        PBC_LOG(ERROR) << "max memory = " << max_memory_ << " bytes is below the estimate of "
+                       << estimate.data_bytes + estimate.state_bytes + estimate.dp_bytes
+                       << " bytes for " << all_pattern_num_ << " of " << pattern_num
+                       << " patterns, data = " << estimate.data_bytes
+                       << ", state = " << estimate.state_bytes
+                       << ", dp workspace = " << estimate.dp_bytes << std::endl;
+        return false;
     }
-    auto CreateSecondaryEncoderData_end_time = std::chrono::steady_clock::now();
-    double CreateSecondaryEncoderData_time =
-        std::chrono::duration<double>(CreateSecondaryEncoderData_end_time -
-                                      CreateSecondaryEncoderData_start_time)
-            .count();
-    PBC_LOG(INFO) << "ComputeTotalMinValueTable_time=" << ComputeTotalMinValueTable_time
-                  << "s,UpdateMinValueTable_time=" << UpdateMinValueTable_time
-                  << "s,MergePattern_time=" << MergePattern_time
-                  << "s,GetMinValue_time=" << GetMinValue_time
-                  << "s,CreateSecondaryEncoderData_time=" << CreateSecondaryEncoderData_time << "s."
+    if (max_memory_ > 0) {
+        int64_t dp_room = max_memory_ - estimate.data_bytes - estimate.state_bytes;
+        int64_t dp_num = std::max<int64_t>(dp_room / std::max<int64_t>(estimate.dp_bytes, 1), 1);
+        if (dp_num < estimate.dp_num) {
+            estimate.dp_num = static_cast<int>(dp_num);
+            dp_gate_ = std::make_shared<MemoryGate>(std::max(dp_room, estimate.dp_bytes));
+        }
+    }
+    estimated_peak_memory_ = estimate.Peak();
+    PBC_LOG(INFO) << "memory estimate: peak = " << estimated_peak_memory_
+                  << " bytes, data = " << estimate.data_bytes
+                  << ", state = " << estimate.state_bytes << ", dp workspace = "
+                  << estimate.dp_bytes << " x " << estimate.dp_num
+                  << ", max memory = " << max_memory_ << ", pattern num = " << pattern_num
+                  << " -> " << all_pattern_num_ << ", dropped record num = " << dropped_record_num
                   << std::endl;
-    return buffer_len;
+    return true;
 }
 
 void PBC_Train::PreTrain() {
-    PBC_LOG(INFO) << "start pretrain: current pattern_num = " << all_pattern_num_ << std::endl;
+    PBC_LOG(INFO) << "start pretrain: current pattern_num = " << record_num_ << std::endl;
     auto PreTrain_start_time = std::chrono::steady_clock::now();
-    std::unordered_map<PatternInfo, int, PatternInfo::PatternInfoHash,
-                       PatternInfo::PatternInfoComparetor>
-        pattern_info_map;
-    for (const PatternInfo& pattern_info : pattern_infos_) {
-        if (pattern_info_map.find(pattern_info) != pattern_info_map.end()) {
-            // delete the same pattern
-            pattern_info_map[pattern_info]++;
-            delete[] pattern_info.pattern_buffer;
-        } else {
-            pattern_info_map[pattern_info]++;
+    // the distinct patterns keep the ids LoadData gave them in the order they first appeared
+    pattern_set_.clear();
+    std::vector<size_t>().swap(pattern_hashes_);
+
+    cluster_ids_.resize(all_pattern_num_);
+    char_freqs_.resize(all_pattern_num_);
+    min_value_keys_.assign(all_pattern_num_, {INT_MAX, -1});
+    one_gram_tables_.resize(all_pattern_num_);
+    pattern_bounds_.resize(all_pattern_num_);
+    bigram_tables_.assign(all_pattern_num_, nullptr);
+    bigram_nums_.assign(all_pattern_num_, 0);
+    bigram_capacities_.assign(all_pattern_num_, 0);
+    epochs_.assign(all_pattern_num_, 0);
+    candidates_.resize(static_cast<size_t>(all_pattern_num_) * candidate_num_);
+    candidate_counts_.assign(all_pattern_num_, 0);
+    candidate_bounds_.assign(all_pattern_num_, {INT_MAX, INT_MAX});
+    std::vector<std::atomic<int64_t>>(all_pattern_num_).swap(thresholds_);
+    std::vector<int> one_gram(symbol_size_);
+    for (int i = 0; i < all_pattern_num_; i++) {
+        // cluster id initialization
+        cluster_ids_[i] = i;
+        thresholds_[i] = PackCandidateBound({INT_MAX, INT_MAX});
+
+        // counting the literal symbol frequency of the record or seed for 1-gram pruning
+        std::fill(one_gram.begin(), one_gram.end(), 0);
+        char_freqs_[i] = 0;
+        for (int j = 0; j < pattern_lens_[i]; j++) {
+            if (patterns_[i][j] != WILDCARD_SYMBOL) {
+                one_gram[SymbolBucket(patterns_[i][j])]++;
+                char_freqs_[i]++;
+            }
         }
+        one_gram_tables_[i].Build(one_gram.data(), symbol_size_);
+        ComputePatternBounds(i);
     }
-    pattern_infos_.clear();
-    int count = 0;
-    for (auto& pattern_info_pair : pattern_info_map) {
-        PatternInfo pattern_info = pattern_info_pair.first;
-        pattern_info.cluster_id = count;
-        pattern_info.record_num = pattern_info_pair.second;
-        pattern_infos_.push_back(pattern_info);
-        count++;
-    }
-    all_pattern_num_ = count;
     auto PreTrain_end_time = std::chrono::steady_clock::now();
     double PreTrain_time =
         std::chrono::duration<double>(PreTrain_end_time - PreTrain_start_time).count();
     PBC_LOG(INFO) << "end pretrain: current pattern_num = " << all_pattern_num_
+                  << ", state memory = " << StateMemoryUsage() << " bytes"
                   << ", cost time = " << PreTrain_time << "s." << std::endl;
 }
 
+size_t PBC_Train::StateMemoryUsage() const {
+    size_t memory_usage = pattern_arena_.MemoryUsage();
+    memory_usage += patterns_.capacity() * sizeof(Symbol*);
+    memory_usage += (pattern_lens_.capacity() + pattern_capacities_.capacity() +
+                     cluster_ids_.capacity() + record_nums_.capacity() + char_freqs_.capacity() +
+                     bigram_nums_.capacity() + bigram_capacities_.capacity() +
+                     epochs_.capacity() + candidate_counts_.capacity()) *
+                    sizeof(int);
+    memory_usage += (min_value_keys_.capacity() + candidate_bounds_.capacity()) *
+                    sizeof(MinValueKey);
+    memory_usage += one_gram_tables_.capacity() * sizeof(OneGramTable);
+    for (const OneGramTable& one_gram_table : one_gram_tables_) {
+        memory_usage += one_gram_table.MemoryUsage();
+    }
+    memory_usage += pattern_bounds_.capacity() * sizeof(PatternBounds);
+    memory_usage += bigram_tables_.capacity() * sizeof(uint16_t*);
+    memory_usage += candidates_.capacity() * sizeof(Candidate);
+    memory_usage += thresholds_.capacity() * sizeof(std::atomic<int64_t>);
+    return memory_usage;
+}
+
 }  // namespace PBC
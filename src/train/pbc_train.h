@@ -21,16 +21,28 @@
 #include <stdio.h>
 #include <time.h>
 
+#include <algorithm>
+#include <chrono>
 #include <cmath>
 #include <fstream>
+#include <functional>
 #include <iostream>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <string>
 #include <unordered_map>
+#include <unordered_set>
+#include <utility>
 #include <vector>
 
 #include "compress/compress_factory.h"
-#include "train/thread_pool.h"
+#include "train/memory_gate.h"
+#include "train/min_value_heap.h"
+#include "train/one_gram_table.h"
+#include "train/pattern_arena.h"
+#include "train/task_scheduler.h"
+#include "train/token_table.h"
 
 namespace PBC {
 
@@ -42,6 +54,60 @@ public:
     static const size_t DEFAULT_THREAD_NUM;
     static const size_t DEFAULT_SYMBOL_SIZE;
     static const size_t DEFAULT_BUFFER_SIZE;
+    static const int DEFAULT_CANDIDATE_NUM;
+    static const double DEFAULT_MERGE_TOLERANCE;
+    static const double DEFAULT_CHECKPOINT_INTERVAL;
+
+    // Lower bounds of the encoding length checked before the dp, from the cheapest to the most
+    // expensive. No bound prunes a pair the dp would select.
+    enum LowerBound : int {
+        LOWER_BOUND_NONE = 0,
+        LOWER_BOUND_LENGTH = 1,
+        LOWER_BOUND_ANCHOR = 2,
+        LOWER_BOUND_ONE_GRAM = 4,
+        LOWER_BOUND_BIGRAM = 8,
+        LOWER_BOUND_ALL = 15
+    };
+
+    // MERGE_GREEDY merges the closest pair of clusters one at a time. MERGE_RECIPROCAL merges
+    // in rounds: pairs are visited in the greedy (value, cluster id) order and a pair is taken
+    // if its two clusters are strictly nearer to each other than to any other cluster, checked
+    // in both directions. The first pair of each round is the greedy choice, and the round stops
+    // at the first pair whose value exceeds the greedy one by more than the merge tolerance.
+    enum MergeMode : int { MERGE_GREEDY = 0, MERGE_RECIPROCAL = 1 };
+
+    // TRAIN_MERGE merges the loaded records with the encoding length dp. TRAIN_PARSE_TREE first
+    // groups them into templates with a TemplateMiner in one pass, the templates then replace
+    // the records as weighted clusters. With refinement more than k templates are merged down
+    // to k by the dp like records, without it only the k largest templates are kept.
+    enum TrainMethod : int { TRAIN_MERGE = 0, TRAIN_PARSE_TREE = 1 };
+    // COST_UNIT counts every wildcard and every literal symbol left to a residual as 1.
+    // COST_ENTROPY counts them in the bits they take in the compressed records: a wildcard is the
+    // varint of its residual length and a residual symbol is its bytes, both at the bits per byte
+    // the secondary encoder is expected to reach. The estimate takes the numbers and hex ids of
+    // the loaded records as their residuals and codes them by one table of byte frequencies for
+    // fse and zstd, or by 8 bits per byte for pbc_only and fsst. The type byte and pattern id of
+    // a record cost the same under every pattern, so they do not change which pair is cheapest.
+    enum CostModel : int { COST_UNIT = 0, COST_ENTROPY = 1 };
+    // Called with the current cluster number and the target k while clusters are merged
+    typedef std::function<void(int cluster_num, int k)> ProgressCallback;
+
+    // The pattern file of one candidate pattern size evaluated on the holdout records
+    struct PatternSizeReport {
+        // the candidate pattern size and the number of clusters when it was reached
+        int k;
+        int cluster_num;
+        // the length of the pattern file and the number of patterns in it
+        int64_t pattern_len;
+        int pattern_num;
+        // the holdout records and their compressed length
+        int64_t original_len;
+        int64_t compressed_len;
+        // compressed_len / original_len
+        double compress_rate;
+        // MB/s of one thread compressing the holdout
+        double compress_speed;
+    };
 
 public:
     explicit PBC_Train(CompressMethod compress_method = DEFAULT_COMPRESS_METHOD,
@@ -53,6 +119,132 @@ public:
     void LoadData(char* data_buffer, int64_t len, int data_type);
     // Train pattern
     int64_t TrainPattern(int k, char** pattern_buffer);
+    // Run the parallel loops of training on scheduler instead of the scheduler of num_threads
+    // this trainer owns. The scheduler is not owned and may be shared by trainers running at
+    // once, nullptr trains in the calling thread.
+    void SetScheduler(TaskScheduler* scheduler);
+    // Set the lower bounds (LowerBound flags) used to prune pairs, default is LOWER_BOUND_ALL
+    void SetLowerBounds(int lower_bounds) { lower_bounds_ = lower_bounds; }
+    // Set how clusters are merged, default is MERGE_GREEDY
+    void SetMergeMode(MergeMode merge_mode) { merge_mode_ = merge_mode; }
+    // Set the relative value tolerance of a MERGE_RECIPROCAL round, default is
+    // DEFAULT_MERGE_TOLERANCE, i.e. 0. A round only differs from the greedy order where a cluster
+    // merged earlier in the round is nearer to a later pair than the pair is to itself, which
+    // greedy would only see after that merge. With a tolerance of 0 every pair of a round ties
+    // with the greedy choice, a larger tolerance admits pairs up to (1 + tolerance) times its
+    // value, so rounds grow and may deviate more.
+    void SetMergeTolerance(double merge_tolerance) {
+        merge_tolerance_ = std::max(merge_tolerance, 0.0);
+    }
+    // Set what the merge cost of a pair of clusters counts, default is COST_UNIT
+    void SetCostModel(CostModel cost_model) { cost_model_ = cost_model; }
+    // Charge every wildcard segment_penalty bytes more than the cost model does. Decoding a
+    // record reads a varint and copies a residual for each wildcard of its pattern, so a penalty
+    // trades some compress rate for patterns with fewer and longer literals, which decode
+    // faster. Default is 0.
+    void SetSegmentPenalty(double segment_penalty) {
+        segment_penalty_ = std::max(segment_penalty, 0.0);
+    }
+    // Set the number of best candidates kept by each cluster, default is DEFAULT_CANDIDATE_NUM.
+    // More candidates save full rescans after the best candidate merges but loosen the dp
+    // threshold of every scan. The trained patterns are the same for every number.
+    void SetCandidateNum(int candidate_num) { candidate_num_ = std::max(candidate_num, 1); }
+    // Return the number of full rescans after a merge since the trainer was created
+    int64_t GetRescanNum() const { return rescan_num_; }
+    // Split records into tokens on the delimiter bytes before LoadData, the dp then aligns
+    // tokens instead of bytes and every token costs as much as a byte did. Trained patterns are
+    // still byte patterns. An empty string keeps the byte mode, which is the default.
+    void SetTokenDelimiters(const std::string& delimiters);
+    // Group the loaded records whose numbers and hex ids are the only difference before
+    // training. Each group is trained as one cluster weighted by the group size, its pattern is
+    // a member record with a wildcard for every number or hex id the records differ in.
+    // Default is false.
+    void SetCanonicalize(bool canonicalize) { canonicalize_ = canonicalize; }
+    // Split the distinct patterns into shard_num shards before merging them. Every shard is
+    // merged down to k clusters on its own, in parallel when thread_num > 0, then the clusters
+    // of all shards are merged down to k as weighted seeds. Default is 1, i.e. no shards.
+    void SetShardNum(int shard_num) { shard_num_ = std::max(shard_num, 1); }
+    // Add a cluster standing for record_num records before TrainPattern, pattern is in the
+    // escaped form of pattern files. Seeds are trained together with the loaded records.
+    void AddSeedPattern(const char* pattern, int pattern_len, int record_num);
+    // Add the seeds written by SerializeSeeds, return the number of seeds or -1 if the buffer is
+    // malformed
+    int LoadSeeds(const char* seed_buffer, int64_t len);
+    // Write the clusters left by TrainPattern with their record counts, so that another training
+    // run can merge them with LoadSeeds. The buffer is [int32 seed_num] followed by
+    // [int32 record_num, int32 pattern_len, pattern] for every cluster. Return its length.
+    int64_t SerializeSeeds(char** seed_buffer) const;
+    // Write a pattern file of escaped patterns in the given order instead of trained ones, its
+    // secondary encoder data is built from the loaded records as by TrainPattern. Return its
+    // length or -1 if the secondary encoder data could not be built.
+    int64_t WritePatterns(const std::vector<std::string>& escaped_patterns, char** pattern_buffer) {
+        return WritePatternFile(escaped_patterns, pattern_buffer);
+    }
+    // Keep the patterns of an earlier pattern file ahead of the trained ones, so that data
+    // compressed with it still decodes. Records and seeds covered by a base pattern only count
+    // its records, k clusters are trained from the rest and appended behind a "*" pattern which
+    // keeps the id of the records the base did not match, and the secondary encoder
+    // data of the earlier file is kept, so the compress method must be the earlier one. Seeds
+    // written together with the earlier file carry the record counts of its patterns. Return
+    // the number of base patterns or -1 if the buffer is malformed.
+    int LoadBasePatterns(const char* pattern_buffer, int64_t len);
+    // Set how patterns are trained, default is TRAIN_MERGE
+    void SetTrainMethod(TrainMethod train_method, bool refine_templates = true) {
+        train_method_ = train_method;
+        refine_templates_ = refine_templates;
+    }
+    // Stop merging once time_budget seconds passed since TrainPattern started. The clusters
+    // merged so far are then written like the k clusters would be, so the pattern file is still
+    // complete. Default is 0, i.e. no budget.
+    void SetTimeBudget(double time_budget) { time_budget_ = std::max(time_budget, 0.0); }
+    // Keep training under max_memory bytes. Before merging, TrainPattern estimates the peak as
+    // the loaded records, the state of every cluster and a dp workspace for the two longest
+    // patterns on every thread. Evenly spaced distinct records are dropped until the state and
+    // one workspace fit, the kept ones keep their own record counts. Then the workspaces in use
+    // at once are capped by the room left, so threads wait for each other rather than all
+    // allocating their largest tables. TrainPattern fails if the budget can not be met. Default
+    // is 0, i.e. no limit.
+    void SetMaxMemory(int64_t max_memory) { max_memory_ = std::max<int64_t>(max_memory, 0); }
+    // Return the peak memory estimated by the last TrainPattern, in bytes
+    int64_t GetEstimatedPeakMemory() const { return estimated_peak_memory_; }
+    // Report the cluster number about every 1% of the merges and once merging ends
+    void SetProgressCallback(ProgressCallback progress_callback) {
+        progress_callback_ = std::move(progress_callback);
+    }
+    // Return true if the last TrainPattern ran out of its time budget before reaching k
+    bool BudgetExceeded() const { return budget_exceeded_; }
+    // Load the holdout records the candidate pattern sizes are evaluated on, in the format of
+    // LoadData. The buffer must stay alive until TrainPattern returns.
+    void LoadHoldoutData(const char* holdout_buffer, int64_t len, int data_type);
+    // Let TrainPattern choose k among pattern_sizes instead of taking it. Merging goes down to the
+    // smallest size and the clusters are kept as each size is reached. The pattern file of every
+    // size is then written and compresses the holdout records, and the size on the knee of the
+    // compress rate curve over log k is written. An empty list, the default, turns it off.
+    void SetAutoPatternSizes(const std::vector<int>& pattern_sizes);
+    // Return the evaluation of every candidate size of the last TrainPattern by increasing k
+    const std::vector<PatternSizeReport>& GetPatternSizeReports() const {
+        return pattern_size_reports_;
+    }
+    // Return the k chosen by the last TrainPattern, -1 without auto pattern sizes
+    int GetSelectedPatternSize() const { return selected_pattern_size_; }
+    // Write the merge state to checkpoint_path every checkpoint_interval seconds of merging and
+    // when the time budget stops it. The file is replaced by a rename, so a killed run leaves
+    // the last complete checkpoint. An empty path, the default, writes none.
+    void SetCheckpoint(const std::string& checkpoint_path,
+                       double checkpoint_interval = DEFAULT_CHECKPOINT_INTERVAL) {
+        checkpoint_path_ = checkpoint_path;
+        checkpoint_interval_ = checkpoint_interval;
+    }
+    // Write the merge state: every cluster with its pattern, record count, 1-gram table, epoch,
+    // candidate list and min_value_key, the heap entries, the record counts of base patterns
+    // and the patterns kept for auto pattern sizes. Return its length, or -1 before merging.
+    int64_t SerializeCheckpoint(char** checkpoint_buffer) const;
+    // Restore a state written by SerializeCheckpoint. LoadData must have loaded the same records
+    // and the options of the checkpointed run must be set, then TrainPattern goes on merging
+    // where the checkpoint was taken and writes the same patterns as an uninterrupted run.
+    // Return the number of alive clusters, or -1 if the buffer is malformed or was written for
+    // other records.
+    int LoadCheckpoint(const char* checkpoint_buffer, int64_t len);
 
 private:
     struct MinValueKey {
@@ -60,50 +252,64 @@ private:
         int key;
     };
 
-    struct PatternInfo {
-        char* pattern_buffer;
-        int pattern_len;
-        // the state of clusters, cluster_id_[i] != i means cluster i had been merged.
-        int cluster_id;
-        // the number of records in each pattern
-        int record_num;
-        // the frequency of each character
-        int char_freq;
-        // min_value_table_[i] stores the information about the cluster that has
-        // the minimal EL increment for each cluster
-        MinValueKey min_value_key;
-        // the 1-gram std::vector of each pattern
-        std::vector<int> one_gram_table;
-        std::atomic<int> thresholds;
-
-        PatternInfo() : thresholds(0) {}
-
-        PatternInfo(const PatternInfo& pattern_info) {
-            this->pattern_buffer = pattern_info.pattern_buffer;
-            this->pattern_len = pattern_info.pattern_len;
-            this->cluster_id = pattern_info.cluster_id;
-            this->record_num = pattern_info.record_num;
-            this->char_freq = pattern_info.char_freq;
-            this->min_value_key = pattern_info.min_value_key;
-            this->one_gram_table = pattern_info.one_gram_table;
-            this->thresholds.store(pattern_info.thresholds.load());
-        }
-
-        struct PatternInfoHash {
-            size_t operator()(const PatternInfo& pattern_info) const {
-                std::string str(pattern_info.pattern_buffer, pattern_info.pattern_len);
-                return std::hash<std::string>()(str);
-            }
-        };
-
-        struct PatternInfoComparetor {
-            bool operator()(const PatternInfo& pattern_info1,
-                            const PatternInfo& pattern_info2) const {
-                return pattern_info1.pattern_len == pattern_info2.pattern_len &&
-                       memcmp(pattern_info1.pattern_buffer, pattern_info2.pattern_buffer,
-                              pattern_info1.pattern_len) == 0;
-            }
-        };
+    // A cluster behind the owner cluster with their minimal EL increment. The candidate is stale
+    // once the cluster is merged away or its epoch changes.
+    struct Candidate {
+        int value;
+        int key;
+        int epoch;
+    };
+
+    // The symbol statistics of a pattern checked together by the lower bounds
+    struct PatternBounds {
+        // the number of literal symbols and wildcards of the pattern
+        int literal_num;
+        int wildcard_num;
+        // the first and last symbol of the pattern, WILDCARD_SYMBOL if it is a wildcard
+        int first_symbol;
+        int last_symbol;
+        // whether the pattern contains an escaped '*'
+        bool has_literal_star;
+    };
+
+    // The trained patterns kept when merging reached an auto pattern size
+    struct SizeCandidate {
+        int k;
+        int cluster_num;
+        std::vector<std::string> trained_patterns;
+    };
+
+    // Hash and compare distinct patterns by cluster id, LOOKUP_ID stands for lookup_symbols_
+    static const int LOOKUP_ID = -1;
+    struct PatternIdHash {
+        const PBC_Train* train;
+        size_t operator()(int id) const;
+    };
+    struct PatternIdEqual {
+        const PBC_Train* train;
+        bool operator()(int id1, int id2) const;
+    };
+
+    // Patterns are arrays of symbols: a byte of the records, a token of token_table_ in the
+    // tokenized mode, or WILDCARD_SYMBOL. Only the serialized patterns use the escaped form, where
+    // '*' is a wildcard and '\\' escapes a literal '*' or '\\'.
+    typedef uint16_t Symbol;
+    static const int WILDCARD_SYMBOL = 256;
+
+    // The pairs pruned by each lower bound and the pairs reaching the dp, counted by each scan on
+    // its own and added to the totals once it ends
+    struct PruneCounts {
+        int64_t lower_bound_hits[4] = {0, 0, 0, 0};
+        int64_t dp_num = 0;
+    };
+
+    // The costs of a pair of clusters in the dp: every record of a cluster pays wildcard for each
+    // wildcard of its pattern and symbol for each literal symbol left to its residual
+    struct MergeWeights {
+        int wildcard_a;
+        int wildcard_b;
+        int symbol_a;
+        int symbol_b;
     };
 
     enum Type : unsigned char { pat, fs };
@@ -113,49 +319,172 @@ private:
     // Read a pattern from data buffer which is follow format: [varint + data] ... [varint + data]
     int64_t ReadPatternFromDataBuffer(int64_t& data_pos, int64_t max_len, const char* src_buffer,
                                       char* dest_buffer, int data_type);
-    // Compute the state transfer
-    static int UpdateState(int cur_state, enum Type suf_type, bool isWildcard, int num_a,
-                           int num_b);
-    // Compute the merged pattern of two patterns
-    static int MergePattern(const char* str_a, const char* str_b, int len_a, int len_b, int num_a,
-                            int num_b, std::string& str);
-    // Adding escape string to initialize strings
-    static char* AddEscapeChar(char* str, int64_t& len);
+    // Add lookup_symbols_ as a distinct pattern standing for record_num records
+    void AddLookupPattern(int record_num);
+    // Remove all distinct patterns
+    void ClearPatterns();
+    // Merge the distinct patterns down to k clusters
+    void MergeClusters(int k);
+    // Replace the distinct patterns by the clusters of shard_num_ shards
+    void TrainShards(int k);
+    // Return true if the time budget is set and its deadline passed
+    bool DeadlineReached() const {
+        return time_budget_ > 0.0 && std::chrono::steady_clock::now() >= deadline_;
+    }
+    // Return the escaped patterns of the alive clusters which go into the pattern file
+    void CollectTrainedPatterns(std::vector<std::string>& trained_patterns) const;
+    // Write the base patterns, the trained patterns and the secondary encoder data into a new
+    // pattern buffer, return its length or -1 on failure
+    int64_t WritePatternFile(const std::vector<std::string>& trained_patterns,
+                             char** pattern_buffer);
+    // Write the merge state to checkpoint_path_, return false on failure
+    bool WriteCheckpoint() const;
+    // Return a fingerprint of the loaded records for checkpoints
+    uint64_t DataFingerprint() const;
+    // Write the pattern file of every auto pattern size, evaluate it on the holdout records and
+    // keep the one on the knee
+    int64_t SelectPatternSize(char** pattern_buffer);
+    // Compress the holdout records with a pattern file into report
+    bool EvaluateHoldout(const char* pattern_buffer, int64_t pattern_len,
+                         PatternSizeReport& report);
+    // Return the escaped pattern and record count of every alive cluster
+    void CollectClusters(std::vector<std::pair<std::string, int>>& clusters) const;
+    // Count the distinct patterns covered by a base pattern in its records and remove them
+    void AbsorbByBasePatterns();
+    // Return true if the literal symbols of record match pattern as a whole
+    static bool MatchPattern(const Symbol* pattern, int pattern_len, const Symbol* record,
+                             int record_len);
+    // Replace the distinct patterns by one pattern of each canonical group
+    void CanonicalizePatterns();
+    // Parse a pattern in the escaped form into lookup_symbols_
+    void ParseLookupPattern(const std::string& pattern);
+    // Replace the distinct patterns by the templates of a TemplateMiner
+    void MineTemplates(int k);
+    // Compute the state transfer, the weights are those of the cluster of the suffix symbol
+    static int UpdateState(int cur_state, enum Type suf_type, bool isWildcard, int wildcard_a,
+                           int wildcard_b, int symbol_a);
+    // Compute the merged pattern of two patterns. In the byte mode merged is the escaped form
+    // with '*' as WILDCARD_SYMBOL, otherwise it is the merged symbols.
+    static int MergePattern(const Symbol* symbols_a, const Symbol* symbols_b, int len_a, int len_b,
+                            const MergeWeights& weights, std::vector<Symbol>& merged);
+    // Return true if the symbol is escaped in the escaped form
+    static bool IsEscapedSymbol(int symbol) { return symbol == '*' || symbol == '\\'; }
+    // Fold a symbol into the byte sized buckets of the 1-gram and bigram tables. Folding merges
+    // the counts of tokens, which only overestimates the common symbols of two patterns.
+    static int SymbolBucket(int symbol) { return symbol & 0xff; }
+    // Convert symbols to the escaped form
+    void SerializePattern(const Symbol* symbols, int len, std::string& str) const;
+    // Convert a pattern in the escaped form to symbols
+    static void ParsePattern(const char* str, int len, std::vector<Symbol>& symbols);
+    // Fill the dp tables of two patterns and return their min encoding length, or INT_MAX once a
+    // row reaches threshold()
+    template <class Threshold>
+    static int FillTables(std::vector<std::vector<Type>>& type_table,
+                          std::vector<std::vector<int>>& state_table,
+                          std::vector<std::vector<SourcePos>>& trans_sources,
+                          const Symbol* symbols_a, const Symbol* symbols_b, int len_a, int len_b,
+                          const MergeWeights& weights, const Threshold& threshold);
     // Construct tables by dynamic programming and return min encoding length
     static int ConstructTables(std::vector<std::vector<Type>>& type_table,
                                std::vector<std::vector<int>>& state_table,
                                std::vector<std::vector<SourcePos>>& trans_sources,
-                               const char* str_a, const char* str_b, int len_a, int len_b,
-                               int num_a, int num_b, int threshold);
-    // Compute the minimal encoding length of two strings
-    static int MinEncodingLength(const char* str_a, const char* str_b, int len_a, int len_b,
-                                 int num_a, int num_b, int threshold);
+                               const Symbol* symbols_a, const Symbol* symbols_b, int len_a,
+                               int len_b, const MergeWeights& weights, int threshold);
+    // Compute the minimal encoding length of two patterns
+    static int MinEncodingLength(const Symbol* symbols_a, const Symbol* symbols_b, int len_a,
+                                 int len_b, const MergeWeights& weights, int threshold);
 
     // Construct tables by dynamic programming and return min encoding length
     int ConstructTablesMultiThreads(std::vector<std::vector<Type>>& type_table,
                                     std::vector<std::vector<int>>& state_table,
                                     std::vector<std::vector<SourcePos>>& trans_sources,
-                                    const char* str_a, const char* str_b, int len_a, int len_b,
-                                    int num_a, int num_b, int threshold) const;
-    // Compute the minimal encoding length of two strings
-    int MinEncodingLengthMultiThreads(const char* str_a, const char* str_b, int len_a, int len_b,
-                                      int num_a, int num_b, int threshold_id) const;
+                                    const Symbol* symbols_a, const Symbol* symbols_b, int len_a,
+                                    int len_b, const MergeWeights& weights, int threshold_id,
+                                    int key) const;
+    // Compute the minimal encoding length of two patterns
+    int MinEncodingLengthMultiThreads(const Symbol* symbols_a, const Symbol* symbols_b, int len_a,
+                                      int len_b, const MergeWeights& weights, int threshold_id,
+                                      int key) const;
+    // Return the dp weights of merging cluster_id2 into cluster_id1
+    MergeWeights GetMergeWeights(int cluster_id1, int cluster_id2) const {
+        int num_a = record_nums_[cluster_id1], num_b = record_nums_[cluster_id2];
+        return {num_a * wildcard_cost_, num_b * wildcard_cost_, num_a * symbol_cost_,
+                num_b * symbol_cost_};
+    }
+    // Set wildcard_cost_ and symbol_cost_ by the cost model and the segment penalty
+    void ComputeMergeCosts();
+    // Estimate the bits of a wildcard and a literal symbol of COST_ENTROPY from the loaded records
+    void EstimateEntropyCosts(double& wildcard_bits, double& symbol_bits) const;
+
+    // Compute the symbol statistics used by the lower bounds from the pattern of cluster_id
+    void ComputePatternBounds(int cluster_id);
+    // Store pattern as the pattern of cluster_id, reusing its arena slot if the pattern fits
+    void StorePattern(int cluster_id, const Symbol* symbols, int pattern_len);
+    // Return the number of bigrams shared by two sorted bigram tables
+    static int CommonBigramCount(const uint16_t* bigram_table1, int bigram_num1,
+                                 const uint16_t* bigram_table2, int bigram_num2);
+    // Return true if a lower bound of the encoding length of cluster1 and cluster2 reaches
+    // threshold, the bounds are evaluated from the cheapest to the most expensive
+    bool PruneByLowerBounds(int cluster_id1, int cluster_id2, int threshold,
+                            PruneCounts& prune_counts) const;
+    // Add the counts of partial to result
+    static void AddCounts(PruneCounts& result, const PruneCounts& partial);
+    // Add the counts of a scan to the totals
+    void AddPruneCounts(const PruneCounts& prune_counts);
 
     // Get minimal encoding length of cluster1 and cluster2
-    int GetMinEncodingLength(int cluster_id1, int cluster_id2, int threshold) const;
-    int GetMinEncodingLengthMultiThreads(int cluster_id1, int cluster_id2);
-    // Get min value of cluster cluster_id
+    int GetMinEncodingLength(int cluster_id1, int cluster_id2, int threshold,
+                             PruneCounts& prune_counts) const;
+    int GetMinEncodingLengthMultiThreads(int cluster_id1, int cluster_id2,
+                                         PruneCounts& prune_counts);
+    // Return true if candidate1 < candidate2 in (value, key) order
+    static bool CandidateLess(int value1, int key1, int value2, int key2) {
+        return value1 < value2 || (value1 == value2 && key1 < key2);
+    }
+    // Return true if the candidate is not merged away and its pattern has not changed
+    bool IsCandidateValid(const Candidate& candidate) const;
+    // Return the candidate slots of cluster cluster_id
+    Candidate* CandidateList(int cluster_id) {
+        return &candidates_[static_cast<size_t>(cluster_id) * candidate_num_];
+    }
+    // Insert the candidate into the candidate list of cluster cluster_id if it is not greater
+    // than the candidate bound
+    void InsertCandidate(int cluster_id, int value, int key);
+    // Return the threshold at which candidate key can not enter a list with the given bound
+    static int CandidateThreshold(const MinValueKey& bound, int key);
+    // Return the threshold of candidate key from the packed bound of cluster cluster_id
+    int LoadCandidateThreshold(int cluster_id, int key) const;
+    static int64_t PackCandidateBound(const MinValueKey& bound) {
+        return (static_cast<int64_t>(bound.value) << 32) | static_cast<uint32_t>(bound.key);
+    }
+    // Get min value of cluster cluster_id and rebuild its candidate list
     PBC_Train::MinValueKey GetMinValue(int cluster_id, bool skip_non_original_cluster);
     void ComputeMinValue(int cluster_id, bool skip_non_original_cluster);
-    // Get closest cluster
+    // Get closest cluster, i.e. the top of min_value_heap_
     void GetClosestCluster(int& cluster_id1, int& cluster_id2) const;
     // Compute the minimal encoding length and corresponding cluster for each cluster (the
     // min_value_table_). To avoid duplicate computation, cluster(pattern_id = i) only compare with
-    // clusters(pattern_id > i)
-    void ComputeTotalMinValueTable();
-    // Update the min_value of cluster cluster_id after cluster changed_cluster_id merges other
-    // cluster
-    void UpdateMinValueTable(int cluster_id, int changed_cluster_id1, int changed_cluster_id2);
+    // clusters(pattern_id > i). Return false if the deadline passed before it was complete.
+    bool ComputeTotalMinValueTable();
+    // Get disjoint reciprocal pairs of clusters for one round of MERGE_RECIPROCAL, at most
+    // max_pair_num pairs
+    void GetReciprocalClusters(int max_pair_num, std::vector<std::pair<int, int>>& merge_pairs);
+    // Merge cluster cluster_id2 into cluster cluster_id1 and update the pattern of cluster_id1
+    void MergeCluster(int cluster_id1, int cluster_id2);
+    // Update the min_value of cluster cluster_id after the clusters in changed_cluster_ids (sorted)
+    // merge other clusters, return true if the min_value of cluster cluster_id changed
+    bool UpdateMinValueTable(int cluster_id, const std::vector<int>& changed_cluster_ids,
+                             PruneCounts& prune_counts);
+
+    // Locate the non-empty records of a buffer in the format of LoadData, return the max length
+    static int32_t LocateRecords(const char* buffer, int64_t len, int data_type,
+                                 std::vector<int64_t>& record_positions,
+                                 std::vector<int32_t>& record_lens);
+    // Compress the loaded records by pbc_only with the patterns of pattern_buffer, in parallel
+    // when thread_num_ > 0. The outputs are put back to back into samples in record order, the
+    // i-th one starts at sample_offsets[i] and the last offset is the total length.
+    bool CompressSamples(const char* pattern_buffer, int64_t pattern_len,
+                         std::vector<char>& samples, std::vector<size_t>& sample_offsets);
 
     // Create fse table using compressed data of train data compressed by pbc_only
     bool CreateFseTableUsingCompressedData(char* pattern_buffer, int64_t& pattern_len);
@@ -169,22 +498,152 @@ private:
     // Create secondary encoder(fse, fsst, zstd) data
     bool CreateSecondaryEncoderData(char* pattern_buffer, int64_t& pattern_len);
 
+    // The memory TrainPattern expects to take besides the buffers of the caller
+    struct MemoryEstimate {
+        // the loaded and holdout records, the patterns and the state of all clusters
+        int64_t data_bytes;
+        int64_t state_bytes;
+        // one dp workspace for the two longest patterns and the number in use at once
+        int64_t dp_bytes;
+        int dp_num;
+
+        int64_t Peak() const { return data_bytes + state_bytes + dp_bytes * dp_num; }
+    };
+    // Return the bytes of the dp tables of two patterns
+    static int64_t DpWorkspaceBytes(int len_a, int len_b);
+    // Return the bytes of the arena state of patterns with symbol_num symbols in total
+    static int64_t ArenaStateBytes(int64_t symbol_num);
+    MemoryEstimate EstimateMemory() const;
+    // Drop distinct records and set dp_gate_ to fit max_memory_, then log the estimate. Return
+    // false if the records and one dp workspace do not fit with any number of records kept.
+    bool FitMemoryBudget();
+    // Keep keep_num evenly spaced distinct patterns, all of them if keep_num is all_pattern_num_,
+    // in arena blocks scaled to them. Return the number of records of the dropped ones.
+    int64_t SamplePatterns(int keep_num);
+
     // Pre operations(such as ) before start train data
     void PreTrain();
+    // Return the bytes used by the training state of all clusters
+    size_t StateMemoryUsage() const;
 
 private:
     CompressMethod compress_method_;
     int thread_num_;
-    ThreadPool* thread_pool_ = nullptr;
-    ThreadPool* thread_pool2_ = nullptr;
+    // runs the nested parallel loops of training when thread_num_ > 0, owned unless set by
+    // SetScheduler
+    TaskScheduler* scheduler_ = nullptr;
+    bool owns_scheduler_ = false;
+    // the tokens of the tokenized mode, nullptr in the byte mode
+    TokenTable* token_table_ = nullptr;
+    std::string token_delimiters_;
     size_t symbol_size_;
     size_t buffer_size_;
-    char* data_buffer_;
-    uint64_t len_;
-    std::vector<PatternInfo> pattern_infos_;
-    // the initial pattern number
-    int32_t all_pattern_num_;
+    char* data_buffer_ = nullptr;
+    uint64_t len_ = 0;
+    // the number of records read by LoadData and the number of their symbols
+    int64_t record_num_ = 0;
+    int64_t symbol_num_ = 0;
+    // the initial pattern number, i.e. the number of distinct records
+    int32_t all_pattern_num_ = 0;
+
+    // The training state of each cluster as parallel arrays indexed by cluster id. Patterns and
+    // bigram tables live in pattern_arena_, merging rewrites them in place when they fit.
+    PatternArena pattern_arena_;
+    // the symbols of each pattern, and the length it may grow to in place
+    std::vector<Symbol*> patterns_;
+    std::vector<int> pattern_lens_;
+    std::vector<int> pattern_capacities_;
+    // the state of clusters, cluster_ids_[i] != i means cluster i had been merged
+    std::vector<int> cluster_ids_;
+    // the number of records in each cluster
+    std::vector<int> record_nums_;
+    // the number of literal characters of each pattern
+    std::vector<int> char_freqs_;
+    // the cluster with the minimal EL increment for each cluster
+    std::vector<MinValueKey> min_value_keys_;
+    // the compact 1-gram table of each pattern
+    std::vector<OneGramTable> one_gram_tables_;
+    std::vector<PatternBounds> pattern_bounds_;
+    // the sorted bigrams of adjacent literal symbols for bigram pruning
+    std::vector<uint16_t*> bigram_tables_;
+    std::vector<int> bigram_nums_;
+    std::vector<int> bigram_capacities_;
+    // increased every time a pattern changes, used to detect stale candidates
+    std::vector<int> epochs_;
+    // candidate_num_ slots per cluster, the first candidate_counts_[i] slots of cluster i hold
+    // its best candidates sorted by (value, key). Every alive cluster behind cluster i which is
+    // not in the list is greater than candidate_bounds_[i], which is the last candidate once the
+    // list is full.
+    std::vector<Candidate> candidates_;
+    std::vector<int> candidate_counts_;
+    std::vector<MinValueKey> candidate_bounds_;
+    // candidate_bounds_ packed by PackCandidateBound, read by the parallel dp
+    std::vector<std::atomic<int64_t>> thresholds_;
+
+    // The distinct patterns found by LoadData, numbered in the order they first appear
+    std::vector<size_t> pattern_hashes_;
+    std::vector<Symbol> lookup_symbols_;
+    size_t lookup_hash_ = 0;
+    std::unordered_set<int, PatternIdHash, PatternIdEqual> pattern_set_;
     int data_type_;
+    // the patterns of LoadBasePatterns in the escaped form and as byte symbols, with their
+    // record counts and the secondary encoder data that followed them
+    bool has_base_ = false;
+    std::vector<std::string> base_patterns_;
+    std::vector<std::vector<Symbol>> base_symbols_;
+    std::vector<int> base_record_nums_;
+    std::unordered_map<std::string, int> base_ids_;
+    std::string base_encoder_data_;
+    // the min_value_key of every alive cluster ordered by (value, cluster id)
+    MinValueHeap min_value_heap_;
+    // enabled LowerBound flags
+    int lower_bounds_ = LOWER_BOUND_ALL;
+    MergeMode merge_mode_ = MERGE_GREEDY;
+    TrainMethod train_method_ = TRAIN_MERGE;
+    bool canonicalize_ = false;
+    int shard_num_ = 1;
+    bool refine_templates_ = true;
+    double merge_tolerance_ = DEFAULT_MERGE_TOLERANCE;
+    // the cost model, the segment penalty in bytes and the dp costs of a wildcard and a literal
+    // symbol per record they take
+    CostModel cost_model_ = COST_UNIT;
+    double segment_penalty_ = 0.0;
+    int wildcard_cost_ = 1;
+    int symbol_cost_ = 1;
+    // the memory limit in bytes, 0 for none, the peak estimated by the last TrainPattern, and
+    // the bound of the dp workspaces in use at once when not all threads fit under the limit
+    int64_t max_memory_ = 0;
+    int64_t estimated_peak_memory_ = 0;
+    std::shared_ptr<MemoryGate> dp_gate_;
+    // the time budget in seconds and its deadline, set when TrainPattern starts
+    double time_budget_ = 0.0;
+    std::chrono::steady_clock::time_point deadline_;
+    bool budget_exceeded_ = false;
+    ProgressCallback progress_callback_;
+    // the candidate sizes in decreasing order, the trained patterns kept when merging reached
+    // each of them, and the evaluations of the last TrainPattern
+    std::vector<int> auto_pattern_sizes_;
+    std::vector<SizeCandidate> size_candidates_;
+    std::vector<PatternSizeReport> pattern_size_reports_;
+    int selected_pattern_size_ = -1;
+    // the file written by WriteCheckpoint, and whether LoadCheckpoint restored a merge state
+    std::string checkpoint_path_;
+    double checkpoint_interval_ = DEFAULT_CHECKPOINT_INTERVAL;
+    bool resumed_ = false;
+    const char* holdout_buffer_ = nullptr;
+    int64_t holdout_len_ = 0;
+    int holdout_data_type_ = 0;
+    // the clusters touched by a pair of the current MERGE_RECIPROCAL round
+    std::vector<bool> round_touched_;
+    // the max size of the candidate list of each cluster
+    int candidate_num_ = DEFAULT_CANDIDATE_NUM;
+    // protect the candidate list of each cluster when the dp runs in parallel
+    std::vector<std::mutex> candidate_mutexes_;
+    // the number of full rescans in UpdateMinValueTable
+    std::atomic<int64_t> rescan_num_;
+    // the number of pairs pruned by each lower bound, and the number of pairs reaching the dp
+    std::atomic<int64_t> lower_bound_hits_[4];
+    std::atomic<int64_t> dp_num_;
 };
 }  // namespace PBC
 #endif  // SRC_TRAIN_PBC_TRAIN_H_
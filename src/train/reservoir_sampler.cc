@@ -0,0 +1,216 @@
+/*
+ * Copyright 2023 The PBC Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include "train/reservoir_sampler.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+
+#include "base/memcpy.h"
+#include "common/utils.h"
+
+namespace PBC {
+
+const uint64_t ReservoirSampler::DEFAULT_SEED = 5489;
+
+namespace {
+
+bool StreamFd(int fd, const char* path, int32_t input_type,
+              const std::function<void(const char*, int32_t)>& record_callback,
+              int64_t chunk_size) {
+    std::vector<char> chunk(std::max<int64_t>(chunk_size, 1));
+    // the head of a record which goes on in the next chunk
+    std::string pending;
+    while (true) {
+        ssize_t read_len = read(fd, chunk.data(), chunk.size());
+        if (read_len < 0 && errno == EINTR) {
+            continue;
+        }
+        if (read_len < 0) {
+            PBC_LOG(ERROR) << "read failed: " << path << std::endl;
+            return false;
+        }
+        if (read_len == 0) {
+            break;
+        }
+        if (input_type == TYPE_RECORD) {
+            const char* begin = chunk.data();
+            const char* end = chunk.data() + read_len;
+            while (begin < end) {
+                const char* newline =
+                    reinterpret_cast<const char*>(memchr(begin, '\n', end - begin));
+                if (newline == nullptr) {
+                    pending.append(begin, end - begin);
+                    break;
+                }
+                if (pending.empty()) {
+                    record_callback(begin, newline - begin);
+                } else {
+                    pending.append(begin, newline - begin);
+                    record_callback(pending.data(), pending.size());
+                    pending.clear();
+                }
+                begin = newline + 1;
+            }
+        } else {
+            pending.append(chunk.data(), read_len);
+            size_t pos = 0;
+            while (pending.size() - pos >= sizeof(int32_t)) {
+                int32_t record_len = 0;
+                pbc_memcpy(&record_len, pending.data() + pos, sizeof(int32_t));
+                if (record_len < 0) {
+                    PBC_LOG(ERROR) << "invalid record length " << record_len << ": " << path
+                                   << std::endl;
+                    return false;
+                }
+                if (pending.size() - pos - sizeof(int32_t) < static_cast<size_t>(record_len)) {
+                    break;
+                }
+                record_callback(pending.data() + pos + sizeof(int32_t), record_len);
+                pos += sizeof(int32_t) + record_len;
+            }
+            pending.erase(0, pos);
+        }
+    }
+    if (input_type == TYPE_RECORD && !pending.empty()) {
+        record_callback(pending.data(), pending.size());
+    } else if (input_type == TYPE_VARCHAR && !pending.empty()) {
+        PBC_LOG(ERROR) << "truncated record at the end of " << path << std::endl;
+        return false;
+    }
+    return true;
+}
+
+}  // namespace
+
+bool StreamRecords(const char* path, int32_t input_type,
+                   const std::function<void(const char*, int32_t)>& record_callback,
+                   int64_t chunk_size) {
+    if (path == nullptr || !strcmp(path, "-")) {
+        return StreamFd(STDIN_FILENO, "stdin", input_type, record_callback, chunk_size);
+    }
+    struct stat statbuf;
+    if (stat(path, &statbuf) != 0) {
+        PBC_LOG(ERROR) << "The input path does not exist: " << path << std::endl;
+        return false;
+    }
+    if (S_ISDIR(statbuf.st_mode)) {
+        DIR* dir = opendir(path);
+        if (dir == nullptr) {
+            PBC_LOG(ERROR) << "can't open directory: " << path << std::endl;
+            return false;
+        }
+        std::vector<std::string> names;
+        for (struct dirent* entry = readdir(dir); entry != nullptr; entry = readdir(dir)) {
+            if (strcmp(entry->d_name, ".") && strcmp(entry->d_name, "..")) {
+                names.push_back(entry->d_name);
+            }
+        }
+        closedir(dir);
+        std::sort(names.begin(), names.end());
+        for (const std::string& name : names) {
+            std::string child_path = std::string(path) + "/" + name;
+            if (!StreamRecords(child_path.c_str(), input_type, record_callback, chunk_size)) {
+                return false;
+            }
+        }
+        return true;
+    }
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        PBC_LOG(ERROR) << "can't open file: " << path << std::endl;
+        return false;
+    }
+    bool success = StreamFd(fd, path, input_type, record_callback, chunk_size);
+    close(fd);
+    return success;
+}
+
+ReservoirSampler::ReservoirSampler(int64_t sample_num, uint64_t seed)
+    : sample_num_(std::max<int64_t>(sample_num, 0)), generator_(seed) {
+    next_index_ = sample_num_;
+}
+
+double ReservoirSampler::RandomUnit() {
+    // in (0, 1) so that its logarithm is finite
+    return ((generator_() >> 11) + 0.5) / 9007199254740992.0;
+}
+
+void ReservoirSampler::NextSkip() {
+    double skip = std::floor(std::log(RandomUnit()) / std::log1p(-w_));
+    next_index_ += static_cast<int64_t>(std::min(skip, 1e18)) + 1;
+}
+
+void ReservoirSampler::Add(const char* record, int32_t len) {
+    int64_t index = seen_num_++;
+    if (sample_num_ <= 0) {
+        return;
+    }
+    if (index < sample_num_) {
+        sample_.emplace_back(index, std::string(record, len));
+        sample_bytes_ += len;
+        if (index + 1 == sample_num_) {
+            w_ = std::exp(std::log(RandomUnit()) / sample_num_);
+            next_index_ = index;
+            NextSkip();
+        }
+        return;
+    }
+    if (index < next_index_) {
+        return;
+    }
+    std::pair<int64_t, std::string>& replaced =
+        sample_[std::uniform_int_distribution<int64_t>(0, sample_num_ - 1)(generator_)];
+    sample_bytes_ += len - static_cast<int64_t>(replaced.second.size());
+    replaced.first = index;
+    replaced.second.assign(record, len);
+    w_ *= std::exp(std::log(RandomUnit()) / sample_num_);
+    NextSkip();
+}
+
+int64_t ReservoirSampler::Serialize(char** data_buffer, int64_t& record_num,
+                                    int32_t& max_record_len) const {
+    std::vector<const std::pair<int64_t, std::string>*> records;
+    for (const auto& record : sample_) {
+        records.push_back(&record);
+    }
+    std::sort(records.begin(), records.end(),
+              [](const std::pair<int64_t, std::string>* a,
+                 const std::pair<int64_t, std::string>* b) { return a->first < b->first; });
+    int64_t data_buffer_len = sample_bytes_ + records.size() * sizeof(int32_t);
+    *data_buffer = new char[std::max<int64_t>(data_buffer_len, 1)];
+    int64_t pos = 0;
+    record_num = records.size();
+    max_record_len = 0;
+    for (const auto* record : records) {
+        int32_t record_len = record->second.size();
+        pbc_memcpy(*data_buffer + pos, &record_len, sizeof(int32_t));
+        pbc_memcpy(*data_buffer + pos + sizeof(int32_t), record->second.data(), record_len);
+        pos += sizeof(int32_t) + record_len;
+        max_record_len = std::max(max_record_len, record_len);
+    }
+    return data_buffer_len;
+}
+
+}  // namespace PBC
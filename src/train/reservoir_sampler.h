@@ -0,0 +1,73 @@
+/*
+ * Copyright 2023 The PBC Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#ifndef SRC_TRAIN_RESERVOIR_SAMPLER_H_
+#define SRC_TRAIN_RESERVOIR_SAMPLER_H_
+
+#include <cstdint>
+#include <functional>
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace PBC {
+
+// Call record_callback for every record of a file, of every file under a directory in name order,
+// or of stdin if path is nullptr or "-", reading chunk_size bytes at a time, so memory does not
+// grow with the input. input_type is TYPE_RECORD or TYPE_VARCHAR as for ReadDataFromBuffer, a
+// record of a file of TYPE_RECORD ends at '\n' or at the end of the file. Return false if a path
+// can not be read or a varchar file is truncated.
+bool StreamRecords(const char* path, int32_t input_type,
+                   const std::function<void(const char*, int32_t)>& record_callback,
+                   int64_t chunk_size = 1 << 20);
+
+// Uniform sample of a fixed number of records of a stream of unknown length, with the skips of
+// Li's algorithm L, so the random generator runs once per record kept rather than once per record
+// seen. Only the sampled records are stored.
+class ReservoirSampler {
+public:
+    static const uint64_t DEFAULT_SEED;
+
+public:
+    explicit ReservoirSampler(int64_t sample_num, uint64_t seed = DEFAULT_SEED);
+
+    void Add(const char* record, int32_t len);
+    // Write the sampled records in input order in the format of ReadDataFromBuffer into a new
+    // data_buffer and return its length
+    int64_t Serialize(char** data_buffer, int64_t& record_num, int32_t& max_record_len) const;
+
+    int64_t SeenNum() const { return seen_num_; }
+    int64_t SampleBytes() const { return sample_bytes_; }
+
+private:
+    double RandomUnit();
+    // Draw the index of the next record to replace one of the sample
+    void NextSkip();
+
+private:
+    int64_t sample_num_;
+    std::mt19937_64 generator_;
+    // the sampled records with their index in the stream
+    std::vector<std::pair<int64_t, std::string>> sample_;
+    int64_t seen_num_ = 0;
+    int64_t sample_bytes_ = 0;
+    double w_ = 1.0;
+    int64_t next_index_ = 0;
+};
+
+}  // namespace PBC
+#endif  // SRC_TRAIN_RESERVOIR_SAMPLER_H_
@@ -0,0 +1,205 @@
+/*
+ * Copyright 2023 The PBC Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include "train/stratified_sampler.h"
+
+#include <algorithm>
+#include <chrono>  // NOLINT
+#include <cmath>
+#include <cstring>
+#include <iostream>
+#include <unordered_map>
+
+#include "base/memcpy.h"
+#include "common/utils.h"
+#include "train/token_table.h"
+
+namespace PBC {
+
+const int StratifiedSampler::DEFAULT_KEY_TOKEN_NUM = 2;
+
+namespace {
+
+const uint64_t FNV_OFFSET = 14695981039346656037ULL;
+const uint64_t FNV_PRIME = 1099511628211ULL;
+
+uint64_t HashByte(uint64_t hash, unsigned char byte) { return (hash ^ byte) * FNV_PRIME; }
+
+}  // namespace
+
+uint64_t StratifiedSampler::Signature(const char* record, int32_t len) const {
+    static const struct Delimiters {
+        bool table[256];
+        Delimiters() {
+            memset(table, 0, sizeof(table));
+            for (const char* c = TokenTable::DEFAULT_DELIMITERS; *c != '\0'; c++) {
+                table[static_cast<unsigned char>(*c)] = true;
+            }
+        }
+    } delimiters;
+
+    uint64_t shape_hash = FNV_OFFSET, key_hash = FNV_OFFSET;
+    int key_num = 0;
+    for (int32_t i = 0; i < len;) {
+        unsigned char c = record[i];
+        if (delimiters.table[c]) {
+            shape_hash = HashByte(shape_hash, c);
+            i++;
+            continue;
+        }
+        int32_t word_begin = i;
+        bool has_digit = false;
+        while (i < len && !delimiters.table[static_cast<unsigned char>(record[i])]) {
+            has_digit = has_digit || (record[i] >= '0' && record[i] <= '9');
+            i++;
+        }
+        shape_hash = HashByte(shape_hash, has_digit ? 'n' : 'a');
+        if (!has_digit && key_num < key_token_num_) {
+            for (int32_t j = word_begin; j < i; j++) {
+                key_hash = HashByte(key_hash, record[j]);
+            }
+            // separate the key words
+            key_hash = HashByte(key_hash, 0);
+            key_num++;
+        }
+    }
+    return shape_hash ^ (key_hash * FNV_PRIME);
+}
+
+void StratifiedSampler::AllocateQuotas(const std::vector<int64_t>& sizes, int64_t train_num,
+                                       std::vector<int64_t>& quotas) {
+    int64_t stratum_num = sizes.size();
+    quotas.assign(stratum_num, 0);
+    // one record from each of the largest strata while there are more strata than records
+    int64_t remain = train_num;
+    for (int64_t i = 0; i < stratum_num && remain > 0; i++) {
+        quotas[i] = 1;
+        remain--;
+    }
+    // the rest by the square root of the sizes, a stratum takes at most all its records
+    while (remain > 0) {
+        double total_weight = 0.0;
+        for (int64_t i = 0; i < stratum_num; i++) {
+            if (quotas[i] < sizes[i]) total_weight += std::sqrt(static_cast<double>(sizes[i]));
+        }
+        if (total_weight == 0.0) {
+            break;
+        }
+        int64_t round_remain = remain;
+        for (int64_t i = 0; i < stratum_num && remain > 0; i++) {
+            if (quotas[i] >= sizes[i]) continue;
+            int64_t share = static_cast<int64_t>(
+                round_remain * std::sqrt(static_cast<double>(sizes[i])) / total_weight);
+            share = std::min(std::min(share, sizes[i] - quotas[i]), remain);
+            quotas[i] += share;
+            remain -= share;
+        }
+        // the rounded down shares are left, hand them out one by one from the largest stratum
+        if (remain == round_remain) {
+            for (int64_t i = 0; i < stratum_num && remain > 0; i++) {
+                if (quotas[i] < sizes[i]) {
+                    quotas[i]++;
+                    remain--;
+                }
+            }
+        }
+    }
+}
+
+int64_t StratifiedSampler::Sample(const char* data_buffer, int64_t data_buffer_len,
+                                  int64_t record_num, char** train_buffer, int64_t train_num,
+                                  double phase) {
+    auto start_time = std::chrono::steady_clock::now();
+    std::vector<int64_t> record_positions(record_num);
+    int64_t buffer_ptr = 0;
+    for (int64_t i = 0; i < record_num; i++) {
+        record_positions[i] = buffer_ptr;
+        int32_t record_len = 0;
+        pbc_memcpy(&record_len, data_buffer + buffer_ptr, sizeof(int32_t));
+        buffer_ptr += sizeof(int32_t) + record_len;
+    }
+
+    // the signatures are computed by blocks of records
+    std::vector<uint64_t> signatures(record_num);
+    int block_num = scheduler_ != nullptr ? 4 * static_cast<int>(scheduler_->ThreadNum()) : 1;
+    block_num = static_cast<int>(std::max<int64_t>(std::min<int64_t>(block_num, record_num), 1));
+    auto sign_block = [&](int block) {
+        int64_t begin = record_num * block / block_num;
+        int64_t end = record_num * (block + 1) / block_num;
+        for (int64_t i = begin; i < end; i++) {
+            int32_t record_len = 0;
+            pbc_memcpy(&record_len, data_buffer + record_positions[i], sizeof(int32_t));
+            signatures[i] =
+                Signature(data_buffer + record_positions[i] + sizeof(int32_t), record_len);
+        }
+    };
+    if (scheduler_ != nullptr) {
+        scheduler_->ParallelFor(0, block_num, 1, sign_block);
+    } else {
+        sign_block(0);
+    }
+
+    // strata in order of first appearance, then sorted by decreasing size
+    std::unordered_map<uint64_t, int> stratum_ids;
+    std::vector<std::vector<int64_t>> strata;
+    for (int64_t i = 0; i < record_num; i++) {
+        auto it = stratum_ids.emplace(signatures[i], static_cast<int>(strata.size())).first;
+        if (it->second == static_cast<int>(strata.size())) {
+            strata.emplace_back();
+        }
+        strata[it->second].push_back(i);
+    }
+    std::stable_sort(strata.begin(), strata.end(),
+                     [](const std::vector<int64_t>& a, const std::vector<int64_t>& b) {
+                         return a.size() > b.size();
+                     });
+    stratum_num_ = static_cast<int>(strata.size());
+    std::vector<int64_t> sizes(strata.size()), quotas;
+    for (size_t i = 0; i < strata.size(); i++) {
+        sizes[i] = strata[i].size();
+    }
+    AllocateQuotas(sizes, std::max<int64_t>(train_num, 0), quotas);
+
+    std::vector<int64_t> sampled;
+    phase = std::min(std::max(phase, 0.0), 1.0);
+    for (size_t i = 0; i < strata.size(); i++) {
+        double step = static_cast<double>(sizes[i]) / std::max<int64_t>(quotas[i], 1);
+        for (int64_t j = 0; j < quotas[i]; j++) {
+            int64_t pos = std::min(static_cast<int64_t>((j + phase) * step), sizes[i] - 1);
+            sampled.push_back(strata[i][pos]);
+        }
+    }
+    std::sort(sampled.begin(), sampled.end());
+
+    int64_t train_buffer_len = 0;
+    *train_buffer = new char[data_buffer_len];
+    for (int64_t i : sampled) {
+        int32_t record_len = 0;
+        pbc_memcpy(&record_len, data_buffer + record_positions[i], sizeof(int32_t));
+        pbc_memcpy(*train_buffer + train_buffer_len, data_buffer + record_positions[i],
+                   sizeof(int32_t) + record_len);
+        train_buffer_len += sizeof(int32_t) + record_len;
+    }
+    auto end_time = std::chrono::steady_clock::now();
+    PBC_LOG(INFO) << "stratified sampling: total data number = " << record_num
+                  << ", stratum num = " << stratum_num_ << ", train data number = "
+                  << sampled.size() << ", cost time = "
+                  << std::chrono::duration<double>(end_time - start_time).count() << "s."
+                  << std::endl;
+    return train_buffer_len;
+}
+
+}  // namespace PBC
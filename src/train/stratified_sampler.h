@@ -0,0 +1,67 @@
+/*
+ * Copyright 2023 The PBC Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#ifndef SRC_TRAIN_STRATIFIED_SAMPLER_H_
+#define SRC_TRAIN_STRATIFIED_SAMPLER_H_
+
+#include <cstdint>
+#include <vector>
+
+#include "train/task_scheduler.h"
+
+namespace PBC {
+
+// Sampler of training records across strata of records with the same structural signature. The
+// signature is the shape of a record, where every word is 'a', or 'n' if it has a digit, and every
+// delimiter byte of TokenTable::DEFAULT_DELIMITERS is itself, together with its first
+// key_token_num words without digits. Every stratum gets a share of the sample growing with the
+// square root of its size and at least one record, the largest strata first if there are more
+// strata than records to sample. So rare templates are sampled and a burst of one template does
+// not take the whole sample. The records of a stratum are taken evenly spaced in input order.
+class StratifiedSampler {
+public:
+    static const int DEFAULT_KEY_TOKEN_NUM;
+
+public:
+    // Signatures are computed in parallel on scheduler unless it is nullptr
+    explicit StratifiedSampler(TaskScheduler* scheduler = nullptr,
+                               int key_token_num = DEFAULT_KEY_TOKEN_NUM)
+        : scheduler_(scheduler), key_token_num_(key_token_num) {}
+
+    // Sample about train_num records of a buffer in the format of ReadDataFromBuffer into a new
+    // train_buffer of the same format, in input order, and return its length. phase in [0, 1)
+    // shifts the records taken from each stratum, so that samples of phase 0 and 0.5 hardly
+    // overlap.
+    int64_t Sample(const char* data_buffer, int64_t data_buffer_len, int64_t record_num,
+                   char** train_buffer, int64_t train_num, double phase = 0.0);
+    // Return the number of strata found by the last Sample
+    int StratumNum() const { return stratum_num_; }
+
+private:
+    // Return the hash of the signature of a record
+    uint64_t Signature(const char* record, int32_t len) const;
+    // Split train_num records among strata of the given sizes, sorted by decreasing size
+    static void AllocateQuotas(const std::vector<int64_t>& sizes, int64_t train_num,
+                               std::vector<int64_t>& quotas);
+
+private:
+    TaskScheduler* scheduler_;
+    int key_token_num_;
+    int stratum_num_ = 0;
+};
+
+}  // namespace PBC
+#endif  // SRC_TRAIN_STRATIFIED_SAMPLER_H_
@@ -0,0 +1,194 @@
+/*
+ * Copyright 2023 The PBC Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include "train/task_scheduler.h"
+
+#include <algorithm>
+
+namespace PBC {
+
+namespace {
+
+// the scheduler owning the current thread and the range slot of the thread in its jobs
+thread_local const TaskScheduler* current_scheduler = nullptr;
+thread_local size_t current_slot = 0;
+
+inline uint64_t PackRange(uint32_t front, uint32_t back) {
+    return (static_cast<uint64_t>(front) << 32) | back;
+}
+
+inline uint32_t RangeFront(uint64_t range) { return static_cast<uint32_t>(range >> 32); }
+
+inline uint32_t RangeBack(uint64_t range) { return static_cast<uint32_t>(range); }
+
+// Take grain_size items from the front of range
+bool PopChunk(std::atomic<uint64_t>& range, uint32_t grain_size, uint32_t& chunk_begin,
+              uint32_t& chunk_end) {
+    uint64_t current = range.load();
+    while (RangeFront(current) < RangeBack(current)) {
+        uint32_t front = RangeFront(current);
+        uint32_t new_front = std::min(RangeBack(current), front + grain_size);
+        if (range.compare_exchange_weak(current, PackRange(new_front, RangeBack(current)))) {
+            chunk_begin = front;
+            chunk_end = new_front;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Take the back half of range
+bool StealHalf(std::atomic<uint64_t>& range, uint32_t& steal_begin, uint32_t& steal_end) {
+    uint64_t current = range.load();
+    while (RangeFront(current) < RangeBack(current)) {
+        uint32_t front = RangeFront(current), back = RangeBack(current);
+        uint32_t middle = back - std::max<uint32_t>(1, (back - front) / 2);
+        if (range.compare_exchange_weak(current, PackRange(front, middle))) {
+            steal_begin = middle;
+            steal_end = back;
+            return true;
+        }
+    }
+    return false;
+}
+
+}  // namespace
+
+TaskScheduler::TaskScheduler(size_t num_threads) {
+    size_t hardware_num = std::thread::hardware_concurrency();
+    if (num_threads == 0 || (hardware_num > 0 && num_threads > hardware_num)) {
+        num_threads = hardware_num;
+    }
+    for (size_t i = 1; i < num_threads; i++) {
+        workers_.emplace_back(&TaskScheduler::WorkerLoop, this, i - 1);
+    }
+}
+
+TaskScheduler::~TaskScheduler() {
+    {
+        std::unique_lock<std::mutex> lock(jobs_mutex_);
+        stop_ = true;
+    }
+    jobs_condition_.notify_all();
+    for (std::thread& worker : workers_) {
+        worker.join();
+    }
+}
+
+void TaskScheduler::Run(int begin, int end, int grain_size, ChunkFunction function,
+                        const void* body) {
+    if (begin >= end) {
+        return;
+    }
+    grain_size = std::max(grain_size, 1);
+    uint32_t item_num = static_cast<uint32_t>(end - begin);
+    if (workers_.empty() || item_num <= static_cast<uint32_t>(grain_size)) {
+        function(body, begin, end);
+        return;
+    }
+
+    Job job(ThreadNum());
+    job.function = function;
+    job.body = body;
+    job.begin = begin;
+    job.grain_size = grain_size;
+    size_t range_num = job.ranges.size();
+    for (size_t i = 0; i < range_num; i++) {
+        job.ranges[i] = PackRange(static_cast<uint32_t>(item_num * i / range_num),
+                                  static_cast<uint32_t>(item_num * (i + 1) / range_num));
+    }
+    {
+        std::unique_lock<std::mutex> lock(jobs_mutex_);
+        jobs_.push_back(&job);
+    }
+    jobs_condition_.notify_all();
+
+    // a worker uses its own slot, any other thread the last one
+    RunChunks(job, current_scheduler == this ? current_slot : workers_.size());
+
+    {
+        std::unique_lock<std::mutex> lock(jobs_mutex_);
+        jobs_.erase(std::find(jobs_.begin(), jobs_.end(), &job));
+    }
+    // workers which joined the job are finishing the chunks they took
+    while (job.active_num.load() > 0) {
+        std::this_thread::yield();
+    }
+}
+
+void TaskScheduler::RunChunks(Job& job, size_t slot) {
+    uint32_t grain_size = static_cast<uint32_t>(job.grain_size);
+    uint32_t chunk_begin, chunk_end;
+    while (true) {
+        while (PopChunk(job.ranges[slot], grain_size, chunk_begin, chunk_end)) {
+            job.function(job.body, job.begin + static_cast<int>(chunk_begin),
+                         job.begin + static_cast<int>(chunk_end));
+        }
+        // steal from the range with the most items left
+        size_t victim = slot;
+        uint32_t victim_size = 0;
+        for (size_t i = 0; i < job.ranges.size(); i++) {
+            uint64_t range = job.ranges[i].load();
+            if (RangeBack(range) > RangeFront(range) &&
+                RangeBack(range) - RangeFront(range) > victim_size) {
+                victim = i;
+                victim_size = RangeBack(range) - RangeFront(range);
+            }
+        }
+        if (victim_size == 0) {
+            job.exhausted = true;
+            return;
+        }
+        uint32_t steal_begin, steal_end;
+        if (victim != slot && StealHalf(job.ranges[victim], steal_begin, steal_end)) {
+            // only this thread refills its own range, and only once it is empty
+            job.ranges[slot] = PackRange(steal_begin, steal_end);
+        }
+    }
+}
+
+TaskScheduler::Job* TaskScheduler::FindJob() const {
+    for (auto it = jobs_.rbegin(); it != jobs_.rend(); it++) {
+        if (!(*it)->exhausted) {
+            return *it;
+        }
+    }
+    return nullptr;
+}
+
+void TaskScheduler::WorkerLoop(size_t slot) {
+    current_scheduler = this;
+    current_slot = slot;
+    while (true) {
+        Job* job = nullptr;
+        {
+            std::unique_lock<std::mutex> lock(jobs_mutex_);
+            jobs_condition_.wait(lock, [this, &job] {
+                job = FindJob();
+                return stop_ || job != nullptr;
+            });
+            if (job == nullptr) {
+                return;
+            }
+            // joined under the lock, so the caller can not remove the job before it is counted
+            job->active_num++;
+        }
+        RunChunks(*job, slot);
+        job->active_num--;
+    }
+}
+
+}  // namespace PBC
@@ -0,0 +1,120 @@
+/*
+ * Copyright 2023 The PBC Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#ifndef SRC_TRAIN_TASK_SCHEDULER_H_
+#define SRC_TRAIN_TASK_SCHEDULER_H_
+
+#include <atomic>
+#include <condition_variable>  // NOLINT
+#include <cstdint>
+#include <mutex>   // NOLINT
+#include <thread>  // NOLINT
+#include <vector>
+
+namespace PBC {
+
+// Work-stealing scheduler for data parallel loops. A loop over [begin, end) is split into one
+// range per thread, every thread takes chunks of grain_size items from the front of its own range
+// and steals half of another range once its own is empty. The calling thread runs the loop too,
+// so a loop body may start a nested loop without blocking a worker. Loops live on the stack of
+// the caller and call the body through a function pointer, no allocation happens per item.
+class TaskScheduler {
+public:
+    // num_threads counts the calling thread and is limited to the hardware concurrency, 0 means
+    // the hardware concurrency
+    explicit TaskScheduler(size_t num_threads = 0);
+    ~TaskScheduler();
+
+    TaskScheduler(const TaskScheduler&) = delete;
+    TaskScheduler& operator=(const TaskScheduler&) = delete;
+
+    // Return the number of threads running a loop, including the calling thread
+    size_t ThreadNum() const { return workers_.size() + 1; }
+
+    // Call body(chunk_begin, chunk_end) for disjoint chunks covering [begin, end)
+    template <class F>
+    void ParallelForChunks(int begin, int end, int grain_size, const F& body) {
+        Run(begin, end, grain_size, &CallChunk<F>, static_cast<const void*>(&body));
+    }
+
+    // Call body(i) for every i in [begin, end)
+    template <class F>
+    void ParallelFor(int begin, int end, int grain_size, const F& body) {
+        ParallelForChunks(begin, end, grain_size, [&body](int chunk_begin, int chunk_end) {
+            for (int i = chunk_begin; i < chunk_end; i++) {
+                body(i);
+            }
+        });
+    }
+
+    // Call map(chunk_begin, chunk_end, partial) for disjoint chunks covering [begin, end), each
+    // partial starting from identity, and fold the partials with combine(result, partial).
+    // combine must be associative and commutative since chunks finish in any order.
+    template <class T, class Map, class Combine>
+    T ParallelReduce(int begin, int end, int grain_size, const T& identity, const Map& map,
+                     const Combine& combine) {
+        T result = identity;
+        std::mutex result_mutex;
+        ParallelForChunks(begin, end, grain_size, [&](int chunk_begin, int chunk_end) {
+            T partial = identity;
+            map(chunk_begin, chunk_end, partial);
+            std::lock_guard<std::mutex> lock(result_mutex);
+            combine(result, partial);
+        });
+        return result;
+    }
+
+private:
+    typedef void (*ChunkFunction)(const void* body, int chunk_begin, int chunk_end);
+
+    struct Job {
+        ChunkFunction function;
+        const void* body;
+        int begin;
+        int grain_size;
+        // one range of item offsets per thread, packed as (front << 32 | back)
+        std::vector<std::atomic<uint64_t>> ranges;
+        // the number of workers running chunks of the job
+        std::atomic<int> active_num;
+        // set once every range is empty, workers do not join the job any more
+        std::atomic<bool> exhausted;
+
+        explicit Job(size_t range_num) : ranges(range_num), active_num(0), exhausted(false) {}
+    };
+
+    template <class F>
+    static void CallChunk(const void* body, int chunk_begin, int chunk_end) {
+        (*static_cast<const F*>(body))(chunk_begin, chunk_end);
+    }
+
+    void Run(int begin, int end, int grain_size, ChunkFunction function, const void* body);
+    // Run chunks of the job from range slot, steal from other ranges when it is empty
+    static void RunChunks(Job& job, size_t slot);
+    // Return the newest job which still has items, nullptr if there is none
+    Job* FindJob() const;
+    void WorkerLoop(size_t slot);
+
+private:
+    std::vector<std::thread> workers_;
+    // jobs in the order they started, nested jobs come after the job running their caller
+    std::vector<Job*> jobs_;
+    std::mutex jobs_mutex_;
+    std::condition_variable jobs_condition_;
+    bool stop_ = false;
+};
+
+}  // namespace PBC
+#endif  // SRC_TRAIN_TASK_SCHEDULER_H_
@@ -0,0 +1,124 @@
+/*
+ * Copyright 2023 The PBC Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include "train/template_miner.h"
+
+#include <string>
+
+namespace PBC {
+
+const uint16_t TemplateMiner::WILDCARD_TOKEN;
+const int TemplateMiner::DEFAULT_KEY_TOKEN_NUM = 2;
+const int TemplateMiner::DEFAULT_MAX_CHILDREN = 100;
+const double TemplateMiner::DEFAULT_SIMILARITY = 0.5;
+
+TemplateMiner::TemplateMiner(const TokenTable* token_table, int key_token_num, int max_children,
+                             double similarity)
+    : token_table_(token_table),
+      key_token_num_(key_token_num),
+      max_children_(max_children),
+      similarity_(similarity),
+      nodes_(1) {}
+
+int TemplateMiner::Child(int node, uint32_t key) {
+    auto it = nodes_[node].children.find(key);
+    if (it != nodes_[node].children.end()) {
+        return it->second;
+    }
+    int child = static_cast<int>(nodes_.size());
+    nodes_.emplace_back();
+    nodes_[node].children.emplace(key, child);
+    return child;
+}
+
+uint32_t TemplateMiner::TokenKey(uint16_t token) const {
+    if (token == WILDCARD_TOKEN) {
+        return WILDCARD_TOKEN;
+    }
+    // tokens with digits are most likely variables
+    for (char c : token_table_->Token(token)) {
+        if (c >= '0' && c <= '9') {
+            return WILDCARD_TOKEN;
+        }
+    }
+    return token;
+}
+
+int TemplateMiner::Add(const uint16_t* tokens, int len, int weight) {
+    // descend the tree by the token count and the leading non-delimiter tokens
+    int node = Child(0, static_cast<uint32_t>(len));
+    int key_num = 0;
+    for (int i = 0; i < len && key_num < key_token_num_; i++) {
+        if (token_table_->IsDelimiter(tokens[i])) {
+            continue;
+        }
+        uint32_t key = TokenKey(tokens[i]);
+        const std::unordered_map<uint32_t, int>& children = nodes_[node].children;
+        if (key != WILDCARD_TOKEN && children.find(key) == children.end() &&
+            static_cast<int>(children.size()) >= max_children_) {
+            key = WILDCARD_TOKEN;
+        }
+        node = Child(node, key);
+        key_num++;
+    }
+
+    // find the most similar template of the leaf, prefer the one with more wildcards on ties
+    int best_id = -1;
+    double best_similarity = -1.0;
+    int best_wildcard_num = -1;
+    for (int template_id : nodes_[node].template_ids) {
+        const std::vector<uint16_t>& tokens_template = templates_[template_id];
+        int word_num = 0, equal_num = 0, wildcard_num = 0;
+        for (int i = 0; i < len; i++) {
+            if (tokens_template[i] == WILDCARD_TOKEN) {
+                wildcard_num++;
+                continue;
+            }
+            if (token_table_->IsDelimiter(tokens[i])) {
+                continue;
+            }
+            word_num++;
+            if (tokens_template[i] == tokens[i]) {
+                equal_num++;
+            }
+        }
+        double similarity = word_num == 0 ? 1.0 : static_cast<double>(equal_num) / word_num;
+        if (similarity > best_similarity ||
+            (similarity == best_similarity && wildcard_num > best_wildcard_num)) {
+            best_id = template_id;
+            best_similarity = similarity;
+            best_wildcard_num = wildcard_num;
+        }
+    }
+
+    if (best_id < 0 || best_similarity < similarity_) {
+        best_id = static_cast<int>(templates_.size());
+        templates_.emplace_back(tokens, tokens + len);
+        weights_.push_back(weight);
+        nodes_[node].template_ids.push_back(best_id);
+        return best_id;
+    }
+    std::vector<uint16_t>& tokens_template = templates_[best_id];
+    for (int i = 0; i < len; i++) {
+        if (tokens_template[i] != tokens[i]) {
+            tokens_template[i] = WILDCARD_TOKEN;
+        }
+    }
+    weights_[best_id] += weight;
+    return best_id;
+}
+
+}  // namespace PBC
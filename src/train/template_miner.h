@@ -0,0 +1,81 @@
+/*
+ * Copyright 2023 The PBC Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#ifndef SRC_TRAIN_TEMPLATE_MINER_H_
+#define SRC_TRAIN_TEMPLATE_MINER_H_
+
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+#include "train/token_table.h"
+
+namespace PBC {
+
+// Single pass template miner over token sequences, in the style of fixed depth parse tree log
+// parsers. A sequence descends the tree by its token count and its first key_token_num
+// non-delimiter tokens, tokens with digits and tokens beyond max_children children share a
+// wildcard branch. The leaf holds templates of that length, the sequence joins the most similar
+// one if at least similarity of its non-delimiter tokens are equal, the differing positions of the
+// template become WILDCARD_TOKEN. Otherwise the sequence starts a new template.
+class TemplateMiner {
+public:
+    static const uint16_t WILDCARD_TOKEN = TokenTable::FIRST_SYMBOL - 1;
+    static const int DEFAULT_KEY_TOKEN_NUM;
+    static const int DEFAULT_MAX_CHILDREN;
+    static const double DEFAULT_SIMILARITY;
+
+public:
+    explicit TemplateMiner(const TokenTable* token_table,
+                           int key_token_num = DEFAULT_KEY_TOKEN_NUM,
+                           int max_children = DEFAULT_MAX_CHILDREN,
+                           double similarity = DEFAULT_SIMILARITY);
+
+    // Add a token sequence standing for weight records, return its template id
+    int Add(const uint16_t* tokens, int len, int weight);
+    // Return the number of templates
+    int TemplateNum() const { return static_cast<int>(templates_.size()); }
+    // Return the tokens of a template, WILDCARD_TOKEN stands for a single token
+    const std::vector<uint16_t>& Template(int template_id) const {
+        return templates_[template_id];
+    }
+    // Return the number of records of a template
+    int64_t Weight(int template_id) const { return weights_[template_id]; }
+
+private:
+    struct Node {
+        std::unordered_map<uint32_t, int> children;
+        std::vector<int> template_ids;
+    };
+
+    // Return the child of node for key, create it if it does not exist
+    int Child(int node, uint32_t key);
+    // Return the tree key of a token
+    uint32_t TokenKey(uint16_t token) const;
+
+private:
+    const TokenTable* token_table_;
+    int key_token_num_;
+    int max_children_;
+    double similarity_;
+    // nodes_[0] is the root whose children are keyed by the token count
+    std::vector<Node> nodes_;
+    std::vector<std::vector<uint16_t>> templates_;
+    std::vector<int64_t> weights_;
+};
+
+}  // namespace PBC
+#endif  // SRC_TRAIN_TEMPLATE_MINER_H_
@@ -0,0 +1,76 @@
+/*
+ * Copyright 2023 The PBC Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include "train/token_table.h"
+
+#include <algorithm>
+#include <utility>
+
+namespace PBC {
+
+const char* const TokenTable::DEFAULT_DELIMITERS = " \t=,:;_[](){}<>\"'/";
+
+TokenTable::TokenTable(const std::string& delimiters) {
+    std::fill(delimiters_, delimiters_ + 256, false);
+    for (char delimiter : delimiters) {
+        delimiters_[static_cast<unsigned char>(delimiter)] = true;
+    }
+    // the single byte tokens
+    for (int i = 0; i < 256; i++) {
+        tokens_.push_back(std::string(1, static_cast<char>(i)));
+    }
+}
+
+void TokenTable::Tokenize(const char* record, int len, std::vector<uint16_t>& symbols) {
+    int token_begin = 0;
+    for (int i = 0; i < len; i++) {
+        if (!delimiters_[static_cast<unsigned char>(record[i])]) {
+            continue;
+        }
+        AddToken(record + token_begin, i - token_begin, symbols);
+        AddToken(record + i, 1, symbols);
+        token_begin = i + 1;
+    }
+    AddToken(record + token_begin, len - token_begin, symbols);
+}
+
+void TokenTable::AddToken(const char* token, int len, std::vector<uint16_t>& symbols) {
+    if (len == 1) {
+        symbols.push_back(FIRST_SYMBOL + static_cast<unsigned char>(token[0]));
+        return;
+    }
+    if (len == 0) {
+        return;
+    }
+    std::string token_str(token, len);
+    auto it = symbols_.find(token_str);
+    if (it != symbols_.end()) {
+        symbols.push_back(it->second);
+        return;
+    }
+    if (FIRST_SYMBOL + tokens_.size() > MAX_SYMBOL) {
+        for (int i = 0; i < len; i++) {
+            symbols.push_back(FIRST_SYMBOL + static_cast<unsigned char>(token[i]));
+        }
+        return;
+    }
+    uint16_t symbol = static_cast<uint16_t>(FIRST_SYMBOL + tokens_.size());
+    tokens_.push_back(token_str);
+    symbols_.emplace(std::move(token_str), symbol);
+    symbols.push_back(symbol);
+}
+
+}  // namespace PBC
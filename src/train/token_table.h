@@ -0,0 +1,64 @@
+/*
+ * Copyright 2023 The PBC Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#ifndef SRC_TRAIN_TOKEN_TABLE_H_
+#define SRC_TRAIN_TOKEN_TABLE_H_
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace PBC {
+
+// Interned tokens of the tokenized training mode. A record is split into maximal runs of
+// non-delimiter bytes and single delimiter bytes, so the tokens of a record concatenate to the
+// record and a pattern over tokens expands to a valid byte pattern. Tokens are numbered after
+// the byte and wildcard symbols of the byte mode: a single byte token is FIRST_SYMBOL + byte and
+// longer tokens follow, once the symbol space is used up new long tokens are split into single
+// byte tokens.
+class TokenTable {
+public:
+    static const char* const DEFAULT_DELIMITERS;
+    static const int FIRST_SYMBOL = 257;
+    static const int MAX_SYMBOL = UINT16_MAX;
+
+public:
+    explicit TokenTable(const std::string& delimiters = DEFAULT_DELIMITERS);
+
+    // Append the token symbols of a record to symbols
+    void Tokenize(const char* record, int len, std::vector<uint16_t>& symbols);
+    // Return the bytes of a token symbol
+    const std::string& Token(int symbol) const { return tokens_[symbol - FIRST_SYMBOL]; }
+    // Return true if symbol is a single delimiter byte
+    bool IsDelimiter(int symbol) const {
+        return symbol >= FIRST_SYMBOL && symbol < FIRST_SYMBOL + 256 &&
+               delimiters_[symbol - FIRST_SYMBOL];
+    }
+    // Return the number of interned tokens, single byte tokens included
+    size_t Size() const { return tokens_.size(); }
+
+private:
+    void AddToken(const char* token, int len, std::vector<uint16_t>& symbols);
+
+private:
+    bool delimiters_[256];
+    std::vector<std::string> tokens_;
+    std::unordered_map<std::string, uint16_t> symbols_;
+};
+
+}  // namespace PBC
+#endif  // SRC_TRAIN_TOKEN_TABLE_H_
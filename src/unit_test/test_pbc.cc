@@ -16,14 +16,29 @@
 
 #include <gflags/gflags.h>
 #include <gtest/gtest.h>
+#include <unistd.h>
 
+#include <algorithm>
 #include <iostream>
+#include <mutex>  // NOLINT
 #include <string>
+#include <thread>  // NOLINT
 #include <vector>
 
 #include "common/utils.h"
 #include "compress/compress_factory.h"
+#include "train/adaptive_compress.h"
+#include "train/memory_gate.h"
+#include "train/min_value_heap.h"
+#include "train/multi_trainer.h"
+#include "train/one_gram_table.h"
+#include "train/pattern_refiner.h"
 #include "train/pbc_train.h"
+#include "train/reservoir_sampler.h"
+#include "train/stratified_sampler.h"
+#include "train/task_scheduler.h"
+#include "train/template_miner.h"
+#include "train/token_table.h"
 
 DEFINE_string(dataset_path, "./", "dataset_path");
 
@@ -157,6 +172,53 @@ static void TestRandomDataWithPattern(bool contain_null_character) {
     delete[] pattern_buffer;
 }
 
+// Test that every record decompresses back to itself with the patterns of pattern_buffer, return
+// the total compressed length or -1 if the patterns could not be read
+static int64_t TestRecordsRoundTrip(PBC::CompressMethod compress_method, const char* pattern_buffer,
+                                    int64_t pattern_buffer_len,
+                                    const std::vector<std::string>& records) {
+    PBC::PBC_Compress* pbc_compress = PBC::CompressFactory::CreatePBCCompress(compress_method);
+    if (!pbc_compress->ReadData(pattern_buffer, pattern_buffer_len)) {
+        ADD_FAILURE() << "read pattern failed";
+        delete pbc_compress;
+        return -1;
+    }
+    std::vector<char> compressed_data(MAX_RECORD_SIZE), decompressed_data(MAX_RECORD_SIZE);
+    int64_t total_compressed_len = 0;
+    for (const std::string& record : records) {
+        size_t compressed_len = pbc_compress->CompressUsingPattern(record.data(), record.size(),
+                                                                   compressed_data.data());
+        EXPECT_FALSE(PBC::PBC_isError(compressed_len)) << "compress failed: " << record;
+        size_t decompressed_len = pbc_compress->DecompressUsingPattern(
+            compressed_data.data(), compressed_len, decompressed_data.data());
+        EXPECT_EQ(record, std::string(decompressed_data.data(), decompressed_len));
+        total_compressed_len += compressed_len;
+    }
+    delete pbc_compress;
+    return total_compressed_len;
+}
+
+// Return the (pattern, record_num) seeds SerializeSeeds writes for the clusters of pbc_train
+static std::vector<std::pair<std::string, int>> SerializedSeeds(const PBC::PBC_Train& pbc_train) {
+    char* seed_buffer = nullptr;
+    int64_t seed_buffer_len = pbc_train.SerializeSeeds(&seed_buffer);
+    std::vector<std::pair<std::string, int>> seeds;
+    int32_t seed_num = 0;
+    memcpy(&seed_num, seed_buffer, sizeof(int32_t));
+    int64_t pos = sizeof(int32_t);
+    for (int32_t i = 0; i < seed_num; i++) {
+        int32_t record_num, pattern_len;
+        memcpy(&record_num, seed_buffer + pos, sizeof(int32_t));
+        memcpy(&pattern_len, seed_buffer + pos + sizeof(int32_t), sizeof(int32_t));
+        pos += 2 * sizeof(int32_t);
+        seeds.emplace_back(std::string(seed_buffer + pos, pattern_len), record_num);
+        pos += pattern_len;
+    }
+    EXPECT_EQ(seed_buffer_len, pos);
+    delete[] seed_buffer;
+    return seeds;
+}
+
 // Test compress and decompress given datasets
 TEST(PBC_CompressionTest, GivenDatasets) {
     for (const std::string& dataset : test_datasets) {
@@ -279,3 +341,900 @@ TEST(PBC_CompressionTest, RandomDataWithPattern) {
 TEST(PBC_CompressionTest, RandomDataWithPatternContainEmptyChar) {
     TestRandomDataWithPattern(true);
 }
+
+// Test common symbol count of compact 1-gram tables, including overflowed counts
+TEST(PBC_TrainTest, OneGramTableCommonCount) {
+    const size_t symbol_size = 256;
+    std::vector<int> counts_a(symbol_size, 0), counts_b(symbol_size, 0);
+    counts_a['a'] = 3;
+    counts_b['a'] = 7;
+    counts_a['b'] = 1000;
+    counts_b['b'] = 20;
+    counts_a['c'] = 300;
+    counts_b['c'] = 4000;
+    counts_a[255] = 255;
+    counts_b[255] = 254;
+    int expected = 0;
+    for (size_t i = 0; i < symbol_size; i++) {
+        expected += std::min(counts_a[i], counts_b[i]);
+    }
+    PBC::OneGramTable table_a, table_b;
+    table_a.Build(counts_a.data(), symbol_size);
+    table_b.Build(counts_b.data(), symbol_size);
+    EXPECT_EQ(expected, PBC::OneGramTable::CommonCount(table_a, table_b));
+    EXPECT_EQ(expected, PBC::OneGramTable::CommonCount(table_b, table_a));
+}
+
+TEST(PBC_TrainTest, LowerBoundsKeepPatterns) {
+    // random records over a small alphabet merge into patterns full of wildcards, whose
+    // encoding length the literal counts alone overestimate
+    std::string records;
+    unsigned int state = 160 * 2654435761u;
+    auto next = [&state](int n) {
+        state = state * 1103515245u + 12345u;
+        return static_cast<int>((state >> 16) % n);
+    };
+    int record_num = 20 + next(40);
+    for (int i = 0; i < record_num; i++) {
+        int record_len = 5 + next(15);
+        for (int j = 0; j < record_len; j++) {
+            records.push_back("abcde fg"[next(8)]);
+        }
+        records.push_back('\n');
+    }
+    // every bound, ONE_GRAM included, only prunes pairs the dp rejects too, serial and threaded
+    std::string pattern_files[4];
+    const int lower_bounds[2] = {PBC::PBC_Train::LOWER_BOUND_NONE,
+                                 PBC::PBC_Train::LOWER_BOUND_ALL};
+    for (int i = 0; i < 4; i++) {
+        PBC::PBC_Train pbc_train(PBC::PBC_ONLY, i < 2 ? 0 : 2);
+        pbc_train.SetLowerBounds(lower_bounds[i % 2]);
+        pbc_train.LoadData(const_cast<char*>(records.data()), records.size(), TYPE_RECORD);
+        char* pattern_buffer = nullptr;
+        int64_t pattern_buffer_len = pbc_train.TrainPattern(4, &pattern_buffer);
+        ASSERT_GT(pattern_buffer_len, 0);
+        pattern_files[i].assign(pattern_buffer, pattern_buffer_len);
+        delete[] pattern_buffer;
+    }
+    for (int i = 1; i < 4; i++) {
+        EXPECT_EQ(pattern_files[0], pattern_files[i]);
+    }
+}
+
+TEST(PBC_TrainTest, MinValueHeapOrder) {
+    PBC::MinValueHeap heap;
+    heap.Reset(6);
+    int values[] = {5, 3, 3, 9, 1, 3};
+    for (int i = 0; i < 6; i++) {
+        heap.Update(i, values[i]);
+    }
+    heap.Erase(4);
+    heap.Update(3, 2);
+    heap.Update(1, 7);
+    // equal values pop the smallest id first
+    int expected_ids[] = {3, 2, 5, 0, 1};
+    int expected_values[] = {2, 3, 3, 5, 7};
+    for (int i = 0; i < 5; i++) {
+        int id, value;
+        ASSERT_TRUE(heap.Top(id, value));
+        EXPECT_EQ(expected_ids[i], id);
+        EXPECT_EQ(expected_values[i], value);
+        heap.Erase(id);
+    }
+    EXPECT_EQ(0, heap.Size());
+}
+
+TEST(PBC_TrainTest, CandidateListsKeepPatterns) {
+    std::string records;
+    unsigned int state = 1;
+    auto next = [&state](int n) {
+        state = state * 1103515245u + 12345u;
+        return static_cast<int>((state >> 16) % n);
+    };
+    for (int i = 0; i < 200; i++) {
+        records += "id=" + std::to_string(next(1000)) + " op=" + "rwx"[next(3)] + " ";
+        int record_len = 3 + next(10);
+        for (int j = 0; j < record_len; j++) {
+            records.push_back("abcd ef"[next(7)]);
+        }
+        records.push_back('\n');
+    }
+    // merges leave candidates stale, a single candidate then always rescans while longer lists
+    // fall back to the next valid candidate, and both merge the same pairs
+    std::string pattern_files[6];
+    int64_t rescan_nums[6];
+    const int candidate_nums[3] = {1, 2, 8};
+    for (int i = 0; i < 6; i++) {
+        PBC::PBC_Train pbc_train(PBC::PBC_ONLY, i < 3 ? 0 : 2);
+        pbc_train.SetCandidateNum(candidate_nums[i % 3]);
+        pbc_train.LoadData(const_cast<char*>(records.data()), records.size(), TYPE_RECORD);
+        char* pattern_buffer = nullptr;
+        int64_t pattern_buffer_len = pbc_train.TrainPattern(8, &pattern_buffer);
+        ASSERT_GT(pattern_buffer_len, 0);
+        pattern_files[i].assign(pattern_buffer, pattern_buffer_len);
+        rescan_nums[i] = pbc_train.GetRescanNum();
+        delete[] pattern_buffer;
+    }
+    for (int i = 1; i < 6; i++) {
+        EXPECT_EQ(pattern_files[0], pattern_files[i]);
+    }
+    EXPECT_GT(rescan_nums[2], 0);
+    EXPECT_LT(rescan_nums[2], rescan_nums[1]);
+    EXPECT_LT(rescan_nums[1], rescan_nums[0]);
+}
+
+TEST(PBC_TrainTest, ReciprocalMergeMatchesGreedy) {
+    std::string records;
+    const char* actions[] = {"login", "logout", "read", "write", "delete"};
+    for (int i = 0; i < 80; i++) {
+        records += "user " + std::to_string(i * 37 % 101) + " " + actions[i % 5] + " from 10.0." +
+                   std::to_string(i % 7) + "." + std::to_string(i * 13 % 251) + "\n";
+        records += "[" + std::to_string(i % 24) + ":" + std::to_string(i * 7 % 60) + "] disk sd" +
+                   std::string(1, static_cast<char>('a' + i % 4)) + " " + std::to_string(i * 3) +
+                   "% full\n";
+        records += "job-" + std::to_string(i * 11 % 97) + " done in " + std::to_string(i * 7) +
+                   "ms, exit " + std::to_string(i % 3) + "\n";
+    }
+    // with no tolerance every pair of a round ties with the greedy choice and is mutually
+    // nearest, so these records merge exactly as one pair at a time would
+    std::string pattern_files[4];
+    for (int i = 0; i < 4; i++) {
+        PBC::PBC_Train pbc_train(PBC::PBC_ONLY, i < 2 ? 0 : 2);
+        pbc_train.SetMergeMode(i % 2 == 0 ? PBC::PBC_Train::MERGE_GREEDY
+                                          : PBC::PBC_Train::MERGE_RECIPROCAL);
+        pbc_train.LoadData(const_cast<char*>(records.data()), records.size(), TYPE_RECORD);
+        char* pattern_buffer = nullptr;
+        int64_t pattern_buffer_len = pbc_train.TrainPattern(6, &pattern_buffer);
+        ASSERT_GT(pattern_buffer_len, 0);
+        pattern_files[i].assign(pattern_buffer, pattern_buffer_len);
+        delete[] pattern_buffer;
+    }
+    for (int i = 1; i < 4; i++) {
+        EXPECT_EQ(pattern_files[0], pattern_files[i]);
+    }
+}
+
+TEST(PBC_TrainTest, TaskSchedulerNestedLoops) {
+    PBC::TaskScheduler scheduler(4);
+    std::vector<int> sums(100, 0);
+    // every item is visited once, also by loops nested in a loop body
+    scheduler.ParallelFor(0, 100, 3, [&scheduler, &sums](int i) {
+        sums[i] = scheduler.ParallelReduce(
+            0, i + 1, 4, 0, [](int begin, int end, int& sum) {
+                for (int j = begin; j < end; j++) sum += j;
+            },
+            [](int& sum, const int& partial) { sum += partial; });
+    });
+    for (int i = 0; i < 100; i++) {
+        EXPECT_EQ(i * (i + 1) / 2, sums[i]);
+    }
+}
+
+TEST(PBC_TrainTest, LoadDataCountsDistinctRecords) {
+    std::string records =
+        "user 1 login\nuser 2 login\nuser 1 login\ndisk * full\nuser 2 login\nuser 1 login\n"
+        "path c:\\tmp\n";
+    PBC::PBC_Train pbc_train(PBC::PBC_ONLY, 0);
+    pbc_train.LoadData(const_cast<char*>(records.data()), records.size(), TYPE_RECORD);
+    char* pattern_buffer = nullptr;
+    EXPECT_GT(pbc_train.TrainPattern(10, &pattern_buffer), 0);
+
+    // every distinct record is one cluster counting its copies, numbered in the order the
+    // records first appear, with its '*' and '\\' escaped
+    const std::vector<std::pair<std::string, int>> expected = {
+        {"user 1 login", 3}, {"user 2 login", 2}, {"disk \\* full", 1}, {"path c:\\\\tmp", 1}};
+    EXPECT_EQ(expected, SerializedSeeds(pbc_train));
+    delete[] pattern_buffer;
+}
+
+TEST(PBC_TrainTest, EscapedSymbolsRoundTrip) {
+    // records with a literal '*' or '\\' merged into one pattern, and the pattern the escaped
+    // string training wrote for them
+    const std::vector<std::pair<std::string, std::string>> cases = {
+        {"a*b 12 x\na*b 345 x\n", "a\\*b * x"},
+        {"c\\d 1\nc\\d 22\nc\\e 333\n", "c\\\\*"},
+        {"a\\*b\na\\ 1 b\na\\ 22 b\n", "a\\\\*b"},
+        {"u*\\v\nu 1\\v\nu 22\\v\n", "u*\\\\v"},
+        // the literal '*' of the first record is aligned with the wildcard of the other two
+        {"k*m\nk 1 m\nk 22 m\n", "k*m"},
+        {"p 1 * q\np 22 * q\np 333 q 4 r\n", "p * q*"}};
+    for (const auto& test_case : cases) {
+        const std::string& records = test_case.first;
+        PBC::PBC_Train pbc_train(PBC::PBC_ONLY, 0);
+        pbc_train.LoadData(const_cast<char*>(records.data()), records.size(), TYPE_RECORD);
+        char* pattern_buffer = nullptr;
+        int64_t pattern_buffer_len = pbc_train.TrainPattern(1, &pattern_buffer);
+        ASSERT_GT(pattern_buffer_len, 0);
+        int32_t pattern_num, pattern_len;
+        memcpy(&pattern_num, pattern_buffer, sizeof(int32_t));
+        memcpy(&pattern_len, pattern_buffer + sizeof(int32_t), sizeof(int32_t));
+        EXPECT_EQ(1, pattern_num);
+        EXPECT_EQ(test_case.second,
+                  std::string(pattern_buffer + 2 * sizeof(int32_t), pattern_len));
+
+        std::vector<std::string> record_list = PBC::SplitString(records, "\n");
+        record_list.erase(std::remove(record_list.begin(), record_list.end(), ""),
+                          record_list.end());
+        TestRecordsRoundTrip(PBC::PBC_ONLY, pattern_buffer, pattern_buffer_len, record_list);
+        delete[] pattern_buffer;
+    }
+}
+
+TEST(PBC_TrainTest, TokenTableTokenize) {
+    PBC::TokenTable token_table(" =[]");
+    std::string record = "[notice] key=value  key=other";
+    std::vector<uint16_t> symbols;
+    token_table.Tokenize(record.data(), record.size(), symbols);
+    // delimiters are tokens of their own and repeated tokens share a symbol
+    ASSERT_EQ(12u, symbols.size());
+    EXPECT_EQ(symbols[4], symbols[9]);
+    EXPECT_EQ(PBC::TokenTable::FIRST_SYMBOL + ' ', symbols[7]);
+    std::string tokens;
+    for (uint16_t symbol : symbols) {
+        tokens += token_table.Token(symbol);
+    }
+    EXPECT_EQ(record, tokens);
+}
+
+TEST(PBC_TrainTest, TemplateMinerGroupsRecords) {
+    PBC::TokenTable token_table(" ");
+    PBC::TemplateMiner miner(&token_table);
+    std::vector<std::string> records = {"open file a.txt done", "open file b.txt done",
+                                        "close socket 7"};
+    std::vector<int> template_ids;
+    for (const std::string& record : records) {
+        std::vector<uint16_t> tokens;
+        token_table.Tokenize(record.data(), record.size(), tokens);
+        template_ids.push_back(miner.Add(tokens.data(), tokens.size(), 2));
+    }
+    // the first two records only differ in one token
+    EXPECT_EQ(2, miner.TemplateNum());
+    EXPECT_EQ(template_ids[0], template_ids[1]);
+    EXPECT_EQ(4, miner.Weight(template_ids[0]));
+    const std::vector<uint16_t>& tokens_template = miner.Template(template_ids[0]);
+    ASSERT_EQ(7u, tokens_template.size());
+    EXPECT_EQ(PBC::TemplateMiner::WILDCARD_TOKEN, tokens_template[4]);
+    EXPECT_EQ("done", token_table.Token(tokens_template[6]));
+}
+
+TEST(PBC_TrainTest, CanonicalizeGroupsRecords) {
+    std::string records =
+        "GET /item/123 from 10.0.0.1\nGET /item/4567 from 10.0.0.1\nsession 9f3a2c done\n"
+        "GET /item/4567 from 10.0.0.1\nsession cafe done\nsession 0x1b done\nuser bob7 logged\n"
+        "session a1b2c3 done\nuser bob8 logged\nsession a1b2c3 done\nsession a1b2c3 done\n";
+    PBC::PBC_Train pbc_train(PBC::PBC_ONLY, 0);
+    pbc_train.SetCanonicalize(true);
+    pbc_train.LoadData(const_cast<char*>(records.data()), records.size(), TYPE_RECORD);
+    char* pattern_buffer = nullptr;
+    EXPECT_GT(pbc_train.TrainPattern(10, &pattern_buffer), 0);
+
+    // Numbers and hex words with a digit are masked, so "cafe" keeps its own group. A masked
+    // run the members differ in becomes a wildcard, a shared one like the address stays literal
+    // and the rest is the first member. Groups keep load order and count the records of all
+    // their members.
+    const std::vector<std::pair<std::string, int>> expected = {
+        {"GET /item/* from 10.0.0.1", 3},
+        {"session * done", 5},
+        {"session cafe done", 1},
+        {"user bob* logged", 2}};
+    EXPECT_EQ(expected, SerializedSeeds(pbc_train));
+    delete[] pattern_buffer;
+}
+
+TEST(PBC_TrainTest, SeedsRoundTrip) {
+    std::vector<std::string> records = {"user 1 login ok", "user 2 login ok",
+                                        "user 3 logout ok", "disk \\* full now"};
+    PBC::PBC_Train pbc_train(PBC::PBC_ONLY, 0);
+    for (const std::string& record : records) {
+        pbc_train.AddSeedPattern(record.data(), record.size(), 2);
+    }
+    char* pattern_buffer = nullptr;
+    EXPECT_GT(pbc_train.TrainPattern(2, &pattern_buffer), 0);
+    char* seed_buffer = nullptr;
+    int64_t seed_buffer_len = pbc_train.SerializeSeeds(&seed_buffer);
+
+    // the merged clusters keep their record counts and escaped patterns
+    PBC::PBC_Train seeded_train(PBC::PBC_ONLY, 0);
+    EXPECT_EQ(2, seeded_train.LoadSeeds(seed_buffer, seed_buffer_len));
+    char* seeded_pattern_buffer = nullptr;
+    int64_t pattern_buffer_len = seeded_train.TrainPattern(2, &seeded_pattern_buffer);
+    char* seeded_seed_buffer = nullptr;
+    EXPECT_EQ(seed_buffer_len, seeded_train.SerializeSeeds(&seeded_seed_buffer));
+    EXPECT_GT(pattern_buffer_len, 0);
+
+    PBC::PBC_Train truncated_train(PBC::PBC_ONLY, 0);
+    EXPECT_EQ(-1, truncated_train.LoadSeeds(seed_buffer, seed_buffer_len - 1));
+    delete[] pattern_buffer;
+    delete[] seed_buffer;
+    delete[] seeded_pattern_buffer;
+    delete[] seeded_seed_buffer;
+}
+
+TEST(PBC_TrainTest, BasePatternsKeepIds) {
+    PBC::PBC_Train base_train(PBC::PBC_ONLY, 0);
+    for (const char* record : {"user 1 login ok", "user 2 login ok", "user 3 login ok"}) {
+        base_train.AddSeedPattern(record, strlen(record), 2);
+    }
+    char* base_buffer = nullptr;
+    int64_t base_buffer_len = base_train.TrainPattern(1, &base_buffer);
+    ASSERT_GT(base_buffer_len, 0);
+
+    // the covered record only counts for the base pattern, the others are appended
+    PBC::PBC_Train train(PBC::PBC_ONLY, 0);
+    EXPECT_EQ(1, train.LoadBasePatterns(base_buffer, base_buffer_len));
+    for (const char* record : {"user 4 login ok", "disk 1 full now", "disk 2 full now"}) {
+        train.AddSeedPattern(record, strlen(record), 2);
+    }
+    char* pattern_buffer = nullptr;
+    int64_t pattern_buffer_len = train.TrainPattern(1, &pattern_buffer);
+    int32_t pattern_num = 0;
+    memcpy(&pattern_num, pattern_buffer, sizeof(int32_t));
+    // the base patterns, the kept id of their unmatched records and the new pattern
+    EXPECT_EQ(3, pattern_num);
+    ASSERT_GT(pattern_buffer_len, base_buffer_len);
+    EXPECT_EQ(0, memcmp(base_buffer + sizeof(int32_t), pattern_buffer + sizeof(int32_t),
+                        base_buffer_len - sizeof(int32_t)));
+
+    // a record the base patterns did not match still decodes with the new patterns
+    std::string record = "disk 3 full now";
+    char compressed_data[64], decompressed_data[64];
+    PBC::PBC_Compress* base_compress = PBC::CompressFactory::CreatePBCCompress(PBC::PBC_ONLY);
+    PBC::PBC_Compress* pbc_compress = PBC::CompressFactory::CreatePBCCompress(PBC::PBC_ONLY);
+    ASSERT_TRUE(base_compress->ReadData(base_buffer, base_buffer_len));
+    ASSERT_TRUE(pbc_compress->ReadData(pattern_buffer, pattern_buffer_len));
+    int compressed_len = base_compress->CompressUsingPattern(const_cast<char*>(record.c_str()),
+                                                             record.size(), compressed_data);
+    int decompressed_len =
+        pbc_compress->DecompressUsingPattern(compressed_data, compressed_len, decompressed_data);
+    EXPECT_EQ(record, std::string(decompressed_data, decompressed_len));
+    delete base_compress;
+    delete pbc_compress;
+
+    std::vector<std::pair<std::string, int>> seeds = SerializedSeeds(train);
+    ASSERT_EQ(2u, seeds.size());
+    EXPECT_EQ(2, seeds[0].second);
+
+    PBC::PBC_Train truncated_train(PBC::PBC_ONLY, 0);
+    EXPECT_EQ(-1, truncated_train.LoadBasePatterns(base_buffer, base_buffer_len - 1));
+    delete[] base_buffer;
+    delete[] pattern_buffer;
+}
+
+TEST(PBC_TrainTest, AdaptiveVersions) {
+    PBC::PBC_Train base_train(PBC::PBC_ONLY, 0);
+    for (const char* record : {"user 1 login ok", "user 2 login ok"}) {
+        base_train.AddSeedPattern(record, strlen(record), 2);
+    }
+    char* base_buffer = nullptr;
+    int64_t base_buffer_len = base_train.TrainPattern(1, &base_buffer);
+    ASSERT_GT(base_buffer_len, 0);
+
+    PBC::AdaptiveTrainer trainer(PBC::PBC_ONLY, 1);
+    trainer.SetDictionary(base_buffer, base_buffer_len);
+    trainer.SetMaxFeedRate(3);
+    PBC::AdaptiveCompress adaptive_compress(&trainer);
+    std::vector<std::string> records = {"disk 1 full now", "disk 2 full now", "disk 3 full now",
+                                        "disk 4 full now"};
+    std::vector<std::string> compressed_records;
+    char compressed_data[64], decompressed_data[64];
+    for (const std::string& record : records) {
+        size_t compressed_len =
+            adaptive_compress.CompressUsingPattern(record.data(), record.size(), compressed_data);
+        compressed_records.emplace_back(compressed_data, compressed_len);
+    }
+    // the unmatched records beyond the feed rate are dropped
+    EXPECT_EQ(1, trainer.GetDroppedNum());
+    EXPECT_TRUE(trainer.TrainPending());
+    EXPECT_EQ(1u, trainer.GetVersion());
+
+    // the next record is compressed by the new pattern of version 1
+    records.push_back("disk 5 full now");
+    size_t compressed_len = adaptive_compress.CompressUsingPattern(
+        records.back().data(), records.back().size(), compressed_data);
+    compressed_records.emplace_back(compressed_data, compressed_len);
+    EXPECT_EQ(1u, adaptive_compress.GetVersion());
+    EXPECT_EQ(1, compressed_data[0]);
+    EXPECT_EQ(PBC::COMPRESS_PBC_ONLY, compressed_data[1]);
+
+    // version 1 still decodes the records of version 0
+    for (size_t i = 0; i < records.size(); i++) {
+        size_t decompressed_len = adaptive_compress.DecompressUsingPattern(
+            compressed_records[i].data(), compressed_records[i].size(), decompressed_data);
+        EXPECT_EQ(records[i], std::string(decompressed_data, decompressed_len));
+    }
+    delete[] base_buffer;
+}
+
+TEST(PBC_TrainTest, ParallelEncoderSamples) {
+    std::string records;
+    unsigned int state = 1;
+    auto next = [&state](int n) {
+        state = state * 1103515245u + 12345u;
+        return static_cast<int>((state >> 16) % n);
+    };
+    const char* events[] = {"login ok", "logout", "disk full", "job done"};
+    for (int i = 0; i < 400; i++) {
+        records += "id=" + std::to_string(next(100000)) + " user" + std::to_string(next(50)) +
+                   " " + events[next(4)] + " took " + std::to_string(next(1000)) + "ms\n";
+    }
+    // the secondary encoder is trained from the residuals of every record, which the threaded
+    // pass compresses by blocks straight into one buffer
+    for (PBC::CompressMethod compress_method : {PBC::PBC_FSE, PBC::PBC_FSST, PBC::PBC_ZSTD}) {
+        std::string pattern_files[2];
+        for (int i = 0; i < 2; i++) {
+            PBC::PBC_Train pbc_train(compress_method, i == 0 ? 0 : 3);
+            pbc_train.LoadData(const_cast<char*>(records.data()), records.size(), TYPE_RECORD);
+            char* pattern_buffer = nullptr;
+            int64_t pattern_buffer_len = pbc_train.TrainPattern(4, &pattern_buffer);
+            ASSERT_GT(pattern_buffer_len, 0);
+            pattern_files[i].assign(pattern_buffer, pattern_buffer_len);
+            delete[] pattern_buffer;
+        }
+        EXPECT_EQ(pattern_files[0], pattern_files[1]);
+    }
+}
+
+TEST(PBC_TrainTest, TimeBudgetKeepsClusters) {
+    std::vector<std::string> records = {"user 1 login ok", "user 2 login ok",
+                                        "user 3 logout ok", "disk 1 full now"};
+    PBC::PBC_Train pbc_train(PBC::PBC_ONLY, 0);
+    for (const std::string& record : records) {
+        pbc_train.AddSeedPattern(record.data(), record.size(), 2);
+    }
+    std::vector<int> cluster_nums;
+    pbc_train.SetTimeBudget(1e-9);
+    pbc_train.SetProgressCallback(
+        [&cluster_nums](int cluster_num, int k) { cluster_nums.push_back(cluster_num); });
+    char* pattern_buffer = nullptr;
+    int64_t pattern_buffer_len = pbc_train.TrainPattern(1, &pattern_buffer);
+    ASSERT_GT(pattern_buffer_len, 0);
+    EXPECT_TRUE(pbc_train.BudgetExceeded());
+    ASSERT_FALSE(cluster_nums.empty());
+    EXPECT_EQ(4, cluster_nums.back());
+
+    // the unmerged clusters still make a complete pattern file
+    int32_t pattern_num = 0;
+    memcpy(&pattern_num, pattern_buffer, sizeof(int32_t));
+    EXPECT_EQ(4, pattern_num);
+    TestRecordsRoundTrip(PBC::PBC_ONLY, pattern_buffer, pattern_buffer_len, records);
+    delete[] pattern_buffer;
+}
+
+TEST(PBC_TrainTest, AutoPatternSizes) {
+    std::string records;
+    for (int i = 0; i < 40; i++) {
+        records += "user " + std::to_string(i) + " login ok\n";
+        records += "disk " + std::to_string(i) + " full now\n";
+        records += "job " + std::to_string(i) + " done in " + std::to_string(i * 7) + "ms\n";
+    }
+    std::string holdout = "user 77 login ok\ndisk 78 full now\njob 79 done in 5ms\n";
+    PBC::PBC_Train pbc_train(PBC::PBC_ONLY, 0);
+    pbc_train.LoadData(const_cast<char*>(records.data()), records.size(), TYPE_RECORD);
+    pbc_train.LoadHoldoutData(holdout.data(), holdout.size(), TYPE_RECORD);
+    pbc_train.SetAutoPatternSizes({4, 1, 2, 2});
+    char* pattern_buffer = nullptr;
+    int64_t pattern_buffer_len = pbc_train.TrainPattern(100, &pattern_buffer);
+    ASSERT_GT(pattern_buffer_len, 0);
+
+    // every size is evaluated once by increasing k, three patterns compress all holdout records
+    const auto& reports = pbc_train.GetPatternSizeReports();
+    ASSERT_EQ(3u, reports.size());
+    EXPECT_EQ(1, reports[0].k);
+    EXPECT_EQ(4, reports[2].k);
+    EXPECT_EQ(static_cast<int64_t>(holdout.size()) - 3, reports[2].original_len);
+    EXPECT_LT(reports[2].compress_rate, reports[0].compress_rate);
+    int selected = pbc_train.GetSelectedPatternSize();
+    EXPECT_TRUE(selected == 1 || selected == 2 || selected == 4);
+    for (const auto& report : reports) {
+        if (report.k == selected) {
+            EXPECT_EQ(report.pattern_len, pattern_buffer_len);
+        }
+    }
+    delete[] pattern_buffer;
+}
+
+TEST(PBC_TrainTest, CheckpointResume) {
+    std::string records;
+    for (int i = 0; i < 20; i++) {
+        records += "user " + std::to_string(i) + " login ok\n";
+        records += "disk " + std::to_string(i * 3) + " full now\n";
+        records += "job " + std::to_string(i) + " done in " + std::to_string(i * 7) + "ms\n";
+    }
+    char* pattern_buffer = nullptr;
+    PBC::PBC_Train pbc_train(PBC::PBC_FSE, 0);
+    pbc_train.LoadData(const_cast<char*>(records.data()), records.size(), TYPE_RECORD);
+    int64_t pattern_buffer_len = pbc_train.TrainPattern(2, &pattern_buffer);
+
+    // a run stopped at 6 clusters and resumed down to 2 writes the same pattern file
+    char* stopped_pattern_buffer = nullptr;
+    PBC::PBC_Train stopped_train(PBC::PBC_FSE, 0);
+    stopped_train.LoadData(const_cast<char*>(records.data()), records.size(), TYPE_RECORD);
+    stopped_train.TrainPattern(6, &stopped_pattern_buffer);
+    char* checkpoint_buffer = nullptr;
+    int64_t checkpoint_len = stopped_train.SerializeCheckpoint(&checkpoint_buffer);
+    ASSERT_GT(checkpoint_len, 0);
+
+    char* resumed_pattern_buffer = nullptr;
+    PBC::PBC_Train resumed_train(PBC::PBC_FSE, 0);
+    resumed_train.LoadData(const_cast<char*>(records.data()), records.size(), TYPE_RECORD);
+    EXPECT_EQ(-1, resumed_train.LoadCheckpoint(checkpoint_buffer, checkpoint_len - 1));
+    EXPECT_EQ(6, resumed_train.LoadCheckpoint(checkpoint_buffer, checkpoint_len));
+    ASSERT_EQ(pattern_buffer_len, resumed_train.TrainPattern(2, &resumed_pattern_buffer));
+    EXPECT_EQ(0, memcmp(pattern_buffer, resumed_pattern_buffer, pattern_buffer_len));
+
+    // the checkpoint only fits the records it was written for
+    std::string other_records = records + "disk 99 full now\n";
+    PBC::PBC_Train other_train(PBC::PBC_FSE, 0);
+    other_train.LoadData(const_cast<char*>(other_records.data()), other_records.size(),
+                         TYPE_RECORD);
+    EXPECT_EQ(-1, other_train.LoadCheckpoint(checkpoint_buffer, checkpoint_len));
+
+    // and the merge options it was written with
+    for (int i = 0; i < 3; i++) {
+        PBC::PBC_Train option_train(PBC::PBC_FSE, 0);
+        if (i == 0) {
+            option_train.SetMergeMode(PBC::PBC_Train::MERGE_RECIPROCAL);
+        } else if (i == 1) {
+            option_train.SetMergeTolerance(0.5);
+        } else {
+            option_train.SetLowerBounds(PBC::PBC_Train::LOWER_BOUND_NONE);
+        }
+        option_train.LoadData(const_cast<char*>(records.data()), records.size(), TYPE_RECORD);
+        EXPECT_EQ(-1, option_train.LoadCheckpoint(checkpoint_buffer, checkpoint_len));
+    }
+    delete[] pattern_buffer;
+    delete[] stopped_pattern_buffer;
+    delete[] resumed_pattern_buffer;
+    delete[] checkpoint_buffer;
+}
+
+TEST(PBC_TrainTest, EntropyCostModel) {
+    std::string records;
+    for (int i = 0; i < 30; i++) {
+        records += "user " + std::to_string(i * 13) + " login from 10.0.0." + std::to_string(i) +
+                   "\n";
+        records += "disk " + std::to_string(i) + " full now\n";
+        records += "job " + std::to_string(i) + " done in " + std::to_string(i * 7) + "ms\n";
+    }
+    // the lower bounds stay exact under the entropy costs, so pruning keeps the same patterns
+    std::string pattern_files[2];
+    const int lower_bounds[2] = {PBC::PBC_Train::LOWER_BOUND_NONE,
+                                 PBC::PBC_Train::LOWER_BOUND_LENGTH |
+                                     PBC::PBC_Train::LOWER_BOUND_ANCHOR |
+                                     PBC::PBC_Train::LOWER_BOUND_BIGRAM};
+    for (int i = 0; i < 2; i++) {
+        PBC::PBC_Train pbc_train(PBC::PBC_FSE, 0);
+        pbc_train.SetCostModel(PBC::PBC_Train::COST_ENTROPY);
+        pbc_train.SetLowerBounds(lower_bounds[i]);
+        pbc_train.LoadData(const_cast<char*>(records.data()), records.size(), TYPE_RECORD);
+        char* pattern_buffer = nullptr;
+        int64_t pattern_buffer_len = pbc_train.TrainPattern(3, &pattern_buffer);
+        ASSERT_GT(pattern_buffer_len, 0);
+        pattern_files[i].assign(pattern_buffer, pattern_buffer_len);
+        delete[] pattern_buffer;
+    }
+    EXPECT_EQ(pattern_files[0], pattern_files[1]);
+
+    TestRecordsRoundTrip(PBC::PBC_FSE, pattern_files[1].data(), pattern_files[1].size(),
+                         {"user 4242 login from 10.0.0.77"});
+
+    // a checkpoint holds the costs of its cost model
+    PBC::PBC_Train unit_train(PBC::PBC_FSE, 0);
+    unit_train.LoadData(const_cast<char*>(records.data()), records.size(), TYPE_RECORD);
+    char* pattern_buffer = nullptr;
+    unit_train.TrainPattern(6, &pattern_buffer);
+    char* checkpoint_buffer = nullptr;
+    int64_t checkpoint_len = unit_train.SerializeCheckpoint(&checkpoint_buffer);
+    ASSERT_GT(checkpoint_len, 0);
+    PBC::PBC_Train entropy_train(PBC::PBC_FSE, 0);
+    entropy_train.SetCostModel(PBC::PBC_Train::COST_ENTROPY);
+    entropy_train.LoadData(const_cast<char*>(records.data()), records.size(), TYPE_RECORD);
+    EXPECT_EQ(-1, entropy_train.LoadCheckpoint(checkpoint_buffer, checkpoint_len));
+    delete[] pattern_buffer;
+    delete[] checkpoint_buffer;
+}
+
+TEST(PBC_TrainTest, SegmentPenalty) {
+    std::string records;
+    for (int i = 0; i < 20; i++) {
+        records += std::to_string(i * 37 % 101) + " xy " + std::to_string(i * 13 % 29) + " zw " +
+                   std::to_string(i * 7 % 11) + " end\n";
+    }
+    // a penalty of 4 bytes outweighs the 4 literal bytes between two numbers
+    int wildcard_nums[2];
+    const double segment_penalties[2] = {0.0, 4.0};
+    for (int i = 0; i < 2; i++) {
+        PBC::PBC_Train pbc_train(PBC::PBC_ONLY, 0);
+        pbc_train.SetSegmentPenalty(segment_penalties[i]);
+        pbc_train.LoadData(const_cast<char*>(records.data()), records.size(), TYPE_RECORD);
+        char* pattern_buffer = nullptr;
+        int64_t pattern_buffer_len = pbc_train.TrainPattern(1, &pattern_buffer);
+        ASSERT_GT(pattern_buffer_len, 0);
+        wildcard_nums[i] = std::count(pattern_buffer, pattern_buffer + pattern_buffer_len, '*');
+
+        TestRecordsRoundTrip(PBC::PBC_ONLY, pattern_buffer, pattern_buffer_len,
+                             {"7 xy 8 zw 9 end"});
+        delete[] pattern_buffer;
+    }
+    EXPECT_EQ(3, wildcard_nums[0]);
+    EXPECT_EQ(1, wildcard_nums[1]);
+}
+
+TEST(PBC_TrainTest, StratifiedSamplingCoversRareTemplates) {
+    std::string records;
+    for (int i = 0; i < 1000; i++) {
+        if (i == 123 || i == 456 || i == 789) {
+            records += "ERROR disk sd" + std::to_string(i) + " is full\n";
+        } else if (i == 500) {
+            records += "WARN retry " + std::to_string(i) + "\n";
+        } else {
+            records += "GET /index.html " + std::to_string(i) + " 200\n";
+        }
+    }
+    char* records_buffer = nullptr;
+    int64_t record_num = 0;
+    int32_t max_record_len = 0;
+    int64_t records_buffer_len = PBC::ReadDataFromBuffer(
+        TYPE_RECORD, records.data(), records.size(), &records_buffer, record_num, max_record_len);
+    PBC::TaskScheduler scheduler(2);
+    PBC::StratifiedSampler sampler(&scheduler);
+    std::vector<std::string> samples[2];
+    const double phases[2] = {0.0, 0.5};
+    for (int i = 0; i < 2; i++) {
+        char* train_buffer = nullptr;
+        int64_t train_buffer_len = sampler.Sample(records_buffer, records_buffer_len, record_num,
+                                                  &train_buffer, 20, phases[i]);
+        for (int64_t pos = 0; pos < train_buffer_len;) {
+            int32_t record_len = 0;
+            memcpy(&record_len, train_buffer + pos, sizeof(int32_t));
+            samples[i].emplace_back(train_buffer + pos + sizeof(int32_t), record_len);
+            pos += sizeof(int32_t) + record_len;
+        }
+        delete[] train_buffer;
+    }
+    delete[] records_buffer;
+    // a step of 50 records would miss every ERROR record
+    EXPECT_EQ(3, sampler.StratumNum());
+    ASSERT_EQ(20u, samples[0].size());
+    EXPECT_EQ(1, std::count(samples[0].begin(), samples[0].end(), "WARN retry 500"));
+    int error_num = 0;
+    for (const std::string& sample : samples[0]) {
+        error_num += sample.compare(0, 5, "ERROR") == 0;
+    }
+    EXPECT_GE(error_num, 1);
+    // the records keep their input order and another phase takes other GET records
+    std::vector<std::string> get_samples;
+    for (const std::string& sample : samples[0]) {
+        if (sample.compare(0, 3, "GET") == 0) get_samples.push_back(sample);
+    }
+    for (size_t i = 1; i < get_samples.size(); i++) {
+        EXPECT_LT(atoi(get_samples[i - 1].c_str() + 16), atoi(get_samples[i].c_str() + 16));
+    }
+    EXPECT_EQ(20u, samples[1].size());
+    EXPECT_EQ(samples[1].end(),
+              std::find(samples[1].begin(), samples[1].end(), get_samples.front()));
+}
+
+TEST(PBC_TrainTest, StreamingReservoirSample) {
+    char dir_path[] = "/tmp/pbc_test_XXXXXX";
+    ASSERT_NE(nullptr, mkdtemp(dir_path));
+    // the second file does not end with a newline, the chunks split most records
+    std::string records[2];
+    for (int i = 0; i < 1000; i++) {
+        records[i / 500] += "record " + std::to_string(i) + (i == 999 ? "" : "\n");
+    }
+    std::string file_paths[2] = {std::string(dir_path) + "/a.log",
+                                 std::string(dir_path) + "/b.log"};
+    for (int i = 0; i < 2; i++) {
+        PBC::WriteFile(file_paths[i].c_str(), records[i].data(), records[i].size());
+    }
+    std::vector<std::string> streamed;
+    ASSERT_TRUE(PBC::StreamRecords(
+        dir_path, TYPE_RECORD,
+        [&streamed](const char* record, int32_t len) { streamed.emplace_back(record, len); }, 7));
+    ASSERT_EQ(1000u, streamed.size());
+    EXPECT_EQ("record 0", streamed.front());
+    EXPECT_EQ("record 999", streamed.back());
+
+    std::vector<std::string> samples[2];
+    for (int i = 0; i < 2; i++) {
+        PBC::ReservoirSampler reservoir(50);
+        ASSERT_TRUE(PBC::StreamRecords(dir_path, TYPE_RECORD,
+                                       [&reservoir](const char* record, int32_t len) {
+                                           reservoir.Add(record, len);
+                                       }));
+        EXPECT_EQ(1000, reservoir.SeenNum());
+        char* sample_buffer = nullptr;
+        int64_t record_num = 0;
+        int32_t max_record_len = 0;
+        int64_t sample_buffer_len = reservoir.Serialize(&sample_buffer, record_num, max_record_len);
+        EXPECT_EQ(50, record_num);
+        EXPECT_EQ(reservoir.SampleBytes() + 50 * static_cast<int64_t>(sizeof(int32_t)),
+                  sample_buffer_len);
+        for (int64_t pos = 0; pos < sample_buffer_len;) {
+            int32_t record_len = 0;
+            memcpy(&record_len, sample_buffer + pos, sizeof(int32_t));
+            samples[i].emplace_back(sample_buffer + pos + sizeof(int32_t), record_len);
+            pos += sizeof(int32_t) + record_len;
+        }
+        delete[] sample_buffer;
+    }
+    // the sample is reproducible, in input order and reaches past the first records
+    EXPECT_EQ(samples[0], samples[1]);
+    for (size_t i = 1; i < samples[0].size(); i++) {
+        EXPECT_LT(atoi(samples[0][i - 1].c_str() + 7), atoi(samples[0][i].c_str() + 7));
+    }
+    EXPECT_GE(atoi(samples[0].back().c_str() + 7), 500);
+
+    // an empty reservoir only counts the records
+    PBC::ReservoirSampler empty_reservoir(0);
+    for (const std::string& record : streamed) {
+        empty_reservoir.Add(record.data(), record.size());
+    }
+    EXPECT_EQ(1000, empty_reservoir.SeenNum());
+    EXPECT_EQ(0, empty_reservoir.SampleBytes());
+    for (int i = 0; i < 2; i++) {
+        unlink(file_paths[i].c_str());
+    }
+    rmdir(dir_path);
+}
+
+TEST(PBC_TrainTest, MemoryGateBoundsWorkspaces) {
+    PBC::MemoryGate gate(100);
+    std::vector<std::thread> threads;
+    for (int i = 0; i < 4; i++) {
+        threads.emplace_back([&gate, i] {
+            for (int j = 0; j < 200; j++) {
+                // a workspace over the limit runs alone
+                PBC::MemoryGuard guard(&gate, (i + j) % 10 == 0 ? 150 : 40);
+            }
+        });
+    }
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+    EXPECT_LE(gate.PeakBytes(), 150);
+    EXPECT_GE(gate.PeakBytes(), 40);
+}
+
+TEST(PBC_TrainTest, MaxMemoryDropsRecords) {
+    std::string records;
+    for (int i = 0; i < 400; i++) {
+        records += "user " + std::to_string(i * 7919 % 1000) + " login from host-" +
+                   std::to_string(i % 13) + (i % 3 == 0 ? " ok\n" : " failed twice\n");
+    }
+    std::string patterns[3];
+    int64_t peaks[3], limits[3] = {0, 0, 0};
+    for (int i = 0; i < 3; i++) {
+        PBC::PBC_Train pbc_train(PBC::PBC_ONLY, 0);
+        // no limit, a limit at the estimate, and a limit below the estimate under a limit
+        if (i > 0) limits[i] = i == 1 ? peaks[0] : peaks[1] - 100000;
+        pbc_train.SetMaxMemory(limits[i]);
+        pbc_train.LoadData(const_cast<char*>(records.data()), records.size(), TYPE_RECORD);
+        char* pattern_buffer = nullptr;
+        int64_t pattern_buffer_len = pbc_train.TrainPattern(4, &pattern_buffer);
+        ASSERT_GT(pattern_buffer_len, 0);
+        patterns[i].assign(pattern_buffer, pattern_buffer_len);
+        peaks[i] = pbc_train.GetEstimatedPeakMemory();
+        if (i > 0) {
+            EXPECT_LE(peaks[i], limits[i]);
+        }
+
+        TestRecordsRoundTrip(PBC::PBC_ONLY, pattern_buffer, pattern_buffer_len,
+                             {"user 17 login from host-5 failed twice"});
+        delete[] pattern_buffer;
+
+        // the clusters count the records they were trained on, the dropped ones are not added
+        // to the kept ones
+        int record_num_sum = 0;
+        for (const auto& seed : SerializedSeeds(pbc_train)) {
+            record_num_sum += seed.second;
+        }
+        if (i < 2) {
+            EXPECT_EQ(400, record_num_sum);
+        } else {
+            EXPECT_LT(record_num_sum, 400);
+        }
+    }
+    // the arena blocks shrink with the patterns under a limit
+    EXPECT_EQ(patterns[0], patterns[1]);
+    EXPECT_LT(peaks[1], peaks[0]);
+
+    // a limit below the records fails instead of training on one of them
+    PBC::PBC_Train small_train(PBC::PBC_ONLY, 0);
+    small_train.SetMaxMemory(1000);
+    small_train.LoadData(const_cast<char*>(records.data()), records.size(), TYPE_RECORD);
+    char* pattern_buffer = nullptr;
+    EXPECT_EQ(-1, small_train.TrainPattern(4, &pattern_buffer));
+    delete[] pattern_buffer;
+}
+
+TEST(PBC_TrainTest, MultiTrainerSharedScheduler) {
+    std::vector<std::string> inputs(5);
+    for (int job = 0; job < 5; job++) {
+        for (int i = 0; i < 40 + 30 * job; i++) {
+            std::string event =
+                i % (job + 2) == 0 ? "login ok" : "read block " + std::to_string(i);
+            inputs[job] += "job " + std::to_string(job) + " user " + std::to_string(i * 37 % 101) +
+                           " " + event + "\n";
+        }
+    }
+    PBC::MultiTrainer driver(2);
+    for (int job = 0; job < 5; job++) {
+        const std::string& input = inputs[job];
+        driver.AddJob("job" + std::to_string(job), PBC::PBC_ONLY, 3, input.size(),
+                      [&input](PBC::PBC_Train& pbc_train, std::vector<char*>& buffers) {
+                          char* data_buffer = new char[input.size()];
+                          memcpy(data_buffer, input.data(), input.size());
+                          buffers.push_back(data_buffer);
+                          pbc_train.LoadData(data_buffer, input.size(), TYPE_RECORD);
+                          return true;
+                      });
+    }
+    std::vector<std::string> patterns(5);
+    std::vector<int> finish_nums(5, 0);
+    std::mutex mutex;
+    driver.SetFinishCallback([&](int job_id, const std::string&, const char* pattern_buffer,
+                                 int64_t pattern_len) {
+        std::lock_guard<std::mutex> lock(mutex);
+        finish_nums[job_id]++;
+        if (pattern_len > 0) patterns[job_id].assign(pattern_buffer, pattern_len);
+    });
+    EXPECT_EQ(5, driver.Run());
+
+    // every job trains the patterns a trainer of its own would
+    for (int job = 0; job < 5; job++) {
+        EXPECT_EQ(1, finish_nums[job]);
+        PBC::PBC_Train pbc_train(PBC::PBC_ONLY, 0);
+        pbc_train.LoadData(const_cast<char*>(inputs[job].data()), inputs[job].size(), TYPE_RECORD);
+        char* pattern_buffer = nullptr;
+        int64_t pattern_buffer_len = pbc_train.TrainPattern(3, &pattern_buffer);
+        ASSERT_GT(pattern_buffer_len, 0);
+        EXPECT_EQ(std::string(pattern_buffer, pattern_buffer_len), patterns[job]);
+        delete[] pattern_buffer;
+    }
+}
+
+TEST(PBC_TrainTest, PatternRefinerSplitsAndAddsPatterns) {
+    // the training sample mixes two kinds of user records, the full input also has disk records
+    std::string train_records, records;
+    for (int i = 0; i < 2000; i++) {
+        std::string record =
+            i % 2 == 0 ? "user " + std::to_string(i % 97) + " read block " + std::to_string(i)
+                       : "user " + std::to_string(i % 89) + " wrote page to cache " +
+                             std::to_string(i % 7) + " and flushed journal";
+        if (i % 5 == 4) record = "disk " + std::to_string(i % 13) + " is almost full now";
+        records += record + "\n";
+        if (i < 40 && i % 5 != 4) train_records += record + "\n";
+    }
+    PBC::PBC_Train pbc_train(PBC::PBC_ONLY, 0);
+    pbc_train.LoadData(const_cast<char*>(train_records.data()), train_records.size(), TYPE_RECORD);
+    char* pattern_buffer = nullptr;
+    int64_t pattern_buffer_len = pbc_train.TrainPattern(1, &pattern_buffer);
+    ASSERT_GT(pattern_buffer_len, 0);
+
+    PBC::PatternRefiner refiner(PBC::PBC_ONLY);
+    ASSERT_TRUE(refiner.LoadPatterns(pattern_buffer, pattern_buffer_len));
+    for (const std::string& record : PBC::SplitString(records, "\n")) {
+        refiner.Add(record.data(), record.size());
+    }
+    char* refined_buffer = nullptr;
+    int64_t refined_buffer_len = refiner.Refine(&refined_buffer);
+    ASSERT_GT(refined_buffer_len, 0);
+    EXPECT_EQ(2000, refiner.RecordNum());
+    EXPECT_EQ(400, refiner.UnmatchedNum());
+    EXPECT_EQ(1, refiner.SplitPatternCount());
+    EXPECT_GE(refiner.NewPatternCount(), 1);
+    // the trained pattern keeps its id
+    EXPECT_EQ(std::string(pattern_buffer + sizeof(int32_t), pattern_buffer_len - sizeof(int32_t)),
+              std::string(refined_buffer + sizeof(int32_t), pattern_buffer_len - sizeof(int32_t)));
+
+    std::vector<std::string> record_list = PBC::SplitString(records, "\n");
+    int64_t compressed_len =
+        TestRecordsRoundTrip(PBC::PBC_ONLY, pattern_buffer, pattern_buffer_len, record_list);
+    int64_t refined_len =
+        TestRecordsRoundTrip(PBC::PBC_ONLY, refined_buffer, refined_buffer_len, record_list);
+    EXPECT_LT(refined_len, compressed_len * 0.8);
+    delete[] pattern_buffer;
+    delete[] refined_buffer;
+}